@@ -5,6 +5,8 @@
 
 #include "lane.h"
 
+#include "wsclean/instrumentation.h"
+
 template<typename Tp>
 class lane_write_buffer 
 {
@@ -54,6 +56,7 @@ public:
 		
 	void flush()
 	{
+		Instrumentation::Accumulator wait(Instrumentation::LaneWaitStage, _buffer.size());
 		_lane->write(&_buffer[0], _buffer.size());
 		_buffer.clear();
 	}
@@ -85,6 +88,7 @@ public:
 	{
 		if(_buffer_pos == _buffer_fill_count)
 		{
+			Instrumentation::Accumulator wait(Instrumentation::LaneWaitStage, _buffer_size);
 			_buffer_fill_count = _lane->read(_buffer, _buffer_size);
 			_buffer_pos = 0;
 			if(_buffer_fill_count == 0)
@@ -36,7 +36,8 @@ size_t ClarkModel::GetMaxComponent(double* scratch, double& maxValue) const
 	return maxComponent;
 }
 
-double ClarkLoop::Run(ImageSet& convolvedResidual, const ao::uvector<const double*>& doubleConvolvedPsfs)
+template<typename NumT>
+double ClarkLoop::Run(ImageSetBase<NumT>& convolvedResidual, const ao::uvector<const NumT*>& doubleConvolvedPsfs)
 {
 	_clarkModel = ClarkModel(_width, _height);
 	
@@ -77,7 +78,7 @@ double ClarkLoop::Run(ImageSet& convolvedResidual, const ao::uvector<const doubl
 		for(size_t imgIndex=0; imgIndex!=_clarkModel.Residual().size(); ++imgIndex)
 		{
 			double* image = _clarkModel.Residual()[imgIndex];
-			const double* psf = doubleConvolvedPsfs[_clarkModel.Residual().PSFIndex(imgIndex)];
+			const NumT* psf = doubleConvolvedPsfs[_clarkModel.Residual().PSFIndex(imgIndex)];
 			double psfFactor = componentValues[imgIndex];
 			for(size_t px=0; px!=_clarkModel.size(); ++px)
 			{
@@ -94,7 +95,8 @@ double ClarkLoop::Run(ImageSet& convolvedResidual, const ao::uvector<const doubl
 	return maxValue;
 }
 
-void ClarkModel::MakeSets(const ImageSet& residualSet)
+template<typename NumT>
+void ClarkModel::MakeSets(const ImageSetBase<NumT>& residualSet)
 {
 	_residual.reset(new ImageSet(&residualSet.Table(), residualSet.Allocator(), residualSet.ChannelsInDeconvolution(), residualSet.SquareJoinedChannels(), size(), 1));
 	_model.reset(new ImageSet(&residualSet.Table(), residualSet.Allocator(), residualSet.ChannelsInDeconvolution(), residualSet.SquareJoinedChannels(), size(), 1));
@@ -102,7 +104,7 @@ void ClarkModel::MakeSets(const ImageSet& residualSet)
 	{
 		std::fill((*_model)[imgIndex], (*_model)[imgIndex]+size(), 0.0);
 		
-		const double* sourceResidual = residualSet[imgIndex];
+		const NumT* sourceResidual = residualSet[imgIndex];
 		double* destResidual = (*_residual)[imgIndex];
 		for(size_t pxIndex=0; pxIndex!=size(); ++pxIndex)
 		{
@@ -122,7 +124,8 @@ void ClarkModel::MakeRMSFactorImage(Image& rmsFactorImage)
 	}
 }
 
-void ClarkLoop::findPeakPositions(ImageSet& convolvedResidual)
+template<typename NumT>
+void ClarkLoop::findPeakPositions(ImageSetBase<NumT>& convolvedResidual)
 {
 	Image integratedScratch(_width, _height, convolvedResidual.Allocator());
 	convolvedResidual.GetLinearIntegrated(integratedScratch.data());
@@ -182,10 +185,13 @@ void ClarkLoop::GetFullIndividualModel(size_t imageIndex, double* individualMode
 	}
 }
 
-void ClarkLoop::CorrectResidualDirty(double* scratchA, double* scratchB, double* scratchC, size_t imageIndex, double* residual, const double* singleConvolvedPsf) const
+template<typename NumT>
+void ClarkLoop::CorrectResidualDirty(double* scratchA, double* scratchB, double* scratchC, size_t imageIndex, NumT* residual, const NumT* singleConvolvedPsf) const
 {
-	// Get padded kernel in scratchB
-	Image::Untrim(scratchA, _untrimmedWidth, _untrimmedHeight, singleConvolvedPsf, _width, _height);
+	// Get padded kernel in scratchB. The convolution itself is always done in
+	// double precision, so a single-precision psf is converted first.
+	const double* psf = toDouble(singleConvolvedPsf, scratchC);
+	Image::Untrim(scratchA, _untrimmedWidth, _untrimmedHeight, psf, _width, _height);
 	FFTConvolver::PrepareKernel(scratchB, scratchA, _untrimmedWidth, _untrimmedHeight);
 	
 	// Get padded model image in scratchA
@@ -202,6 +208,11 @@ void ClarkLoop::CorrectResidualDirty(double* scratchA, double* scratchB, double*
 		residual[i] -= scratchC[i];
 }
 
+template double ClarkLoop::Run<double>(ImageSetBase<double>& convolvedResidual, const ao::uvector<const double*>& doubleConvolvedPsfs);
+template double ClarkLoop::Run<float>(ImageSetBase<float>& convolvedResidual, const ao::uvector<const float*>& doubleConvolvedPsfs);
+template void ClarkLoop::CorrectResidualDirty<double>(double* scratchA, double* scratchB, double* scratchC, size_t imageIndex, double* residual, const double* singleConvolvedPsf) const;
+template void ClarkLoop::CorrectResidualDirty<float>(double* scratchA, double* scratchB, double* scratchC, size_t imageIndex, float* residual, const float* singleConvolvedPsf) const;
+
 void ClarkLoop::UpdateAutoMask(bool* mask) const
 {
 	for(size_t imageIndex=0; imageIndex!=_clarkModel.Model().size(); ++imageIndex)
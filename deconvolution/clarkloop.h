@@ -48,7 +48,12 @@ public:
 	 */
 	size_t size() const { return _positions.size(); }
 	
-	void MakeSets(const ImageSet& templateSet);
+	/**
+	 * Copies the selected pixels of the template set into the (double
+	 * precision) residual set of the model.
+	 */
+	template<typename NumT>
+	void MakeSets(const ImageSetBase<NumT>& templateSet);
 	void MakeRMSFactorImage(Image& rmsFactorImage);
 	
 	ImageSet& Residual() { return *_residual; }
@@ -130,7 +135,12 @@ public:
 	
 	double FluxCleaned() const { return _fluxCleaned; }
 	
-	double Run(ImageSet& convolvedResidual, const ao::uvector<const double*>& doubleConvolvedPsfs);
+	/**
+	 * Runs the loop on the selected pixels. Instantiated for double and
+	 * float sets; the selected pixels are always cleaned in double precision.
+	 */
+	template<typename NumT>
+	double Run(ImageSetBase<NumT>& convolvedResidual, const ao::uvector<const NumT*>& doubleConvolvedPsfs);
 	
 	/**
 	 * The produced model is convolved with the given psf, and the result is subtracted from the given residual image.
@@ -139,7 +149,8 @@ public:
 	 * scratchA and scratchB need to be able to store the full padded image (_untrimmedWidth x _untrimmedHeight).
 	 * scratchC only needs to store the trimmed size (_width x _height).
 	 */
-	void CorrectResidualDirty(double* scratchA, double* scratchB, double* scratchC, size_t imageIndex, double* residual, const double* singleConvolvedPsf) const;
+	template<typename NumT>
+	void CorrectResidualDirty(double* scratchA, double* scratchB, double* scratchC, size_t imageIndex, NumT* residual, const NumT* singleConvolvedPsf) const;
 	
 	void GetFullIndividualModel(size_t imageIndex, double* individualModelImg) const;
 	
@@ -148,7 +159,16 @@ public:
 	void UpdateComponentList(class ComponentList& list, size_t scaleIndex) const;
 	
 private:
-	void findPeakPositions(ImageSet& convolvedResidual);
+	template<typename NumT>
+	void findPeakPositions(ImageSetBase<NumT>& convolvedResidual);
+	
+	static const double* toDouble(const double* image, double*) { return image; }
+	
+	const double* toDouble(const float* image, double* scratch) const
+	{
+		std::copy(image, image + _width*_height, scratch);
+		return scratch;
+	}
 	
 	size_t _width, _height, _untrimmedWidth, _untrimmedHeight;
 	double _threshold, _consideredPixelThreshold, _gain;
@@ -17,11 +17,13 @@
 
 #include "../wsclean/imagefilename.h"
 #include "../wsclean/imagingtable.h"
+#include "../wsclean/instrumentation.h"
 #include "../wsclean/primarybeam.h"
+#include "../wsclean/tiledimagestore.h"
 #include "../wsclean/wscleansettings.h"
 
 Deconvolution::Deconvolution(const class WSCleanSettings& settings) :
-	_settings(settings), _autoMaskIsFinished(false),
+	_settings(settings), _autoMaskIsFinished(false), _useSinglePrecision(false),
 	_beamSize(0.0), _pixelScaleX(0.0), _pixelScaleY(0.0)
 {
 }
@@ -37,9 +39,29 @@ void Deconvolution::Perform(const class ImagingTable& groupTable, bool& reachedM
 	Logger::Info << " == Cleaning (" << majorIterationNr << ") ==\n";
 	
 	_imageAllocator->FreeUnused();
-	ImageSet
-		residualSet(&groupTable, *_imageAllocator, _settings.deconvolutionChannelCount, _settings.squaredJoins, _imgWidth, _imgHeight),
-		modelSet(&groupTable, *_imageAllocator, _settings.deconvolutionChannelCount, _settings.squaredJoins, _imgWidth, _imgHeight);
+	if(_useSinglePrecision)
+		performWithSets<FloatImageSet>(groupTable, reachedMajorThreshold, majorIterationNr);
+	else
+		performWithSets<ImageSet>(groupTable, reachedMajorThreshold, majorIterationNr);
+}
+
+template<typename ImageSetType>
+void Deconvolution::performWithSets(const ImagingTable& groupTable, bool& reachedMajorThreshold, size_t majorIterationNr)
+{
+	typedef typename ImageSetType::value_type NumT;
+	TiledImageStore* store = nullptr;
+	if(_settings.deconvolutionOutOfCore)
+	{
+		if(!_imageStore)
+		{
+			std::string prefix = _settings.temporaryDirectory.empty() ? _settings.prefixName : (_settings.temporaryDirectory + "/wsclean");
+			_imageStore.reset(new TiledImageStore(prefix + "-deconvolution", _imgWidth * _imgHeight * sizeof(NumT)));
+		}
+		store = _imageStore.get();
+	}
+	ImageSetType
+		residualSet(&groupTable, *_imageAllocator, _settings.deconvolutionChannelCount, _settings.squaredJoins, _imgWidth, _imgHeight, store),
+		modelSet(&groupTable, *_imageAllocator, _settings.deconvolutionChannelCount, _settings.squaredJoins, _imgWidth, _imgHeight, store);
 		
 	residualSet.LoadAndAverage(*_residualImages);
 	modelSet.LoadAndAverage(*_modelImages);
@@ -96,10 +118,10 @@ void Deconvolution::Perform(const class ImagingTable& groupTable, bool& reachedM
 		_cleanAlgorithm->SetThreshold(std::max(stddev * _settings.autoDeconvolutionThresholdSigma, _settings.deconvolutionThreshold));
 	integrated.reset();
 	
-	std::vector<ao::uvector<double>> psfVecs(groupTable.SquaredGroupCount());
+	std::vector<ao::uvector<NumT>> psfVecs(groupTable.SquaredGroupCount());
 	residualSet.LoadAndAveragePSFs(*_psfImages, psfVecs, _psfPolarization);
 	
-	ao::uvector<const double*> psfs(groupTable.SquaredGroupCount());
+	ao::uvector<const NumT*> psfs(groupTable.SquaredGroupCount());
 	for(size_t i=0; i!=psfVecs.size(); ++i)
 		psfs[i] = psfVecs[i].data();
 	
@@ -122,7 +144,7 @@ void Deconvolution::Perform(const class ImagingTable& groupTable, bool& reachedM
 				_autoMask.resize(_imgWidth * _imgHeight);
 				for(size_t imgIndex=0; imgIndex!=modelSet.size(); ++imgIndex)
 				{
-					const double* image = modelSet[imgIndex];
+					const NumT* image = modelSet[imgIndex];
 					for(size_t i=0; i!=_imgWidth * _imgHeight; ++i)
 					{
 						_autoMask[i] = (image[i]==0.0) ? false : true;
@@ -133,7 +155,12 @@ void Deconvolution::Perform(const class ImagingTable& groupTable, bool& reachedM
 		}
 	}
 		
-	_cleanAlgorithm->ExecuteMajorIteration(residualSet, modelSet, psfs, _imgWidth, _imgHeight, reachedMajorThreshold);
+	{
+		Instrumentation::ScopedTimer timer(Instrumentation::MinorLoopStage);
+		const size_t startIteration = _cleanAlgorithm->IterationNumber();
+		_cleanAlgorithm->ExecuteMajorIteration(residualSet, modelSet, psfs, _imgWidth, _imgHeight, reachedMajorThreshold);
+		timer.AddItems(_cleanAlgorithm->IterationNumber() - startIteration);
+	}
 	
 	if(!reachedMajorThreshold && _settings.autoMask && !_autoMaskIsFinished)
 	{
@@ -167,6 +194,7 @@ void Deconvolution::InitializeDeconvolutionAlgorithm(const ImagingTable& groupTa
 	_pixelScaleX = pixelScaleX;
 	_pixelScaleY = pixelScaleY;
 	_autoMaskIsFinished = false;
+	_imageStore.reset();
 	FreeDeconvolutionAlgorithms();
 	
 	_summedCount = groupTable.SquaredGroupCount();
@@ -212,6 +240,15 @@ void Deconvolution::InitializeDeconvolutionAlgorithm(const ImagingTable& groupTa
 		_cleanAlgorithm.reset(new GenericClean(*_imageAllocator, _settings.useClarkOptimization));
 	}
 	
+	_useSinglePrecision = false;
+	if(_settings.deconvolutionSinglePrecision)
+	{
+		if(_cleanAlgorithm->SupportsSinglePrecision())
+			_useSinglePrecision = true;
+		else
+			Logger::Warn << "WARNING: The selected deconvolution algorithm does not support single precision; deconvolving in double precision.\n";
+	}
+	
 	_cleanAlgorithm->SetMaxNIter(_settings.deconvolutionIterationCount);
 	_cleanAlgorithm->SetThreshold(_settings.deconvolutionThreshold);
 	_cleanAlgorithm->SetGain(_settings.deconvolutionGain);
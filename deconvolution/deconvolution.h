@@ -36,15 +36,19 @@ public:
 	void SavePBSourceList(const class ImagingTable& table, long double phaseCentreRA, long double phaseCentreDec) const;
 
 private:
+	template<typename ImageSetType>
+	void performWithSets(const ImagingTable& groupTable, bool& reachedMajorThreshold, size_t majorIterationNr);
+	
 	void calculateDeconvolutionFrequencies(const ImagingTable& groupTable, ao::uvector<double>& frequencies, ao::uvector<double>& weights);
 	
 	const class WSCleanSettings& _settings;
 	
 	std::unique_ptr<class DeconvolutionAlgorithm> _cleanAlgorithm;
+	std::unique_ptr<class TiledImageStore> _imageStore;
 	
 	ao::uvector<bool> _cleanMask;
 	
-	bool _autoMaskIsFinished;
+	bool _autoMaskIsFinished, _useSinglePrecision;
 	size_t _summedCount, _squaredCount;
 	std::set<PolarizationEnum> _polarizations;
 	PolarizationEnum _psfPolarization;
@@ -3,6 +3,7 @@
 
 #include <string>
 #include <cmath>
+#include <stdexcept>
 
 #include "spectralfitter.h"
 
@@ -21,6 +22,17 @@ public:
 	
 	virtual void ExecuteMajorIteration(class ImageSet& dataImage, class ImageSet& modelImage, const ao::uvector<const double*>& psfImages, size_t width, size_t height, bool& reachedMajorThreshold) = 0;
 	
+	/**
+	 * Single-precision version of ExecuteMajorIteration(). Only algorithms for
+	 * which @ref SupportsSinglePrecision() returns true implement it.
+	 */
+	virtual void ExecuteMajorIteration(class FloatImageSet& dataImage, FloatImageSet& modelImage, const ao::uvector<const float*>& psfImages, size_t width, size_t height, bool& reachedMajorThreshold)
+	{
+		throw std::runtime_error("This deconvolution algorithm does not support single-precision deconvolution");
+	}
+	
+	virtual bool SupportsSinglePrecision() const { return false; }
+	
 	void SetMaxNIter(size_t nIter) { _maxIter = nIter; }
 	
 	void SetThreshold(double threshold) { _threshold = threshold; }
@@ -17,7 +17,8 @@ GenericClean::GenericClean(ImageBufferAllocator& allocator, bool clarkOptimizati
 {
 }
 
-void GenericClean::ExecuteMajorIteration(ImageSet& dirtySet, ImageSet& modelSet, const ao::uvector<const double*>& psfs, size_t width, size_t height, bool& reachedMajorThreshold)
+template<typename NumT>
+void GenericClean::executeMajorIteration(ImageSetBase<NumT>& dirtySet, ImageSetBase<NumT>& modelSet, const ao::uvector<const NumT*>& psfs, size_t width, size_t height, bool& reachedMajorThreshold)
 {
 	const size_t iterationCounterAtStart = _iterationNumber;
 	if(_stopOnNegativeComponent)
@@ -78,11 +79,11 @@ void GenericClean::ExecuteMajorIteration(ImageSet& dirtySet, ImageSet& modelSet,
 		for(size_t imageIndex=0; imageIndex!=dirtySet.size(); ++imageIndex)
 		{
 			// TODO this can be multi-threaded if each thread has its own temporaries
-			const double *psf = psfs[dirtySet.PSFIndex(imageIndex)];
+			const NumT *psf = psfs[dirtySet.PSFIndex(imageIndex)];
 			clarkLoop.CorrectResidualDirty(scratchA.data(), scratchB.data(), integrated.data(), imageIndex, dirtySet[imageIndex],  psf);
 			
 			clarkLoop.GetFullIndividualModel(imageIndex, scratchA.data());
-			double* model = modelSet[imageIndex];
+			NumT* model = modelSet[imageIndex];
 			for(size_t i=0; i!=_width*_height; ++i)
 				model[i] += scratchA.data()[i];
 		}
@@ -145,6 +146,9 @@ void GenericClean::ExecuteMajorIteration(ImageSet& dirtySet, ImageSet& modelSet,
 	reachedMajorThreshold = mgainReached && didWork && !negativeReached && !finalThresholdReached;
 }
 
+template void GenericClean::executeMajorIteration<double>(ImageSetBase<double>& dirtySet, ImageSetBase<double>& modelSet, const ao::uvector<const double*>& psfs, size_t width, size_t height, bool& reachedMajorThreshold);
+template void GenericClean::executeMajorIteration<float>(ImageSetBase<float>& dirtySet, ImageSetBase<float>& modelSet, const ao::uvector<const float*>& psfs, size_t width, size_t height, bool& reachedMajorThreshold);
+
 std::string GenericClean::peakDescription(const double* image, size_t& x, size_t& y)
 {
 	std::ostringstream str;
@@ -17,9 +17,22 @@ class GenericClean : public DeconvolutionAlgorithm
 public:
 	explicit GenericClean(class ImageBufferAllocator& allocator, bool useClarkOptimization);
 	
-	virtual void ExecuteMajorIteration(ImageSet& dirtySet, ImageSet& modelSet, const ao::uvector<const double*>& psfs, size_t width, size_t height, bool& reachedMajorThreshold) final override;
+	virtual void ExecuteMajorIteration(ImageSet& dirtySet, ImageSet& modelSet, const ao::uvector<const double*>& psfs, size_t width, size_t height, bool& reachedMajorThreshold) final override
+	{
+		executeMajorIteration(dirtySet, modelSet, psfs, width, height, reachedMajorThreshold);
+	}
+	
+	virtual void ExecuteMajorIteration(FloatImageSet& dirtySet, FloatImageSet& modelSet, const ao::uvector<const float*>& psfs, size_t width, size_t height, bool& reachedMajorThreshold) final override
+	{
+		executeMajorIteration(dirtySet, modelSet, psfs, width, height, reachedMajorThreshold);
+	}
+	
+	virtual bool SupportsSinglePrecision() const final override { return true; }
 	
 private:
+	template<typename NumT>
+	void executeMajorIteration(ImageSetBase<NumT>& dirtySet, ImageSetBase<NumT>& modelSet, const ao::uvector<const NumT*>& psfs, size_t width, size_t height, bool& reachedMajorThreshold);
+	
 	size_t _width, _height, _convolutionWidth, _convolutionHeight;
 	double _convolutionPadding;
 	bool _useClarkOptimization;
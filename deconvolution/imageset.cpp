@@ -6,13 +6,88 @@
 #include "../wsclean/primarybeam.h"
 #include "../wsclean/primarybeamimageset.h"
 
-void ImageSet::LoadAndAverage(CachedImageSet& imageSet)
+#include "../threadpool.h"
+
+#include <exception>
+#include <functional>
+#include <thread>
+
+namespace {
+	/**
+	 * Runs one task at a time in a separate thread, such that loading or storing
+	 * the next channel image overlaps with processing the current one. An
+	 * exception of the task is rethrown by Wait().
+	 */
+	class BackgroundTask
+	{
+	public:
+		~BackgroundTask()
+		{
+			if(_thread.joinable())
+				_thread.join();
+		}
+		
+		void Run(std::function<void()> task)
+		{
+			Wait();
+			_thread = std::thread([this, task]() {
+				try {
+					task();
+				} catch(...) {
+					_exception = std::current_exception();
+				}
+			});
+		}
+		
+		void Wait()
+		{
+			if(_thread.joinable())
+				_thread.join();
+			if(_exception)
+			{
+				std::exception_ptr exception = _exception;
+				_exception = nullptr;
+				std::rethrow_exception(exception);
+			}
+		}
+	private:
+		std::thread _thread;
+		std::exception_ptr _exception;
+	};
+	
+	/** Minimum number of pixels that a thread processes */
+	const size_t minPixelsPerThread = 4096;
+}
+
+template<>
+void ImageSetBase<double>::storeImage(CachedImageSet& imageSet, const double* image, PolarizationEnum polarization, size_t freqIndex, bool isImaginary, ImageBufferAllocator::Ptr&) const
+{
+	imageSet.Store(image, polarization, freqIndex, isImaginary);
+}
+
+template<>
+void ImageSetBase<float>::storeImage(CachedImageSet& imageSet, const float* image, PolarizationEnum polarization, size_t freqIndex, bool isImaginary, ImageBufferAllocator::Ptr& scratch) const
+{
+	if(!scratch)
+		_allocator.Allocate(_imageSize, scratch);
+	assign(scratch.data(), image);
+	imageSet.Store(scratch.data(), polarization, freqIndex, isImaginary);
+}
+
+template<typename NumT>
+void ImageSetBase<NumT>::LoadAndAverage(CachedImageSet& imageSet)
 {
 	for(size_t i=0; i!=_images.size(); ++i)
 		assign(_images[i], 0.0);
 	
-	ImageBufferAllocator::Ptr scratch;
-	_allocator.Allocate(_imageSize, scratch);
+	struct LoadItem
+	{
+		PolarizationEnum polarization;
+		size_t outputChannelIndex;
+		bool isImaginary;
+		size_t imgIndex;
+	};
+	std::vector<LoadItem> loadItems;
 	
 	/// TODO : use real weights of images
 	ao::uvector<size_t> weights(_images.size(), 0.0);
@@ -29,8 +104,7 @@ void ImageSet::LoadAndAverage(CachedImageSet& imageSet)
 			const ImagingTableEntry& e = subTable[eIndex];
 			for(size_t i=0; i!=e.imageCount; ++i)
 			{
-				imageSet.Load(scratch.data(), e.polarization, e.outputChannelIndex, i==1);
-				add(_images[imgIndex], scratch.data());
+				loadItems.push_back(LoadItem{e.polarization, e.outputChannelIndex, i==1, imgIndex});
 				weights[imgIndex]++;
 				++imgIndex;
 			}
@@ -43,11 +117,43 @@ void ImageSet::LoadAndAverage(CachedImageSet& imageSet)
 			imgIndex = imgIndexForChannel;
 	}
 	
+	// The next image is loaded while the current one is added.
+	ImageBufferAllocator::Ptr scratch[2];
+	_allocator.Allocate(_imageSize, scratch[0]);
+	_allocator.Allocate(_imageSize, scratch[1]);
+	ThreadPool pool;
+	BackgroundTask loader;
+	for(size_t i=0; i!=loadItems.size(); ++i)
+	{
+		if(i == 0)
+		{
+			const LoadItem& item = loadItems[0];
+			imageSet.Load(scratch[0].data(), item.polarization, item.outputChannelIndex, item.isImaginary);
+		}
+		else
+			loader.Wait();
+		if(i+1 != loadItems.size())
+		{
+			const LoadItem& next = loadItems[i+1];
+			double* nextImage = scratch[(i+1)%2].data();
+			loader.Run([&imageSet, &next, nextImage]() {
+				imageSet.Load(nextImage, next.polarization, next.outputChannelIndex, next.isImaginary);
+			});
+		}
+		NumT* image = _images[loadItems[i].imgIndex];
+		const double* loaded = scratch[i%2].data();
+		pool.for_each_range(_imageSize, minPixelsPerThread, [image, loaded](size_t start, size_t end) {
+			for(size_t px=start; px!=end; ++px)
+				image[px] += loaded[px];
+		});
+	}
+	
 	for(size_t i=0; i!=_images.size(); ++i)
 		multiply(_images[i], 1.0/double(weights[i]));
 }
 
-void ImageSet::LoadAndAveragePSFs(CachedImageSet& psfSet, vector<ao::uvector<double>>& psfImages, PolarizationEnum psfPolarization)
+template<typename NumT>
+void ImageSetBase<NumT>::LoadAndAveragePSFs(CachedImageSet& psfSet, std::vector<ao::uvector<NumT>>& psfImages, PolarizationEnum psfPolarization)
 {
 	for(size_t chIndex=0; chIndex!=_channelsInDeconvolution; ++chIndex)
 		psfImages[chIndex].assign(_imageSize, 0.0);
@@ -71,7 +177,8 @@ void ImageSet::LoadAndAveragePSFs(CachedImageSet& psfSet, vector<ao::uvector<dou
 		multiply(psfImages[chIndex].data(), 1.0/double(weights[chIndex]));
 }
 
-void ImageSet::LoadAveragePrimaryBeam(PrimaryBeamImageSet& beamImages, const WSCleanSettings& settings, size_t imageIndex)
+template<typename NumT>
+void ImageSetBase<NumT>::LoadAveragePrimaryBeam(PrimaryBeamImageSet& beamImages, const WSCleanSettings& settings, size_t imageIndex)
 {
 	beamImages.SetToZero();
 	
@@ -100,7 +207,8 @@ void ImageSet::LoadAveragePrimaryBeam(PrimaryBeamImageSet& beamImages, const WSC
 	beamImages *= (1.0 / double(count));
 }
 
-void ImageSet::InterpolateAndStore(CachedImageSet& imageSet, const SpectralFitter& fitter)
+template<typename NumT>
+void ImageSetBase<NumT>::InterpolateAndStore(CachedImageSet& imageSet, const SpectralFitter& fitter)
 {
 	if(_channelsInDeconvolution == _imagingTable.SquaredGroupCount())
 	{
@@ -116,57 +224,43 @@ void ImageSet::InterpolateAndStore(CachedImageSet& imageSet, const SpectralFitte
 		// the terms of the fit. By doing this first, it is not necessary
 		// to have all channel images in memory at the same time.
 		// TODO: this assumes that polarizations are not joined!
-		size_t nTerms = fitter.NTerms();
+		const size_t nTerms = fitter.NTerms();
 		ao::uvector<double> termsImage(_imageSize * nTerms);
-		ao::uvector<double> spectralPixel(_channelsInDeconvolution);
-		ao::uvector<double> termsPixel(nTerms);
-		for(size_t px=0; px!=_imageSize; ++px)
-		{
-			bool isZero = true;
-			for(size_t s=0; s!=_images.size(); ++s)
-			{
-				double value = _images[s][px];
-				spectralPixel[s] = value;
-				isZero = isZero && (value == 0.0);
-			}
-			double* termsPtr = &termsImage[px*nTerms];
-			// Skip fitting if it is zero; most of model images will be zero, so this can
-			// save a lot of time.
-			if(isZero) {
-				for(double* p=termsPtr; p!=termsPtr+nTerms; ++p)
-					*p = 0.0;
-			}
-			else {
-				fitter.Fit(termsPixel, spectralPixel.data());
-				for(size_t i=0; i!=nTerms; ++i)
-					termsPtr[i] = termsPixel[i];
-			}
-		}
+		ao::uvector<double*> termImages(nTerms);
+		for(size_t t=0; t!=nTerms; ++t)
+			termImages[t] = &termsImage[t * _imageSize];
+		fitter.FitImages(termImages.data(), _images.data(), _imageSize);
 		
 		// Now that we know the fit for each pixel, evaluate the function for each
-		// pixel of each output channel.
-		ImageBufferAllocator::Ptr scratch;
-		_allocator.Allocate(_imageSize, scratch);
-		size_t imgIndex = 0;
+		// pixel of each output channel. An evaluated image is stored while the
+		// next one is evaluated.
+		ImageBufferAllocator::Ptr scratch[2];
+		_allocator.Allocate(_imageSize, scratch[0]);
+		_allocator.Allocate(_imageSize, scratch[1]);
+		ThreadPool pool;
+		BackgroundTask storer;
 		for(size_t eIndex=0; eIndex!=_imagingTable.EntryCount(); ++eIndex)
 		{
 			const ImagingTableEntry& e = _imagingTable[eIndex];
-			double freq = e.CentralFrequency();
-			for(size_t px=0; px!=_imageSize; ++px)
-			{
-				const double* termsPtr = &termsImage[px*nTerms];
-				for(size_t i=0; i!=nTerms; ++i)
-					termsPixel[i] = termsPtr[i];
-				scratch[px] = fitter.Evaluate(termsPixel, freq);
-			}
+			double* image = scratch[eIndex%2].data();
+			const double frequency = e.CentralFrequency();
+			pool.for_each_range(_imageSize, minPixelsPerThread, [&](size_t start, size_t end) {
+				ao::uvector<const double*> terms(nTerms);
+				for(size_t t=0; t!=nTerms; ++t)
+					terms[t] = termImages[t] + start;
+				fitter.EvaluateBlock(image + start, terms.data(), end - start, frequency);
+			});
 			
-			imageSet.Store(scratch.data(), e.polarization, e.outputChannelIndex, false);
-			++imgIndex;
+			storer.Run([&imageSet, &e, image]() {
+				imageSet.Store(image, e.polarization, e.outputChannelIndex, false);
+			});
 		}
+		storer.Wait();
 	}
 }
 
-void ImageSet::AssignAndStore(CachedImageSet& imageSet)
+template<typename NumT>
+void ImageSetBase<NumT>::AssignAndStore(CachedImageSet& imageSet)
 {
 	if(_channelsInDeconvolution == _imagingTable.SquaredGroupCount())
 	{
@@ -174,6 +268,7 @@ void ImageSet::AssignAndStore(CachedImageSet& imageSet)
 	}
 	else {
 		Logger::Info << "Assigning from " << _channelsInDeconvolution << " to " << _imagingTable.SquaredGroupCount() << " channels...\n";
+		ImageBufferAllocator::Ptr scratch;
 		size_t imgIndex = 0;
 		for(size_t sqIndex=0; sqIndex!=_imagingTable.SquaredGroupCount(); ++sqIndex)
 		{
@@ -184,7 +279,7 @@ void ImageSet::AssignAndStore(CachedImageSet& imageSet)
 				const ImagingTableEntry& e = subTable[eIndex];
 				for(size_t i=0; i!=e.imageCount; ++i)
 				{
-					imageSet.Store(_images[imgIndex], e.polarization, e.outputChannelIndex, i==1);
+					storeImage(imageSet, _images[imgIndex], e.polarization, e.outputChannelIndex, i==1, scratch);
 					++imgIndex;
 				}
 			}
@@ -196,21 +291,24 @@ void ImageSet::AssignAndStore(CachedImageSet& imageSet)
 	}
 }
 
-void ImageSet::directStore(CachedImageSet& imageSet)
+template<typename NumT>
+void ImageSetBase<NumT>::directStore(CachedImageSet& imageSet)
 {
+	ImageBufferAllocator::Ptr scratch;
 	size_t imgIndex = 0;
 	for(size_t i=0; i!=_imagingTable.EntryCount(); ++i)
 	{
 		const ImagingTableEntry& e = _imagingTable[i];
 		for(size_t i=0; i!=e.imageCount; ++i)
 		{
-			imageSet.Store(_images[imgIndex], e.polarization, e.outputChannelIndex, i==1);
+			storeImage(imageSet, _images[imgIndex], e.polarization, e.outputChannelIndex, i==1, scratch);
 			++imgIndex;
 		}
 	}
 }
 
-void ImageSet::getSquareIntegratedWithNormalChannels(double* dest, double* scratch) const
+template<typename NumT>
+void ImageSetBase<NumT>::getSquareIntegratedWithNormalChannels(double* dest, double* scratch) const
 {
 	if(_channelsInDeconvolution == 1)
 	{
@@ -282,7 +380,8 @@ void ImageSet::getSquareIntegratedWithNormalChannels(double* dest, double* scrat
 	}
 }
 
-void ImageSet::getSquareIntegratedWithSquaredChannels(double* dest) const
+template<typename NumT>
+void ImageSetBase<NumT>::getSquareIntegratedWithSquaredChannels(double* dest) const
 {
 	size_t addIndex = 0;
 	for(size_t sqIndex = 0; sqIndex!=_channelsInDeconvolution; ++sqIndex)
@@ -308,7 +407,8 @@ void ImageSet::getSquareIntegratedWithSquaredChannels(double* dest) const
 	squareRoot(dest);
 }
 
-void ImageSet::getLinearIntegratedWithNormalChannels(double* dest) const
+template<typename NumT>
+void ImageSetBase<NumT>::getLinearIntegratedWithNormalChannels(double* dest) const
 {
 	if(_channelsInDeconvolution == 1 && _imagingTable.GetSquaredGroup(0).EntryCount() == 1)
 	{
@@ -342,3 +442,6 @@ void ImageSet::getLinearIntegratedWithNormalChannels(double* dest) const
 			assign(dest, 0.0);
 	}
 }
+
+template class ImageSetBase<double>;
+template class ImageSetBase<float>;
@@ -4,84 +4,107 @@
 #include "../uvector.h"
 #include "../wsclean/imagingtable.h"
 #include "../wsclean/imagebufferallocator.h"
+#include "../wsclean/tiledimagestore.h"
 
+#include <algorithm>
 #include <vector>
 #include <map>
 
-class ImageSet
+/**
+ * Holds the images that are deconvolved together. The element type of the
+ * images is a template parameter, such that the deconvolution can be
+ * performed in single precision to halve the memory and bandwidth
+ * requirements. Reductions over images (integration, spectral fitting)
+ * are always accumulated in double precision.
+ *
+ * When a @ref TiledImageStore is given, the images are placed in its
+ * memory-mapped scratch file instead of in the allocator, so that a large set
+ * does not need to be resident in memory at once.
+ * @sa ImageSet, FloatImageSet
+ */
+template<typename NumT>
+class ImageSetBase
 {
 public:
-	ImageSet(const ImagingTable* table, ImageBufferAllocator& allocator, size_t requestedChannelsInDeconvolution, bool squareJoinedChannels) :
+	typedef NumT value_type;
+	
+	ImageSetBase(const ImagingTable* table, ImageBufferAllocator& allocator, size_t requestedChannelsInDeconvolution, bool squareJoinedChannels) :
 		_images(),
 		_imageSize(0),
 		_channelsInDeconvolution((requestedChannelsInDeconvolution==0) ? table->SquaredGroupCount() : requestedChannelsInDeconvolution),
 		_squareJoinedChannels(squareJoinedChannels),
 		_imagingTable(*table),
 		_imageIndexToPSFIndex(),
-		_allocator(allocator)
+		_allocator(allocator),
+		_store(nullptr)
 	{
 		size_t nPol = table->GetSquaredGroup(0).EntryCount();
 		size_t nImages = nPol * _channelsInDeconvolution;
-		_images.assign(nImages, static_cast<double*>(0));
+		_images.assign(nImages, static_cast<NumT*>(0));
 		_imageIndexToPSFIndex.resize(nImages);
 		
 		initializeIndices();
 	}
 	
-	ImageSet(const ImagingTable* table, ImageBufferAllocator& allocator, size_t requestedChannelsInDeconvolution, bool squareJoinedChannels, size_t width, size_t height) :
+	ImageSetBase(const ImagingTable* table, ImageBufferAllocator& allocator, size_t requestedChannelsInDeconvolution, bool squareJoinedChannels, size_t width, size_t height, TiledImageStore* store = nullptr) :
 		_images(),
 		_imageSize(width*height),
 		_channelsInDeconvolution((requestedChannelsInDeconvolution==0) ? table->SquaredGroupCount() : requestedChannelsInDeconvolution),
 		_squareJoinedChannels(squareJoinedChannels),
 		_imagingTable(*table),
 		_imageIndexToPSFIndex(),
-		_allocator(allocator)
+		_allocator(allocator),
+		_store(store)
 	{
 		size_t nPol = table->GetSquaredGroup(0).EntryCount();
 		size_t nImages = nPol * _channelsInDeconvolution;
-		_images.assign(nImages, static_cast<double*>(0));
+		_images.assign(nImages, static_cast<NumT*>(0));
 		_imageIndexToPSFIndex.resize(nImages);
 		
 		initializeIndices();
 		AllocateImages();
 	}
 	
-	~ImageSet()
+	~ImageSetBase()
 	{
-		for(ao::uvector<double*>::iterator img=_images.begin();
+		for(typename ao::uvector<NumT*>::iterator img=_images.begin();
 				img!=_images.end(); ++img)
-			_allocator.Free(*img);
+			freeImage(*img);
 	}
 	
 	void AllocateImages()
 	{
-		for(ao::uvector<double*>::iterator img=_images.begin();
+		for(typename ao::uvector<NumT*>::iterator img=_images.begin();
 				img!=_images.end(); ++img)
 		{
-			*img = _allocator.Allocate(_imageSize);
+			*img = allocateImage();
 		}
 	}
 	
 	void AllocateImages(size_t width, size_t height)
 	{
 		_imageSize = width*height;
-		for(ao::uvector<double*>::iterator img=_images.begin();
+		for(typename ao::uvector<NumT*>::iterator img=_images.begin();
 				img!=_images.end(); ++img)
 		{
-			*img = _allocator.Allocate(_imageSize);
+			*img = allocateImage();
 		}
 	}
 	
-	double* Release(size_t imageIndex)
+	NumT* Release(size_t imageIndex)
 	{
-		double* image = _images[imageIndex];
+		NumT* image = _images[imageIndex];
 		_images[imageIndex] = 0;
 		return image;
 	}
 	
-	void Claim(size_t imageIndex, double* data)
+	/**
+	 * Replace an image by the given data, which should have been obtained
+	 * from the same allocator or store as the images of this set.
+	 */
+	void Claim(size_t imageIndex, NumT* data)
 	{
-		_allocator.Free(_images[imageIndex]);
+		freeImage(_images[imageIndex]);
 		_images[imageIndex] = data;
 	}
 	
@@ -97,7 +120,7 @@ public:
 	
 	void LoadAndAverage(class CachedImageSet& imageSet);
 	
-	void LoadAndAveragePSFs(class CachedImageSet& psfSet, std::vector<ao::uvector<double>>& psfImages, PolarizationEnum psfPolarization);
+	void LoadAndAveragePSFs(class CachedImageSet& psfSet, std::vector<ao::uvector<NumT>>& psfImages, PolarizationEnum psfPolarization);
 	
 	void LoadAveragePrimaryBeam(class PrimaryBeamImageSet& beamImages, const class WSCleanSettings& settings, size_t imageIndex);
 	
@@ -156,9 +179,9 @@ public:
 			getLinearIntegratedWithNormalChannels(dest);
 	}
 
-	void GetIntegratedPSF(double* dest, const ao::uvector<const double*>& psfs)
+	void GetIntegratedPSF(double* dest, const ao::uvector<const NumT*>& psfs)
 	{
-		memcpy(dest, psfs[0], sizeof(double) * _imageSize);
+		assign(dest, psfs[0]);
 		for(size_t i = 1; i!=PSFCount(); ++i)
 		{
 			add(dest, psfs[i]);
@@ -170,19 +193,19 @@ public:
 	
 	size_t ChannelsInDeconvolution() const { return _channelsInDeconvolution; }
 	
-	ImageSet& operator=(double val)
+	ImageSetBase& operator=(double val)
 	{
 		for(size_t i=0; i!=size(); ++i)
 			assign(_images[i], val);
 		return *this;
 	}
 	
-	double* operator[](size_t index)
+	NumT* operator[](size_t index)
 	{
 		return _images[index];
 	}
 	
-	const double* operator[](size_t index) const
+	const NumT* operator[](size_t index) const
 	{
 		return _images[index];
 	}
@@ -193,37 +216,27 @@ public:
 	
 	const ImagingTable& Table() const { return _imagingTable; }
 	
-	ImageSet* CreateTrimmed(size_t x1, size_t y1, size_t x2, size_t y2, size_t oldWidth) const
-	{
-		std::unique_ptr<ImageSet> p(new ImageSet(&_imagingTable, _allocator, _channelsInDeconvolution, _squareJoinedChannels, x2-x1, y2-y1));
-		for(size_t i=0; i!=_images.size(); ++i)
-		{
-			copySmallerPart(_images[i], p->_images[i], x1, y1, x2, y2, oldWidth);
-		}
-		return p.release();
-	}
-	
-	ImageSet& operator*=(double factor)
+	ImageSetBase& operator*=(double factor)
 	{
 		for(size_t i=0; i!=size(); ++i)
 			multiply(_images[i], factor);
 		return *this;
 	}
 	
-	ImageSet& operator+=(const ImageSet& other)
+	ImageSetBase& operator+=(const ImageSetBase& other)
 	{
 		for(size_t i=0; i!=size(); ++i)
 			add(_images[i], other._images[i]);
 		return *this;
 	}
 	
-	void FactorAdd(ImageSet& rhs, double factor)
+	void FactorAdd(ImageSetBase& rhs, double factor)
 	{
 		for(size_t i=0; i!=size(); ++i)
 			addFactor(_images[i], rhs._images[i], factor);
 	}
 	
-	void Set(size_t index, const double* rhs)
+	void Set(size_t index, const NumT* rhs)
 	{
 		assign(_images[index], rhs);
 	}
@@ -231,30 +244,35 @@ public:
 	bool SquareJoinedChannels() const {
 		return _squareJoinedChannels; 
 	}
-private:
-	void assign(double* lhs, const double* rhs) const
+protected:
+	template<typename Dest, typename Src>
+	void assign(Dest* lhs, const Src* rhs) const
 	{
-		memcpy(lhs, rhs, sizeof(double) * _imageSize);
+		std::copy(rhs, rhs + _imageSize, lhs);
 	}
 	
-	void assign(double* lhs, const ImageBufferAllocator::Ptr& rhs) const
+	template<typename Dest>
+	void assign(Dest* lhs, const ImageBufferAllocator::Ptr& rhs) const
 	{
-		memcpy(lhs, rhs.data(), sizeof(double) * _imageSize);
+		assign(lhs, rhs.data());
 	}
 	
-	void assignMultiply(double* lhs, const double* rhs, double factor) const
+	template<typename Dest, typename Src>
+	void assignMultiply(Dest* lhs, const Src* rhs, double factor) const
 	{
 		for(size_t i=0; i!=_imageSize; ++i)
 			lhs[i] = rhs[i] * factor;
 	}
 	
-	void assign(double* image, double value) const
+	template<typename Dest>
+	void assign(Dest* image, double value) const
 	{
 		for(size_t i=0; i!=_imageSize; ++i)
 			image[i] = value;
 	}
 	
-	void add(double* lhs, const double* rhs) const
+	template<typename Dest, typename Src>
+	void add(Dest* lhs, const Src* rhs) const
 	{
 		for(size_t i=0; i!=_imageSize; ++i)
 			lhs[i] += rhs[i];
@@ -272,19 +290,22 @@ private:
 			image[i] = sqrt(image[i]);
 	}
 	
-	void addSquared(double* lhs, const double* rhs) const
+	template<typename Src>
+	void addSquared(double* lhs, const Src* rhs) const
 	{
 		for(size_t i=0; i!=_imageSize; ++i)
-			lhs[i] += rhs[i]*rhs[i];
+			lhs[i] += double(rhs[i])*double(rhs[i]);
 	}
 	
-	void addFactor(double* lhs, const double* rhs, double factor) const
+	template<typename Dest, typename Src>
+	void addFactor(Dest* lhs, const Src* rhs, double factor) const
 	{
 		for(size_t i=0; i!=_imageSize; ++i)
 			lhs[i] += rhs[i] * factor;
 	}
 	
-	void multiply(double* image, double fact) const
+	template<typename Dest>
+	void multiply(Dest* image, double fact) const
 	{
 		if(fact != 1.0)
 		{
@@ -293,6 +314,32 @@ private:
 		}
 	}
 	
+	double* allocateImage(double*) const { return _allocator.Allocate(_imageSize); }
+	float* allocateImage(float*) const { return _allocator.AllocateFloat(_imageSize); }
+	
+	NumT* allocateImage() const
+	{
+		if(_store == nullptr)
+			return allocateImage(static_cast<NumT*>(nullptr));
+		if(_store->ImageBytes() < _imageSize * sizeof(NumT))
+			throw std::runtime_error("Image store is too small for the images of this image set");
+		return static_cast<NumT*>(_store->Allocate());
+	}
+	
+	void freeImage(NumT* image) const
+	{
+		if(_store == nullptr)
+			_allocator.Free(image);
+		else
+			_store->Free(image);
+	}
+	
+	/**
+	 * Stores a single image in the cache, converting it to double precision
+	 * first when necessary. The conversion scratch is allocated on first use.
+	 */
+	void storeImage(class CachedImageSet& imageSet, const NumT* image, PolarizationEnum polarization, size_t freqIndex, bool isImaginary, ImageBufferAllocator::Ptr& scratch) const;
+	
 	void initializeIndices()
 	{
 		for(size_t i=0; i!=_imagingTable.EntryCount(); ++i)
@@ -312,13 +359,13 @@ private:
 		}
 	}
 	
-	void copySmallerPart(const double* input, double* output, size_t x1, size_t y1, size_t x2, size_t y2, size_t oldWidth) const
+	void copySmallerPart(const NumT* input, NumT* output, size_t x1, size_t y1, size_t x2, size_t y2, size_t oldWidth) const
 	{
 		size_t newWidth = x2 - x1;
 		for(size_t y=y1; y!=y2; ++y)
 		{
-			const double* oldPtr = &input[y*oldWidth];
-			double* newPtr = &output[(y-y1)*newWidth];
+			const NumT* oldPtr = &input[y*oldWidth];
+			NumT* newPtr = &output[(y-y1)*newWidth];
 			for(size_t x=x1; x!=x2; ++x)
 			{
 				newPtr[x - x1] = oldPtr[x];
@@ -334,13 +381,47 @@ private:
 	
 	void getLinearIntegratedWithNormalChannels(double* dest) const;
 	
-	ao::uvector<double*> _images;
+	ao::uvector<NumT*> _images;
 	size_t _imageSize, _channelsInDeconvolution;
 	bool _squareJoinedChannels;
 	const ImagingTable& _imagingTable;
 	std::map<size_t, size_t> _tableIndexToImageIndex;
 	ao::uvector<size_t> _imageIndexToPSFIndex;
 	ImageBufferAllocator& _allocator;
+	TiledImageStore* _store;
+};
+
+/**
+ * Set of double-precision images; this is the default type used by all
+ * deconvolution algorithms.
+ */
+class ImageSet : public ImageSetBase<double>
+{
+public:
+	using ImageSetBase<double>::ImageSetBase;
+	using ImageSetBase<double>::operator=;
+	
+	ImageSet* CreateTrimmed(size_t x1, size_t y1, size_t x2, size_t y2, size_t oldWidth) const
+	{
+		std::unique_ptr<ImageSet> p(new ImageSet(&_imagingTable, _allocator, _channelsInDeconvolution, _squareJoinedChannels, x2-x1, y2-y1));
+		for(size_t i=0; i!=_images.size(); ++i)
+		{
+			copySmallerPart(_images[i], p->_images[i], x1, y1, x2, y2, oldWidth);
+		}
+		return p.release();
+	}
+};
+
+/**
+ * Set of single-precision images, used when the deconvolution is performed
+ * in single precision.
+ * @sa DeconvolutionAlgorithm::SupportsSinglePrecision()
+ */
+class FloatImageSet : public ImageSetBase<float>
+{
+public:
+	using ImageSetBase<float>::ImageSetBase;
+	using ImageSetBase<float>::operator=;
 };
 
 #endif
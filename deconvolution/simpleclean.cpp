@@ -202,7 +202,8 @@ void SimpleClean::SubtractImage(double *image, const double *psf, size_t width,
 	}
 }
 
-void SimpleClean::PartialSubtractImage(double *image, const double *psf, size_t width, size_t height, size_t x, size_t y, double factor, size_t startY, size_t endY)
+template<typename NumT>
+void SimpleClean::PartialSubtractImage(NumT *image, const NumT *psf, size_t width, size_t height, size_t x, size_t y, double factor, size_t startY, size_t endY)
 {
 	size_t startX, endX;
 	int offsetX = (int) x - width/2, offsetY = (int) y - height/2;
@@ -222,24 +223,26 @@ void SimpleClean::PartialSubtractImage(double *image, const double *psf, size_t
 	if(!isAligned) --endX;
 	
 	endY = std::min(y + height/2, endY);
+	const NumT f = factor;
 	
 	for(size_t ypos = startY; ypos < endY; ++ypos)
 	{
-		double *imageIter = image + ypos * width + startX;
-		const double *psfIter = psf + (ypos - offsetY) * width + startX - offsetX;
+		NumT *imageIter = image + ypos * width + startX;
+		const NumT *psfIter = psf + (ypos - offsetY) * width + startX - offsetX;
 		for(size_t xpos = startX; xpos != endX; xpos+=2)
 		{
-			*imageIter = *imageIter - (*psfIter * factor);
-			*(imageIter+1) = *(imageIter+1) - (*(psfIter+1) * factor);
+			*imageIter = *imageIter - (*psfIter * f);
+			*(imageIter+1) = *(imageIter+1) - (*(psfIter+1) * f);
 			imageIter+=2;
 			psfIter+=2;
 		}
 		if(!isAligned)
-			*imageIter -= *psfIter * factor;
+			*imageIter -= *psfIter * f;
 	}
 }
 
-void SimpleClean::PartialSubtractImage(double *image, size_t imgWidth, size_t imgHeight, const double *psf, size_t psfWidth, size_t psfHeight, size_t x, size_t y, double factor, size_t startY, size_t endY)
+template<typename NumT>
+void SimpleClean::PartialSubtractImage(NumT *image, size_t imgWidth, size_t imgHeight, const NumT *psf, size_t psfWidth, size_t psfHeight, size_t x, size_t y, double factor, size_t startY, size_t endY)
 {
 	size_t startX, endX;
 	int offsetX = (int) x - psfWidth/2, offsetY = (int) y - psfHeight/2;
@@ -258,23 +261,29 @@ void SimpleClean::PartialSubtractImage(double *image, size_t imgWidth, size_t im
 	if(!isAligned) --endX;
 	
 	endY = std::min(y + psfHeight/2, endY);
+	const NumT f = factor;
 	
 	for(size_t ypos = startY; ypos < endY; ++ypos)
 	{
-		double *imageIter = image + ypos * imgWidth + startX;
-		const double *psfIter = psf + (ypos - offsetY) * psfWidth + startX - offsetX;
+		NumT *imageIter = image + ypos * imgWidth + startX;
+		const NumT *psfIter = psf + (ypos - offsetY) * psfWidth + startX - offsetX;
 		for(size_t xpos = startX; xpos != endX; xpos+=2)
 		{
-			*imageIter = *imageIter - (*psfIter * factor);
-			*(imageIter+1) = *(imageIter+1) - (*(psfIter+1) * factor);
+			*imageIter = *imageIter - (*psfIter * f);
+			*(imageIter+1) = *(imageIter+1) - (*(psfIter+1) * f);
 			imageIter+=2;
 			psfIter+=2;
 		}
 		if(!isAligned)
-			*imageIter -= *psfIter * factor;
+			*imageIter -= *psfIter * f;
 	}
 }
 
+template void SimpleClean::PartialSubtractImage<double>(double *image, const double *psf, size_t width, size_t height, size_t x, size_t y, double factor, size_t startY, size_t endY);
+template void SimpleClean::PartialSubtractImage<float>(float *image, const float *psf, size_t width, size_t height, size_t x, size_t y, double factor, size_t startY, size_t endY);
+template void SimpleClean::PartialSubtractImage<double>(double *image, size_t imgWidth, size_t imgHeight, const double *psf, size_t psfWidth, size_t psfHeight, size_t x, size_t y, double factor, size_t startY, size_t endY);
+template void SimpleClean::PartialSubtractImage<float>(float *image, size_t imgWidth, size_t imgHeight, const float *psf, size_t psfWidth, size_t psfHeight, size_t x, size_t y, double factor, size_t startY, size_t endY);
+
 #if defined __AVX__ && defined USE_INTRINSICS
 void SimpleClean::PartialSubtractImageAVX(double *image, size_t imgWidth, size_t imgHeight, const double *psf, size_t psfWidth, size_t psfHeight, size_t x, size_t y, double factor, size_t startY, size_t endY)
 {
@@ -323,4 +332,52 @@ void SimpleClean::PartialSubtractImageAVX(double *image, size_t imgWidth, size_t
 	}
 }
 
+void SimpleClean::PartialSubtractImageAVX(float *image, size_t imgWidth, size_t imgHeight, const float *psf, size_t psfWidth, size_t psfHeight, size_t x, size_t y, double factor, size_t startY, size_t endY)
+{
+	size_t startX, endX;
+	int offsetX = (int) x - psfWidth/2, offsetY = (int) y - psfHeight/2;
+	
+	if(offsetX > 0)
+		startX = offsetX;
+	else
+		startX = 0;
+	
+	if(offsetY > (int) startY)
+		startY = offsetY;
+	
+	endX = std::min(x + psfWidth/2, imgWidth);
+	
+	size_t unAlignedCount = (endX - startX) % 8;
+	endX -= unAlignedCount;
+	
+	endY = std::min(y + psfHeight/2, endY);
+	
+	const float f = factor;
+	const __m256 mFactor = _mm256_set1_ps(-f);
+	for(size_t ypos = startY; ypos < endY; ++ypos)
+	{
+		float *imageIter = image + ypos * imgWidth + startX;
+		const float *psfIter = psf + (ypos - offsetY) * psfWidth + startX - offsetX;
+		for(size_t xpos = startX; xpos != endX; xpos+=8)
+		{
+			__m256
+				imgVal = _mm256_loadu_ps(imageIter),
+				psfVal = _mm256_loadu_ps(psfIter);
+#ifdef __AVX2__
+			_mm256_storeu_ps(imageIter, _mm256_fmadd_ps(psfVal, mFactor, imgVal));
+#else
+			_mm256_storeu_ps(imageIter, _mm256_add_ps(imgVal, _mm256_mul_ps(psfVal, mFactor)));
+#endif
+			imageIter+=8;
+			psfIter+=8;
+		}
+		for(size_t xpos = endX; xpos!=endX + unAlignedCount; ++xpos)
+		{
+			*imageIter -= *psfIter * f;
+			++imageIter;
+			++psfIter;
+		}
+	}
+}
+
 #endif
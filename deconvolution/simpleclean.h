@@ -60,12 +60,20 @@ class SimpleClean
 		
 		static void SubtractImage(double *image, const double *psf, size_t width, size_t height, size_t x, size_t y, double factor);
 		
-		static void PartialSubtractImage(double *image, const double *psf, size_t width, size_t height, size_t x, size_t y, double factor, size_t startY, size_t endY);
+		/**
+		 * Subtracts the factor times the psf, centred on x,y, from rows startY to endY
+		 * of the image. Instantiated for double and float images.
+		 */
+		template<typename NumT>
+		static void PartialSubtractImage(NumT *image, const NumT *psf, size_t width, size_t height, size_t x, size_t y, double factor, size_t startY, size_t endY);
 		
-		static void PartialSubtractImage(double *image, size_t imgWidth, size_t imgHeight, const double *psf, size_t psfWidth, size_t psfHeight, size_t x, size_t y, double factor, size_t startY, size_t endY);
+		template<typename NumT>
+		static void PartialSubtractImage(NumT *image, size_t imgWidth, size_t imgHeight, const NumT *psf, size_t psfWidth, size_t psfHeight, size_t x, size_t y, double factor, size_t startY, size_t endY);
 		
 #if defined __AVX__ && defined USE_INTRINSICS
 		static void PartialSubtractImageAVX(double *image, size_t imgWidth, size_t imgHeight, const double *psf, size_t psfWidth, size_t psfHeight, size_t x, size_t y, double factor, size_t startY, size_t endY);
+		
+		static void PartialSubtractImageAVX(float *image, size_t imgWidth, size_t imgHeight, const float *psf, size_t psfWidth, size_t psfHeight, size_t x, size_t y, double factor, size_t startY, size_t endY);
 #endif
 		
 	private:
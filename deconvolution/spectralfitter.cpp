@@ -2,16 +2,86 @@
 
 #include "../polynomialfitter.h"
 #include "../nlplfitter.h"
+#include "../threadpool.h"
 
 #include "../wsclean/logger.h"
 
+#include <algorithm>
 #include <limits>
 
-void SpectralFitter::FitAndEvaluate(double* values) const
+namespace {
+	/** Number of pixels that FitBlock() processes together */
+	const size_t fitBlockSize = 256;
+}
+
+void SpectralFitter::precalculate()
 {
+	_fitMatrix.clear();
+	_evaluationMatrix.clear();
+	_fitAndEvaluateMatrix.clear();
+	const size_t nChannels = _frequencies.size();
+	if(_mode != PolynomialSpectralFitting || nChannels == 0 || _nTerms == 0)
+		return;
+	
+	// Because the fit is linear in the values, column ch of the fit matrix are
+	// the terms that fit a unit value in channel ch. This gives exactly the
+	// solution of PolynomialFitter, including its handling of degenerate cases.
+	const double refFreq = ReferenceFrequency();
+	_fitMatrix.assign(_nTerms * nChannels, 0.0);
 	ao::uvector<double> terms;
-	Fit(terms, values);
-	Evaluate(values, terms);
+	for(size_t ch=0; ch!=nChannels; ++ch)
+	{
+		PolynomialFitter fitter;
+		for(size_t i=0; i!=nChannels; ++i)
+			fitter.AddDataPoint(_frequencies[i] / refFreq - 1.0, i==ch ? 1.0 : 0.0, _weights[i]);
+		fitter.Fit(terms, _nTerms);
+		for(size_t t=0; t!=_nTerms; ++t)
+			_fitMatrix[t * nChannels + ch] = terms[t];
+	}
+	
+	_evaluationMatrix.resize(nChannels * _nTerms);
+	for(size_t ch=0; ch!=nChannels; ++ch)
+	{
+		const double x = _frequencies[ch] / refFreq - 1.0;
+		double f = 1.0;
+		for(size_t t=0; t!=_nTerms; ++t)
+		{
+			_evaluationMatrix[ch * _nTerms + t] = f;
+			f *= x;
+		}
+	}
+	
+	_fitAndEvaluateMatrix.assign(nChannels * nChannels, 0.0);
+	for(size_t row=0; row!=nChannels; ++row)
+	{
+		for(size_t t=0; t!=_nTerms; ++t)
+		{
+			const double e = _evaluationMatrix[row * _nTerms + t];
+			for(size_t col=0; col!=nChannels; ++col)
+				_fitAndEvaluateMatrix[row * nChannels + col] += e * _fitMatrix[t * nChannels + col];
+		}
+	}
+}
+
+void SpectralFitter::FitAndEvaluate(double* values) const
+{
+	if(_mode == PolynomialSpectralFitting)
+	{
+		const size_t nChannels = _frequencies.size();
+		ao::uvector<double> result(nChannels, 0.0);
+		for(size_t row=0; row!=nChannels; ++row)
+		{
+			const double* matrixRow = &_fitAndEvaluateMatrix[row * nChannels];
+			for(size_t col=0; col!=nChannels; ++col)
+				result[row] += matrixRow[col] * values[col];
+		}
+		std::copy(result.begin(), result.end(), values);
+	}
+	else {
+		ao::uvector<double> terms;
+		Fit(terms, values);
+		Evaluate(values, terms);
+	}
 }
 
 void SpectralFitter::Fit(ao::uvector<double>& terms, const double* values) const
@@ -23,14 +93,14 @@ void SpectralFitter::Fit(ao::uvector<double>& terms, const double* values) const
 			break;
 			
 		case PolynomialSpectralFitting: {
-			PolynomialFitter fitter;
-			double refFreq = ReferenceFrequency();
-			for(size_t i=0; i!=_frequencies.size(); ++i)
+			const size_t nChannels = _frequencies.size();
+			terms.assign(_nTerms, 0.0);
+			for(size_t t=0; t!=_nTerms; ++t)
 			{
-				fitter.AddDataPoint(_frequencies[i] / refFreq - 1.0, values[i], _weights[i]);
+				const double* matrixRow = _fitMatrix.data() + t * nChannels;
+				for(size_t ch=0; ch!=nChannels; ++ch)
+					terms[t] += matrixRow[ch] * values[ch];
 			}
-			
-			fitter.Fit(terms, _nTerms);
 		} break;
 		
 		case LogPolynomialSpectralFitting: {
@@ -38,12 +108,93 @@ void SpectralFitter::Fit(ao::uvector<double>& terms, const double* values) const
 			double refFreq = ReferenceFrequency();
 			for(size_t i=0; i!=_frequencies.size(); ++i)
 				fitter.AddDataPoint(_frequencies[i] / refFreq, values[i]);
-			
+				
 			fitter.Fit(terms, _nTerms);
 		} break;
 	}
 }
 
+template void SpectralFitter::FitBlock(double* const* termValues, const float* const* channelValues, size_t count) const;
+template void SpectralFitter::FitBlock(double* const* termValues, const double* const* channelValues, size_t count) const;
+
+template<typename NumT>
+void SpectralFitter::FitBlock(double* const* termValues, const NumT* const* channelValues, size_t count) const
+{
+	const size_t nChannels = _frequencies.size();
+	if(_mode == PolynomialSpectralFitting)
+	{
+		// Every term is accumulated over the channels for a block of pixels, such
+		// that the inner loop runs over consecutive pixels and can be vectorized,
+		// while the term values of the block stay in cache.
+		for(size_t blockStart=0; blockStart<count; blockStart+=fitBlockSize)
+		{
+			const size_t blockCount = std::min(fitBlockSize, count - blockStart);
+			for(size_t t=0; t!=_nTerms; ++t)
+			{
+				double* termRow = termValues[t] + blockStart;
+				std::fill(termRow, termRow + blockCount, 0.0);
+				for(size_t ch=0; ch!=nChannels; ++ch)
+				{
+					const double factor = _fitMatrix[t * nChannels + ch];
+					const NumT* values = channelValues[ch] + blockStart;
+					for(size_t i=0; i!=blockCount; ++i)
+						termRow[i] += factor * values[i];
+				}
+			}
+		}
+	}
+	else if(_mode == LogPolynomialSpectralFitting) {
+		// Blocks of pixels are transposed such that the spectrum of a pixel is
+		// contiguous, instead of gathering every spectrum from all channel images.
+		// The fitter is reused for all blocks.
+		NonLinearPowerLawFitter fitter;
+		const double refFreq = ReferenceFrequency();
+		ao::uvector<double> xValues(nChannels);
+		for(size_t ch=0; ch!=nChannels; ++ch)
+			xValues[ch] = _frequencies[ch] / refFreq;
+		ao::uvector<double> spectra(fitBlockSize * nChannels), blockTerms(fitBlockSize * _nTerms);
+		for(size_t blockStart=0; blockStart<count; blockStart+=fitBlockSize)
+		{
+			const size_t blockCount = std::min(fitBlockSize, count - blockStart);
+			for(size_t ch=0; ch!=nChannels; ++ch)
+			{
+				const NumT* values = channelValues[ch] + blockStart;
+				for(size_t i=0; i!=blockCount; ++i)
+					spectra[i * nChannels + ch] = values[i];
+			}
+			fitter.FitBatch(blockTerms.data(), spectra.data(), blockCount, xValues.data(), nChannels, _nTerms);
+			for(size_t t=0; t!=_nTerms; ++t)
+			{
+				for(size_t i=0; i!=blockCount; ++i)
+					termValues[t][blockStart + i] = blockTerms[i * _nTerms + t];
+			}
+		}
+	}
+	else {
+		for(size_t t=0; t!=_nTerms; ++t)
+			std::fill(termValues[t], termValues[t] + count, 0.0);
+	}
+}
+
+template void SpectralFitter::FitImages(double* const* termImages, const float* const* channelImages, size_t imageSize) const;
+template void SpectralFitter::FitImages(double* const* termImages, const double* const* channelImages, size_t imageSize) const;
+
+template<typename NumT>
+void SpectralFitter::FitImages(double* const* termImages, const NumT* const* channelImages, size_t imageSize) const
+{
+	const size_t nChannels = _frequencies.size();
+	ThreadPool pool;
+	pool.for_each_range(imageSize, fitBlockSize, [&](size_t start, size_t end) {
+		ao::uvector<const NumT*> values(nChannels);
+		for(size_t ch=0; ch!=nChannels; ++ch)
+			values[ch] = channelImages[ch] + start;
+		ao::uvector<double*> terms(_nTerms);
+		for(size_t t=0; t!=_nTerms; ++t)
+			terms[t] = termImages[t] + start;
+		FitBlock(terms.data(), values.data(), end - start);
+	});
+}
+
 void SpectralFitter::Evaluate(double* values, const ao::uvector<double>& terms) const
 {
 	switch(_mode)
@@ -53,14 +204,13 @@ void SpectralFitter::Evaluate(double* values, const ao::uvector<double>& terms)
 			break;
 			
 		case PolynomialSpectralFitting: {
-			double refFreq = ReferenceFrequency();
 			for(size_t i=0; i!=_frequencies.size(); ++i) {
-				double newValue = PolynomialFitter::Evaluate(_frequencies[i] / refFreq - 1.0, terms);
-				//std::cout << values[i] << "->" << newValue << ' ';
+				const double* powers = _evaluationMatrix.data() + i * _nTerms;
+				double newValue = 0.0;
+				for(size_t t=0; t!=std::min(_nTerms, terms.size()); ++t)
+					newValue += powers[t] * terms[t];
 				values[i] = newValue;
 			}
-			//std::cout << '\n';
-			
 		} break;
 		
 		case LogPolynomialSpectralFitting: {
@@ -91,3 +241,36 @@ double SpectralFitter::Evaluate(const ao::uvector<double>& terms, double frequen
 			return NonLinearPowerLawFitter::Evaluate(frequency, terms, ReferenceFrequency());
 	}
 }
+
+void SpectralFitter::EvaluateBlock(double* values, const double* const* termValues, size_t count, double frequency) const
+{
+	switch(_mode)
+	{
+		default:
+		case NoSpectralFitting:
+			throw std::runtime_error("Something is inconsistent: can't evaluate terms at frequency without fitting");
+			
+		case PolynomialSpectralFitting: {
+			const double x = frequency / ReferenceFrequency() - 1.0;
+			std::fill(values, values + count, 0.0);
+			double f = 1.0;
+			for(size_t t=0; t!=_nTerms; ++t)
+			{
+				const double* terms = termValues[t];
+				for(size_t px=0; px!=count; ++px)
+					values[px] += f * terms[px];
+				f *= x;
+			}
+		} break;
+		
+		case LogPolynomialSpectralFitting: {
+			ao::uvector<double> pixelTerms(_nTerms);
+			for(size_t px=0; px!=count; ++px)
+			{
+				for(size_t t=0; t!=_nTerms; ++t)
+					pixelTerms[t] = termValues[t][px];
+				values[px] = NonLinearPowerLawFitter::Evaluate(frequency, pixelTerms, ReferenceFrequency());
+			}
+		} break;
+	}
+}
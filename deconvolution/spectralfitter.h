@@ -9,6 +9,14 @@ enum SpectralFittingMode {
 	LogPolynomialSpectralFitting
 };
 
+/**
+ * Fits a spectrum to the values of the deconvolution channels.
+ *
+ * A polynomial fit is linear in the values, and the frequencies and weights
+ * don't change during a run. Therefore, the least-squares solution is
+ * calculated once when the mode or frequencies are set, and every fit is a
+ * matrix-vector product with the resulting matrix.
+ */
 class SpectralFitter
 {
 public:
@@ -25,20 +33,48 @@ public:
 	{
 		_mode = mode;
 		_nTerms = nTerms;
+		precalculate();
 	}
 	
 	void FitAndEvaluate(double* values) const;
 	
 	void Fit(ao::uvector<double>& terms, const double* values) const;
 	
+	/**
+	 * Fit the spectra of many pixels at once. This is faster than calling
+	 * Fit() for every pixel.
+	 * @param termValues For every term, an output array of @p count values, e.g.
+	 * a term image.
+	 * @param channelValues For every channel, an array of @p count values, e.g.
+	 * a channel image.
+	 * @param count Number of pixels to fit.
+	 */
+	template<typename NumT>
+	void FitBlock(double* const* termValues, const NumT* const* channelValues, size_t count) const;
+	
+	/**
+	 * Like FitBlock(), but divides the pixels over threads.
+	 */
+	template<typename NumT>
+	void FitImages(double* const* termImages, const NumT* const* channelImages, size_t imageSize) const;
+	
 	void Evaluate(double* values, const ao::uvector<double>& terms) const;
 	
 	double Evaluate(const ao::uvector<double>& terms, double frequency) const;
 	
+	/**
+	 * Evaluate the terms of many pixels at one frequency.
+	 * @param values Output array of @p count values.
+	 * @param termValues For every term, an array of @p count values, as
+	 * produced by FitBlock().
+	 */
+	void EvaluateBlock(double* values, const double* const* termValues, size_t count, double frequency) const;
+	
 	void SetFrequencies(const double* frequencies, const double* weights, size_t n)
 	{
 		_frequencies.assign(frequencies, frequencies+n);
 		_weights.assign(weights, weights+n);
+		precalculate();
 	}
 	
 	size_t NTerms() const { return _nTerms; }
@@ -47,9 +83,19 @@ public:
 		return _frequencies[_frequencies.size()/2];
 	}
 private:
+	void precalculate();
+	
 	enum SpectralFittingMode _mode;
 	size_t _nTerms;
 	ao::uvector<double> _frequencies, _weights;
+	
+	/**
+	 * For polynomial fitting: the NTerms() x nChannels matrix that maps the
+	 * channel values onto the terms, the nChannels x NTerms() matrix that
+	 * evaluates the terms at the channel frequencies, and their product, which
+	 * maps the values directly onto the fitted values.
+	 */
+	ao::uvector<double> _fitMatrix, _evaluationMatrix, _fitAndEvaluateMatrix;
 };
 
 #endif
@@ -4,8 +4,20 @@
 #include "model/model.h"
 #include "progressbar.h"
 
+#include "wsclean/logger.h"
+
 #include <casacore/measures/TableMeasures/ArrayMeasColumn.h>
 
+#include <cmath>
+
+#ifdef __SSE__
+#define USE_INTRINSICS
+#endif
+
+#ifdef USE_INTRINSICS
+#include <immintrin.h>
+#endif
+
 DFTPredictionImage::DFTPredictionImage(size_t width, size_t height, ImageBufferAllocator& allocator) :
 	_width(width),
 	_height(height),
@@ -251,6 +263,266 @@ void DFTPredictionInput::InitializeFromModel(const Model& model, long double pha
 	}
 }
 
+DFTPredictionAlgorithm::DFTPredictionAlgorithm(DFTPredictionInput& input, const BandData& band) :
+	_input(input), _band(band), _hasBeam(false)
+{
+	initializeComponentArrays();
+}
+
+void DFTPredictionAlgorithm::initializeComponentArrays()
+{
+	_components.clear();
+	for(DFTPredictionInput::const_iterator c=_input.begin(); c!=_input.end(); ++c)
+	{
+		if(!c->IsGaussian())
+			_components.push_back(&*c);
+	}
+	_pointCount = _components.size();
+	for(DFTPredictionInput::const_iterator c=_input.begin(); c!=_input.end(); ++c)
+	{
+		if(c->IsGaussian())
+			_components.push_back(&*c);
+	}
+	
+	const size_t n = _components.size(), channelCount = _band.ChannelCount();
+	_l.resize(n);
+	_m.resize(n);
+	_n.resize(n);
+	_isStokesIOnly = true;
+	for(size_t i=0; i!=n; ++i)
+	{
+		const DFTPredictionComponent& component = *_components[i];
+		_l[i] = component.L();
+		_m[i] = component.M();
+		_n[i] = component.LMSqrt() - 1.0;
+		for(size_t ch=0; ch!=channelCount; ++ch)
+		{
+			const MC2x2& flux = component.LinearFlux(ch);
+			if(flux[1] != 0.0 || flux[2] != 0.0 || flux[0] != flux[3] || flux[0].imag() != 0.0)
+				_isStokesIOnly = false;
+		}
+	}
+	if(_isStokesIOnly)
+	{
+		_stokesIFlux.resize(channelCount * n);
+		for(size_t ch=0; ch!=channelCount; ++ch)
+		{
+			for(size_t i=0; i!=n; ++i)
+				_stokesIFlux[ch*n + i] = _components[i]->LinearFlux(ch)[0].real();
+		}
+	}
+	else {
+		_stokesIFlux.clear();
+	}
+	
+	// Phasor stepping requires the channels to be evenly spaced
+	_hasRegularChannels = true;
+	if(channelCount > 1)
+	{
+		const double
+			start = _band.ChannelFrequency(0),
+			step = (_band.ChannelFrequency(channelCount-1) - start) / (channelCount-1);
+		for(size_t ch=0; ch!=channelCount; ++ch)
+		{
+			if(std::fabs(_band.ChannelFrequency(ch) - (start + ch*step)) > 1e-6 * std::fabs(step))
+				_hasRegularChannels = false;
+		}
+	}
+	Logger::Debug << "DFT prediction of " << n << " components (" << (n-_pointCount) << " Gaussians), "
+		<< (_isStokesIOnly ? "Stokes I only" : "full polarization") << ", " << (_hasRegularChannels ? "regular" : "irregular") << " channels.\n";
+}
+
+void DFTPredictionAlgorithm::SinCos(const double* x, double* sinX, double* cosX, size_t n)
+{
+	// The argument is reduced to r in [-pi/4, pi/4] with a three-part pi/2
+	// (Cody-Waite), after which the kernel polynomials of fdlibm are used.
+	const double
+		twoOverPi = 6.36619772367581382433e-01,
+		pio2_1 = 1.57079632673412561417e+00,
+		pio2_2 = 6.07710050630396597660e-11,
+		pio2_3 = 2.02226624879595063154e-21,
+		s1 = -1.66666666666666324348e-01, s2 = 8.33333333332248946124e-03,
+		s3 = -1.98412698298579493134e-04, s4 = 2.75573137070700676789e-06,
+		s5 = -2.50507602534068634195e-08, s6 = 1.58969099521155010221e-10,
+		c1 = 4.16666666666666019037e-02, c2 = -1.38888888888741095749e-03,
+		c3 = 2.48015872894767294178e-05, c4 = -2.75573143513906633035e-07,
+		c5 = 2.08757232129817482790e-09, c6 = -1.13596475577881948265e-11,
+		roundShift = 6755399441055744.0;
+	for(size_t i=0; i!=n; ++i)
+	{
+		// Adding and subtracting 1.5 x 2^52 rounds to the nearest integer; unlike
+		// std::round(), this allows the loop to be vectorized.
+		const double q = (x[i] * twoOverPi + roundShift) - roundShift;
+		const double r = ((x[i] - q * pio2_1) - q * pio2_2) - q * pio2_3;
+		const double z = r * r;
+		const double s = r + r * z * (s1 + z * (s2 + z * (s3 + z * (s4 + z * (s5 + z * s6)))));
+		const double c = 1.0 - 0.5 * z + z * z * (c1 + z * (c2 + z * (c3 + z * (c4 + z * (c5 + z * c6)))));
+		const int quadrant = int(q) & 3;
+		const double sinR = (quadrant & 1) ? c : s;
+		const double cosR = (quadrant & 1) ? s : c;
+		sinX[i] = (quadrant & 2) ? -sinR : sinR;
+		cosX[i] = ((quadrant + 1) & 2) ? -cosR : cosR;
+	}
+}
+
+namespace {
+	/**
+	 * Multiplies the phasor (cosPhase, sinPhase) by (cosStep, sinStep).
+	 */
+	inline void rotatePhasor(double& sinPhase, double& cosPhase, double sinStep, double cosStep)
+	{
+		const double s = sinPhase * cosStep + cosPhase * sinStep;
+		cosPhase = cosPhase * cosStep - sinPhase * sinStep;
+		sinPhase = s;
+	}
+	
+	/**
+	 * Sums flux x phasor over the components in [start, end) and, when step is
+	 * given, rotates the phasors to the next channel.
+	 */
+	void accumulateStokesI(const double* flux, double* sinPhase, double* cosPhase, const double* sinStep, const double* cosStep, size_t start, size_t end, double& real, double& imag)
+	{
+		size_t i = start;
+#if defined __AVX__ && defined USE_INTRINSICS && !defined FORCE_NON_AVX
+		__m256d real4 = _mm256_setzero_pd(), imag4 = _mm256_setzero_pd();
+		for(; i+4<=end; i+=4)
+		{
+			const __m256d f = _mm256_loadu_pd(&flux[i]);
+			const __m256d s = _mm256_loadu_pd(&sinPhase[i]);
+			const __m256d c = _mm256_loadu_pd(&cosPhase[i]);
+			real4 = _mm256_add_pd(real4, _mm256_mul_pd(f, c));
+			imag4 = _mm256_add_pd(imag4, _mm256_mul_pd(f, s));
+			if(sinStep != 0)
+			{
+				const __m256d ss = _mm256_loadu_pd(&sinStep[i]);
+				const __m256d cs = _mm256_loadu_pd(&cosStep[i]);
+				_mm256_storeu_pd(&sinPhase[i], _mm256_add_pd(_mm256_mul_pd(s, cs), _mm256_mul_pd(c, ss)));
+				_mm256_storeu_pd(&cosPhase[i], _mm256_sub_pd(_mm256_mul_pd(c, cs), _mm256_mul_pd(s, ss)));
+			}
+		}
+		double r[4], m[4];
+		_mm256_storeu_pd(r, real4);
+		_mm256_storeu_pd(m, imag4);
+		real += (r[0] + r[1]) + (r[2] + r[3]);
+		imag += (m[0] + m[1]) + (m[2] + m[3]);
+#endif
+		for(; i<end; ++i)
+		{
+			real += flux[i] * cosPhase[i];
+			imag += flux[i] * sinPhase[i];
+			if(sinStep != 0)
+				rotatePhasor(sinPhase[i], cosPhase[i], sinStep[i], cosStep[i]);
+		}
+	}
+}
+
+void DFTPredictionAlgorithm::PredictRow(MC2x2* dest, double uInM, double vInM, double wInM, size_t a1, size_t a2) const
+{
+	if(_hasBeam)
+		predictRow<false, true>(dest, uInM, vInM, wInM, a1, a2);
+	else if(_isStokesIOnly)
+		predictRow<true, false>(dest, uInM, vInM, wInM, a1, a2);
+	else
+		predictRow<false, false>(dest, uInM, vInM, wInM, a1, a2);
+}
+
+template<bool IsStokesIOnly, bool HasBeam>
+void DFTPredictionAlgorithm::predictRow(MC2x2* dest, double uInM, double vInM, double wInM, size_t a1, size_t a2) const
+{
+	const size_t n = _components.size(), channelCount = _band.ChannelCount();
+	for(size_t ch=0; ch!=channelCount; ++ch)
+		dest[ch] = MC2x2::Zero();
+	if(n == 0)
+		return;
+	
+	const double speedOfLight = 299792458.0;
+	// Phase per Hz of each component
+	ao::uvector<double> phaseFactor(n), angle(n), sinPhase(n), cosPhase(n), sinStep, cosStep;
+	for(size_t i=0; i!=n; ++i)
+		phaseFactor[i] = (2.0*M_PI/speedOfLight) * (uInM*_l[i] + vInM*_m[i] + wInM*_n[i]);
+	if(_hasRegularChannels && channelCount > 1)
+	{
+		const double step = (_band.ChannelFrequency(channelCount-1) - _band.ChannelFrequency(0)) / (channelCount-1);
+		sinStep.resize(n);
+		cosStep.resize(n);
+		for(size_t i=0; i!=n; ++i)
+			angle[i] = phaseFactor[i] * step;
+		SinCos(angle.data(), sinStep.data(), cosStep.data(), n);
+	}
+	
+	// Exponent per Hz^2 of the Gaussians
+	const size_t gausCount = n - _pointCount;
+	ao::uvector<double> gausExponent(gausCount), gaus(gausCount);
+	for(size_t g=0; g!=gausCount; ++g)
+	{
+		const double* gausTrans = _components[_pointCount + g]->GausTransformationMatrix();
+		const double
+			u = (uInM*gausTrans[0] + vInM*gausTrans[1]) / speedOfLight,
+			v = (uInM*gausTrans[2] + vInM*gausTrans[3]) / speedOfLight;
+		gausExponent[g] = -u*u - v*v;
+	}
+	
+	for(size_t ch=0; ch!=channelCount; ++ch)
+	{
+		const double frequency = _band.ChannelFrequency(ch);
+		if(ch == 0 || sinStep.empty())
+		{
+			for(size_t i=0; i!=n; ++i)
+				angle[i] = phaseFactor[i] * frequency;
+			SinCos(angle.data(), sinPhase.data(), cosPhase.data(), n);
+		}
+		for(size_t g=0; g!=gausCount; ++g)
+			gaus[g] = exp(gausExponent[g] * frequency * frequency);
+		// The phasors are rotated to the next channel after they have been used
+		const bool rotate = !sinStep.empty() && ch+1 != channelCount;
+		
+		if(IsStokesIOnly)
+		{
+			const double* flux = &_stokesIFlux[ch * n];
+			double real = 0.0, imag = 0.0;
+			accumulateStokesI(flux, sinPhase.data(), cosPhase.data(), rotate ? sinStep.data() : 0, cosStep.data(), 0, _pointCount, real, imag);
+			for(size_t g=0; g!=gausCount; ++g)
+			{
+				const size_t i = _pointCount + g;
+				real += flux[i] * gaus[g] * cosPhase[i];
+				imag += flux[i] * gaus[g] * sinPhase[i];
+				if(rotate)
+					rotatePhasor(sinPhase[i], cosPhase[i], sinStep[i], cosStep[i]);
+			}
+			dest[ch][0] = std::complex<double>(real, imag);
+			dest[ch][3] = dest[ch][0];
+		}
+		else {
+			MC2x2& value = dest[ch];
+			for(size_t i=0; i!=n; ++i)
+			{
+				const DFTPredictionComponent& component = *_components[i];
+				MC2x2 appFlux;
+				if(HasBeam)
+				{
+					MC2x2 temp;
+					MC2x2::ATimesB(temp, component.AntennaInfo(a1).BeamValue(ch), component.LinearFlux(ch));
+					MC2x2::ATimesHermB(appFlux, temp, component.AntennaInfo(a2).BeamValue(ch));
+				}
+				else {
+					appFlux = component.LinearFlux(ch);
+				}
+				const double weight = (i < _pointCount) ? 1.0 : gaus[i - _pointCount];
+				const double s = sinPhase[i] * weight, c = cosPhase[i] * weight;
+				for(size_t p=0; p!=4; ++p)
+				{
+					const std::complex<double> val = appFlux[p];
+					value[p] += std::complex<double>(
+						val.real() * c - val.imag() * s,
+						val.real() * s + val.imag() * c);
+				}
+				if(rotate)
+					rotatePhasor(sinPhase[i], cosPhase[i], sinStep[i], cosStep[i]);
+			}
+		}
+	}
+}
+
 void DFTPredictionAlgorithm::Predict(MC2x2& dest, double u, double v, double w, size_t channelIndex, size_t a1, size_t a2)
 {
 	dest = MC2x2::Zero();
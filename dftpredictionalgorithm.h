@@ -173,22 +173,74 @@ private:
 	std::vector<PolarizationEnum> _pols;
 };
 
+/**
+ * Predicts visibilities from a list of components by direct Fourier transform.
+ *
+ * For predicting all channels of a row, the positions and (when possible) the
+ * fluxes of the components are copied into structure-of-arrays buffers on
+ * construction. The phases of the first channel are calculated for all
+ * components at once with a vectorizable sincos, and the phases of the other
+ * channels are found by rotating the phasors with a per-component channel step.
+ * When all components are unpolarized and no beam is applied, a faster Stokes I
+ * path is used. The components (but not their beam values) should therefore not
+ * be changed after construction.
+ *
+ * All const methods, including PredictRow(), can be called from multiple
+ * threads simultaneously, so rows can be predicted in parallel.
+ */
 class DFTPredictionAlgorithm
 {
 public:
-	DFTPredictionAlgorithm(DFTPredictionInput& input, const BandData& band) : _input(input), _band(band), _hasBeam(false)
-	{ }
+	DFTPredictionAlgorithm(DFTPredictionInput& input, const BandData& band);
 	
+	/**
+	 * Predict a single visibility.
+	 * @param u U coordinate in wavelengths.
+	 * @param v V coordinate in wavelengths.
+	 * @param w W coordinate in wavelengths.
+	 */
 	void Predict(MC2x2& dest, double u, double v, double w, size_t channelIndex, size_t a1, size_t a2);
 
+	/**
+	 * Predict the visibilities of all channels of a row.
+	 * @param dest Array of ChannelCount() values.
+	 * @param uInM U coordinate in meters.
+	 * @param vInM V coordinate in meters.
+	 * @param wInM W coordinate in meters.
+	 */
+	void PredictRow(MC2x2* dest, double uInM, double vInM, double wInM, size_t a1, size_t a2) const;
+
 	void UpdateBeam(LBeamEvaluator& beamEvaluator);
 	
+	/**
+	 * Calculates the sine and cosine of n values. The loop is written such that
+	 * the compiler can vectorize it. The result is accurate to a few ulp for
+	 * |x| < 1e6.
+	 */
+	static void SinCos(const double* x, double* sinX, double* cosX, size_t n);
+	
 private:
 	void predict(MC2x2& dest, double u, double v, double w, size_t channelIndex, size_t a1, size_t a2, const DFTPredictionComponent& component);
 	
+	void initializeComponentArrays();
+	
+	template<bool IsStokesIOnly, bool HasBeam>
+	void predictRow(MC2x2* dest, double uInM, double vInM, double wInM, size_t a1, size_t a2) const;
+	
 	DFTPredictionInput& _input;
 	BandData _band;
 	bool _hasBeam;
+	
+	/**
+	 * Component arrays. Point sources come first and are followed by the
+	 * Gaussians; _components holds the component that each index refers to.
+	 */
+	std::vector<const DFTPredictionComponent*> _components;
+	ao::uvector<double> _l, _m, _n;
+	size_t _pointCount;
+	// Stokes I flux of all components, stored per channel.
+	ao::uvector<double> _stokesIFlux;
+	bool _isStokesIOnly, _hasRegularChannels;
 };
 
 #endif
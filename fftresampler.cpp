@@ -2,6 +2,8 @@
 #include "uvector.h"
 #include "wsclean/logger.h"
 
+#include <algorithm>
+#include <cmath>
 #include <complex>
 #include <iostream>
 
@@ -9,19 +11,21 @@ FFTResampler::FFTResampler(size_t inWidth, size_t inHeight, size_t outWidth, siz
 	_inputWidth(inWidth), _inputHeight(inHeight),
 	_outputWidth(outWidth), _outputHeight(outHeight),
 	_fftWidth(std::max(inWidth, outWidth)), _fftHeight(std::max(inHeight, outHeight)),
+	_spectrumSize(std::max((inWidth/2+1)*inHeight, (outWidth/2+1)*outHeight)),
 	_tasks(cpuCount),
 	_verbose(verbose)
 {
-	double* inputData = reinterpret_cast<double*>(fftw_malloc(_fftWidth*_fftHeight * sizeof(double)));
-	fftw_complex* fftData = reinterpret_cast<fftw_complex*>(fftw_malloc(_fftWidth*_fftHeight * sizeof(fftw_complex)));
+	// The forward FFT is in place, the backward FFT writes to the output image
+	fftw_complex* fftData = reinterpret_cast<fftw_complex*>(allocateSpectrum());
+	double* outputData = reinterpret_cast<double*>(fftw_malloc(_outputWidth*_outputHeight * sizeof(double)));
 	_inToFPlan =
 		fftw_plan_dft_r2c_2d(_inputHeight, _inputWidth,
-			inputData, fftData, FFTW_ESTIMATE);
+			reinterpret_cast<double*>(fftData), fftData, FFTW_ESTIMATE);
 	_fToOutPlan =
 		fftw_plan_dft_c2r_2d(_outputHeight, _outputWidth,
-			fftData, inputData, FFTW_ESTIMATE);
+			fftData, outputData, FFTW_ESTIMATE);
 	fftw_free(fftData);
-	fftw_free(inputData);
+	fftw_free(outputData);
 }
 
 FFTResampler::~FFTResampler()
@@ -31,89 +35,140 @@ FFTResampler::~FFTResampler()
 	fftw_destroy_plan(_fToOutPlan);
 }
 
+std::complex<double>* FFTResampler::allocateSpectrum() const
+{
+	return reinterpret_cast<std::complex<double>*>(fftw_malloc(_spectrumSize * sizeof(std::complex<double>)));
+}
+
+void FFTResampler::copyInput(const double* input, std::complex<double>* spectrum) const
+{
+	double* data = reinterpret_cast<double*>(spectrum);
+	const size_t paddedWidth = 2*(_inputWidth/2+1);
+	for(size_t y=0; y!=_inputHeight; ++y)
+	{
+		const double* inputRow = &input[y*_inputWidth];
+		double* dataRow = &data[y*paddedWidth];
+		for(size_t x=0; x!=_inputWidth; ++x)
+			dataRow[x] = std::isfinite(inputRow[x]) ? inputRow[x] : 0.0;
+	}
+}
+
+void FFTResampler::resizeSpectrum(std::complex<double>* spectrum) const
+{
+	// The last dimension is stored half
+	const size_t
+		oldStride = _inputWidth/2+1,
+		newStride = _outputWidth/2+1,
+		minWidth = std::min(_inputWidth, _outputWidth),
+		minHeight = std::min(_inputHeight, _outputHeight),
+		minMidX = minWidth/2,
+		minMidY = minHeight/2;
+	const double factor = 1.0 / (minWidth*minHeight);
+	const bool copyNyquist = _inputWidth >= _outputWidth;
+	
+	// When both dimensions grow, every row moves to a higher address, and when
+	// both shrink, every row moves to a lower address. Rows are then moved in
+	// the order that never overwrites a row that still has to be moved. Otherwise,
+	// the rows are copied from a copy of the input spectrum.
+	const bool
+		isGrowing = newStride >= oldStride && _outputHeight >= _inputHeight,
+		isShrinking = newStride <= oldStride && _outputHeight <= _inputHeight;
+	ao::uvector<std::complex<double>> copy;
+	const std::complex<double>* source = spectrum;
+	if(!isGrowing && !isShrinking)
+	{
+		copy.assign(spectrum, spectrum + oldStride*_inputHeight);
+		source = copy.data();
+	}
+	
+	auto moveRow = [&](size_t y)
+	{
+		size_t oldY = y-minMidY + _inputHeight;
+		size_t newY = y-minMidY + _outputHeight;
+		if(oldY >= _inputHeight) oldY -= _inputHeight;
+		if(newY >= _outputHeight) newY -= _outputHeight;
+		const std::complex<double>* sourceRow = &source[oldY * oldStride];
+		std::complex<double>* destRow = &spectrum[newY * newStride];
+		const std::complex<double> nyquist = sourceRow[_inputWidth/2];
+		if(destRow <= sourceRow)
+		{
+			for(size_t x=0; x!=minMidX; ++x)
+				destRow[x] = sourceRow[x] * factor;
+		}
+		else {
+			for(size_t x=minMidX; x!=0; --x)
+				destRow[x-1] = sourceRow[x-1] * factor;
+		}
+		if(copyNyquist)
+			destRow[_outputWidth/2] = nyquist * factor;
+	};
+	// Rows y >= minMidY end up at the start of the output spectrum
+	if(isGrowing && source == spectrum)
+	{
+		for(size_t y=minMidY; y!=0; --y)
+			moveRow(y-1);
+		for(size_t y=minHeight; y!=minMidY; --y)
+			moveRow(y-1);
+	}
+	else {
+		for(size_t y=minMidY; y!=minHeight; ++y)
+			moveRow(y);
+		for(size_t y=0; y!=minMidY; ++y)
+			moveRow(y);
+	}
+	
+	// Zero the part of the output spectrum that was not copied
+	const size_t
+		copiedWidth = copyNyquist ? newStride : minMidX,
+		firstEmptyRow = minHeight - minMidY,
+		endEmptyRow = _outputHeight - minMidY;
+	for(size_t y=0; y!=_outputHeight; ++y)
+	{
+		std::complex<double>* row = &spectrum[y * newStride];
+		if(y >= firstEmptyRow && y < endEmptyRow)
+			std::fill_n(row, newStride, std::complex<double>(0.0));
+		else
+			std::fill(row + copiedWidth, row + newStride, std::complex<double>(0.0));
+	}
+}
+
 void FFTResampler::runThread()
 {
+	// The buffer is allocated for the first task, and reused for the next tasks
+	// of this thread. It holds the input image, its spectrum and the output
+	// spectrum.
+	std::complex<double>* spectrum = nullptr;
 	Task task;
 	while(_tasks.read(task))
 	{
-		double *endPtr = task.input + _inputWidth*_inputHeight;
-		for(double* i=task.input; i!=endPtr; ++i)
-		{
-			if(!std::isfinite(*i))
-				*i = 0.0;
-		}
+		if(spectrum == nullptr)
+			spectrum = allocateSpectrum();
+		copyInput(task.input, spectrum);
 		
-		size_t fftInWidth = _inputWidth/2+1;
-		std::complex<double>
-			*fftData = reinterpret_cast<std::complex<double>*>(fftw_malloc(fftInWidth*_inputHeight*sizeof(std::complex<double>)));
 		if(_verbose) Logger::Debug << "FFT " << _inputWidth << " x " << _inputHeight << " real -> complex...\n";
-		fftw_execute_dft_r2c(_inToFPlan, task.input, reinterpret_cast<fftw_complex*>(fftData));
-		
-		size_t fftOutWidth = _outputWidth/2+1;
-		// TODO this can be done without allocating more mem!
-		std::complex<double>
-			*newfftData = reinterpret_cast<std::complex<double>*>(fftw_malloc(fftOutWidth*_outputHeight*sizeof(std::complex<double>)));
-		memset(newfftData, 0, fftOutWidth*_outputHeight*sizeof(std::complex<double>));
-			
-		size_t oldMidX = _inputWidth/2;
-		size_t newMidX = _outputWidth/2;
-		
-		size_t minWidth = std::min(_inputWidth, _outputWidth);
-		size_t minHeight = std::min(_inputHeight, _outputHeight);
-		
-		size_t minMidX = minWidth/2;
-		size_t minMidY = minHeight/2;
+		fftw_execute_dft_r2c(_inToFPlan, reinterpret_cast<double*>(spectrum), reinterpret_cast<fftw_complex*>(spectrum));
 		
-		double factor = 1.0 / (minWidth*minHeight);
-		
-		for(size_t y=0; y!=minHeight; ++y)
-		{
-			size_t oldY = y-minMidY + _inputHeight;
-			size_t newY = y-minMidY + _outputHeight;
-			if(oldY >= _inputHeight) oldY -= _inputHeight;
-			if(newY >= _outputHeight) newY -= _outputHeight;
-			
-			// The last dimension is stored half
-			for(size_t x=0; x!=minMidX; ++x)
-			{
-				size_t oldX = x;
-				size_t newX = x;
-				size_t oldIndex = oldX + oldY * (oldMidX+1);
-				size_t newIndex = newX + newY * (newMidX+1);
-				
-				newfftData[newIndex] = fftData[oldIndex] * factor;
-				
-				//if((x == 0 && newY == 0) || (x==minMidX-1 && y==minHeight-1))
-				//	std::cout << newfftData[newIndex] << " (" << oldX << " , " << oldY << ") - (" << newX << " , " << newY << ")\n";
-			}
-			if(_inputWidth >= _outputWidth)
-			{
-				size_t oldIndex = _inputWidth/2 + oldY * (oldMidX+1);
-				size_t newIndex = _outputWidth/2 + newY * (newMidX+1);
-				newfftData[newIndex] = fftData[oldIndex] * factor;
-			}
-		}
-		
-		fftw_free(fftData);
+		resizeSpectrum(spectrum);
 		
 		if(_verbose) Logger::Debug << "FFT " << _outputWidth << " x " << _outputHeight << " complex -> real...\n";
-		fftw_execute_dft_c2r(_fToOutPlan, reinterpret_cast<fftw_complex*>(newfftData), task.output);
-		
-		fftw_free(newfftData);
+		fftw_execute_dft_c2r(_fToOutPlan, reinterpret_cast<fftw_complex*>(spectrum), task.output);
 	}
+	fftw_free(spectrum);
 }
 
 void FFTResampler::SingleFT(const double* input, double* realOutput, double* imaginaryOutput)
 {
-	ao::uvector<double> data(_inputWidth*_inputHeight);
-	size_t
+	std::complex<double>* fftData = allocateSpectrum();
+	double* data = reinterpret_cast<double*>(fftData);
+	const size_t
+		paddedWidth = 2*(_inputWidth/2+1),
 		halfWidth = _inputWidth/2,
 		halfHeight = _inputHeight/2;
 	for(size_t y=0; y!=_inputHeight; ++y)
 	{
 		size_t yIn = y + halfHeight;
 		if(yIn >= _inputHeight) yIn -= _inputHeight;
-		double* rowOutPtr = &data[y*_inputWidth];
+		double* rowOutPtr = &data[y*paddedWidth];
 		const double* rowInPtr = &input[yIn*_inputWidth];
 		for(size_t x=0; x!=_inputWidth; ++x)
 		{
@@ -126,11 +181,8 @@ void FFTResampler::SingleFT(const double* input, double* realOutput, double* ima
 		}
 	}
 	
-	size_t fftInWidth = _inputWidth/2+1;
-	std::complex<double>
-		*fftData = reinterpret_cast<std::complex<double>*>(fftw_malloc(fftInWidth*_inputHeight*sizeof(std::complex<double>)));
 	if(_verbose) Logger::Debug << "FFT " << _inputWidth << " x " << _inputHeight << " real -> complex...\n";
-	fftw_execute_dft_r2c(_inToFPlan, data.data(), reinterpret_cast<fftw_complex*>(fftData));
+	fftw_execute_dft_r2c(_inToFPlan, data, reinterpret_cast<fftw_complex*>(fftData));
 	
 	size_t midX = _inputWidth/2;
 	size_t midY = _inputHeight/2;
@@ -3,6 +3,7 @@
 
 #include "lane.h"
 
+#include <complex>
 #include <vector>
 
 #include <fftw3.h>
@@ -57,9 +58,28 @@ public:
 private:
 	void runThread();
 	
+	/**
+	 * Allocates a buffer that can hold both the (padded) input image and the
+	 * input and output spectra.
+	 */
+	std::complex<double>* allocateSpectrum() const;
+	
+	/**
+	 * Copies the input into the buffer, in the padded layout of the in-place
+	 * real-to-complex FFT. Non-finite values are replaced by zero.
+	 */
+	void copyInput(const double* input, std::complex<double>* spectrum) const;
+	
+	/**
+	 * Pads or crops the input spectrum in place to the output spectrum, and
+	 * normalizes it.
+	 */
+	void resizeSpectrum(std::complex<double>* spectrum) const;
+	
 	size_t _inputWidth, _inputHeight;
 	size_t _outputWidth, _outputHeight;
 	size_t _fftWidth, _fftHeight;
+	size_t _spectrumSize;
 	
 	fftw_plan _inToFPlan, _fToOutPlan;
 	
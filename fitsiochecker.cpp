@@ -5,6 +5,11 @@
 #include <sstream>
 #include <stdexcept>
 
+bool FitsIOChecker::IsThreadSafe()
+{
+	return fits_is_reentrant() != 0;
+}
+
 void FitsIOChecker::checkStatus(int status, const std::string& filename)
 {
 	if(status) {
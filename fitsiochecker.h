@@ -9,6 +9,13 @@ protected:
 	static void checkStatus(int status, const std::string& filename);
 	static void checkStatus(int status, const std::string& filename, const std::string& operation);
 public:
+	/**
+	 * Whether cfitsio was built to be reentrant, in which case different threads
+	 * may use it at the same time. Otherwise, all cfitsio calls should be made
+	 * from a single thread at a time.
+	 */
+	static bool IsThreadSafe();
+	
 	enum Unit {
 		JanskyPerBeam,
 		Jansky,
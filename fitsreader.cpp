@@ -1,6 +1,8 @@
 #include "fitsreader.h"
 #include "polarization.h"
 
+#include "wsclean/instrumentation.h"
+
 #include <stdexcept>
 #include <sstream>
 #include <cmath>
@@ -26,12 +28,13 @@ FitsReader::FitsReader(const FitsReader& source) :
 	_history(source._history)
 {
 	int status = 0;
-	fits_open_file(&_fitsPtr, _filename.c_str(), READONLY, &status);
+	fits_open_image(&_fitsPtr, _filename.c_str(), READONLY, &status);
 	checkStatus(status, _filename);
 	
-	// Move to first HDU
+	// fits_open_image() moved to the first HDU with an image, which is an
+	// extension when the image is tile compressed
 	int hduType;
-	fits_movabs_hdu(_fitsPtr, 1, &hduType, &status);
+	fits_get_hdu_type(_fitsPtr, &hduType, &status);
 	checkStatus(status, _filename);
 	if(hduType != IMAGE_HDU) throw std::runtime_error("First HDU is not an image");
 }
@@ -73,12 +76,13 @@ FitsReader& FitsReader::operator=(const FitsReader& rhs)
 	fits_close_file(_fitsPtr, &status);
 	checkStatus(status, _filename);
 	
-	fits_open_file(&_fitsPtr, _filename.c_str(), READONLY, &status);
+	fits_open_image(&_fitsPtr, _filename.c_str(), READONLY, &status);
 	checkStatus(status, _filename);
 	
-	// Move to first HDU
+	// fits_open_image() moved to the first HDU with an image, which is an
+	// extension when the image is tile compressed
 	int hduType;
-	fits_movabs_hdu(_fitsPtr, 1, &hduType, &status);
+	fits_get_hdu_type(_fitsPtr, &hduType, &status);
 	checkStatus(status, _filename);
 	if(hduType != IMAGE_HDU) throw std::runtime_error("First HDU is not an image");
 	return *this;
@@ -151,12 +155,13 @@ bool FitsReader::ReadStringKeyIfExists(const char *key, std::string& value, std:
 void FitsReader::initialize()
 {
 	int status = 0;
-	fits_open_file(&_fitsPtr, _filename.c_str(), READONLY, &status);
+	fits_open_image(&_fitsPtr, _filename.c_str(), READONLY, &status);
 	checkStatus(status, _filename);
 	
-	// Move to first HDU
+	// fits_open_image() moved to the first HDU with an image, which is an
+	// extension when the image is tile compressed
 	int hduType;
-	fits_movabs_hdu(_fitsPtr, 1, &hduType, &status);
+	fits_get_hdu_type(_fitsPtr, &hduType, &status);
 	checkStatus(status, _filename);
 	if(hduType != IMAGE_HDU) throw std::runtime_error("First HDU is not an image");
 	
@@ -290,6 +295,8 @@ template void FitsReader::Read(double* image);
 template<typename NumType>
 void FitsReader::Read(NumType* image)
 {
+	Instrumentation::ScopedTimer timer(Instrumentation::FitsIOStage);
+	timer.AddItems(1);
 	int status = 0;
 	int naxis = 0;
 	fits_get_img_dim(_fitsPtr, &naxis, &status);
@@ -3,21 +3,38 @@
 
 #include "uvector.h"
 
+#include "wsclean/instrumentation.h"
+
 #include <stdexcept>
 #include <sstream>
 #include <vector>
 
+#include <cerrno>
 #include <cmath>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <limits>
 #include <iostream>
 
-void FitsWriter::writeHeaders(fitsfile*& fptr, const std::string& filename, size_t nFreq, size_t nPol) const
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+void FitsWriter::writeHeaders(fitsfile*& fptr, const std::string& filename, size_t nFreq, size_t nPol, bool inMemory) const
 {
 	int status = 0;
-	fits_create_file(&fptr, (std::string("!") + filename).c_str(), &status);
+	fits_create_file(&fptr, inMemory ? "mem://" : (std::string("!") + filename).c_str(), &status);
 	checkStatus(status, filename);
 	
+	if(_compression != NoCompression)
+	{
+		fits_set_compression_type(fptr, _compression == RiceCompression ? RICE_1 : GZIP_1, &status);
+		checkStatus(status, filename);
+		fits_set_quantize_level(fptr, _quantizeLevel, &status);
+		checkStatus(status, filename);
+	}
+	
 	// append image HDU
 	int bitPixInt = FLOAT_IMG;
 	long naxes[4];
@@ -28,8 +45,12 @@ void FitsWriter::writeHeaders(fitsfile*& fptr, const std::string& filename, size
 	fits_create_img(fptr, bitPixInt, 4, naxes, &status);
 	checkStatus(status, filename);
 	double zero = 0, one = 1, equinox = 2000.0;
-	fits_write_key(fptr, TDOUBLE, "BSCALE", (void*) &one, "", &status); checkStatus(status, filename);
-	fits_write_key(fptr, TDOUBLE, "BZERO", (void*) &zero, "", &status); checkStatus(status, filename);
+	// Compressed images store their scaling in the compression keywords
+	if(_compression == NoCompression)
+	{
+		fits_write_key(fptr, TDOUBLE, "BSCALE", (void*) &one, "", &status); checkStatus(status, filename);
+		fits_write_key(fptr, TDOUBLE, "BZERO", (void*) &zero, "", &status); checkStatus(status, filename);
+	}
 	
 	switch(_unit)
 	{
@@ -226,18 +247,98 @@ void FitsWriter::WriteMask(const std::string& filename, const bool* mask) const
 	Write(filename, maskAsImage.data());
 }
 
+std::string FitsWriter::headerUnit(fitsfile* fptr, const std::string& filename) const
+{
+	// The header records are 80 characters each and end with the END record; the
+	// header unit is padded with spaces to a multiple of the FITS block size.
+	const size_t blockSize = 2880, recordSize = 80;
+	int status = 0, keyCount = 0;
+	char* records = nullptr;
+	fits_hdr2str(fptr, 0, nullptr, 0, &records, &keyCount, &status);
+	checkStatus(status, filename);
+	std::string header(records);
+	free(records);
+	if(header.size() < recordSize || header.compare(header.size() - recordSize, 3, "END") != 0)
+		header += std::string("END") + std::string(recordSize - 3, ' ');
+	header.resize(((header.size() + blockSize - 1) / blockSize) * blockSize, ' ');
+	return header;
+}
+
+template<typename NumType>
+void FitsWriter::writeUncompressed(const std::string& filename, const std::string& header, const NumType* image) const
+{
+	// The data unit consists of big-endian floats, padded with zeros to a
+	// multiple of the FITS block size. Values equal to the maximum are written
+	// as NaN, like fits_write_pixnull() does in writeImage().
+	const size_t blockSize = 2880, n = _width * _height;
+	const size_t byteCount = ((n * sizeof(float) + blockSize - 1) / blockSize) * blockSize;
+	ao::uvector<uint32_t> data(byteCount / sizeof(uint32_t), 0);
+	const NumType nullValue = std::numeric_limits<NumType>::max();
+	for(size_t i=0; i!=n; ++i)
+	{
+		const float value = (image[i] == nullValue) ? std::numeric_limits<float>::quiet_NaN() : float(image[i]);
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(float));
+		data[i] = htonl(bits);
+	}
+	
+	int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd < 0)
+		throw std::runtime_error("Could not open " + filename + " for writing: " + strerror(errno));
+	const std::pair<const char*, size_t> units[2] = {
+		std::make_pair(header.data(), header.size()),
+		std::make_pair(reinterpret_cast<const char*>(data.data()), byteCount)
+	};
+	for(const std::pair<const char*, size_t>& unit : units)
+	{
+		size_t written = 0;
+		while(written != unit.second)
+		{
+			ssize_t result = write(fd, unit.first + written, unit.second - written);
+			if(result < 0)
+			{
+				if(errno == EINTR)
+					continue;
+				const std::string error = strerror(errno);
+				close(fd);
+				throw std::runtime_error("Error writing image to " + filename + ": " + error);
+			}
+			written += result;
+		}
+	}
+	if(close(fd) != 0)
+		throw std::runtime_error("Error closing " + filename + ": " + strerror(errno));
+}
+
 template<typename NumType>
 void FitsWriter::Write(const std::string& filename, const NumType* image) const
 {
+	Instrumentation::ScopedTimer timer(Instrumentation::FitsIOStage);
+	timer.AddItems(1);
 	fitsfile *fptr;
-
-	writeHeaders(fptr, filename, 1, 1);
-	
-	writeImage(fptr, filename, image);
 	
 	int status = 0;
-	fits_close_file(fptr, &status);
-	checkStatus(status, filename);
+	if(_compression == NoCompression)
+	{
+		// cfitsio only formats the header, in memory. The image is resized to
+		// zero pixels before closing, so that no data unit is filled in memory.
+		writeHeaders(fptr, filename, 1, 1, true);
+		const std::string header = headerUnit(fptr, filename);
+		long noPixels[4] = { 0, 0, 0, 0 };
+		fits_resize_img(fptr, FLOAT_IMG, 4, noPixels, &status);
+		checkStatus(status, filename);
+		fits_close_file(fptr, &status);
+		checkStatus(status, filename);
+		
+		writeUncompressed(filename, header, image);
+	}
+	else {
+		writeHeaders(fptr, filename, 1, 1);
+		writeImage(fptr, filename, image);
+		
+		fits_close_file(fptr, &status);
+		checkStatus(status, filename);
+	}
 }
 
 template void FitsWriter::Write<long double>(const std::string& filename, const long double* image) const;
@@ -19,6 +19,15 @@ class FitsWriter : protected FitsIOChecker
 		Jansky,
 		Kelvin,
 		MilliKelvin
+	};
+	/**
+	 * Tile compression of written images. Rice compression quantizes the
+	 * values; GZip compression is lossless when the quantize level is zero.
+	 */
+	enum Compression {
+		NoCompression,
+		RiceCompression,
+		GZipCompression
 	};
 		FitsWriter() :
 			_width(0), _height(0),
@@ -33,6 +42,7 @@ class FitsWriter : protected FitsIOChecker
 			_isUV(false),
 			_telescopeName(), _observer(), _objectName(),
 			_origin("AO/WSImager"), _originComment("Imager written by Andre Offringa"),
+			_compression(NoCompression), _quantizeLevel(4.0),
 			_multiFPtr(0)
 		{
 		}
@@ -50,6 +60,7 @@ class FitsWriter : protected FitsIOChecker
 			_isUV(false),
 			_telescopeName(), _observer(), _objectName(),
 			_origin("AO/WSImager"), _originComment("Imager written by Andre Offringa"),
+			_compression(NoCompression), _quantizeLevel(4.0),
 			_multiFPtr(0)
 		{
 			SetMetadata(reader);
@@ -61,6 +72,10 @@ class FitsWriter : protected FitsIOChecker
 				FinishMulti();
 		}
 		
+		/**
+		 * Write a single image. Without compression, the header is formatted by cfitsio
+		 * in memory, and the header and the converted data unit are written directly.
+		 */
 		template<typename NumType> void Write(const std::string& filename, const NumType* image) const;
 		
 		void WriteMask(const std::string& filename, const bool* mask) const;
@@ -133,6 +148,13 @@ class FitsWriter : protected FitsIOChecker
 		{
 			_unit = unit;
 		}
+		Compression GetCompression() const { return _compression; }
+		double QuantizeLevel() const { return _quantizeLevel; }
+		void SetCompression(Compression compression, double quantizeLevel)
+		{
+			_compression = compression;
+			_quantizeLevel = quantizeLevel;
+		}
 		void SetIsUV(bool isUV)
 		{
 			_isUV = isUV;
@@ -235,13 +257,28 @@ class FitsWriter : protected FitsIOChecker
 		std::vector<std::string> _history;
 		std::map<std::string, std::string> _extraStringKeywords;
 		std::map<std::string, double> _extraNumKeywords;
+		Compression _compression;
+		double _quantizeLevel;
 		
 		void julianDateToYMD(double jd, int &year, int &month, int &day) const;
-		void writeHeaders(fitsfile*& fptr, const std::string& filename, size_t nFreq, size_t nPol) const;
+		/**
+		 * Create the file and write the header keywords.
+		 * @param inMemory Create the file in memory instead of at @p filename, which is then only used in error messages.
+		 */
+		void writeHeaders(fitsfile*& fptr, const std::string& filename, size_t nFreq, size_t nPol, bool inMemory = false) const;
+		/**
+		 * The header unit of the current HDU as it is stored in a file.
+		 */
+		std::string headerUnit(fitsfile* fptr, const std::string& filename) const;
 		void writeImage(fitsfile* fptr, const std::string& filename, const double* image) const;
 		void writeImage(fitsfile* fptr, const std::string& filename, const float* image) const;
 		template<typename NumType>
 		void writeImage(fitsfile* fptr, const std::string& filename, const NumType* image) const;
+		/**
+		 * Write the header unit and the converted data unit to a new file, each byte once.
+		 */
+		template<typename NumType>
+		void writeUncompressed(const std::string& filename, const std::string& header, const NumType* image) const;
 		
 		std::string _multiFilename;
 		fitsfile *_multiFPtr;
@@ -1,11 +1,35 @@
-#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
-
 #include <Python.h>
 
-#include <numpy/arrayobject.h>
+#include <complex.h>
+#include <math.h>
+#include <string.h>
 
 #include "wscleaninterface.h"
 
+/*
+ * Arrays are accessed through the buffer protocol, so that numpy arrays (and
+ * other objects that export contiguous buffers) are used without copying them.
+ * The GIL is released while WSClean runs, so that other Python threads can
+ * continue, e.g. while pywsclean.Operator runs an operator asynchronously.
+ * Errors that WSClean returns are raised as a RuntimeError once the GIL is
+ * acquired again.
+ */
+
+#if PY_MAJOR_VERSION >= 3
+#define PyString_AsString PyUnicode_AsUTF8
+#define PyString_FromString PyUnicode_FromString
+#define PyInt_Check PyLong_Check
+#define PyInt_AsLong PyLong_AsLong
+#define PyInt_FromLong PyLong_FromLong
+#endif
+
+typedef struct
+{
+	void* userData;
+	Py_ssize_t dataSize;
+	Py_ssize_t imageSize;
+} pywsclean_handle;
+
 static PyObject* getAttribute(PyObject* o, const char* attr)
 {
 	PyObject* attrObj = PyObject_GetAttrString(o, attr);
@@ -47,14 +71,26 @@ static int getIntAttribute(PyObject* o, const char* attr, int* isValid)
 	}
 }
 
-static void* getUserData(PyObject* capsule)
+static void freeHandle(PyObject* capsule)
+{
+	free(PyCapsule_GetPointer(capsule, "pywsclean.userdata"));
+}
+
+static pywsclean_handle* getHandle(PyObject* capsule)
 {
+	pywsclean_handle* handle;
 	if(!PyCapsule_CheckExact(capsule))
 	{
 		PyErr_SetString(PyExc_RuntimeError, "Invalid parameter specified; expecting a userdata structure");
 		return NULL;
 	}
-	return PyCapsule_GetPointer(capsule, "pywsclean.userdata");
+	handle = (pywsclean_handle*) PyCapsule_GetPointer(capsule, "pywsclean.userdata");
+	if(handle && !handle->userData)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "WSClean userdata was already deinitialized");
+		return NULL;
+	}
+	return handle;
 }
 
 PyObject* setException(const char* c)
@@ -63,16 +99,48 @@ PyObject* setException(const char* c)
 	return NULL;
 }
 
+/**
+ * Parse an angle, or set an exception and return NaN if it is invalid.
+ */
+static double parseAngle(const char* angle)
+{
+	double value = wsclean_parse_angle(angle);
+	if(isnan(value))
+		setException(wsclean_last_error());
+	return value;
+}
+
+/**
+ * Get a C-contiguous buffer of @p count items of the given size, without copying.
+ * On success, the buffer should be released with PyBuffer_Release().
+ */
+static int getBuffer(PyObject* obj, Py_buffer* view, Py_ssize_t count, Py_ssize_t itemSize, const char* format, int writable, const char* name)
+{
+	int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT;
+	if(writable)
+		flags |= PyBUF_WRITABLE;
+	if(PyObject_GetBuffer(obj, view, flags) != 0)
+		return 0;
+	if(view->itemsize != itemSize || (view->format && strcmp(view->format, format) != 0) || view->len != count * itemSize)
+	{
+		PyErr_Format(PyExc_ValueError, "%s should be a contiguous array of %zd %s values",
+			name, count, itemSize == sizeof(double) ? "float64" : "complex128");
+		PyBuffer_Release(view);
+		return 0;
+	}
+	return 1;
+}
+
 static PyObject* wsclean_initialize_func(PyObject* self, PyObject* args)
 {
 	PyObject *parameters;
   int ok = PyArg_ParseTuple(args, "O", &parameters);
 	if(!ok)
 		return NULL;
-	
+
 	//PyObject_Print(parameters, stdout, 0); printf("\n");
 	//PyObject_Print(data, stdout, 0); printf("\n");
-	
+
 	imaging_parameters p;
 	p.msPath = getStringAttribute(parameters, "msPath");
 	if(!p.msPath) return NULL;
@@ -83,19 +151,33 @@ static PyObject* wsclean_initialize_func(PyObject* self, PyObject* args)
 	if(!valid) return NULL;
 	const char* scaleStr = getStringAttribute(parameters, "pixelScaleX");
 	if(!scaleStr) return NULL;
-	p.pixelScaleX = wsclean_parse_angle(scaleStr);
+	p.pixelScaleX = parseAngle(scaleStr);
+	if(isnan(p.pixelScaleX)) return NULL;
 	scaleStr = getStringAttribute(parameters, "pixelScaleY");
 	if(!scaleStr) return NULL;
-	p.pixelScaleY = wsclean_parse_angle(scaleStr);
+	p.pixelScaleY = parseAngle(scaleStr);
+	if(isnan(p.pixelScaleY)) return NULL;
 	p.extraParameters = getStringAttribute(parameters, "extraParameters");
 	if(!p.extraParameters) return NULL;
 
-	void *userData;
+	pywsclean_handle* handle = (pywsclean_handle*) malloc(sizeof(pywsclean_handle));
+	if(!handle)
+		return PyErr_NoMemory();
 	imaging_data d;
-	wsclean_initialize(&userData, &p, &d);
-	
-	PyObject* capsule = PyCapsule_New(userData, "pywsclean.userdata", NULL);
-	
+	int result;
+	Py_BEGIN_ALLOW_THREADS
+	result = wsclean_initialize(&handle->userData, &p, &d);
+	Py_END_ALLOW_THREADS
+	if(result != 0)
+	{
+		free(handle);
+		return setException(wsclean_last_error());
+	}
+	handle->dataSize = d.dataSize;
+	handle->imageSize = (Py_ssize_t) p.imageWidth * p.imageHeight;
+
+	PyObject* capsule = PyCapsule_New(handle, "pywsclean.userdata", freeHandle);
+
 	PyObject* wscleanModuleString = PyString_FromString((char*)"pywsclean");
 	if(!wscleanModuleString)
 		return setException("failed creating wsclean string");
@@ -105,14 +187,14 @@ static PyObject* wsclean_initialize_func(PyObject* self, PyObject* args)
 	PyObject* imagingDataFunc = PyObject_GetAttrString(wscleanModule, "ImagingData");
 	if(!imagingDataFunc)
 		return setException("failed to get attribute pywsclean.ImagingData");
-	
-	PyObject* imagingDataObj = PyType_GenericNew(imagingDataFunc, Py_BuildValue(""), Py_BuildValue(""));
+
+	PyObject* imagingDataObj = PyType_GenericNew((PyTypeObject*) imagingDataFunc, Py_BuildValue(""), Py_BuildValue(""));
 	if(!imagingDataObj)
 		return NULL;
 	PyObject_SetAttrString(imagingDataObj, "dataSize", PyInt_FromLong(d.dataSize));
-	
+
 	// No return value:
-	return Py_BuildValue("OO", capsule, imagingDataObj);
+	return Py_BuildValue("NN", capsule, imagingDataObj);
 }
 
 static PyObject* wsclean_deinitialize_func(PyObject* self, PyObject* args)
@@ -121,10 +203,17 @@ static PyObject* wsclean_deinitialize_func(PyObject* self, PyObject* args)
   int ok = PyArg_ParseTuple(args, "O", &pyUserData);
 	if(!ok)
 		return NULL;
-	void* userData = getUserData(pyUserData);
-	if(!userData)
+	pywsclean_handle* handle = getHandle(pyUserData);
+	if(!handle)
 		return NULL;
-	wsclean_deinitialize(userData);
+	void* userData = handle->userData;
+	handle->userData = NULL;
+	int result;
+	Py_BEGIN_ALLOW_THREADS
+	result = wsclean_deinitialize(userData);
+	Py_END_ALLOW_THREADS
+	if(result != 0)
+		return setException(wsclean_last_error());
 	return Py_BuildValue("");
 }
 
@@ -134,19 +223,28 @@ static PyObject* wsclean_read_func(PyObject* self, PyObject* args)
   int ok = PyArg_ParseTuple(args, "OOO", &pyUserData, &pyData, &pyWeights);
 	if(!ok)
 		return NULL;
-	void* userData = getUserData(pyUserData);
-	if(!userData)
+	pywsclean_handle* handle = getHandle(pyUserData);
+	if(!handle)
 		return NULL;
-	
-	DCOMPLEX *data = (DCOMPLEX *) PyArray_DATA(pyData);
-	if(!data)
+
+	Py_buffer data, weights;
+	if(!getBuffer(pyData, &data, handle->dataSize, sizeof(DCOMPLEX), "Zd", 1, "data"))
 		return NULL;
-	double *weights = (double *) PyArray_DATA(pyWeights);
-	if(!weights)
+	if(!getBuffer(pyWeights, &weights, handle->dataSize, sizeof(double), "d", 1, "weights"))
+	{
+		PyBuffer_Release(&data);
 		return NULL;
-	
-	wsclean_read(userData, data, weights);
-	
+	}
+
+	int result;
+	Py_BEGIN_ALLOW_THREADS
+	result = wsclean_read(handle->userData, (DCOMPLEX*) data.buf, (double*) weights.buf);
+	Py_END_ALLOW_THREADS
+
+	PyBuffer_Release(&weights);
+	PyBuffer_Release(&data);
+	if(result != 0)
+		return setException(wsclean_last_error());
 	return Py_BuildValue("");
 }
 
@@ -156,21 +254,27 @@ static PyObject* wsclean_write_func(PyObject* self, PyObject* args)
   int ok = PyArg_ParseTuple(args, "OOO", &pyUserData, &pyFilename, &pyImage);
 	if(!ok)
 		return NULL;
-	
-	void* userData = getUserData(pyUserData);
-	if(!userData)
+
+	pywsclean_handle* handle = getHandle(pyUserData);
+	if(!handle)
 		return NULL;
-	
+
 	const char* filename = PyString_AsString(pyFilename);
 	if(!filename)
 		return NULL;
-	
-	double *image = (double *) PyArray_DATA(pyImage);
-	if(!image)
+
+	Py_buffer image;
+	if(!getBuffer(pyImage, &image, handle->imageSize, sizeof(double), "d", 0, "image"))
 		return NULL;
-	
-	wsclean_write(userData, filename, image);
-	
+
+	int result;
+	Py_BEGIN_ALLOW_THREADS
+	result = wsclean_write(handle->userData, filename, (const double*) image.buf);
+	Py_END_ALLOW_THREADS
+
+	PyBuffer_Release(&image);
+	if(result != 0)
+		return setException(wsclean_last_error());
 	return Py_BuildValue("");
 }
 
@@ -180,20 +284,28 @@ static PyObject* wsclean_operator_A_func(PyObject* self, PyObject* args)
   int ok = PyArg_ParseTuple(args, "OOO", &pyUserData, &pyDest, &pySrc);
 	if(!ok)
 		return NULL;
-	void* userData = getUserData(pyUserData);
-	if(!userData)
+	pywsclean_handle* handle = getHandle(pyUserData);
+	if(!handle)
 		return NULL;
-	
-	DCOMPLEX *dest = (DCOMPLEX *) PyArray_DATA(pyDest);
-	if(!dest)
+
+	Py_buffer dest, src;
+	if(!getBuffer(pyDest, &dest, handle->dataSize, sizeof(DCOMPLEX), "Zd", 1, "dataOut"))
 		return NULL;
-	
-	double *src = (double *) PyArray_DATA(pySrc);
-	if(!src)
+	if(!getBuffer(pySrc, &src, handle->imageSize, sizeof(double), "d", 0, "dataIn"))
+	{
+		PyBuffer_Release(&dest);
 		return NULL;
-	
-	wsclean_operator_A(userData, dest, src);
-	
+	}
+
+	int result;
+	Py_BEGIN_ALLOW_THREADS
+	result = wsclean_operator_A(handle->userData, (DCOMPLEX*) dest.buf, (const double*) src.buf);
+	Py_END_ALLOW_THREADS
+
+	PyBuffer_Release(&src);
+	PyBuffer_Release(&dest);
+	if(result != 0)
+		return setException(wsclean_last_error());
 	return Py_BuildValue("");
 }
 
@@ -204,20 +316,28 @@ static PyObject* wsclean_operator_At_func(PyObject* self, PyObject* args)
   int ok = PyArg_ParseTuple(args, "OOO", &pyUserData, &pyDest, &pySrc);
 	if(!ok)
 		return NULL;
-	void* userData = getUserData(pyUserData);
-	if(!userData)
+	pywsclean_handle* handle = getHandle(pyUserData);
+	if(!handle)
 		return NULL;
-	
-	double *dest = (double *) PyArray_DATA(pyDest);
-	if(!dest)
+
+	Py_buffer dest, src;
+	if(!getBuffer(pyDest, &dest, handle->imageSize, sizeof(double), "d", 1, "dataOut"))
 		return NULL;
-	
-	DCOMPLEX *src = (DCOMPLEX *) PyArray_DATA(pySrc);
-	if(!src)
+	if(!getBuffer(pySrc, &src, handle->dataSize, sizeof(DCOMPLEX), "Zd", 0, "dataIn"))
+	{
+		PyBuffer_Release(&dest);
 		return NULL;
-	
-	wsclean_operator_At(userData, dest, src);
-	
+	}
+
+	int result;
+	Py_BEGIN_ALLOW_THREADS
+	result = wsclean_operator_At(handle->userData, (double*) dest.buf, (const DCOMPLEX*) src.buf);
+	Py_END_ALLOW_THREADS
+
+	PyBuffer_Release(&src);
+	PyBuffer_Release(&dest);
+	if(result != 0)
+		return setException(wsclean_last_error());
 	return Py_BuildValue("");
 }
 
@@ -231,8 +351,18 @@ static PyMethodDef WSCleanMethods[] = {
  { NULL, NULL, 0, NULL }
 };
 
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef WSCleanModule = {
+	PyModuleDef_HEAD_INIT, "_wsclean", NULL, -1, WSCleanMethods
+};
+
+PyMODINIT_FUNC PyInit__wsclean(void)
+{
+	return PyModule_Create(&WSCleanModule);
+}
+#else
 DL_EXPORT(void) init_wsclean(void)
 {
   Py_InitModule("_wsclean", WSCleanMethods);
 }
-
+#endif
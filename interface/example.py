@@ -4,7 +4,7 @@ import numpy
 from pywsclean import *
 
 if len(sys.argv)<2:
-	print 'Syntax: example.py <ms>\n'
+	print('Syntax: example.py <ms>\n')
 else:
 	parameters = ImagingParameters()
 	parameters.msPath = sys.argv[1]
@@ -29,6 +29,10 @@ else:
 	
 	o.backward(image, data)
 	
+	# Let the operator run while Python continues
+	future = o.forward_async(data, image)
+	future.result()
+	
 	o.write("name.fits", image)
 
 # Test the full cleaning command
@@ -54,5 +58,5 @@ else:
 		o.backward(data, image)
 		raise RuntimeError('Should have crashed!')
 	except:
-		print 'Ok, specifying wrong input gave an exception.'
+		print('Ok, specifying wrong input gave an exception.')
 
@@ -5,6 +5,12 @@ This wrapper can be used to call the (C++) WSClean imager.
 
 import _wsclean
 import numpy
+import threading
+try:
+	from concurrent.futures import ThreadPoolExecutor
+except ImportError:
+	# Python 2 without the 'futures' backport
+	ThreadPoolExecutor = None
 
 class ImagingParameters(object):
 	"""Parameters for imaging"""
@@ -21,22 +27,29 @@ class ImagingData(object):
 	
 class Operator(object):
 	"""Class that wraps WSClean as an operator, so that it is easy
-	to get an image from data 'in memory' (and the inverse). Currently, the
-	operator will write that data to the MODEL_DATA Measurement Set before imaging."""
+	to get an image from data 'in memory' (and the inverse). The arrays are
+	passed to WSClean without copying them, so they should be C-contiguous
+	numpy arrays (or other objects with a contiguous buffer) of the right type:
+	complex128 for visibilities and float64 for images. Python's global
+	interpreter lock is released while WSClean runs."""
 	_userdata = None;
 	_parameters = None;
 	_imagingdata = None;
+	_executor = None;
 	
 	def __init__(self, parameters):
 		"""Constructor: initialize WSClean"""
 		self._parameters = parameters
 		self._userdata,self._imagingdata = _wsclean.initialize(parameters)
+		self._lock = threading.Lock()
 		return
 	
 	def __del__(self):
 		"""Destructor: release WSClean resources"""
+		if self._executor != None:
+			self._executor.shutdown(wait=True)
 		if self._userdata != None:
-			print 'Releasing resources for WSClean...'
+			print('Releasing resources for WSClean...')
 			_wsclean.deinitialize(self._userdata)
 
 	def data_size(self):
@@ -49,16 +62,15 @@ class Operator(object):
 
 	def read(self):
 		"""Read the visibilities and return as a (data,weight) tuple. """
-		print 'Reading '+str(self.data_size())+' samples...'
-		data = numpy.ascontiguousarray(numpy.zeros(self._imagingdata.dataSize, dtype=numpy.complex128))
-		weights = numpy.ascontiguousarray(numpy.zeros(self._imagingdata.dataSize, dtype=numpy.float64))
+		print('Reading '+str(self.data_size())+' samples...')
+		data = numpy.empty(self._imagingdata.dataSize, dtype=numpy.complex128)
+		weights = numpy.empty(self._imagingdata.dataSize, dtype=numpy.float64)
 		_wsclean.read(self._userdata, data, weights)
 		return data,weights
 
 	def write(self, filename, data):
 		"""Write a FITS image with the correct keywords etc."""
-		dataCont = numpy.ascontiguousarray(data)
-		_wsclean.write(self._userdata, filename, data)
+		_wsclean.write(self._userdata, filename, numpy.ascontiguousarray(data, dtype=numpy.float64))
 
 	def forward(self, dataOut, dataIn):
 		"""Perform the forward operation. This is 'prediction': convert
@@ -67,19 +79,17 @@ class Operator(object):
 		of doubles, representing the image for the operator input."""
 		
 		if numpy.shape(dataOut)[0]!=self.data_size():
-			raise RuntimeError('Size of output argument ('+str(numpy.shape(dataOut)[0])+') does not match the image size (' + str(self.data_size()) +')')
+			raise RuntimeError('Size of output argument ('+str(numpy.shape(dataOut)[0])+') does not match the number of visibilities (' + str(self.data_size()) +')')
 		
 		if numpy.shape(dataIn)[0]!=self.image_size():
-			raise RuntimeError('Shape of input argument ('+str(numpy.shape(dataIn)[0])+') does not match the number of visibilities (' + str(self.image_size()) + ')')
+			raise RuntimeError('Shape of input argument ('+str(numpy.shape(dataIn)[0])+') does not match the image size (' + str(self.image_size()) + ')')
 		
-		dataOutCont = numpy.ascontiguousarray(dataOut)
-		dataInCont = numpy.ascontiguousarray(dataIn)
 		_wsclean.operator_A(self._userdata, dataOut, dataIn)
 		
 	def backward(self, dataOut, dataIn):
 		"""Perform the backward operation. This is the 'imaging' step:
 		convert visibilities into an image. dataOut should be an array
-		of doubles, which will be filled with the image, dataOut should be an array
+		of doubles, which will be filled with the image, dataIn should be an array
 		of complex doubles, representing the visibilities for the operator input."""
 		
 		if numpy.shape(dataOut)[0]!=self.image_size():
@@ -88,9 +98,28 @@ class Operator(object):
 		if numpy.shape(dataIn)[0]!=self.data_size():
 			raise RuntimeError('Shape of input argument ('+str(numpy.shape(dataIn)[0])+') does not match the number of visibilities (' + str(self.data_size()) +')')
 		
-		dataOutCont = numpy.ascontiguousarray(dataOut)
-		dataInCont = numpy.ascontiguousarray(dataIn)
 		_wsclean.operator_At(self._userdata, dataOut, dataIn)
+	
+	def forward_async(self, dataOut, dataIn):
+		"""Like forward(), but returns immediately with a
+		concurrent.futures.Future. The arrays should not be changed until the
+		future is done. Calls on the same operator run in order of submission."""
+		return self.__submit(self.forward, dataOut, dataIn)
+	
+	def backward_async(self, dataOut, dataIn):
+		"""Like backward(), but returns immediately with a
+		concurrent.futures.Future. The arrays should not be changed until the
+		future is done. Calls on the same operator run in order of submission."""
+		return self.__submit(self.backward, dataOut, dataIn)
+	
+	def __submit(self, function, dataOut, dataIn):
+		if ThreadPoolExecutor == None:
+			raise RuntimeError('Asynchronous operators require the concurrent.futures module')
+		with self._lock:
+			if self._executor == None:
+				# WSClean serializes the calls on one operator, so one thread is enough
+				self._executor = ThreadPoolExecutor(max_workers=1)
+			return self._executor.submit(function, dataOut, dataIn)
 
 class WSClean(object):
 	"""The Python interface to WSClean
@@ -130,7 +159,7 @@ class WSClean(object):
 		import os
 		msnamelist=' '.join(msnames)
 		cmd='wsclean '+str(plist)+' '+msnamelist
-		print cmd
+		print(cmd)
 		os.system(cmd)
 		return;
 	
@@ -140,7 +169,7 @@ class WSClean(object):
 		import os
 		msnamelist=' '.join(msnames)
 		cmd='wsclean -predict '+str(plist)+' '+msnamelist
-		print cmd
+		print(cmd)
 		os.system(cmd)
 		return;
 	
@@ -1,18 +1,33 @@
 #include "wscleaninterface.h"
 
 #include "../wsclean/commandline.h"
+#include "../wsclean/imagebufferallocator.h"
+#include "../wsclean/imageweightcache.h"
+#include "../wsclean/logger.h"
+#include "../wsclean/wscleansettings.h"
+#include "../wsclean/wsmsgridder.h"
 
+#include "../msproviders/contiguousms.h"
+#include "../msproviders/memoryms.h"
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
 
 #include <casacore/ms/MeasurementSets/MeasurementSet.h>
 
 #include <boost/thread/mutex.hpp>
 
+#include <fftw3.h>
+
 #include "../units/angle.h"
 
 #include "../banddata.h"
-#include "../fitsreader.h"
 #include "../fitswriter.h"
+#include "../uvector.h"
 
 struct WSCleanUserData
 {
@@ -23,9 +38,18 @@ struct WSCleanUserData
 	double pixelScaleY;
 	std::string extraParameters;
 	
-	std::string dataColumn;
+	size_t dataSize;
 	size_t nACalls, nAtCalls;
 	
+	WSCleanSettings settings;
+	double bandStart, bandEnd;
+	ImageBufferAllocator allocator;
+	std::unique_ptr<MemoryMS> memoryMS;
+	std::unique_ptr<ImageWeightCache> weightCache;
+	// Declared after the allocator, because it needs to be destructed first
+	std::unique_ptr<WSMSGridder> gridder;
+	ao::uvector<double> modelImage;
+	
 	boost::mutex mutex;
 };
 
@@ -37,31 +61,117 @@ std::string str(T i)
 	return s.str();
 }
 
-void wsclean_main(const std::vector<std::string>& parms)
+void getCommandLine(std::vector<std::string>& commandline, const WSCleanUserData& userData)
 {
-	char** argv = new char*[parms.size()];
-	for(size_t i=0; i!=parms.size(); ++i)
+	commandline.push_back("wsclean");
+	commandline.push_back("-size");
+	commandline.push_back(str(userData.width));
+	commandline.push_back(str(userData.height));
+	commandline.push_back("-scale");
+	commandline.push_back(Angle::ToNiceString(userData.pixelScaleX));
+	commandline.push_back("-quiet");
+	if(!userData.extraParameters.empty())
 	{
-		std::cout << parms[i] << ' ';
-		argv[i] = new char[parms[i].size()+1];
-		memcpy(argv[i], parms[i].c_str(), parms[i].size()+1);
+		size_t pos = 0;
+		size_t nextPos = userData.extraParameters.find(' ', 0);
+		while(nextPos!=std::string::npos)
+		{
+			commandline.push_back(userData.extraParameters.substr(pos, nextPos-pos));
+			pos = nextPos+1;
+			nextPos = userData.extraParameters.find(' ', pos);
+		}
+		commandline.push_back(userData.extraParameters.substr(pos));
 	}
-	std::cout << '\n';
+	if(userData.pixelScaleX != userData.pixelScaleY)
+		throw std::runtime_error("pixelscaleX should be equal to pixelscaleY for WSClean");
+}
 
-	CommandLine::Run(parms.size(), argv);
+void parseSettings(WSCleanUserData& userData)
+{
+	std::vector<std::string> parms;
+	getCommandLine(parms, userData);
+	parms.push_back(userData.msPath);
 	
+	std::vector<char*> argv(parms.size());
 	for(size_t i=0; i!=parms.size(); ++i)
-		delete[] argv[i];
-	delete[] argv;
+		argv[i] = &parms[i][0];
+	
+	WSCleanSettings& settings = userData.settings;
+	int returnValue;
+	if(!CommandLine::Parse(settings, argv.size(), argv.data(), returnValue))
+		throw std::runtime_error("The extra parameters of the operator interface should not ask for help or version information");
+	
+	if(settings.mode != WSCleanSettings::ImagingMode)
+		throw std::runtime_error("The operator interface does not support predict or restore mode");
+	if(settings.channelsOut != 1 || settings.intervalsOut != 1)
+		throw std::runtime_error("The operator interface does not support multiple output channels or intervals");
+	if(settings.polarizations.size() != 1 || *settings.polarizations.begin() != Polarization::StokesI)
+		throw std::runtime_error("The operator interface only supports Stokes I imaging");
+	if(settings.useIDG)
+		throw std::runtime_error("The operator interface does not support IDG");
+	if(settings.deconvolutionIterationCount != 0)
+		Logger::Warn << "The operator interface does not deconvolve: deconvolution settings are ignored.\n";
+	
+	settings.Propogate();
+	settings.Validate();
+	if(settings.trimmedImageWidth != userData.width || settings.trimmedImageHeight != userData.height)
+		throw std::runtime_error("The operator interface does not support trimming");
 }
 
-void wsclean_initialize(
-	void** userData,
-	const imaging_parameters* parameters,
-	imaging_data* imgData
-)
+void initializeGridder(WSCleanUserData& userData)
+{
+	const WSCleanSettings& settings = userData.settings;
+	userData.gridder.reset(new WSMSGridder(&userData.allocator, settings.threadCount, settings.memFraction, settings.absMemLimit));
+	WSMSGridder& gridder = *userData.gridder;
+	gridder.SetGridMode(settings.gridMode);
+	gridder.SetImageWidth(settings.untrimmedImageWidth);
+	gridder.SetImageHeight(settings.untrimmedImageHeight);
+	gridder.SetTrimSize(settings.trimmedImageWidth, settings.trimmedImageHeight);
+	gridder.SetNWSize(settings.widthForNWCalculation, settings.heightForNWCalculation);
+	gridder.SetPixelSizeX(settings.pixelScaleX);
+	gridder.SetPixelSizeY(settings.pixelScaleY);
+	if(settings.nWLayers != 0)
+		gridder.SetWGridSize(settings.nWLayers);
+	else
+		gridder.SetNoWGridSize();
+	gridder.SetAntialiasingKernelSize(settings.antialiasingKernelSize);
+	gridder.SetOverSamplingFactor(settings.overSamplingFactor);
+	gridder.SetPolarization(Polarization::StokesI);
+	gridder.SetIsComplex(false);
+	gridder.SetDataColumnName(settings.dataColumnName);
+	gridder.SetWeighting(settings.weightMode);
+	gridder.SetWLimit(settings.wLimit/100.0);
+	gridder.SetSmallInversion(settings.smallInversion);
+	gridder.SetFFTTimingFile(settings.fftTimingFile);
+	gridder.SetNormalizeForWeighting(settings.normalizeForWeighting);
+	gridder.SetVisibilityWeightingMode(settings.visibilityWeightingMode);
+	gridder.SetVerbose(false);
+}
+
+namespace {
+	/** Message of the last failed call on this thread, see wsclean_last_error() */
+	thread_local std::string lastError;
+}
+
+/**
+ * Exceptions may not propagate through the C interface: every entry point
+ * catches them, stores their message and returns this value.
+ */
+static int setLastError(const char* function, const char* message)
 {
-	WSCleanUserData* wscUserData = new WSCleanUserData();
+	lastError = std::string(function) + "(): " + message;
+	Logger::Error << lastError << '\n';
+	return 1;
+}
+
+static void initializeInterface(void** userData, const imaging_parameters* parameters, imaging_data* imgData)
+{
+	// The operators of separate handles may run concurrently, which requires
+	// a thread-safe fftw planner.
+	static std::once_flag fftwFlag;
+	std::call_once(fftwFlag, fftw_make_planner_thread_safe);
+	
+	std::unique_ptr<WSCleanUserData> wscUserData(new WSCleanUserData());
 	boost::mutex::scoped_lock lock(wscUserData->mutex);
 	
 	wscUserData->msPath = parameters->msPath;
@@ -72,7 +182,10 @@ void wsclean_initialize(
 	wscUserData->extraParameters = parameters->extraParameters;
 	wscUserData->nACalls = 0;
 	wscUserData->nAtCalls = 0;
-	(*userData) = static_cast<void*>(wscUserData);
+	parseSettings(*wscUserData);
+	WSCleanSettings& settings = wscUserData->settings;
+	
+	boost::mutex::scoped_lock casacoreLock(MSGridderBase::MetaDataMutex());
 	
 	// Number of vis is nchannels x selected nrows; calculate both.
 	// (Assuming Stokes I polarization for now)
@@ -82,13 +195,18 @@ void wsclean_initialize(
 	BandData bandData(ms.spectralWindow());
 	size_t nChannel = bandData.ChannelCount();
 	size_t selectedRows = 0;
+	std::vector<size_t> bufferRowOfMSRow(ms.nrow(), std::numeric_limits<size_t>::max());
 	for(size_t row=0; row!=ms.nrow(); ++row)
 	{
 		if(a1Col(row) != a2Col(row))
+		{
+			bufferRowOfMSRow[row] = selectedRows;
 			++selectedRows;
+		}
 	}
 	
-	imgData->dataSize = selectedRows * nChannel;
+	wscUserData->dataSize = selectedRows * nChannel;
+	imgData->dataSize = wscUserData->dataSize;
 	imgData->lhs_data_type = imaging_data::DATA_TYPE_COMPLEX_DOUBLE;
 	imgData->rhs_data_type = imaging_data::DATA_TYPE_DOUBLE;
 	//data_info->deinitialize_function = wsclean_deinitialize;
@@ -97,30 +215,70 @@ void wsclean_initialize(
 	//data_info->operator_A_function = wsclean_operator_A;
 	//data_info->operator_At_function = wsclean_operator_At;
 	
-	bool hasCorrected = ms.tableDesc().isColumn("CORRECTED_DATA");
-	if(hasCorrected) {
-		std::cout << "First measurement set has corrected data: tasks will be applied on the corrected data column.\n";
-		wscUserData->dataColumn = "CORRECTED_DATA";
-	} else {
-		std::cout << "No corrected data in first measurement set: tasks will be applied on the data column.\n";
-		wscUserData->dataColumn = "DATA";
+	if(settings.dataColumnName.empty())
+	{
+		bool hasCorrected = ms.tableDesc().isColumn("CORRECTED_DATA");
+		if(hasCorrected) {
+			std::cout << "First measurement set has corrected data: tasks will be applied on the corrected data column.\n";
+			settings.dataColumnName = "CORRECTED_DATA";
+		} else {
+			std::cout << "No corrected data in first measurement set: tasks will be applied on the data column.\n";
+			settings.dataColumnName = "DATA";
+		}
 	}
+	
+	// The metadata and weights are read once; the operators only pass the
+	// visibilities, which stay in the buffers of the caller.
+	MSSelection selection;
+	settings.GetMSSelection(selection);
+	if(settings.endChannel != 0)
+		selection.SetChannelRange(settings.startChannel, settings.endChannel);
+	const BandData selectedBand = selection.HasChannelRange() ?
+		BandData(bandData, selection.ChannelRangeStart(), selection.ChannelRangeEnd()) : bandData;
+	wscUserData->bandStart = selectedBand.BandStart();
+	wscUserData->bandEnd = selectedBand.BandEnd();
+	{
+		ContiguousMS source(wscUserData->msPath, settings.dataColumnName, selection, Polarization::StokesI, 0, false);
+		wscUserData->memoryMS.reset(new MemoryMS(source, selection, 0, bufferRowOfMSRow, nChannel));
+	}
+	
+	initializeGridder(*wscUserData);
+	wscUserData->gridder->AddMeasurementSet(wscUserData->memoryMS.get(), selection);
+	
+	wscUserData->weightCache.reset(new ImageWeightCache(
+		settings.weightMode,
+		settings.untrimmedImageWidth, settings.untrimmedImageHeight,
+		settings.pixelScaleX, settings.pixelScaleY,
+		settings.minUVInLambda, settings.maxUVInLambda,
+		settings.rankFilterLevel, settings.rankFilterSize));
+	wscUserData->weightCache->SetTaperInfo(
+		settings.gaussianTaperBeamSize,
+		settings.tukeyTaperInLambda, settings.tukeyInnerTaperInLambda,
+		settings.edgeTaperInLambda, settings.edgeTukeyTaperInLambda);
+	wscUserData->weightCache->Update(*wscUserData->gridder, 0, 0);
+	wscUserData->gridder->SetPrecalculatedWeightInfo(&wscUserData->weightCache->Weights());
+	
+	wscUserData->modelImage.resize(settings.trimmedImageWidth * settings.trimmedImageHeight);
+	
+	lock.unlock();
+	(*userData) = static_cast<void*>(wscUserData.release());
 }
 
-void wsclean_deinitialize(void* userData)
+static void deinitializeInterface(void* userData)
 {
 	WSCleanUserData* wscUserData = static_cast<WSCleanUserData*>(userData);
-	boost::mutex::scoped_lock lock(wscUserData->mutex);
-	if(wscUserData->nAtCalls != 0)
-		std::remove("tmp-operator-At-0-image.fits");
-		
+	// Wait for a running operator to finish before destructing
+	{
+		boost::mutex::scoped_lock lock(wscUserData->mutex);
+	}
 	delete wscUserData;
 }
 
-void wsclean_read(void* userData, DCOMPLEX* data, double* weights)
+static void readVisibilities(void* userData, DCOMPLEX* data, double* weights)
 {
 	WSCleanUserData* wscUserData = static_cast<WSCleanUserData*>(userData);
 	boost::mutex::scoped_lock lock(wscUserData->mutex);
+	boost::mutex::scoped_lock casacoreLock(MSGridderBase::MetaDataMutex());
 	
 	casacore::MeasurementSet ms(wscUserData->msPath);
 	BandData bandData(ms.spectralWindow());
@@ -129,7 +287,7 @@ void wsclean_read(void* userData, DCOMPLEX* data, double* weights)
 	casacore::ROScalarColumn<int> a1Col(ms, casacore::MeasurementSet::columnName(casacore::MSMainEnums::ANTENNA1));
 	casacore::ROScalarColumn<int> a2Col(ms, casacore::MeasurementSet::columnName(casacore::MSMainEnums::ANTENNA2));
 	
-	casacore::ROArrayColumn<casacore::Complex> dataCol(ms, wscUserData->dataColumn);
+	casacore::ROArrayColumn<casacore::Complex> dataCol(ms, wscUserData->settings.dataColumnName);
 	casacore::ROArrayColumn<float> weightCol(ms, casacore::MeasurementSet::columnName(casacore::MSMainEnums::WEIGHT_SPECTRUM));
 	casacore::ROArrayColumn<bool> flagCol(ms, casacore::MeasurementSet::columnName(casacore::MSMainEnums::FLAG));
 	
@@ -178,197 +336,183 @@ void wsclean_read(void* userData, DCOMPLEX* data, double* weights)
 	}
 }
 
-void wsclean_write(void* userData, const char* filename, const double* image)
+static void writeImage(void* userData, const char* filename, const double* image)
 {
 	WSCleanUserData* wscUserData = static_cast<WSCleanUserData*>(userData);
 	boost::mutex::scoped_lock lock(wscUserData->mutex);
 	
 	std::cout << "wsclean_write() : Writing " << filename << "...\n";
 	FitsWriter writer;
-	writer.SetImageDimensions(wscUserData->width, wscUserData->height, wscUserData->pixelScaleX, wscUserData->pixelScaleY);
-	if(wscUserData->nAtCalls != 0)
+	if(wscUserData->nAtCalls != 0 || wscUserData->nACalls != 0)
 	{
-		FitsReader reader("tmp-operator-At-0-image.fits");
-		writer = FitsWriter(reader);
+		// The gridder knows the metadata after it has processed the measurement set
+		const WSMSGridder& gridder = *wscUserData->gridder;
+		writer.SetImageDimensions(wscUserData->width, wscUserData->height, gridder.PhaseCentreRA(), gridder.PhaseCentreDec(), wscUserData->pixelScaleX, wscUserData->pixelScaleY);
+		writer.SetDate(gridder.StartTime());
+		if(gridder.HasDenormalPhaseCentre())
+			writer.SetPhaseCentreShift(gridder.PhaseCentreDL(), gridder.PhaseCentreDM());
+		writer.SetTelescopeName(gridder.TelescopeName());
+		writer.SetObserver(gridder.Observer());
+		writer.SetObjectName(gridder.FieldName());
+		writer.SetFrequency(0.5*(wscUserData->bandStart + wscUserData->bandEnd), wscUserData->bandEnd - wscUserData->bandStart);
 	}
-	writer.Write(filename, image);
-}
-
-void getCommandLine(std::vector<std::string>& commandline, const WSCleanUserData& userData)
-{
-	commandline.push_back("wsclean");
-	commandline.push_back("-size");
-	commandline.push_back(str(userData.width));
-	commandline.push_back(str(userData.height));
-	commandline.push_back("-scale");
-	commandline.push_back(Angle::ToNiceString(userData.pixelScaleX));
-	commandline.push_back("-quiet");
-	if(!userData.extraParameters.empty())
-	{
-		size_t pos = 0;
-		size_t nextPos = userData.extraParameters.find(' ', 0);
-		while(nextPos!=std::string::npos)
-		{
-			commandline.push_back(userData.extraParameters.substr(pos, nextPos-pos));
-			pos = nextPos+1;
-			nextPos = userData.extraParameters.find(' ', pos);
-		}
-		commandline.push_back(userData.extraParameters.substr(pos));
+	else {
+		writer.SetImageDimensions(wscUserData->width, wscUserData->height, wscUserData->pixelScaleX, wscUserData->pixelScaleY);
 	}
-	if(userData.pixelScaleX != userData.pixelScaleY)
-		throw std::runtime_error("pixelscaleX should be equal to pixelscaleY for WSClean");
+	writer.Write(filename, image);
 }
 
 // Go from image to visibilities
 // dataIn :  double[] of size width*height
 // dataOut : complex double[] of size nvis: nchannels x nbaselines x ntimesteps
-void wsclean_operator_A(void* userData, DCOMPLEX* dataOut, const double* dataIn)
+static void predictVisibilities(void* userData, DCOMPLEX* dataOut, const double* dataIn)
 {
 	WSCleanUserData* wscUserData = static_cast<WSCleanUserData*>(userData);
 	boost::mutex::scoped_lock lock(wscUserData->mutex);
 	
 	std::cout << "------ wsclean_operator_A(), image: " << wscUserData->width << " x " << wscUserData->height << ", pixelscale=" << Angle::ToNiceString(wscUserData->pixelScaleX) << "," << Angle::ToNiceString(wscUserData->pixelScaleY) << '\n';
 	
-	// Remove non-finite values
-	// TODO skipped now -- can't change input array without making a copy
+	// Remove non-finite values; the input is copied, because the gridder
+	// takes a non-const image.
 	size_t nonFiniteValues = 0;
 	double imageSum = 0.0;
+	ao::uvector<double>& modelImage = wscUserData->modelImage;
 	for(size_t i=0; i!=wscUserData->width * wscUserData->height; ++i)
 	{
 		if(!std::isfinite(dataIn[i]))
 		{
-			//dataIn[i] = 0.0;
+			modelImage[i] = 0.0;
 			++nonFiniteValues;
 		}
 		else {
+			modelImage[i] = dataIn[i];
 			imageSum += dataIn[i];
 		}
 	}
 	if(nonFiniteValues != 0)
 		std::cout << "Warning: input image contains " << nonFiniteValues << " non-finite values!\n";
 	std::cout << "Mean value in image: " << imageSum/(wscUserData->width*wscUserData->height-nonFiniteValues) << '\n';
-
-	std::ostringstream filenameStr;
-	filenameStr << "tmp-operator-A-" << wscUserData->nACalls;
 	
-	// Write dataIn to a fits file
-	FitsWriter writer;
-	writer.SetImageDimensions(wscUserData->width, wscUserData->height, wscUserData->pixelScaleX, wscUserData->pixelScaleY);
-	writer.Write(filenameStr.str() + "-model.fits", dataIn);
-	
-	// Run WSClean -predict (creates/fills new column MODEL_DATA)
-	std::vector<std::string> commandline;
-	getCommandLine(commandline, *wscUserData);
-	commandline.push_back("-name");
-	commandline.push_back(filenameStr.str());
-	commandline.push_back("-predict");
-	commandline.push_back(wscUserData->msPath);
-	wsclean_main(commandline);
-	std::remove((filenameStr.str() + "-model.fits").c_str());
-	
-	// Read MODEL_DATA into dataOut
-	casacore::MeasurementSet ms(wscUserData->msPath);
-	BandData bandData(ms.spectralWindow());
-	size_t nChannels = bandData.ChannelCount();
+	// Rows that are not selected are not predicted
+	std::fill(dataOut, dataOut + wscUserData->dataSize, DCOMPLEX(0.0));
+	wscUserData->memoryMS->SetModel(dataOut);
+	wscUserData->gridder->SetAddToModel(false);
+	wscUserData->gridder->Predict(modelImage.data());
+	wscUserData->memoryMS->SetModel(nullptr);
 	
-	casacore::ROScalarColumn<int> a1Col(ms, casacore::MeasurementSet::columnName(casacore::MSMainEnums::ANTENNA1));
-	casacore::ROScalarColumn<int> a2Col(ms, casacore::MeasurementSet::columnName(casacore::MSMainEnums::ANTENNA2));
-	
-	casacore::ROArrayColumn<casacore::Complex> dataCol(ms,  casacore::MeasurementSet::columnName(casacore::MSMainEnums::MODEL_DATA));
-	
-	DCOMPLEX* dataPtr = (DCOMPLEX*) dataOut;
-	casacore::IPosition shape = dataCol.shape(0);
-	size_t polarizationCount = shape[0];
-	casacore::Array<casacore::Complex> dataArr(shape);
-	for(size_t row=0; row!=ms.nrow(); ++row)
-	{
-		if(a1Col(row) != a2Col(row))
-		{
-			dataCol.get(row, dataArr);
-			casacore::Array<casacore::Complex>::contiter di = dataArr.cbegin();
-			
-			for(size_t ch=0; ch!=nChannels; ++ch)
-			{
-				dataPtr[ch] = 0.5 * (std::complex<double>(*di) + std::complex<double>(*(di+polarizationCount-1)));
-				// This *might* change the weighting; but if a value is not finite, it should already
-				// have received zero weight during the initial read out.
-				if(!std::isfinite(dataPtr[ch].real()) || !std::isfinite(dataPtr[ch].imag()))
-					dataPtr[ch] = 0.0;
-				di += polarizationCount;
-			}
-			
-			dataPtr += nChannels;
-		}
-	}
 	++(wscUserData->nACalls);
 	std::cout << "------ end of wsclean_operator_A()\n";
 }
 
 // Go from visibilities to image
-void wsclean_operator_At(void* userData, double* dataOut, const DCOMPLEX* dataIn)
+static void imageVisibilities(void* userData, double* dataOut, const DCOMPLEX* dataIn)
 {
 	WSCleanUserData* wscUserData = static_cast<WSCleanUserData*>(userData);
 	boost::mutex::scoped_lock lock(wscUserData->mutex);
 	
-	// Write dataIn to the MODEL_DATA column
 	std::cout << "------ wsclean_operator_At(), image: " << wscUserData->width << " x " << wscUserData->height << ", pixelscale=" << Angle::ToNiceString(wscUserData->pixelScaleX) << "," << Angle::ToNiceString(wscUserData->pixelScaleY) << '\n';
-	casacore::MeasurementSet ms(wscUserData->msPath, casacore::Table::Update);
-	BandData bandData(ms.spectralWindow());
-	size_t nChannels = bandData.ChannelCount();
-	
-	casacore::ROScalarColumn<int> a1Col(ms, casacore::MeasurementSet::columnName(casacore::MSMainEnums::ANTENNA1));
-	casacore::ROScalarColumn<int> a2Col(ms, casacore::MeasurementSet::columnName(casacore::MSMainEnums::ANTENNA2));
-	
-	casacore::ArrayColumn<casacore::Complex> dataCol(ms,  casacore::MeasurementSet::columnName(casacore::MSMainEnums::MODEL_DATA));
-	
-	DCOMPLEX* dataPtr = (DCOMPLEX*) dataIn;
-	casacore::IPosition shape = dataCol.shape(0);
-	size_t polarizationCount = shape[0];
-	casacore::Array<casacore::Complex> dataArr(shape);
-	for(size_t row=0; row!=ms.nrow(); ++row)
-	{
-		if(a1Col(row) != a2Col(row))
-		{
-			dataCol.get(row, dataArr);
-			casacore::Array<casacore::Complex>::contiter di = dataArr.cbegin();
-			
-			for(size_t ch=0; ch!=nChannels; ++ch)
-			{
-				*di = std::complex<float>(dataPtr[ch]);
-				*(di+polarizationCount-1) = std::complex<float>(dataPtr[ch]);
-				di += polarizationCount;
-			}
-			
-			dataCol.put(row, dataArr);
-			dataPtr += nChannels;
-		}
-	}
 	
-	std::ostringstream prefixName;
-	prefixName << "tmp-operator-At-" << wscUserData->nAtCalls;
+	// The visibilities are gridded directly from the buffer of the caller
+	wscUserData->memoryMS->SetData(dataIn);
+	wscUserData->gridder->SetDoImagePSF(false);
+	wscUserData->gridder->SetDoSubtractModel(false);
+	wscUserData->gridder->Invert();
+	wscUserData->memoryMS->SetData(nullptr);
 	
-	// Run WSClean to create dirty image
-	std::vector<std::string> commandline;
-	getCommandLine(commandline, *wscUserData);
-	commandline.push_back("-name");
-	commandline.push_back(prefixName.str());
-	commandline.push_back("-datacolumn");
-	commandline.push_back("MODEL_DATA");
-	commandline.push_back("-no-dirty");
-	commandline.push_back(wscUserData->msPath);
-	wsclean_main(commandline);
-	
-	// Read dirty image and store in dataOut
-	FitsReader reader(prefixName.str() + "-image.fits");
-	reader.Read(dataOut);
-	// Image 0 is saved until the end to retrieve keywords from...
-	if(wscUserData->nAtCalls != 0)
-		std::remove((prefixName.str() + "-image.fits").c_str());
+	const double* image = wscUserData->gridder->ImageRealResult();
+	std::copy(image, image + wscUserData->width * wscUserData->height, dataOut);
 	++(wscUserData->nAtCalls);
 	std::cout << "------ end of wsclean_operator_At()\n";
 }
 
+int wsclean_initialize(
+	void** userData,
+	const imaging_parameters* parameters,
+	imaging_data* imgData
+)
+{
+	*userData = nullptr;
+	try {
+		initializeInterface(userData, parameters, imgData);
+		return 0;
+	} catch(const std::exception& e) {
+		return setLastError("wsclean_initialize", e.what());
+	} catch(...) {
+		return setLastError("wsclean_initialize", "unknown error");
+	}
+}
+
+int wsclean_deinitialize(void* userData)
+{
+	try {
+		deinitializeInterface(userData);
+		return 0;
+	} catch(const std::exception& e) {
+		return setLastError("wsclean_deinitialize", e.what());
+	} catch(...) {
+		return setLastError("wsclean_deinitialize", "unknown error");
+	}
+}
+
+int wsclean_read(void* userData, DCOMPLEX* data, double* weights)
+{
+	try {
+		readVisibilities(userData, data, weights);
+		return 0;
+	} catch(const std::exception& e) {
+		return setLastError("wsclean_read", e.what());
+	} catch(...) {
+		return setLastError("wsclean_read", "unknown error");
+	}
+}
+
+int wsclean_write(void* userData, const char* filename, const double* image)
+{
+	try {
+		writeImage(userData, filename, image);
+		return 0;
+	} catch(const std::exception& e) {
+		return setLastError("wsclean_write", e.what());
+	} catch(...) {
+		return setLastError("wsclean_write", "unknown error");
+	}
+}
+
+int wsclean_operator_A(void* userData, DCOMPLEX* dataOut, const double* dataIn)
+{
+	try {
+		predictVisibilities(userData, dataOut, dataIn);
+		return 0;
+	} catch(const std::exception& e) {
+		return setLastError("wsclean_operator_A", e.what());
+	} catch(...) {
+		return setLastError("wsclean_operator_A", "unknown error");
+	}
+}
+
+int wsclean_operator_At(void* userData, double* dataOut, const DCOMPLEX* dataIn)
+{
+	try {
+		imageVisibilities(userData, dataOut, dataIn);
+		return 0;
+	} catch(const std::exception& e) {
+		return setLastError("wsclean_operator_At", e.what());
+	} catch(...) {
+		return setLastError("wsclean_operator_At", "unknown error");
+	}
+}
+
 double wsclean_parse_angle(const char* angle)
 {
-	return Angle::Parse(angle, "angle", Angle::Degrees);
+	try {
+		return Angle::Parse(angle, "angle", Angle::Degrees);
+	} catch(const std::exception& e) {
+		setLastError("wsclean_parse_angle", e.what());
+		return std::numeric_limits<double>::quiet_NaN();
+	}
+}
+
+const char* wsclean_last_error(void)
+{
+	return lastError.c_str();
 }
@@ -20,13 +20,23 @@
  * - Call @ref wsclean_write() once or more to save image results.
  * - Call @ref wsclean_deinitialize()
  * 
- * Methods are thread safe, in that one can e.g. call the operator methods at the
- * same time from different threads, and things will still work. However, this is
- * accomplished by using a global lock, such that this will actually not speed up
- * processing.
+ * The metadata and weights of the measurement set are read once by
+ * @ref wsclean_initialize(). The operators grid directly from, and predict
+ * directly into, the buffers of the caller; they do not write visibilities or
+ * images to disk.
  * 
- * @todo Currently, these methods write the visibilities to disk before performing the
- * imaging or prediction operation. This is unnecessary overhead.
+ * Methods are thread safe. Each handle has its own lock, so calls on the same
+ * handle are serialized, but operators on different handles (e.g. for different
+ * measurement sets or image sizes) run concurrently. Only the short reads of the
+ * measurement set metadata are serialized over all handles.
+ * 
+ * The extra parameters are parsed like the wsclean command line. Options that
+ * change the shape of the operators, such as multiple output channels, other
+ * polarizations than Stokes I or trimming, are not supported.
+ * 
+ * Errors are reported by the return value: functions return zero on success
+ * and a non-zero value on failure, after which @ref wsclean_last_error() describes
+ * what went wrong.
  */
 
 /**
@@ -62,8 +72,9 @@ extern "C" {
  * a structure that WSClean internally uses.
  * @param parameters domain specific information, containing the measurement set.
  * @param imgData will be filled with info describing the data.
+ * @return zero on success. On failure, the userData pointer is set to NULL.
  */
-void wsclean_initialize(
+int wsclean_initialize(
 	void** userData,
 	const imaging_parameters* parameters,
 	imaging_data* imgData
@@ -74,8 +85,9 @@ void wsclean_initialize(
  * Every call to @ref wsclean_initialize() should be followed by a call to 
  * wsclean_deinitialize().
  * @param userData A wsclean userdata struct as returned by @ref wsclean_initialize().
+ * @return zero on success.
  */
-void wsclean_deinitialize(void* userData);
+int wsclean_deinitialize(void* userData);
 
 /**
  * Reads the visibility data array from the measurement set. The returned data are
@@ -88,24 +100,27 @@ void wsclean_deinitialize(void* userData);
  * returned in the @ref imaging_data struct.
  * @param weights An already allocated array which will be set to the weights, of equal size
  * as the data.
+ * @return zero on success.
  */
-void wsclean_read(void* userData, DCOMPLEX* data, double* weights);
+int wsclean_read(void* userData, DCOMPLEX* data, double* weights);
 
 /**
  * Write the final image out.
  * @param userData A wsclean userdata struct as returned by @ref wsclean_initialize().
  * @param filename Filename of fits output file.
  * @param image The image data of size width x height.
+ * @return zero on success.
  */
-void wsclean_write(void* userData, const char* filename, const double* image);
+int wsclean_write(void* userData, const char* filename, const double* image);
 
 /**
  * Calculate the unweighted visibilities for the given image data.
  * @param userData A wsclean userdata struct as returned by @ref wsclean_initialize().
  * @param dataOut Array that will be filled with the predicted visibilities.
  * @param dataIn The image data: array of size width x height.
+ * @return zero on success.
  */
-void wsclean_operator_A(void* userData, DCOMPLEX* dataOut, const double* dataIn);
+int wsclean_operator_A(void* userData, DCOMPLEX* dataOut, const double* dataIn);
 
 /**
  * Calculate the dirty image from the visibilities. The weights will be applied
@@ -116,18 +131,28 @@ void wsclean_operator_A(void* userData, DCOMPLEX* dataOut, const double* dataIn)
  * @param userData A wsclean userdata struct as returned by @ref wsclean_initialize().
  * @param dataOut Array of size width x height that will be filled with the dirty image.
  * @param dataIn The visibility data to image.
+ * @return zero on success.
  */
-void wsclean_operator_At(void* userData, double* dataOut, const DCOMPLEX* dataIn);
+int wsclean_operator_At(void* userData, double* dataOut, const DCOMPLEX* dataIn);
 
 /**
  * Convert a string with units to an angle in radians. A client program can use
  * this to convert a string like "10asec" or "1deg" to a numeric angle that can
  * be passed to @ref wsclean_initialize().
  * @param angle A string specifying an angle.
- * @return the angle converted to double, in radians.
+ * @return the angle converted to double, in radians, or NaN when @p angle
+ * could not be parsed.
  */
 double wsclean_parse_angle(const char* angle);
 
+/**
+ * Describes the error of the last call on this thread that failed. Each thread
+ * has its own message, so a failure is not overwritten by calls on other threads.
+ * @return a message that stays valid until the next failing call on this
+ * thread, or an empty string when no call has failed.
+ */
+const char* wsclean_last_error(void);
+
 #ifdef __cplusplus
 }
 #endif
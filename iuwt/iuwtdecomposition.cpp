@@ -2,95 +2,254 @@
 
 #include "../threadpool.h"
 
-void IUWTDecomposition::DecomposeMT(ThreadPool& threadPool, const double* input, double* scratch, bool includeLargest)
+#include <mutex>
+
+#if defined __AVX__ && !defined FORCE_NON_AVX
+#include <immintrin.h>
+#endif
+
+/**
+ * Schedules the decomposition as a data-flow graph over horizontal tiles
+ * (strips of rows). Every scale consists of two passes: pass 2s calculates
+ * i1 = i0 (x) kernel, pass 2s+1 calculates coefficients = i0 - (i1 (x) kernel).
+ * A tile of a pass is queued as soon as the tiles within the kernel reach
+ * have finished the previous pass, so there is no barrier between scales and
+ * the thread pool is only waited for once. Because the reach of the kernel
+ * grows with the scale, also all reads of a buffer by neighbouring tiles are
+ * guaranteed to be finished before a tile overwrites it two passes later.
+ */
+class IUWTDecomposition::TileScheduler
 {
-	ao::uvector<double>
-		&i1(_scales.back().Coefficients());
-	i1.resize(_width*_height);
+public:
+	TileScheduler(IUWTDecomposition& decomposition, ThreadPool& threadPool, const double* input, double* temp) :
+		_decomposition(decomposition),
+		_threadPool(threadPool),
+		_input(input), _temp(temp),
+		_passCount(decomposition._scaleCount * 2)
+	{
+		const size_t height = _decomposition._height;
+		// Use a few tiles per thread to keep the threads balanced, but keep
+		// tiles large enough to amortise the scheduling overhead.
+		_tileHeight = std::max<size_t>(16, (height + _threadPool.size()*4 - 1) / (_threadPool.size()*4));
+		_tileCount = (height + _tileHeight - 1) / _tileHeight;
+		_waitCount.resize(_passCount);
+		for(size_t pass=0; pass!=_passCount; ++pass)
+		{
+			_waitCount[pass].resize(_tileCount);
+			for(size_t tile=0; tile!=_tileCount; ++tile)
+			{
+				size_t first, last;
+				dependencyRange(tile, pass, first, last);
+				_waitCount[pass][tile] = last - first;
+			}
+		}
+	}
 	
-	// The first iteration of the loop, unrolled, so that we don't have to
-	// copy the input into i0.
-	ao::uvector<double>& coefficients0 = _scales[0].Coefficients();
-	coefficients0.resize(_width*_height);
-	convolveMT(threadPool, i1.data(), input, scratch, _width, _height, 1);
-	convolveMT(threadPool, coefficients0.data(), i1.data(), scratch, _width, _height, 1);
+	void Run()
+	{
+		for(size_t tile=0; tile!=_tileCount; ++tile)
+			_threadPool.queue(TileTask(this, tile, 0));
+		_threadPool.wait_for_all_tasks();
+	}
 	
-	// coefficients = i0 - i2
-	differenceMT(threadPool, coefficients0.data(), input, coefficients0.data(), _width, _height);
+private:
+	struct TileTask
+	{
+		TileTask(TileScheduler* scheduler, size_t tile, size_t pass) :
+			_scheduler(scheduler), _tile(tile), _pass(pass) { }
+		void operator()() { _scheduler->process(_tile, _pass); }
+		TileScheduler* _scheduler;
+		size_t _tile, _pass;
+	};
 	
-	// i0 = i1;
-	ao::uvector<double>	i0(i1);
+	static size_t halo(size_t pass)
+	{
+		int scale = pass/2 + 1;
+		return 2 * ((1 << scale) - 1);
+	}
 	
-	for(int scale=1; scale!=int(_scaleCount); ++scale)
+	/**
+	 * Range [first, last) of tiles that need to have finished pass-1 before
+	 * the given tile can process the given pass. Because the relation is
+	 * symmetric, this is also the range of tiles that might become ready
+	 * for pass+1 once this tile finished pass.
+	 */
+	void dependencyRange(size_t tile, size_t pass, size_t& first, size_t& last) const
 	{
-		ao::uvector<double>& coefficients = _scales[scale].Coefficients();
-		coefficients.resize(_width*_height);
-		convolveMT(threadPool, i1.data(), i0.data(), scratch, _width, _height, scale+1);
-		convolveMT(threadPool, coefficients.data(), i1.data(), scratch, _width, _height, scale+1);
-		
-		// coefficients = i0 - i2
-		differenceMT(threadPool, coefficients.data(), i0.data(), coefficients.data(), _width, _height);
+		const size_t
+			h = halo(pass),
+			startY = tile * _tileHeight,
+			endY = std::min(startY + _tileHeight, _decomposition._height);
+		first = (startY > h) ? (startY - h) / _tileHeight : 0;
+		last = std::min(endY + h, _decomposition._height);
+		last = (last - 1) / _tileHeight + 1;
+	}
+	
+	const double* source(size_t scale) const
+	{
+		return scale == 0 ? _input : destination(scale-1);
+	}
+	
+	double* destination(size_t scale) const
+	{
+		// Alternate between the two buffers such that the last scale ends up
+		// in the largest scale, which is where it should be stored.
+		if((_decomposition._scaleCount - 1 - scale) % 2 == 0)
+			return _decomposition._scales.back().Coefficients().data();
+		else
+			return _temp;
+	}
+	
+	void process(size_t tile, size_t pass)
+	{
+		const size_t
+			width = _decomposition._width,
+			height = _decomposition._height,
+			scale = pass / 2,
+			startY = tile * _tileHeight,
+			endY = std::min(startY + _tileHeight, height);
+		ao::uvector<double> rowBuffer(width * 2);
+		if(pass % 2 == 0)
+		{
+			// i1 = i0 (x) kernel
+			convolveRows<false>(destination(scale), nullptr, source(scale), rowBuffer.data(), width, height, startY, endY, scale+1);
+		}
+		else {
+			// coefficients = i0 - i1 (x) kernel
+			double* coefficients = _decomposition._scales[scale].Coefficients().data();
+			convolveRows<true>(coefficients, source(scale), destination(scale), rowBuffer.data(), width, height, startY, endY, scale+1);
+		}
 		
-		// i0 = i1;
-		if(scale+1 != int(_scaleCount))
-			memcpy(i0.data(), i1.data(), sizeof(double)*_width*_height);
+		if(pass+1 != _passCount)
+		{
+			size_t first, last;
+			dependencyRange(tile, pass+1, first, last);
+			std::lock_guard<std::mutex> lock(_mutex);
+			for(size_t t=first; t!=last; ++t)
+			{
+				--_waitCount[pass+1][t];
+				if(_waitCount[pass+1][t] == 0)
+					_threadPool.queue(TileTask(this, t, pass+1));
+			}
+		}
 	}
 	
-	// The largest (residual) scales are in i1, but since the
-	// largest scale is aliased to i1, it's already stored there.
-	// Hence we can skip this:
-	//if(includeLargest)
-	//	_scales.back().Coefficients() = i1;
+	IUWTDecomposition& _decomposition;
+	ThreadPool& _threadPool;
+	const double* _input;
+	double* _temp;
+	size_t _passCount, _tileHeight, _tileCount;
+	std::vector<std::vector<size_t>> _waitCount;
+	std::mutex _mutex;
+};
+
+void IUWTDecomposition::DecomposeMT(ThreadPool& threadPool, const double* input, double* /*scratch*/, bool includeLargest)
+{
+	for(size_t scale=0; scale!=_scales.size(); ++scale)
+		_scales[scale].Coefficients().resize(_width*_height);
+	
+	// The largest (residual) scale is used as one of the two intermediate
+	// buffers, and it will hold the residual when all passes are done.
+	ao::uvector<double> temp(_scaleCount > 1 ? _width*_height : 0);
+	TileScheduler scheduler(*this, threadPool, input, temp.data());
+	scheduler.Run();
 	
 	// Do free the memory of the largest scale if it is not necessary:
 	if(!includeLargest)
 		ao::uvector<double>().swap(_scales.back().Coefficients());
 }
 
-void IUWTDecomposition::convolveMT(ThreadPool& threadPool, double* output, const double* image, double* scratch, size_t width, size_t height, int scale)
+template<bool Difference>
+void IUWTDecomposition::convolveRows(double* output, const double* lhs, const double* image, double* rowBuffer, size_t width, size_t height, size_t startY, size_t endY, int scale)
 {
-	ConvolveHorizontalPartialFunc hFunc;
-	hFunc._output = scratch;
-	hFunc._image = image;
-	hFunc._width = width;
-	hFunc._scale = scale;
-	for(size_t t=0; t!=threadPool.size(); ++t)
-	{
-		hFunc._startY = (height * t) / threadPool.size();
-		hFunc._endY = (height * (t+1)) / threadPool.size();
-		threadPool.queue(hFunc);
-	}
-	threadPool.wait_for_all_tasks();
-	
-	ConvolveVerticalPartialFunc vFunc;
-	vFunc._output = output;
-	vFunc._image = scratch;
-	vFunc._width = width;
-	vFunc._height = height;
-	vFunc._scale = scale;
-	for(size_t t=0; t!=threadPool.size(); ++t)
+	const size_t H_SIZE = 5;
+	const double h[H_SIZE] = { 1.0/16.0, 4.0/16.0, 6.0/16.0, 4.0/16.0, 1.0/16.0 };
+	int scaleDist = (1 << scale);
+	double
+		*verticalRow = rowBuffer,
+		*horizontalRow = &rowBuffer[width];
+	for(size_t y=startY; y!=endY; ++y)
 	{
-		vFunc._startX = (width * t) / threadPool.size();
-		vFunc._endX = (width * (t+1)) / threadPool.size();
-		threadPool.queue(vFunc);
+		// Combine the input rows that fall inside the image
+		const double* rows[H_SIZE];
+		double weights[H_SIZE];
+		size_t nRows = 0;
+		for(size_t hIndex=0; hIndex!=H_SIZE; ++hIndex)
+		{
+			int hShift = int(hIndex) - int(H_SIZE / 2);
+			int inputY = int(y) + (scaleDist-1)*hShift;
+			if(inputY >= 0 && inputY < int(height))
+			{
+				rows[nRows] = &image[inputY * width];
+				weights[nRows] = h[hIndex];
+				++nRows;
+			}
+		}
+		weightedRowSum(verticalRow, rows, weights, nRows, width);
+		
+		double* outputPtr = &output[y * width];
+		if(Difference)
+		{
+			convolveHorizontalFast(horizontalRow, verticalRow, width, 1, scale);
+			const double* lhsPtr = &lhs[y * width];
+			for(size_t x=0; x!=width; ++x)
+				outputPtr[x] = lhsPtr[x] - horizontalRow[x];
+		}
+		else {
+			convolveHorizontalFast(outputPtr, verticalRow, width, 1, scale);
+		}
 	}
-	threadPool.wait_for_all_tasks();
 }
 
-void IUWTDecomposition::differenceMT(class ThreadPool& threadPool, double* dest, const double* lhs, const double* rhs, size_t width, size_t height)
+template void IUWTDecomposition::convolveRows<false>(double* output, const double* lhs, const double* image, double* rowBuffer, size_t width, size_t height, size_t startY, size_t endY, int scale);
+
+template void IUWTDecomposition::convolveRows<true>(double* output, const double* lhs, const double* image, double* rowBuffer, size_t width, size_t height, size_t startY, size_t endY, int scale);
+
+void IUWTDecomposition::weightedRowSum(double* output, const double* const* rows, const double* weights, size_t nRows, size_t width)
 {
-	DifferencePartialFunc func;
-	func._dest = dest;
-	func._lhs = lhs;
-	func._rhs = rhs;
-	func._width = width;
-	for(size_t t=0; t!=threadPool.size(); ++t)
+	size_t x = 0;
+#if defined __AVX__ && !defined FORCE_NON_AVX
+	const size_t vecEnd = width - width%4;
+	if(nRows == 5)
+	{
+		const __m256d
+			w0 = _mm256_set1_pd(weights[0]), w1 = _mm256_set1_pd(weights[1]),
+			w2 = _mm256_set1_pd(weights[2]), w3 = _mm256_set1_pd(weights[3]),
+			w4 = _mm256_set1_pd(weights[4]);
+		for(; x!=vecEnd; x+=4)
+		{
+			__m256d sum = _mm256_mul_pd(_mm256_loadu_pd(&rows[2][x]), w2);
+#ifdef __AVX2__
+			sum = _mm256_fmadd_pd(_mm256_loadu_pd(&rows[1][x]), w1, sum);
+			sum = _mm256_fmadd_pd(_mm256_loadu_pd(&rows[3][x]), w3, sum);
+			sum = _mm256_fmadd_pd(_mm256_loadu_pd(&rows[0][x]), w0, sum);
+			sum = _mm256_fmadd_pd(_mm256_loadu_pd(&rows[4][x]), w4, sum);
+#else
+			sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_loadu_pd(&rows[1][x]), w1));
+			sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_loadu_pd(&rows[3][x]), w3));
+			sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_loadu_pd(&rows[0][x]), w0));
+			sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_loadu_pd(&rows[4][x]), w4));
+#endif
+			_mm256_storeu_pd(&output[x], sum);
+		}
+	}
+	else {
+		for(; x!=vecEnd; x+=4)
+		{
+			__m256d sum = _mm256_mul_pd(_mm256_loadu_pd(&rows[0][x]), _mm256_set1_pd(weights[0]));
+			for(size_t r=1; r!=nRows; ++r)
+				sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_loadu_pd(&rows[r][x]), _mm256_set1_pd(weights[r])));
+			_mm256_storeu_pd(&output[x], sum);
+		}
+	}
+#endif
+	for(; x!=width; ++x)
 	{
-		func._startY = (height * t) / threadPool.size();
-		func._endY = (height * (t+1)) / threadPool.size();
-		threadPool.queue(func);
+		double sum = rows[0][x] * weights[0];
+		for(size_t r=1; r!=nRows; ++r)
+			sum += rows[r][x] * weights[r];
+		output[x] = sum;
 	}
-	threadPool.wait_for_all_tasks();
 }
 
 void IUWTDecomposition::convolveHorizontalFast(double* output, const double* image, size_t width, size_t height, int scale)
@@ -267,26 +267,21 @@ private:
 		}
 	}
 
-	static void convolveMT(class ThreadPool& threadPool, double* output, const double* image, double* scratch, size_t width, size_t height, int scale);
-	
-	static void convolveHorizontalPartial(double* output, const double* image, size_t width, size_t startY, size_t endY, int scale)
-	{
-		size_t startIndex = startY * width;
-		convolveHorizontalFast(&output[startIndex], &image[startIndex], width, endY-startY, scale);
-	}
-	
-	struct ConvolveHorizontalPartialFunc
-	{
-		void operator()() {
-			convolveHorizontalPartial(_output, _image, _width, _startY, _endY, _scale);
-		}
-		double* _output;
-		const double* _image;
-		size_t _width;
-		size_t _startY;
-		size_t _endY;
-		int _scale;
-	};
+	/**
+	 * Convolves rows startY to endY of the image with the IUWT kernel in a
+	 * single pass. For each output row, the (up to) five contributing input
+	 * rows are first combined into @p rowBuffer, after which the horizontal
+	 * kernel is applied on that single row. This avoids the image-sized
+	 * scratch buffer and the cache-hostile vertical sweep of the two-pass
+	 * approach. When Difference is true, output = lhs - (image (x) kernel).
+	 * @param rowBuffer Buffer of at least 2 x width values.
+	 */
+	template<bool Difference>
+	static void convolveRows(double* output, const double* lhs, const double* image, double* rowBuffer, size_t width, size_t height, size_t startY, size_t endY, int scale);
+
+	static void weightedRowSum(double* output, const double* const* rows, const double* weights, size_t nRows, size_t width);
+
+	class TileScheduler;
 
 	static void convolveHorizontal(double* output, const double* image, size_t width, size_t height, int scale)
 	{
@@ -322,41 +317,6 @@ private:
 
 	static void convolveVerticalPartialFastFailed(double* output, const double* image, size_t width, size_t height, size_t startX, size_t endX, int scale);
 	
-	struct ConvolveVerticalPartialFunc
-	{
-		void operator()() {
-			convolveVerticalPartialFast(_output, _image, _width, _height, _startX, _endX, _scale);
-		}
-		double* _output;
-		const double* _image;
-		size_t _width;
-		size_t _height;
-		size_t _startX;
-		size_t _endX;
-		int _scale;
-	};
-
-	static void differencePartial(double* dest, const double* lhs, const double* rhs, size_t width, size_t startY, size_t endY)
-	{
-		size_t startIndex = startY * width;
-		difference(&dest[startIndex], &lhs[startIndex], &rhs[startIndex], width, endY-startY);
-	}
-	
-	struct DifferencePartialFunc
-	{
-		void operator()() {
-			differencePartial(_dest, _lhs, _rhs, _width, _startY, _endY);
-		}
-		double* _dest;
-		const double* _lhs;
-		const double* _rhs;
-		size_t _width;
-		size_t _startY;
-		size_t _endY;
-	};
-
-	static void differenceMT(class ThreadPool& threadPool, double* dest, const double* lhs, const double* rhs, size_t width, size_t height);
-	
 	static void difference(double* dest, const double* lhs, const double* rhs, size_t width, size_t height)
 	{
 		for(size_t i=0; i!=width*height; ++i)
@@ -0,0 +1,163 @@
+#include "beamgridevaluator.h"
+
+#include "../units/imagecoordinates.h"
+
+#include <algorithm>
+#include <cmath>
+
+BeamGridEvaluator::BeamGridEvaluator(const BeamModel& model, size_t width, size_t height, double pixelSizeX, double pixelSizeY, double phaseCentreRA, double phaseCentreDec, double phaseCentreDL, double phaseCentreDM) :
+	_model(model),
+	_width(width), _height(height),
+	_stationCount(model.StationCount()),
+	_directions(width * height * 3),
+	_tolerance(0.0),
+	_maxCacheBytes(0),
+	_hasCache(false),
+	_isReused(false),
+	_cachedFrequency(0.0)
+{
+	double* direction = _directions.data();
+	for(size_t y=0; y!=_height; ++y)
+	{
+		for(size_t x=0; x!=_width; ++x)
+		{
+			double l, m, ra, dec;
+			ImageCoordinates::XYToLM(x, y, pixelSizeX, pixelSizeY, _width, _height, l, m);
+			l += phaseCentreDL; m += phaseCentreDM;
+			ImageCoordinates::LMToRaDec(l, m, phaseCentreRA, phaseCentreDec, ra, dec);
+			const double cosDec = cos(dec);
+			direction[0] = cosDec * cos(ra);
+			direction[1] = cosDec * sin(ra);
+			direction[2] = sin(dec);
+			direction += 3;
+		}
+	}
+}
+
+void BeamGridEvaluator::SetReuseTolerance(double tolerance, size_t maxCacheBytes)
+{
+	_tolerance = tolerance;
+	_maxCacheBytes = maxCacheBytes;
+	_hasCache = false;
+	_cache.clear();
+	_cache.shrink_to_fit();
+}
+
+double BeamGridEvaluator::RotationAngle(const double* matrixA, const double* matrixB)
+{
+	// The trace of A B^T is 1 + 2 cos(angle)
+	double trace = 0.0;
+	for(size_t i=0; i!=9; ++i)
+		trace += matrixA[i] * matrixB[i];
+	const double cosAngle = std::max(-1.0, std::min(1.0, 0.5 * (trace - 1.0)));
+	return acos(cosAngle);
+}
+
+void BeamGridEvaluator::MakeSnapshot(double* const* images, const double* stationWeights, double time, double frequency, const double* j2000ToITRF, const double* differentialReference)
+{
+	const size_t pixelCount = _width * _height;
+	const bool useCache = _tolerance > 0.0 &&
+		pixelCount * _stationCount * sizeof(MC2x2) <= _maxCacheBytes;
+	_isReused = useCache && _hasCache && frequency == _cachedFrequency &&
+		RotationAngle(j2000ToITRF, _cachedRotation) < _tolerance;
+	if(useCache && !_isReused)
+	{
+		_cache.resize(pixelCount * _stationCount);
+		_cachedFrequency = frequency;
+		std::copy_n(j2000ToITRF, 9, _cachedRotation);
+		_hasCache = true;
+	}
+	
+	std::vector<MC2x2> inverseCentralGain;
+	if(differentialReference != nullptr)
+	{
+		inverseCentralGain.resize(_stationCount);
+		_model.Response(inverseCentralGain.data(), time, frequency, differentialReference);
+		for(MC2x2& gain : inverseCentralGain)
+		{
+			if(!gain.Invert())
+				gain = MC2x2::NaN();
+		}
+	}
+	
+	ao::uvector<double> factors(_stationCount);
+	double totalWeight = 0.0;
+	for(size_t a=0; a!=_stationCount; ++a)
+	{
+		factors[a] = sqrt(stationWeights[a]);
+		totalWeight += factors[a];
+	}
+	for(double& factor : factors)
+		factor /= totalWeight;
+	
+	_threadPool.for_each_range(_height, 1, [&](size_t rowStart, size_t rowEnd)
+	{
+		// Without cache, the responses of one row are kept in a buffer that is
+		// reused for all rows of this range.
+		std::vector<MC2x2> buffer;
+		if(!useCache)
+			buffer.resize(_width * _stationCount);
+		for(size_t y=rowStart; y!=rowEnd; ++y)
+		{
+			MC2x2* responses = useCache ? &_cache[y * _width * _stationCount] : buffer.data();
+			if(!_isReused)
+				evaluateRow(y, time, frequency, j2000ToITRF, responses);
+			averageRow(y, images, factors, inverseCentralGain, responses);
+		}
+	});
+}
+
+void BeamGridEvaluator::evaluateRow(size_t y, double time, double frequency, const double* j2000ToITRF, MC2x2* responses) const
+{
+	const double* direction = &_directions[y * _width * 3];
+	const double* const directionEnd = direction + _width * 3;
+	const double* r = j2000ToITRF;
+	double itrf[3];
+	while(direction != directionEnd)
+	{
+		for(size_t i=0; i!=3; ++i)
+			itrf[i] = r[i*3] * direction[0] + r[i*3+1] * direction[1] + r[i*3+2] * direction[2];
+		const double norm = 1.0 / sqrt(itrf[0]*itrf[0] + itrf[1]*itrf[1] + itrf[2]*itrf[2]);
+		for(size_t i=0; i!=3; ++i)
+			itrf[i] *= norm;
+		_model.Response(responses, time, frequency, itrf);
+		responses += _stationCount;
+		direction += 3;
+	}
+}
+
+void BeamGridEvaluator::averageRow(size_t y, double* const* images, const ao::uvector<double>& factors, const std::vector<MC2x2>& inverseCentralGain, const MC2x2* responses) const
+{
+	for(size_t index=y*_width; index!=(y+1)*_width; ++index)
+	{
+		MC2x2 gain = MC2x2::Zero();
+		for(size_t a=0; a!=_stationCount; ++a)
+		{
+			if(inverseCentralGain.empty())
+			{
+				gain.AddWithFactorAndAssign(responses[a], factors[a]);
+			}
+			else {
+				// The data have been premultiplied with the central beam C, and we want to
+				// return a matrix that corrects the data for the full beam B. Given our data:
+				//    data = Ci^-1 vis Cj^-*
+				// we want to multiple data with a differential beam matrix D such that
+				//    Di^-1 data Dj^-* = Bi^-1 vis Bj^-*
+				// With B the full beam matrix. We can solve for D:
+				//    Di^-1 Ci^-1 = Bi^-1  (and Cj^-* Dj^-* = Bj^-* )
+				//          Di^-1 = Bi^-1 Ci
+				//          Di    = Ci^-1 Bi
+				// which means: diffBeam = inverseCentralGain * stationGain
+				MC2x2 diffBeam;
+				MC2x2::ATimesB(diffBeam, inverseCentralGain[a], responses[a]);
+				gain.AddWithFactorAndAssign(diffBeam, factors[a]);
+			}
+		}
+		responses += _stationCount;
+		for(size_t i=0; i!=4; ++i)
+		{
+			images[i*2][index] = gain[i].real();
+			images[i*2 + 1][index] = gain[i].imag();
+		}
+	}
+}
@@ -0,0 +1,75 @@
+#ifndef BEAM_GRID_EVALUATOR_H
+#define BEAM_GRID_EVALUATOR_H
+
+#include "beammodel.h"
+
+#include "../threadpool.h"
+#include "../uvector.h"
+
+#include <vector>
+
+/**
+ * Evaluates a @ref BeamModel on a grid of image pixels, and averages the
+ * station responses into beam images. Rows of the grid are evaluated in
+ * parallel, each thread with its own response buffer.
+ *
+ * The J2000 direction of every pixel is calculated once. For every snapshot,
+ * these are converted to ITRF with a rotation matrix, which avoids a full
+ * coordinate conversion per pixel. When a reuse tolerance is set, the station
+ * responses of the previous snapshot are kept, and they are reused when the
+ * frequency is the same and the rotation changed by less than the tolerance.
+ */
+class BeamGridEvaluator
+{
+public:
+	BeamGridEvaluator(const BeamModel& model, size_t width, size_t height, double pixelSizeX, double pixelSizeY, double phaseCentreRA, double phaseCentreDec, double phaseCentreDL, double phaseCentreDM);
+	
+	/**
+	 * Reuse station responses of the previous snapshot when the rotation angle
+	 * between the snapshots is less than @p tolerance (in radians). Responses are
+	 * only kept when they need at most @p maxCacheBytes. A tolerance of zero
+	 * disables reuse.
+	 */
+	void SetReuseTolerance(double tolerance, size_t maxCacheBytes);
+	
+	/**
+	 * Fills 8 images (real and imaginary values of the four Jones matrix elements)
+	 * with the beam, averaged over the stations with the square root of their
+	 * weights.
+	 * @param j2000ToITRF Row-major 3x3 matrix that rotates J2000 unit vectors to ITRF.
+	 * @param differentialReference If not null, the ITRF direction in which the
+	 * beam is normalized to unity, as in a differential beam.
+	 */
+	void MakeSnapshot(double* const* images, const double* stationWeights, double time, double frequency, const double* j2000ToITRF, const double* differentialReference);
+	
+	/**
+	 * Whether the last snapshot reused the station responses of its predecessor.
+	 */
+	bool IsReused() const { return _isReused; }
+	
+	/**
+	 * Angle in radians of the rotation from one J2000 to ITRF matrix to another.
+	 */
+	static double RotationAngle(const double* matrixA, const double* matrixB);
+	
+private:
+	void evaluateRow(size_t y, double time, double frequency, const double* j2000ToITRF, MC2x2* responses) const;
+	
+	void averageRow(size_t y, double* const* images, const ao::uvector<double>& factors, const std::vector<MC2x2>& inverseCentralGain, const MC2x2* responses) const;
+	
+	const BeamModel& _model;
+	size_t _width, _height, _stationCount;
+	// J2000 unit vectors, three per pixel
+	ao::uvector<double> _directions;
+	
+	double _tolerance;
+	size_t _maxCacheBytes;
+	bool _hasCache, _isReused;
+	double _cachedFrequency;
+	double _cachedRotation[9];
+	std::vector<MC2x2> _cache;
+	
+	ThreadPool _threadPool;
+};
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef BEAM_MODEL_H
+#define BEAM_MODEL_H
+
+#include "../matrix2x2.h"
+
+#include <cstddef>
+
+/**
+ * Interface for a model of the station beams, as used by @ref BeamGridEvaluator.
+ * Implementations should be thread safe, since the evaluator calls Response()
+ * concurrently from several threads.
+ */
+class BeamModel
+{
+public:
+	virtual ~BeamModel() { }
+	
+	virtual size_t StationCount() const = 0;
+	
+	/**
+	 * Calculates the Jones matrices of all stations.
+	 * @param gains Array of StationCount() matrices that is filled with the responses.
+	 * @param time Time in MJD seconds.
+	 * @param frequency Frequency in Hz.
+	 * @param itrfDirection Unit vector with the ITRF direction.
+	 */
+	virtual void Response(MC2x2* gains, double time, double frequency, const double* itrfDirection) const = 0;
+};
+
+#endif
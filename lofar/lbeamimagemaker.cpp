@@ -1,4 +1,5 @@
 #include "lbeamimagemaker.h"
+#include "beamgridevaluator.h"
 
 #ifndef HAVE_LOFAR_BEAM
 #include <stdexcept>
@@ -17,7 +18,6 @@ void LBeamImageMaker::Make(PrimaryBeamImageSet&)
 #include "../units/imagecoordinates.h"
 #include "../imageweights.h"
 #include "../matrix2x2.h"
-#include "../progressbar.h"
 #include "../uvector.h"
 
 #include "../wsclean/imageweightcache.h"
@@ -40,12 +40,53 @@ void LBeamImageMaker::Make(PrimaryBeamImageSet&)
 #include <casacore/measures/TableMeasures/ScalarMeasColumn.h>
 #include <casacore/measures/TableMeasures/ArrayMeasColumn.h>
 
+#include <algorithm>
 #include <stdexcept>
 
 using namespace LOFAR::StationResponse;
 
 static void dirToITRF(const casacore::MDirection& dir, casacore::MDirection::Convert& convert, vector3r_t& itrf);
 
+/**
+ * Beam model of the LOFAR stations, pointed at the delay and tile beam directions.
+ */
+class LOFARBeamModel : public BeamModel
+{
+public:
+	LOFARBeamModel(const std::vector<Station::Ptr>& stations, double subbandFrequency) :
+		_stations(stations), _subbandFrequency(subbandFrequency)
+	{ }
+	
+	void SetPointing(const vector3r_t& station0, const vector3r_t& tile0)
+	{
+		_station0 = station0;
+		_tile0 = tile0;
+	}
+	
+	virtual size_t StationCount() const override { return _stations.size(); }
+	
+	virtual void Response(MC2x2* gains, double time, double frequency, const double* itrfDirection) const override
+	{
+		vector3r_t direction;
+		direction[0] = itrfDirection[0];
+		direction[1] = itrfDirection[1];
+		direction[2] = itrfDirection[2];
+		for(size_t a=0; a!=_stations.size(); ++a)
+		{
+			matrix22c_t gainMatrix = _stations[a]->response(time, frequency, direction, _subbandFrequency, _station0, _tile0);
+			gains[a][0] = gainMatrix[0][0];
+			gains[a][1] = gainMatrix[0][1];
+			gains[a][2] = gainMatrix[1][0];
+			gains[a][3] = gainMatrix[1][1];
+		}
+	}
+	
+private:
+	const std::vector<Station::Ptr>& _stations;
+	double _subbandFrequency;
+	vector3r_t _station0, _tile0;
+};
+
 void LBeamImageMaker::Make(PrimaryBeamImageSet& beamImages)
 {
 	_sampledWidth = _width / _undersample;
@@ -125,6 +166,10 @@ void LBeamImageMaker::makeBeamForMS(PrimaryBeamImageSet& beamImages, MSProvider&
 	
 	std::vector<Station::Ptr> stations(aTable.nrow());
 	readStations(ms, stations.begin());
+	LOFARBeamModel beamModel(stations, centralFrequency);
+	BeamGridEvaluator evaluator(beamModel, _sampledWidth, _sampledHeight, _sPixelSizeX, _sPixelSizeY, _phaseCentreRA, _phaseCentreDec, _phaseCentreDL, _phaseCentreDM);
+	// Keeping the responses takes 64 bytes per station per pixel of the sampled grid
+	evaluator.SetReuseTolerance(_beamReuseTolerance, size_t(1024)*1024*1024);
 	
 	Logger::Debug << "Counting timesteps...\n";
 	std::vector<size_t> idToMSRow;
@@ -200,7 +245,7 @@ void LBeamImageMaker::makeBeamForMS(PrimaryBeamImageSet& beamImages, MSProvider&
 				imgPtr[i] = &singleImages[i][0];
 			}
 		
-			makeBeamSnapshot(stations, stationWeights, baselineWeights, imgPtr, time.getValue().get()*86400.0, centralFrequency, centralFrequency, frame);
+			makeBeamSnapshot(beamModel, evaluator, stationWeights, imgPtr, time.getValue().get()*86400.0, centralFrequency, frame);
 		
 			_totalWeightSum += intervalWeight;
 			for(size_t i=0; i!=8; ++i)
@@ -224,105 +269,65 @@ static void dirToITRF(const casacore::MDirection& dir, casacore::MDirection::Con
 	itrf[2] = itrfVal[2];
 }
 
-void LBeamImageMaker::makeBeamSnapshot(const std::vector<Station::Ptr>& stations, const ao::uvector<double>& weights, const WeightMatrix& baselineWeights, double** imgPtr, double time, double frequency, double subbandFrequency, const casacore::MeasFrame& frame)
+/**
+ * Calculates the matrix that rotates J2000 unit vectors to ITRF, by converting
+ * three orthogonal directions around the given direction. This is not exact,
+ * because the conversion also includes aberration, but the error of the
+ * rotation is far below the resolution of the beam.
+ */
+static void j2000ToITRFMatrix(casacore::MDirection::Convert& convert, const casacore::MDirection::Ref& j2000Ref, double ra, double dec, double* matrix)
 {
 	static const casacore::Unit radUnit("rad");
+	const double
+		basisRA[3] = { ra, ra + 0.5*M_PI, ra + M_PI },
+		basisDec[3] = { dec, 0.0, 0.5*M_PI - dec };
+	std::fill_n(matrix, 9, 0.0);
+	for(size_t i=0; i!=3; ++i)
+	{
+		const double j2000[3] = {
+			cos(basisDec[i]) * cos(basisRA[i]),
+			cos(basisDec[i]) * sin(basisRA[i]),
+			sin(basisDec[i]) };
+		casacore::MDirection direction(casacore::MVDirection(
+			casacore::Quantity(basisRA[i], radUnit),
+			casacore::Quantity(basisDec[i], radUnit)),
+			j2000Ref);
+		casacore::Vector<double> itrf = convert(direction).getValue().getValue();
+		for(size_t row=0; row!=3; ++row)
+		{
+			for(size_t col=0; col!=3; ++col)
+				matrix[row*3 + col] += itrf[row] * j2000[col];
+		}
+	}
+}
+
+void LBeamImageMaker::makeBeamSnapshot(LOFARBeamModel& beamModel, BeamGridEvaluator& evaluator, const ao::uvector<double>& weights, double** imgPtr, double time, double frequency, const casacore::MeasFrame& frame)
+{
 	const casacore::MDirection::Ref itrfRef(casacore::MDirection::ITRF, frame);
 	const casacore::MDirection::Ref j2000Ref(casacore::MDirection::J2000, frame);
 	casacore::MDirection::Convert
 		j2000ToITRFRef(j2000Ref, itrfRef);
 		
-	vector3r_t station0, tile0, diffBeamCentre;
+	vector3r_t station0, tile0;
 	dirToITRF(_delayDir, j2000ToITRFRef, station0);
 	dirToITRF(_tileBeamDir, j2000ToITRFRef, tile0);
+	beamModel.SetPointing(station0, tile0);
+	
+	double rotation[9];
+	j2000ToITRFMatrix(j2000ToITRFRef, j2000Ref, _phaseCentreRA, _phaseCentreDec, rotation);
 	
-	std::vector<MC2x2> inverseCentralGain;
+	double diffBeamCentre[3];
 	if(_useDifferentialBeam)
 	{
-		dirToITRF(_referenceDir, j2000ToITRFRef, diffBeamCentre);
-		inverseCentralGain.resize(stations.size());
-		for(size_t a=0; a!=stations.size(); ++a)
-		{
-			Station::Ptr s=stations[a];
-			matrix22c_t gainMatrix = s->response(time, frequency, diffBeamCentre, subbandFrequency, station0, tile0);
-			inverseCentralGain[a][0] = gainMatrix[0][0];
-			inverseCentralGain[a][1] = gainMatrix[0][1];
-			inverseCentralGain[a][2] = gainMatrix[1][0];
-			inverseCentralGain[a][3] = gainMatrix[1][1];
-			if(!inverseCentralGain[a].Invert())
-			{
-				inverseCentralGain[a] = MC2x2::NaN();
-			}
-		}
+		vector3r_t itrf;
+		dirToITRF(_referenceDir, j2000ToITRFRef, itrf);
+		for(size_t i=0; i!=3; ++i)
+			diffBeamCentre[i] = itrf[i];
 	}
-
-	ProgressBar progressBar("Constructing beam");
-	for(size_t y=0;y!=_sampledHeight;++y)
-	{
-		for(size_t x=0;x!=_sampledWidth;++x)
-		{
-			double l, m, ra, dec;
-			ImageCoordinates::XYToLM(x, y, _sPixelSizeX, _sPixelSizeY, _sampledWidth, _sampledHeight, l, m);
-			l += _phaseCentreDL; m += _phaseCentreDM;
-			ImageCoordinates::LMToRaDec(l, m, _phaseCentreRA, _phaseCentreDec, ra, dec);
-			
-			casacore::MDirection imageDir(casacore::MVDirection(
-							casacore::Quantity(ra, radUnit),
-							casacore::Quantity(dec,radUnit)),
-							j2000Ref);
-			
-			vector3r_t itrfDirection;
-			dirToITRF(imageDir, j2000ToITRFRef, itrfDirection);
-			
-			std::vector<MC2x2> stationGains(stations.size());
-			for(size_t a=0; a!=stations.size(); ++a)
-			{
-				Station::Ptr s=stations[a];
-				matrix22c_t gainMatrix = s->response(time, frequency, itrfDirection, subbandFrequency, station0, tile0);
-				stationGains[a][0] = gainMatrix[0][0];
-				stationGains[a][1] = gainMatrix[0][1];
-				stationGains[a][2] = gainMatrix[1][0];
-				stationGains[a][3] = gainMatrix[1][1];
-				
-				if(_useDifferentialBeam)
-				{
-					// The data have been premultiplied with the central beam C, and we want to
-					// return a matrix that corrects the data for the full beam B. Given our data:
-					//    data = Ci^-1 vis Cj^-*
-					// we want to multiple data with a differential beam matrix D such that
-					//    Di^-1 data Dj^-* = Bi^-1 vis Bj^-*
-					// With B the full beam matrix. We can solve for D:
-					//    Di^-1 Ci^-1 = Bi^-1  (and Cj^-* Dj^-* = Bj^-* )
-					//          Di^-1 = Bi^-1 Ci
-					//          Di    = Ci^-1 Bi
-					// which means: diffBeam = inverseCentralGain * stationGain
-					MC2x2 diffBeam;
-					MC2x2::ATimesB(diffBeam, inverseCentralGain[a], stationGains[a]);
-					stationGains[a] = diffBeam;
-				}
-			}
-			
-			MC2x2 gain = MC2x2::Zero();
-			double totalWeight = 0.0;
-			for(size_t a=0; a!=stations.size(); ++a)
-			{
-				double w = sqrt(weights[a]);
-				gain.AddWithFactorAndAssign(stationGains[a], w);
-				totalWeight += w;
-			}
-			gain *= (1.0/totalWeight);
-		
-			for(size_t i=0; i!=4; ++i)
-			{
-				*imgPtr[i*2] = gain[i].real();
-				*imgPtr[i*2 + 1] = gain[i].imag();
-				++imgPtr[i*2];
-				++imgPtr[i*2 + 1];
-			}
-		}
-		progressBar.SetProgress(y, _sampledHeight);
-	}
-	progressBar.SetProgress(_sampledHeight, _sampledHeight);
+	
+	evaluator.MakeSnapshot(imgPtr, weights.data(), time, frequency, rotation, _useDifferentialBeam ? diffBeamCentre : nullptr);
+	if(evaluator.IsReused())
+		Logger::Debug << "Reused the station responses of the previous snapshot.\n";
 }
 
 void LBeamImageMaker::calculateStationWeights(const ImageWeights& imageWeights, double& totalWeight, ao::uvector<double>& weights, WeightMatrix& baselineWeights, MSProvider& msProvider, const MSSelection& selection, size_t intervalStartIdIndex, size_t intervalEndIdIndex)
@@ -22,7 +22,7 @@ public:
 	LBeamImageMaker(const ImagingTableEntry* tableEntry, ImageBufferAllocator* allocator) :
 	_tableEntry(tableEntry), _allocator(allocator),
 	_undersample(8), _secondsBeforeBeamUpdate(1800),
-	_useDifferentialBeam(false)
+	_useDifferentialBeam(false), _beamReuseTolerance(0.0)
 	{
 	}
 	
@@ -54,6 +54,14 @@ public:
 		_useDifferentialBeam = useDifferentialBeam;
 	}
 	
+	/**
+	 * Station responses are reused for the next time interval when the sky
+	 * rotated less than this angle (in radians). Zero disables reuse.
+	 */
+	void SetBeamReuseTolerance(double tolerance) {
+		_beamReuseTolerance = tolerance;
+	}
+	
 private:
 #ifdef HAVE_LOFAR_BEAM
 	class WeightMatrix
@@ -82,7 +90,7 @@ private:
 	
 	void makeBeamForMS(PrimaryBeamImageSet& beamImages, MSProvider& msProvider, const ImagingTableEntry::MSInfo& msInfo, const MSSelection& selection, double centralFrequency);
 
-	void makeBeamSnapshot(const std::vector<LOFAR::StationResponse::Station::Ptr>& stations, const ao::uvector<double>& weights, const WeightMatrix& baselineWeights, double** imgPtr, double time, double frequency, double subbandFrequency, const casacore::MeasFrame& frame);
+	void makeBeamSnapshot(class LOFARBeamModel& beamModel, class BeamGridEvaluator& evaluator, const ao::uvector<double>& weights, double** imgPtr, double time, double frequency, const casacore::MeasFrame& frame);
 	
 	void calculateStationWeights(const class ImageWeights& imageWeights, double& totalWeight, ao::uvector<double>& weights, WeightMatrix& baselineWeights, MSProvider& msProvider, const MSSelection& selection, size_t intervalStartIdIndex, size_t intervalEndIdIndex);
 	
@@ -110,6 +118,7 @@ private:
 	double _pixelSizeX, _pixelSizeY, _phaseCentreRA, _phaseCentreDec, _phaseCentreDL, _phaseCentreDM;
 	double _sPixelSizeX, _sPixelSizeY, _totalWeightSum;
  	bool _useDifferentialBeam;
+	double _beamReuseTolerance;
 	casacore::MDirection _delayDir, _referenceDir, _tileBeamDir;
 };
 
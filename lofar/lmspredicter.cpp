@@ -200,13 +200,7 @@ void LMSPredicter::PredictThreadFunc()
 	RowData rowData;
 	while(_workLane.read(rowData))
 	{
-		MC2x2 *valIter = rowData.modelData;
-		for(size_t ch=0; ch!=_bandData.ChannelCount(); ++ch)
-		{
-			double lambda = _bandData.ChannelWavelength(ch);
-			_predicter->Predict(*valIter, rowData.u/lambda, rowData.v/lambda, rowData.w/lambda, ch, rowData.a1, rowData.a2);
-			++valIter;
-		}
+		_predicter->PredictRow(rowData.modelData, rowData.u, rowData.v, rowData.w, rowData.a1, rowData.a2);
 		_outputLane.write(rowData);
 	}
 	_barrier.wait();
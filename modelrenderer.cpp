@@ -7,21 +7,56 @@
 #include "units/imagecoordinates.h"
 #include "uvector.h"
 #include "fftconvolver.h"
+#include "threadpool.h"
 
-template<typename T>
-T ModelRenderer::gaus(T x, T sigma)
-{
-	long double xi = x / sigma;
-	return exp(T(-0.5) * xi * xi);// / (sigma * sqrt(T(2.0) * M_PIl));
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace {
+	int clamp(int value, int low, int high)
+	{
+		return std::max(low, std::min(value, high));
+	}
+
+	/** Bounding box, offsets and flux of a component restored with a circular beam */
+	struct CircularComponent
+	{
+		int xLeft, xRight, yTop, yBottom;
+		double dl, dm, flux;
+	};
+
+	struct ModelPixel
+	{
+		size_t x, y;
+		double value;
+	};
+
+	/**
+	 * Adds value * kernel to the image row, with the first kernel element at
+	 * column start, wrapping around like a circular (FFT) convolution does.
+	 * The kernel should not be wider than the image.
+	 */
+	void addKernelRow(double* row, size_t width, const double* kernel, size_t kernelSize, size_t start, double value)
+	{
+		const size_t firstPart = std::min(kernelSize, width - start);
+		double* rowPtr = row + start;
+		for(size_t i=0; i!=firstPart; ++i)
+			rowPtr[i] += value * kernel[i];
+		for(size_t i=firstPart; i!=kernelSize; ++i)
+			row[i - firstPart] += value * kernel[i];
+	}
 }
 
 /** Restore a circular beam*/
 void ModelRenderer::Restore(double* imageData, size_t imageWidth, size_t imageHeight, const Model& model, long double beamSize, long double startFrequency, long double endFrequency, PolarizationEnum polarization)
 {
 	// Using the FWHM formula for a Gaussian:
-	long double sigma = beamSize / (2.0L * sqrtl(2.0L * logl(2.0L)));
+	const double sigma = beamSize / (2.0L * sqrtl(2.0L * logl(2.0L)));
+	const double factor = -0.5 / (sigma * sigma);
 	
 	int boundingBoxSize = ceil(sigma * 20.0 / std::min(_pixelScaleL, _pixelScaleM));
+	std::vector<CircularComponent> components;
 	for(Model::const_iterator src=model.begin(); src!=model.end(); ++src)
 	{
 		for(ModelSource::const_iterator comp=src->begin(); comp!=src->end(); ++comp)
@@ -34,43 +69,53 @@ void ModelRenderer::Restore(double* imageData, size_t imageWidth, size_t imageHe
 			const SpectralEnergyDistribution &sed = comp->SED();
 			const long double intFlux = sed.IntegratedFlux(startFrequency, endFrequency, polarization);
 			
-			//std::cout << "Source: " << comp->PosRA() << "," << comp->PosDec() << " Phase centre: " << _phaseCentreRA << "," << _phaseCentreDec << " beamsize: " << beamSize << "\n";
-				
 			int sourceX, sourceY;
 			ImageCoordinates::LMToXY<long double>(sourceL-_phaseCentreDL, sourceM-_phaseCentreDM, _pixelScaleL, _pixelScaleM, imageWidth, imageHeight, sourceX, sourceY);
-			//std::cout << "Adding source " << comp->Name() << " at " << sourceX << "," << sourceY << " of "
-			//	<< intFlux << " Jy ("
-			//	<< startFrequency/1000000.0 << "-" << endFrequency/1000000.0 << " MHz).\n";
-			int
-				xLeft = sourceX - boundingBoxSize,
-				xRight = sourceX + boundingBoxSize,
-				yTop = sourceY - boundingBoxSize,
-				yBottom = sourceY + boundingBoxSize;
-			if(xLeft < 0) xLeft = 0;
-			if(xLeft > (int) imageWidth) xLeft = (int) imageWidth;
-			if(xRight < xLeft) xRight = xLeft;
-			if(xRight > (int) imageWidth) xRight = (int) imageWidth;
-			if(yTop < 0) yTop = 0;
-			if(yTop > (int) imageHeight) yTop = (int) imageHeight;
-			if(yBottom < yTop) yBottom = yTop;
-			if(yBottom > (int) imageHeight) yBottom = (int) imageHeight;
-			
-			for(int y=yTop; y!=yBottom; ++y)
+			CircularComponent component;
+			component.xLeft = clamp(sourceX - boundingBoxSize, 0, int(imageWidth));
+			component.xRight = clamp(sourceX + boundingBoxSize, component.xLeft, int(imageWidth));
+			component.yTop = clamp(sourceY - boundingBoxSize, 0, int(imageHeight));
+			component.yBottom = clamp(sourceY + boundingBoxSize, component.yTop, int(imageHeight));
+			// Offsets from the source to the l,m of pixel (0,0)
+			component.dl = double(imageWidth*0.5L*_pixelScaleL + _phaseCentreDL - sourceL);
+			component.dm = double(_phaseCentreDM - imageHeight*0.5L*_pixelScaleM - sourceM);
+			component.flux = intFlux;
+			if(component.xLeft != component.xRight && component.yTop != component.yBottom)
+				components.push_back(component);
+		}
+	}
+	
+	// The Gaussian is separable: g(x,y) = flux * gx(x) * gy(y). The image is split
+	// in horizontal strips, and every strip renders the part of each component
+	// that falls inside it.
+	const double pixelScaleL = _pixelScaleL, pixelScaleM = _pixelScaleM;
+	ThreadPool pool;
+	pool.for_each_range(imageHeight, 16, [&](size_t start, size_t end) {
+		ao::uvector<double> gx;
+		for(const CircularComponent& component : components)
+		{
+			const int
+				yTop = std::max(component.yTop, int(start)),
+				yBottom = std::min(component.yBottom, int(end));
+			if(yTop < yBottom)
 			{
-				double *imageDataPtr = imageData + y*imageWidth+xLeft;
-				for(int x=xLeft; x!=xRight; ++x)
+				gx.resize(component.xRight - component.xLeft);
+				for(int x=component.xLeft; x!=component.xRight; ++x)
+				{
+					const double dl = component.dl - x*pixelScaleL;
+					gx[x - component.xLeft] = exp(factor * dl * dl);
+				}
+				for(int y=yTop; y!=yBottom; ++y)
 				{
-					long double l, m;
-					ImageCoordinates::XYToLM<long double>(x, y, _pixelScaleL, _pixelScaleM, imageWidth, imageHeight, l, m);
-					l += _phaseCentreDL; m += _phaseCentreDM;
-					long double dist = sqrt((l-sourceL)*(l-sourceL) + (m-sourceM)*(m-sourceM));
-					long double g = gaus(dist, sigma);
-					(*imageDataPtr) += double(g * intFlux);
-					++imageDataPtr;
+					const double dm = component.dm + y*pixelScaleM;
+					const double gy = component.flux * exp(factor * dm * dm);
+					double* imageDataPtr = imageData + y*imageWidth + component.xLeft;
+					for(size_t i=0; i!=gx.size(); ++i)
+						imageDataPtr[i] += gy * gx[i];
 				}
 			}
 		}
-	}
+	});
 }
 
 void ModelRenderer::renderGaussianComponent(double* imageData, size_t imageWidth, size_t imageHeight, long double posRA, long double posDec, long double gausMaj, long double gausMin, long double gausPA, long double flux, bool normalizeIntegratedFlux)
@@ -104,35 +149,36 @@ void ModelRenderer::renderGaussianComponent(double* imageData, size_t imageWidth
 	// Calculate the bounding box
 	int sourceX, sourceY;
 	ImageCoordinates::LMToXY<long double>(sourceL-_phaseCentreDL, sourceM-_phaseCentreDM, _pixelScaleL, _pixelScaleM, imageWidth, imageHeight, sourceX, sourceY);
-	int
-		xLeft = sourceX - boundingBoxSize,
-		xRight = sourceX + boundingBoxSize,
-		yTop = sourceY - boundingBoxSize,
-		yBottom = sourceY + boundingBoxSize;
-	if(xLeft < 0) xLeft = 0;
-	if(xLeft > (int) imageWidth) xLeft = (int) imageWidth;
-	if(xRight < xLeft) xRight = xLeft;
-	if(xRight > (int) imageWidth) xRight = (int) imageWidth;
-	if(yTop < 0) yTop = 0;
-	if(yTop > (int) imageHeight) yTop = (int) imageHeight;
-	if(yBottom < yTop) yBottom = yTop;
-	if(yBottom > (int) imageHeight) yBottom = (int) imageHeight;
+	const int
+		xLeft = clamp(sourceX - boundingBoxSize, 0, int(imageWidth)),
+		xRight = clamp(sourceX + boundingBoxSize, xLeft, int(imageWidth)),
+		yTop = clamp(sourceY - boundingBoxSize, 0, int(imageHeight)),
+		yBottom = clamp(sourceY + boundingBoxSize, yTop, int(imageHeight));
 	
+	// The exponent is a quadratic form in the pixel offsets, which is evaluated in
+	// double precision with the l offsets of the row precalculated.
+	const double t[4] = { double(transf[0]), double(transf[1]), double(transf[2]), double(transf[3]) };
+	const double
+		dl0 = double(imageWidth*0.5L*_pixelScaleL + _phaseCentreDL - sourceL),
+		dm0 = double(_phaseCentreDM - imageHeight*0.5L*_pixelScaleM - sourceM),
+		pixelScaleL = _pixelScaleL, pixelScaleM = _pixelScaleM,
+		fluxD = flux;
+	ao::uvector<double> dl(xRight - xLeft);
+	for(int x=xLeft; x!=xRight; ++x)
+		dl[x - xLeft] = dl0 - x*pixelScaleL;
 	for(int y=yTop; y!=yBottom; ++y)
 	{
+		const double
+			dm = dm0 + y*pixelScaleM,
+			lFromM = dm*t[1],
+			mFromM = dm*t[3];
 		double *imageDataPtr = imageData + y*imageWidth+xLeft;
-		for(int x=xLeft; x!=xRight; ++x)
+		for(size_t i=0; i!=dl.size(); ++i)
 		{
-			long double l, m;
-			ImageCoordinates::XYToLM<long double>(x, y, _pixelScaleL, _pixelScaleM, imageWidth, imageHeight, l, m);
-			l += _phaseCentreDL; m += _phaseCentreDM;
-			long double
-				lTransf = (l-sourceL)*transf[0] + (m-sourceM)*transf[1],
-				mTransf = (l-sourceL)*transf[2] + (m-sourceM)*transf[3];
-			long double dist = sqrt(lTransf*lTransf + mTransf*mTransf);
-			long double g = gaus(dist, 1.0L);
-			(*imageDataPtr) += double(g * flux);
-			++imageDataPtr;
+			const double
+				lTransf = dl[i]*t[0] + lFromM,
+				mTransf = dl[i]*t[2] + mFromM;
+			imageDataPtr[i] += fluxD * exp(-0.5 * (lTransf*lTransf + mTransf*mTransf));
 		}
 	}
 }
@@ -164,7 +210,7 @@ void ModelRenderer::Restore(double* imageData, size_t imageWidth, size_t imageHe
 /**
  * Restore a diffuse image (e.g. produced with multi-scale clean)
  */
-void ModelRenderer::Restore(double* imageData, const double* modelData, size_t imageWidth, size_t imageHeight, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM)
+void ModelRenderer::Restore(double* imageData, const double* modelData, size_t imageWidth, size_t imageHeight, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM, RestoreMethod method)
 {
 	if(beamMaj == 0.0 && beamMin == 0.0)
 	{
@@ -192,29 +238,81 @@ void ModelRenderer::Restore(double* imageData, const double* modelData, size_t i
 		size_t minDimension = std::min(imageWidth, imageHeight);
 		size_t boundingBoxSize = std::min<size_t>(ceil(sigmaMax * 40.0 / std::min(pixelScaleL, pixelScaleM)), minDimension);
 		if(boundingBoxSize%2!=0) ++boundingBoxSize;
+		const size_t halfBox = boundingBoxSize/2;
+		
+		const double t[4] = { double(transf[0]), double(transf[1]), double(transf[2]), double(transf[3]) };
+		const double psL = pixelScaleL, psM = pixelScaleM;
 		ao::uvector<double> kernel(boundingBoxSize*boundingBoxSize);
-		typename ao::uvector<double>::iterator i=kernel.begin();
-		for(size_t y=0; y!=boundingBoxSize; ++y)
+		ThreadPool pool;
+		pool.for_each_range(boundingBoxSize, 16, [&](size_t start, size_t end) {
+			for(size_t y=start; y!=end; ++y)
+			{
+				const double
+					m = (double(y) - double(halfBox)) * psM,
+					lFromM = m*t[1],
+					mFromM = m*t[3];
+				double* kernelPtr = &kernel[y*boundingBoxSize];
+				for(size_t x=0; x!=boundingBoxSize; ++x)
+				{
+					const double
+						l = (double(halfBox) - double(x)) * psL,
+						lTransf = l*t[0] + lFromM,
+						mTransf = l*t[2] + mFromM;
+					kernelPtr[x] = exp(-0.5 * (lTransf*lTransf + mTransf*mTransf));
+				}
+			}
+		});
+		
+		std::vector<ModelPixel> nonZeroPixels;
+		for(size_t y=0; y!=imageHeight; ++y)
 		{
-			for(size_t x=0; x!=boundingBoxSize; ++x)
+			const double* modelPtr = &modelData[y*imageWidth];
+			for(size_t x=0; x!=imageWidth; ++x)
 			{
-				long double l, m;
-				ImageCoordinates::XYToLM<long double>(x, y, pixelScaleL, pixelScaleM, boundingBoxSize, boundingBoxSize, l, m);
-				long double
-					lTransf = l*transf[0] + m*transf[1],
-					mTransf = l*transf[2] + m*transf[3];
-				long double dist = sqrt(lTransf*lTransf + mTransf*mTransf);
-				*i = gaus(dist, (long double) 1.0);
-				++i;
+				if(modelPtr[x] != 0.0)
+					nonZeroPixels.push_back(ModelPixel{x, y, modelPtr[x]});
 			}
 		}
 		
-		ao::uvector<double> convolvedModel(imageWidth*imageHeight);
-		memcpy(convolvedModel.data(), modelData, sizeof(double)*imageWidth*imageHeight);
-		
-		FFTConvolver::Convolve(convolvedModel.data(), imageWidth, imageHeight, kernel.data(), boundingBoxSize);
-		for(size_t j=0; j!=imageWidth*imageHeight; ++j)
-			imageData[j] += convolvedModel[j];
+		// Adding the kernel for every component costs about nonZero x kernelSize
+		// operations, while the FFT convolution costs a few FFTs of the full image.
+		const double
+			imageSize = imageWidth*imageHeight,
+			directCost = double(nonZeroPixels.size()) * boundingBoxSize * boundingBoxSize,
+			fftCost = 10.0 * imageSize * std::log2(std::max(imageSize, 2.0));
+		const bool useDirect = method == AutomaticRestore ? (directCost < fftCost) : (method == DirectRestore);
+		if(useDirect)
+		{
+			// Each strip of rows adds the kernel rows that fall inside the strip. Rows and
+			// columns wrap around, to give the same result as the circular FFT convolution.
+			const long height = imageHeight;
+			pool.for_each_range(imageHeight, 16, [&](size_t start, size_t end) {
+				for(const ModelPixel& pixel : nonZeroPixels)
+				{
+					const long firstRow = long(pixel.y) - long(halfBox);
+					const size_t column = (long(pixel.x) - long(halfBox) + long(imageWidth)) % imageWidth;
+					for(long wrap=-height; wrap<=height; wrap+=height)
+					{
+						const long
+							kernelStart = std::max(0l, long(start) + wrap - firstRow),
+							kernelEnd = std::min(long(boundingBoxSize), long(end) + wrap - firstRow);
+						for(long ky=kernelStart; ky<kernelEnd; ++ky)
+						{
+							const size_t y = firstRow + ky - wrap;
+							addKernelRow(&imageData[y*imageWidth], imageWidth, &kernel[ky*boundingBoxSize], boundingBoxSize, column, pixel.value);
+						}
+					}
+				}
+			});
+		}
+		else {
+			ao::uvector<double> convolvedModel(imageWidth*imageHeight);
+			memcpy(convolvedModel.data(), modelData, sizeof(double)*imageWidth*imageHeight);
+			
+			FFTConvolver::Convolve(convolvedModel.data(), imageWidth, imageHeight, kernel.data(), boundingBoxSize);
+			for(size_t j=0; j!=imageWidth*imageHeight; ++j)
+				imageData[j] += convolvedModel[j];
+		}
 	}
 }
 
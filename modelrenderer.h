@@ -31,9 +31,18 @@ class ModelRenderer
 		}
 
 		/**
-		 * Restore elliptical beam using a FFT deconvolution (static version).
+		 * How a model image is convolved with the beam: by adding the beam for every
+		 * non-zero model pixel, with an FFT convolution, or with whichever of the two
+		 * is expected to be faster.
 		 */
-		static void Restore(double* imageData, const double* modelData, size_t imageWidth, size_t imageHeight, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM);
+		enum RestoreMethod { AutomaticRestore, DirectRestore, FFTRestore };
+		
+		/**
+		 * Restore elliptical beam (static version). Sparse models are restored by adding
+		 * the beam for every non-zero model pixel, dense models with an FFT convolution.
+		 * Both wrap around at the image edges. The work is divided over image strips.
+		 */
+		static void Restore(double* imageData, const double* modelData, size_t imageWidth, size_t imageHeight, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM, RestoreMethod method = AutomaticRestore);
 		
 		/**
 		 * Render without beam convolution, such that each point-source is one pixel.
@@ -59,9 +68,6 @@ class ModelRenderer
 		long double _phaseCentreDec;
 		long double _pixelScaleL, _pixelScaleM;
 		long double _phaseCentreDL, _phaseCentreDM;
-		template<typename T>
-		static T gaus(T x, T sigma);
-		
 		ModelRenderer(const ModelRenderer &) { }
 		void operator=(const ModelRenderer &) { };
 };
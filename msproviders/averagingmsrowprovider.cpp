@@ -1,206 +1,342 @@
 #include "averagingmsrowprovider.h"
 
 #include "../multibanddata.h"
+#include "../threadpool.h"
 #include "../wsclean/logger.h"
 
+#include <casacore/casa/Arrays/Slicer.h>
+
 #include <casacore/tables/Tables/ArrayColumn.h>
+#include <casacore/tables/Tables/ScalarColumn.h>
 
 AveragingMSRowProvider::AveragingMSRowProvider(double nWavelengthsAveraging, const string& msPath, const MSSelection& selection, const std::map<size_t, size_t>& selectedDataDescIds, const string& dataColumnName, bool requireModel) :
-	MSRowProvider(msPath, selection, selectedDataDescIds, dataColumnName, requireModel)
+	MSRowProvider(msPath, selection, selectedDataDescIds, dataColumnName, requireModel),
+	_nWavelengthsAveraging(nWavelengthsAveraging),
+	_threadPool(new ThreadPool())
 {
 	casacore::MSAntenna antennaTable(_ms.antenna());
 	_nAntennae = antennaTable.nrow();
-	
-	casacore::ROArrayColumn<double> positionColumn(antennaTable, casacore::MSAntenna::columnName(casacore::MSAntennaEnums::POSITION));
-	std::vector<Pos> positions(_nAntennae);
 
+	casacore::ROArrayColumn<double> positionColumn(antennaTable, casacore::MSAntenna::columnName(casacore::MSAntennaEnums::POSITION));
+	_antennaPositions.resize(_nAntennae * 3);
 	casa::Array<double> posArr(casacore::IPosition(1, 3));
 	for(size_t i=0; i!=_nAntennae; ++i)
 	{
 		positionColumn.get(i, posArr);
-		positions[i] = Pos(posArr.data()[0], posArr.data()[1], posArr.data()[2]);
+		std::copy(posArr.data(), posArr.data() + 3, &_antennaPositions[i * 3]);
 	}
-	
-	// dataDescId x ant x ant
-	_nElements = selectedDataDescIds.size() * _nAntennae * _nAntennae;
-	_averagingFactors.assign(_nElements, 0.0);
-	_buffers.resize(_nElements);
+
+	_dataShape = DataShape();
 	MultiBandData bands(_ms.spectralWindow(), _ms.dataDescription());
-	
-	double dt = (EndTime() - StartTime()) / (EndTimestep() - StartTimestep());
-	Logger::Debug << "Assuming integration time of " << dt * (24.0*60.0*60.0) << " seconds.\n";
-	
-	size_t element = 0;
-	size_t averagingSum = 0, minAvgFactor = std::numeric_limits<size_t>::max(), maxAvgFactor = 0;
-	for(size_t a1=0; a1!=_nAntennae; ++a1)
+	// The shape of a row follows from the number of correlations of its
+	// polarization and the number of channels of its band.
+	casacore::ROScalarColumn<int> polarizationIdColumn(_ms.dataDescription(), casacore::MSDataDescription::columnName(casacore::MSDataDescriptionEnums::POLARIZATION_ID));
+	casacore::ROScalarColumn<int> correlationCountColumn(_ms.polarization(), casacore::MSPolarization::columnName(casacore::MSPolarizationEnums::NUM_CORR));
+	_useBlockReads = true;
+	for(size_t dataDescId=0; dataDescId!=bands.DataDescCount(); ++dataDescId)
 	{
-		Pos pos1 = positions[a1];
-		for(size_t a2=0; a2!=_nAntennae; ++a2)
-		{
-			Pos pos2 = positions[a2];
-			double dx = std::get<0>(pos1) - std::get<0>(pos2);
-			double dy = std::get<1>(pos1) - std::get<1>(pos2);
-			double dz = std::get<2>(pos1) - std::get<2>(pos2);
-			double dist = sqrt(dx*dx + dy*dy + dz*dz);
-			for(std::map<size_t, size_t>::const_iterator spwIter=selectedDataDescIds.begin();
-					spwIter!=selectedDataDescIds.end(); ++spwIter)
-			{
-				BandData band = bands[spwIter->first];
-				double lambda = band.SmallestWavelength();
-				double nWavelengthsPerIntegration = 2.0 * M_PI * dist / lambda * dt;
-				_averagingFactors[element] = std::max<size_t>(size_t(floor(nWavelengthsAveraging / nWavelengthsPerIntegration)), 1);
-				averagingSum += _averagingFactors[element];
-				if(a1 != a2)
-				{
-					minAvgFactor = std::min<size_t>(minAvgFactor, _averagingFactors[element]);
-					maxAvgFactor = std::max<size_t>(maxAvgFactor, _averagingFactors[element]);
-				}
-				//Logger::Debug << a1 << '\t' << a2 << '\t' << _averagingFactors[element] << '\n';
-				++element;
-			}
-		}
+		const int polarizationId = polarizationIdColumn(dataDescId);
+		if(bands[dataDescId].ChannelCount() != size_t(_dataShape[1]) ||
+			correlationCountColumn(polarizationId) != _dataShape[0])
+			_useBlockReads = false;
 	}
-	Logger::Info << "Averaging factor for longest baseline: " << minAvgFactor << " x . For the shortest: " << maxAvgFactor << " x \n";
-	
+
 	_spwIndexToDataDescId.resize(selectedDataDescIds.size());
+	_smallestWavelengthPerSpw.resize(selectedDataDescIds.size());
 	for(std::map<size_t, size_t>::const_iterator spwIter=selectedDataDescIds.begin();
 		spwIter!=selectedDataDescIds.end(); ++spwIter)
 	{
 		_spwIndexToDataDescId[spwIter->second] = spwIter->first;
+		_smallestWavelengthPerSpw[spwIter->second] = bands[spwIter->first].SmallestWavelength();
 	}
-	
-	_averageFactorSum = 0.0;
+
+	const size_t nTimesteps = EndTimestep() - StartTimestep();
+	_integrationTime = nTimesteps == 0 ? 0.0 : (EndTime() - StartTime()) / nTimesteps;
+	_maxAveragingFactor = nTimesteps + 1;
+	Logger::Debug << "Assuming integration time of " << _integrationTime * (24.0*60.0*60.0) << " seconds.\n";
+
+	size_t minAvgFactor = std::numeric_limits<size_t>::max(), maxAvgFactor = 0;
+	for(size_t a1=0; a1!=_nAntennae; ++a1)
+	{
+		for(size_t a2=a1+1; a2!=_nAntennae; ++a2)
+		{
+			for(size_t spwIndex=0; spwIndex!=_spwIndexToDataDescId.size(); ++spwIndex)
+			{
+				const size_t factor = averagingFactor(a1, a2, spwIndex);
+				minAvgFactor = std::min(minAvgFactor, factor);
+				maxAvgFactor = std::max(maxAvgFactor, factor);
+			}
+		}
+	}
+	Logger::Info << "Averaging factor for longest baseline: " << minAvgFactor << " x . For the shortest: " << maxAvgFactor << " x \n";
+
+	_averageFactorSum = 0;
 	_rowCount = 0;
 	_averagedRowCount = 0;
 
-	_currentData = DataArray(DataShape());
-	_currentModel = DataArray(DataShape());
-	_currentFlags = FlagArray(DataShape());
-	_currentWeights = WeightArray(DataShape());
-	_averagedDataDescId = _currentDataDescId;
+	const size_t n = rowSize();
+	_flushData.resize(n);
+	_flushFlags.resize(n);
+	_flushWeights.resize(n);
+	if(requireModel)
+		_flushModel.resize(n);
+	_timestepIndex = 0;
+	_isFlushing = false;
 	_flushPosition = 0;
-	
-	if(!MSRowProvider::AtEnd())
+
+	_timestepRowIndex = 0;
+	findNextOutputRow();
+}
+
+AveragingMSRowProvider::~AveragingMSRowProvider()
+{ }
+
+size_t AveragingMSRowProvider::averagingFactor(size_t antenna1, size_t antenna2, size_t spwIndex) const
+{
+	const double* pos1 = &_antennaPositions[antenna1 * 3];
+	const double* pos2 = &_antennaPositions[antenna2 * 3];
+	const double
+		dx = pos1[0] - pos2[0],
+		dy = pos1[1] - pos2[1],
+		dz = pos1[2] - pos2[2],
+		dist = sqrt(dx*dx + dy*dy + dz*dz);
+	const double nWavelengthsPerIntegration = 2.0 * M_PI * dist / _smallestWavelengthPerSpw[spwIndex] * _integrationTime;
+	// Zero-length baselines (and single timesteps) can be averaged over the full observation
+	if(nWavelengthsPerIntegration * _maxAveragingFactor <= _nWavelengthsAveraging)
+		return _maxAveragingFactor;
+	else
+		return std::max<size_t>(size_t(floor(_nWavelengthsAveraging / nWavelengthsPerIntegration)), 1);
+}
+
+bool AveragingMSRowProvider::readTimestep()
+{
+	if(MSRowProvider::AtEnd())
+		return false;
+
+	_timestepRows.clear();
+	_timestepRowIndex = 0;
+	const size_t startRow = _currentRow;
+	const double time = _currentTime;
+	const size_t spwCount = selectedDataDescIds().size();
+	bool hasDuplicateBaselines = false;
+	while(!MSRowProvider::AtEnd() && _currentTime == time)
+	{
+		TimestepRow row;
+		row.blockIndex = _currentRow - startRow;
+		row.dataDescId = _currentDataDescId;
+		row.antenna1 = _antenna1Column(_currentRow);
+		row.antenna2 = _antenna2Column(_currentRow);
+		std::copy(_currentUVWArray.data(), _currentUVWArray.data() + 3, row.uvw);
+
+		const size_t spwIndex = selectedDataDescIds().find(row.dataDescId)->second;
+		const size_t avgFactor = averagingFactor(row.antenna1, row.antenna2, spwIndex);
+		_averageFactorSum += avgFactor;
+		++_rowCount;
+		if(avgFactor == 1)
+		{
+			row.baselineIndex = noBaseline;
+			row.isOutput = true;
+		}
+		else {
+			// Only the baselines that are averaged get an index and a buffer
+			const size_t key = (row.antenna1 * _nAntennae + row.antenna2) * spwCount + spwIndex;
+			std::unordered_map<size_t, size_t>::const_iterator iter = _baselineIndices.find(key);
+			if(iter == _baselineIndices.end())
+			{
+				row.baselineIndex = _baselines.size();
+				_baselineIndices.emplace(key, row.baselineIndex);
+				std::unique_ptr<AveragedBaseline> baseline(new AveragedBaseline());
+				baseline->buffer.Initialize(rowSize(), requireModel());
+				baseline->averagingFactor = avgFactor;
+				baseline->dataDescId = row.dataDescId;
+				baseline->antenna1 = row.antenna1;
+				baseline->antenna2 = row.antenna2;
+				baseline->lastTimestep = _timestepIndex;
+				_baselines.emplace_back(std::move(baseline));
+			}
+			else {
+				row.baselineIndex = iter->second;
+				AveragedBaseline& baseline = *_baselines[row.baselineIndex];
+				if(baseline.lastTimestep == _timestepIndex)
+					hasDuplicateBaselines = true;
+				baseline.lastTimestep = _timestepIndex;
+			}
+			row.isOutput = false;
+		}
+		_timestepRows.push_back(row);
+		MSRowProvider::NextRow();
+	}
+
+	readBlock(startRow, _timestepRows.back().blockIndex + 1);
+
+	// Every baseline occurs once per timestep, so rows can be accumulated
+	// in parallel without locking the buffers.
+	if(hasDuplicateBaselines)
 	{
-		bool timestepAvailable = processCurrentTimestep();
-		if(!timestepAvailable)
-			NextRow();
+		for(TimestepRow& row : _timestepRows)
+			accumulateRow(row);
+	}
+	else {
+		_threadPool->for_each_range(_timestepRows.size(), 16, [&](size_t start, size_t end) {
+			for(size_t i=start; i!=end; ++i)
+				accumulateRow(_timestepRows[i]);
+		});
 	}
+	++_timestepIndex;
+	return true;
 }
 
-bool AveragingMSRowProvider::processCurrentTimestep()
+void AveragingMSRowProvider::readBlock(size_t startRow, size_t rowCount)
 {
-	size_t a1 = _antenna1Column(_currentRow);
-	size_t a2 = _antenna2Column(_currentRow);
-	_averagedDataDescId = _currentDataDescId;
-	_averagedAntenna1Index = a1;
-	_averagedAntenna2Index = a2;
-	
-	size_t spwCount = selectedDataDescIds().size();
-	size_t elementIndex = spwCount*(a2 + a1*_nAntennae) + selectedDataDescIds().find(_averagedDataDescId)->second;
-	size_t avgFactor = _averagingFactors[elementIndex];
-	_averageFactorSum += avgFactor;
-	++_rowCount;
-	
-	//if(a1==1 && a2==2)
-	//	Logger::Debug << a1 <<'\t' << a2 << '\t' << avgFactor << '\n';
-	
-	_dataColumn.get(_currentRow, _currentData);
-	_flagColumn.get(_currentRow, _currentFlags);
-	getCurrentWeights(_currentWeights);
-	if(requireModel())
-		_modelColumn->get(_currentRow, _currentModel);
-	
-	if(avgFactor == 1)
-		return true;
-	else
+	const casacore::IPosition blockShape(3, _dataShape[0], _dataShape[1], rowCount);
+	if(_blockData.shape() != blockShape)
 	{
-		size_t bufferSize = DataShape()[0] * DataShape()[1];
-		AveragingBuffer& buffer = _buffers[elementIndex];
-		if(!buffer.IsInitialized())
-			buffer.Initialize(bufferSize, requireModel());
-		
+		_blockData.resize(blockShape);
+		_blockFlags.resize(blockShape);
+		_blockWeights.resize(blockShape);
 		if(requireModel())
-			buffer.AddDataAndModel(bufferSize, _currentData.data(), _currentModel.data(), _currentFlags.data(), _currentWeights.data(), _currentUVWArray.data());
-		else
-			buffer.AddData(bufferSize, _currentData.data(), _currentFlags.data(), _currentWeights.data(), _currentUVWArray.data());
-		
-		bool foundFullBuffer = (buffer.AveragedDataCount() == avgFactor);
-		if(foundFullBuffer)
+			_blockModel.resize(blockShape);
+	}
+
+	if(_useBlockReads)
+	{
+		const casacore::Slicer rowRange(casacore::IPosition(1, startRow), casacore::IPosition(1, rowCount));
+		_dataColumn.getColumnRange(rowRange, _blockData);
+		_flagColumn.getColumnRange(rowRange, _blockFlags);
+		getWeightRange(startRow, rowCount, _blockWeights);
+		if(requireModel())
+			_modelColumn->getColumnRange(rowRange, _blockModel);
+	}
+	else {
+		// Rows of other data descriptions might have a different shape, so only
+		// the selected rows are read, each directly into its part of the block.
+		const size_t n = rowSize();
+		for(const TimestepRow& row : _timestepRows)
 		{
+			const size_t msRow = startRow + row.blockIndex, offset = row.blockIndex * n;
+			DataArray data(_dataShape, _blockData.data() + offset, casacore::SHARE);
+			_dataColumn.get(msRow, data);
+			FlagArray flags(_dataShape, _blockFlags.data() + offset, casacore::SHARE);
+			_flagColumn.get(msRow, flags);
+			WeightArray weights(_dataShape, _blockWeights.data() + offset, casacore::SHARE);
+			getWeights(msRow, weights);
 			if(requireModel())
-				buffer.Get(bufferSize, _currentData.data(), _currentModel.data(), _currentFlags.data(), _currentWeights.data(), _currentUVWArray.data());
-			else
-				buffer.Get(bufferSize, _currentData.data(), _currentFlags.data(), _currentWeights.data(), _currentUVWArray.data());
-			buffer.Reset(bufferSize);
+			{
+				DataArray model(_dataShape, _blockModel.data() + offset, casacore::SHARE);
+				_modelColumn->get(msRow, model);
+			}
 		}
-		return foundFullBuffer;
 	}
 }
 
-void AveragingMSRowProvider::NextRow()
+void AveragingMSRowProvider::accumulateRow(TimestepRow& row)
 {
-	++_averagedRowCount;
-	if(!MSRowProvider::AtEnd())
+	if(row.baselineIndex == noBaseline)
+		return;
+
+	const size_t n = rowSize(), offset = row.blockIndex * n;
+	std::complex<float>* data = _blockData.data() + offset;
+	std::complex<float>* model = requireModel() ? _blockModel.data() + offset : nullptr;
+	bool* flags = _blockFlags.data() + offset;
+	float* weights = _blockWeights.data() + offset;
+	AveragedBaseline& baseline = *_baselines[row.baselineIndex];
+	AveragingBuffer& buffer = baseline.buffer;
+	if(requireModel())
+		buffer.AddDataAndModel(n, data, model, flags, weights, row.uvw);
+	else
+		buffer.AddData(n, data, flags, weights, row.uvw);
+
+	// When the buffer is full, the average replaces the row in the block
+	if(buffer.AveragedDataCount() == baseline.averagingFactor)
 	{
-		bool foundFullBuffer = false;
-		while(!foundFullBuffer)
-		{
-			MSRowProvider::NextRow();
-			if(MSRowProvider::AtEnd())
-				break;
-			
-			foundFullBuffer = processCurrentTimestep();
-		}
-		// TODO I think this should now say "if(foundFullBuffer) return; "
+		buffer.Get(n, data, model, flags, weights, row.uvw);
+		buffer.Reset();
+		row.isOutput = true;
 	}
-	
-	if(MSRowProvider::AtEnd())
+}
+
+void AveragingMSRowProvider::findNextOutputRow()
+{
+	while(_timestepRowIndex < _timestepRows.size() && !_timestepRows[_timestepRowIndex].isOutput)
+		++_timestepRowIndex;
+	while(_timestepRowIndex == _timestepRows.size())
 	{
-		// There might be residual data in the buffers which have to be read out
-		AveragingBuffer* buffer = 0;
-		do {
-			buffer = &_buffers[_flushPosition];
-			++_flushPosition;
-		} while(buffer->AveragedDataCount() == 0 && _flushPosition < _nElements);
-		
-		if(buffer!= 0 && buffer->AveragedDataCount() != 0)
+		if(!readTimestep())
 		{
-			size_t bufferSize = DataShape()[0] * DataShape()[1];
-			if(requireModel())
-				buffer->Get(bufferSize, _currentData.data(), _currentModel.data(), _currentFlags.data(), _currentWeights.data(), _currentUVWArray.data());
-			else
-				buffer->Get(bufferSize, _currentData.data(), _currentFlags.data(), _currentWeights.data(), _currentUVWArray.data());
-			
-			size_t elementIndex = _flushPosition-1;
-			size_t spwCount = selectedDataDescIds().size();
-			size_t spwIndex = elementIndex % spwCount;
-			size_t subIndex = elementIndex / spwCount;
-			_averagedAntenna1Index = subIndex/_nAntennae;
-			_averagedAntenna2Index = subIndex%_nAntennae;
-			_averagedDataDescId = _spwIndexToDataDescId[spwIndex];
+			// There might be residual data in the buffers which have to be read out
+			_isFlushing = true;
+			_flushPosition = 0;
+			flushNextBuffer();
+			return;
 		}
+		while(_timestepRowIndex < _timestepRows.size() && !_timestepRows[_timestepRowIndex].isOutput)
+			++_timestepRowIndex;
+	}
+}
+
+void AveragingMSRowProvider::flushNextBuffer()
+{
+	while(_flushPosition < _baselines.size() && _baselines[_flushPosition]->buffer.AveragedDataCount() == 0)
+		++_flushPosition;
+	if(_flushPosition < _baselines.size())
+	{
+		const AveragingBuffer& buffer = _baselines[_flushPosition]->buffer;
+		buffer.Get(rowSize(), _flushData.data(), requireModel() ? _flushModel.data() : nullptr, _flushFlags.data(), _flushWeights.data(), _flushUVW);
+	}
+}
+
+void AveragingMSRowProvider::NextRow()
+{
+	++_averagedRowCount;
+	if(_isFlushing)
+	{
+		++_flushPosition;
+		flushNextBuffer();
+	}
+	else {
+		++_timestepRowIndex;
+		findNextOutputRow();
 	}
 }
 
 void AveragingMSRowProvider::ReadData(MSRowProvider::DataArray& data, MSRowProvider::FlagArray& flags, MSRowProvider::WeightArray& weights, double& u, double& v, double& w, uint32_t& dataDescId, uint32_t& antenna1, uint32_t& antenna2)
 {
-	size_t bufferSize = DataShape()[0] * DataShape()[1];
-	memcpy(data.data(), _currentData.data(), bufferSize*sizeof(std::complex<float>));
-	memcpy(flags.data(), _currentFlags.data(), bufferSize*sizeof(bool));
-	memcpy(weights.data(), _currentWeights.data(), bufferSize*sizeof(float));
-	u = _currentUVWArray.data()[0];
-	v = _currentUVWArray.data()[1];
-	w = _currentUVWArray.data()[2];
-	dataDescId = _averagedDataDescId;
-	antenna1 = _averagedAntenna1Index;
-	antenna2 = _averagedAntenna2Index;
+	const size_t n = rowSize();
+	if(_isFlushing)
+	{
+		const AveragedBaseline& baseline = *_baselines[_flushPosition];
+		memcpy(data.data(), _flushData.data(), n*sizeof(std::complex<float>));
+		memcpy(flags.data(), _flushFlags.data(), n*sizeof(bool));
+		memcpy(weights.data(), _flushWeights.data(), n*sizeof(float));
+		u = _flushUVW[0];
+		v = _flushUVW[1];
+		w = _flushUVW[2];
+		dataDescId = baseline.dataDescId;
+		antenna1 = baseline.antenna1;
+		antenna2 = baseline.antenna2;
+	}
+	else {
+		const TimestepRow& row = _timestepRows[_timestepRowIndex];
+		const size_t offset = row.blockIndex * n;
+		memcpy(data.data(), _blockData.data() + offset, n*sizeof(std::complex<float>));
+		memcpy(flags.data(), _blockFlags.data() + offset, n*sizeof(bool));
+		memcpy(weights.data(), _blockWeights.data() + offset, n*sizeof(float));
+		u = row.uvw[0];
+		v = row.uvw[1];
+		w = row.uvw[2];
+		dataDescId = row.dataDescId;
+		antenna1 = row.antenna1;
+		antenna2 = row.antenna2;
+	}
 }
 
 void AveragingMSRowProvider::ReadModel(MSRowProvider::DataArray& model)
 {
-	size_t bufferSize = DataShape()[0] * DataShape()[1];
-	memcpy(model.data(), _currentModel.data(), bufferSize*sizeof(std::complex<float>));
+	const size_t n = rowSize();
+	if(_isFlushing)
+		memcpy(model.data(), _flushModel.data(), n*sizeof(std::complex<float>));
+	else
+		memcpy(model.data(), _blockModel.data() + _timestepRows[_timestepRowIndex].blockIndex * n, n*sizeof(std::complex<float>));
 }
 
 void AveragingMSRowProvider::OutputStatistics() const
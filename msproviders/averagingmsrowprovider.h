@@ -5,158 +5,263 @@
 
 #include "../uvector.h"
 
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+
+/**
+ * An MSRowProvider that averages the rows of each baseline in time, with an
+ * averaging factor that depends on the length of the baseline
+ * (baseline-dependent averaging).
+ *
+ * The measurement set is processed one timestep at a time: the rows of a timestep
+ * are read as one block, after which the rows of the different baselines are
+ * accumulated in parallel, since they are independent. The averaging buffers are
+ * only created for baselines that occur in the data and that are averaged,
+ * instead of for every antenna pair, so that large arrays don't need
+ * a quadratic amount of memory.
+ */
 class AveragingMSRowProvider : public MSRowProvider
 {
 public:
 	AveragingMSRowProvider(double nWavelengthsAveraging, const string& msPath, const MSSelection& selection, const std::map<size_t,size_t>& selectedDataDescIds, const std::string& dataColumnName, bool requireModel);
-	
+
+	virtual ~AveragingMSRowProvider();
+
 	virtual bool AtEnd() const {
-		return _flushPosition >= _nElements;
+		return _isFlushing && _flushPosition >= _baselines.size();
 	}
-	
+
 	virtual void NextRow();
-	
+
 	virtual void ReadData(DataArray& data, FlagArray& flags, WeightArray& weights, double& u, double& v, double& w, uint32_t& dataDescId, uint32_t& antenna1, uint32_t& antenna2);
-	
+
 	virtual void ReadModel(DataArray& model);
-	
+
 	virtual void OutputStatistics() const;
-	
+
 private:
 	class AveragingBuffer
 	{
 	public:
 		AveragingBuffer() :
-			_data(0),
-			_modelData(0),
-			_weights(0),
 			_averagedDataCount(0),
-			_uvwWeight(0)
+			_uvwWeight(0.0)
 		{
-			_uvw[0] = 0.0; _uvw[1] = 0.0; _uvw[2] = 0.0;
+			resetUVW();
 		}
-		~AveragingBuffer()
-		{
-			delete[] _data;
-			delete[] _modelData;
-			delete[] _weights;
-		}
-		bool IsInitialized() const { return _data != 0; }
+
+		bool IsInitialized() const { return !_weights.empty(); }
+
 		void Initialize(size_t bufferSize, bool includeModel)
 		{
-			_data = new std::complex<float>[bufferSize];
-			_modelData = includeModel ? new std::complex<float>[bufferSize] : 0;
-			_weights = new float[bufferSize];
-			Reset(bufferSize);
+			_data.resize(bufferSize*2);
+			if(includeModel)
+				_modelData.resize(bufferSize*2);
+			_weights.resize(bufferSize);
+			_rowWeights.resize(bufferSize);
+			Reset();
 		}
+
 		void AddData(size_t n, const std::complex<float>* data, const bool* flags, const float* weights, const double* uvw)
 		{
-			double weightSum = 0.0;
-			for(size_t i=0; i!=n; ++i)
-			{
-				if(!flags[i] && std::isfinite(data[i].real()) && std::isfinite(data[i].imag()))
-				{
-					_data[i] += data[i] * weights[i];
-					_weights[i] += weights[i];
-					weightSum += weights[i];
-				}
-			}
-			weightSum /= double(n);
-			_uvw[0] += uvw[0] * weightSum;
-			_uvw[1] += uvw[1] * weightSum;
-			_uvw[2] += uvw[2] * weightSum;
-			_uvwWeight += weightSum;
-			++_averagedDataCount;
+			add<false>(n, data, nullptr, flags, weights, uvw);
 		}
+
 		void AddDataAndModel(size_t n, const std::complex<float>* data, const std::complex<float>* modelData, const bool* flags, const float* weights, const double* uvw)
 		{
-			double weightSum = 0.0;
-			for(size_t i=0; i!=n; ++i)
-			{
-				if(!flags[i] && std::isfinite(data[i].real()) && std::isfinite(data[i].imag()) &&
-					std::isfinite(modelData[i].real()) && std::isfinite(modelData[i].imag()))
-				{
-					_data[i] += data[i] * weights[i];
-					_modelData[i] += modelData[i] * weights[i];
-					_weights[i] += weights[i];
-					weightSum += weights[i];
-				}
-			}
-			weightSum /= double(n);
-			_uvw[0] += uvw[0] * weightSum;
-			_uvw[1] += uvw[1] * weightSum;
-			_uvw[2] += uvw[2] * weightSum;
-			_uvwWeight += weightSum;
-			++_averagedDataCount;
+			add<true>(n, data, modelData, flags, weights, uvw);
 		}
+
 		size_t AveragedDataCount() const { return _averagedDataCount; }
-		
-		void Get(size_t n, std::complex<float>* data, bool* flags, float* weights, double* uvw)
+
+		/**
+		 * Write the weighted average of the added data. Values without any
+		 * unflagged contributions are flagged, and are zero.
+		 * @param modelData Output for the model, or @c nullptr if the model is not averaged.
+		 */
+		void Get(size_t n, std::complex<float>* data, std::complex<float>* modelData, bool* flags, float* weights, double* uvw) const
 		{
 			for(size_t i=0; i!=n; ++i)
 			{
-				data[i] = _data[i] / _weights[i];
-				flags[i] = (weights[i]==0.0);
-				weights[i] = _weights[i];
+				const float weight = _weights[i];
+				const float factor = weight == 0.0 ? 0.0 : 1.0 / weight;
+				data[i] = std::complex<float>(_data[i*2] * factor, _data[i*2+1] * factor);
+				if(modelData != nullptr)
+					modelData[i] = std::complex<float>(_modelData[i*2] * factor, _modelData[i*2+1] * factor);
+				flags[i] = (weight == 0.0);
+				weights[i] = weight;
 			}
+			// If everything was flagged, the unweighted average is the best estimate
 			for(size_t i=0; i!=3; ++i)
-				uvw[i] = _uvw[i] / _uvwWeight;
+				uvw[i] = (_uvwWeight == 0.0) ? _uvwSum[i] / _averagedDataCount : _uvw[i] / _uvwWeight;
+		}
+
+		void Reset()
+		{
+			std::fill(_data.begin(), _data.end(), 0.0);
+			std::fill(_modelData.begin(), _modelData.end(), 0.0);
+			std::fill(_weights.begin(), _weights.end(), 0.0);
+			resetUVW();
+			_averagedDataCount = 0;
+			_uvwWeight = 0.0;
 		}
-		
-		void Get(size_t n, std::complex<float>* data, std::complex<float>* modelData, bool* flags, float* weights, double* uvw)
+
+	private:
+		/**
+		 * Accumulates one row. Flagged and non-finite values are masked by
+		 * selecting zero instead of branching, so that the compiler can vectorize
+		 * the loop. The absolute value is compared with the largest float instead of
+		 * using std::isfinite(), because that comparison is false for both NaN and
+		 * infinity and is a single vector instruction. The conditions are combined
+		 * with '&' instead of '&&', because short-circuiting makes the loads
+		 * conditional, and the flags are read as bytes, because the vectorizer does not
+		 * handle loads of bools. The sums are marked __restrict: they are owned by
+		 * this buffer, and without it there are too many possible aliases for the
+		 * compiler to vectorize the variant with the model.
+		 */
+		template<bool IncludeModel>
+		void add(size_t n, const std::complex<float>* data, const std::complex<float>* modelData, const bool* flags, const float* weights, const double* uvw)
 		{
+			const float maxValue = std::numeric_limits<float>::max();
+			const float* values = reinterpret_cast<const float*>(data);
+			const float* modelValues = reinterpret_cast<const float*>(modelData);
+			const unsigned char* flagBytes = reinterpret_cast<const unsigned char*>(flags);
+			float* __restrict dataSum = _data.data();
+			float* __restrict modelSum = _modelData.data();
+			float* __restrict weightSum = _weights.data();
+			float* __restrict rowWeights = _rowWeights.data();
 			for(size_t i=0; i!=n; ++i)
 			{
-				data[i] = _data[i] / _weights[i];
-				modelData[i] = _modelData[i] / weights[i];
-				flags[i] = (weights[i]==0.0);
-				weights[i] = _weights[i];
+				const float
+					re = values[i*2], im = values[i*2+1],
+					modelRe = IncludeModel ? modelValues[i*2] : 0.0f,
+					modelIm = IncludeModel ? modelValues[i*2+1] : 0.0f;
+				const bool isValid = (flagBytes[i] == 0) &
+					(std::fabs(re) <= maxValue) & (std::fabs(im) <= maxValue) &
+					(std::fabs(modelRe) <= maxValue) & (std::fabs(modelIm) <= maxValue);
+				const float weight = isValid ? weights[i] : 0.0f;
+				dataSum[i*2] += (isValid ? re : 0.0f) * weight;
+				dataSum[i*2+1] += (isValid ? im : 0.0f) * weight;
+				if(IncludeModel)
+				{
+					modelSum[i*2] += (isValid ? modelRe : 0.0f) * weight;
+					modelSum[i*2+1] += (isValid ? modelIm : 0.0f) * weight;
+				}
+				weightSum[i] += weight;
+				rowWeights[i] = weight;
 			}
+			// A float sum can not be vectorized without reordering it, so the
+			// weight of the row is summed separately from the loop above.
+			double rowWeightSum = 0.0;
+			for(size_t i=0; i!=n; ++i)
+				rowWeightSum += rowWeights[i];
+			const double uvwWeight = rowWeightSum / double(n);
 			for(size_t i=0; i!=3; ++i)
-				uvw[i] = _uvw[i] / _uvwWeight;
+			{
+				_uvw[i] += uvw[i] * uvwWeight;
+				_uvwSum[i] += uvw[i];
+			}
+			_uvwWeight += uvwWeight;
+			++_averagedDataCount;
 		}
-		
-		void Reset(size_t n)
+
+		void resetUVW()
 		{
-			for(size_t i=0; i!=n; ++i)
+			for(size_t i=0; i!=3; ++i)
 			{
-				_data[i] = 0.0;
-				_weights[i] = 0.0;
-				if(_modelData != 0) _modelData[i] = 0.0;
+				_uvw[i] = 0.0;
+				_uvwSum[i] = 0.0;
 			}
-			_uvw[0] = 0.0; _uvw[1] = 0.0; _uvw[2] = 0.0;
-			_averagedDataCount = 0;
-			_uvwWeight = 0.0;
 		}
-	private:
-		std::complex<float>* _data;
-		std::complex<float>* _modelData;
-		double _uvw[3];
-		float* _weights;
+
+		/** Real and imaginary values are interleaved, like in std::complex. */
+		ao::uvector<float> _data, _modelData;
+		ao::uvector<float> _weights;
+		/** Weights of the last added row after masking, used to calculate its uvw weight. */
+		ao::uvector<float> _rowWeights;
+		double _uvw[3], _uvwSum[3];
 		size_t _averagedDataCount;
 		double _uvwWeight;
 	};
-	
-	bool processCurrentTimestep();
-	
-	typedef std::tuple<double, double, double> Pos;
-	
-	ao::uvector<size_t> _averagingFactors;
-	std::vector<AveragingBuffer> _buffers;
+
+	/**
+	 * A baseline (per selected data description) that is averaged.
+	 */
+	struct AveragedBaseline
+	{
+		AveragingBuffer buffer;
+		size_t averagingFactor;
+		uint32_t dataDescId, antenna1, antenna2;
+		/** Last timestep in which this baseline was seen, to detect duplicate rows. */
+		size_t lastTimestep;
+	};
+
+	/**
+	 * A selected row of the timestep that is being processed.
+	 */
+	struct TimestepRow
+	{
+		/** Index of the row in the block of rows that was read for this timestep. */
+		size_t blockIndex;
+		uint32_t dataDescId, antenna1, antenna2;
+		double uvw[3];
+		/** Index in _baselines, or noBaseline when the row is not averaged. */
+		size_t baselineIndex;
+		/** Whether this row is output; averaged rows are only output when the averaging buffer is full. */
+		bool isOutput;
+	};
+
+	static const size_t noBaseline = std::numeric_limits<size_t>::max();
+
+	size_t averagingFactor(size_t antenna1, size_t antenna2, size_t spwIndex) const;
+
+	bool readTimestep();
+	void readBlock(size_t startRow, size_t rowCount);
+	void accumulateRow(TimestepRow& row);
+	void findNextOutputRow();
+	void flushNextBuffer();
+
+	size_t rowSize() const { return _dataShape[0] * _dataShape[1]; }
+
+	double _nWavelengthsAveraging;
+	/** Integration time in days, which is the unit of the time column. */
+	double _integrationTime;
+	size_t _maxAveragingFactor;
+	ao::uvector<double> _antennaPositions;
+	ao::uvector<double> _smallestWavelengthPerSpw;
 	ao::uvector<size_t> _spwIndexToDataDescId;
-	
+
 	size_t _nAntennae;
-	
-	DataArray _currentData, _currentModel;
-	FlagArray _currentFlags;
-	WeightArray _currentWeights;
-	size_t _averagedDataDescId, _averagedAntenna1Index, _averagedAntenna2Index;
-	size_t _nElements;
-	
-	// Once the Measurement Set has completely been read, the buffer might be still full.
-	// This value represents the position within that buffer at that point
+	casacore::IPosition _dataShape;
+	/** Whether all rows in the measurement set have the same shape, which is required to read a block with a single call. */
+	bool _useBlockReads;
+
+	/** Maps (spw index, antenna1, antenna2) to the index in _baselines. */
+	std::unordered_map<size_t, size_t> _baselineIndices;
+	std::vector<std::unique_ptr<AveragedBaseline>> _baselines;
+	std::unique_ptr<class ThreadPool> _threadPool;
+
+	/** Data of the rows of the current timestep, in the layout of the measurement set (pol x channel x row). */
+	DataArray _blockData, _blockModel;
+	FlagArray _blockFlags;
+	WeightArray _blockWeights;
+	std::vector<TimestepRow> _timestepRows;
+	size_t _timestepRowIndex, _timestepIndex;
+
+	/**
+	 * Once the measurement set has completely been read, the buffers that are not
+	 * full are output in the order of _baselines. _flushData etc. hold the
+	 * averaged values of the buffer at _flushPosition.
+	 */
+	bool _isFlushing;
 	size_t _flushPosition;
-	
+	ao::uvector<std::complex<float>> _flushData, _flushModel;
+	ao::uvector<bool> _flushFlags;
+	ao::uvector<float> _flushWeights;
+	double _flushUVW[3];
+
 	// Some statistics
 	size_t _averagedRowCount;
 	size_t _averageFactorSum;
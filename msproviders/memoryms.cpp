@@ -0,0 +1,112 @@
+#include "memoryms.h"
+
+#include "../msselection.h"
+#include "../multibanddata.h"
+
+#include "../wsclean/logger.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+MemoryMS::MemoryMS(MSProvider& source, const MSSelection& selection, size_t dataDescId, const std::vector<size_t>& bufferRowOfMSRow, size_t bufferChannelCount) :
+	_rowId(0),
+	_dataDescId(dataDescId),
+	_bufferChannelCount(bufferChannelCount),
+	_startTime(source.StartTime()),
+	_polarization(source.Polarization()),
+	_ms(source.MS()),
+	_data(nullptr),
+	_model(nullptr)
+{
+	if(_polarization == Polarization::Instrumental)
+		throw std::runtime_error("The in-memory measurement set does not support instrumental polarization");
+
+	const MultiBandData bandData(_ms.spectralWindow(), _ms.dataDescription());
+	if(selection.HasChannelRange())
+	{
+		_startChannel = selection.ChannelRangeStart();
+		_channelCount = selection.ChannelRangeEnd() - _startChannel;
+	}
+	else {
+		_startChannel = 0;
+		_channelCount = bandData[dataDescId].ChannelCount();
+	}
+	if(_startChannel + _channelCount > _bufferChannelCount)
+		throw std::runtime_error("The selected channels do not fit in the visibility buffer");
+
+	std::vector<size_t> idToMSRow;
+	source.MakeIdToMSRowMapping(idToMSRow);
+	_rows.reserve(idToMSRow.size());
+	_weights.resize(idToMSRow.size() * _channelCount);
+
+	Logger::Info << "Reading metadata and weights into memory... ";
+	Logger::Info.Flush();
+	source.Reset();
+	while(source.CurrentRowAvailable())
+	{
+		Row row;
+		size_t rowDataDescId;
+		source.ReadMeta(row.u, row.v, row.w, rowDataDescId, row.antenna1, row.antenna2);
+		row.msRow = idToMSRow[_rows.size()];
+		row.bufferRow = bufferRowOfMSRow[row.msRow];
+		source.ReadWeights(&_weights[_rows.size() * _channelCount]);
+		_rows.push_back(row);
+		source.NextRow();
+	}
+	Logger::Info << "DONE (" << _rows.size() << " rows)\n";
+}
+
+void MemoryMS::readWeighted(std::complex<float>* buffer, const std::complex<double>* source) const
+{
+	if(source == nullptr)
+		throw std::runtime_error("No visibility buffer was set for the in-memory measurement set");
+	const Row& row = _rows[_rowId];
+	const std::complex<double>* values = &source[row.bufferRow * _bufferChannelCount + _startChannel];
+	const float* weights = &_weights[_rowId * _channelCount];
+	for(size_t ch=0; ch!=_channelCount; ++ch)
+	{
+		// Flagged values have a zero weight, but might not be finite
+		if(weights[ch] == 0.0 || !std::isfinite(values[ch].real()) || !std::isfinite(values[ch].imag()))
+			buffer[ch] = 0.0;
+		else
+			buffer[ch] = std::complex<float>(values[ch]) * weights[ch];
+	}
+}
+
+void MemoryMS::ReadData(std::complex<float>* buffer)
+{
+	readWeighted(buffer, _data);
+}
+
+void MemoryMS::ReadModel(std::complex<float>* buffer)
+{
+	readWeighted(buffer, _model);
+}
+
+void MemoryMS::WriteModel(size_t rowId, std::complex<float>* buffer)
+{
+	if(_model == nullptr)
+		throw std::runtime_error("No model buffer was set for the in-memory measurement set");
+	std::complex<double>* values = &_model[_rows[rowId].bufferRow * _bufferChannelCount + _startChannel];
+	for(size_t ch=0; ch!=_channelCount; ++ch)
+		values[ch] = buffer[ch];
+}
+
+void MemoryMS::ReadWeights(float* buffer)
+{
+	const float* weights = &_weights[_rowId * _channelCount];
+	std::copy(weights, weights + _channelCount, buffer);
+}
+
+void MemoryMS::ReadWeights(std::complex<float>* buffer)
+{
+	copyRealToComplex(buffer, &_weights[_rowId * _channelCount], _channelCount);
+}
+
+void MemoryMS::MakeIdToMSRowMapping(std::vector<size_t>& idToMSRow)
+{
+	idToMSRow.resize(_rows.size());
+	for(size_t i=0; i!=_rows.size(); ++i)
+		idToMSRow[i] = _rows[i].msRow;
+}
@@ -0,0 +1,123 @@
+#ifndef MEMORYMS_H
+#define MEMORYMS_H
+
+#include "msprovider.h"
+
+#include "../uvector.h"
+
+#include <casacore/ms/MeasurementSets/MeasurementSet.h>
+
+#include <vector>
+
+/**
+ * An MSProvider that keeps the metadata and weights of a measurement set in memory,
+ * and that reads the visibilities from, and writes the model to, buffers that
+ * are owned by the caller. This is used by the operator interface
+ * (see wscleaninterface.h), which passes the visibilities in memory and should
+ * not have to write them to disk for every call.
+ *
+ * A buffer holds one Stokes I value for each channel of each row. Buffer rows
+ * don't have to be in the same order as the selected rows: the constructor
+ * receives the buffer row of every measurement set row.
+ */
+class MemoryMS : public MSProvider
+{
+public:
+	/**
+	 * Copy the metadata and weights of all rows of @p source.
+	 * @param source Provider for the rows to keep; its polarization should not be
+	 * instrumental.
+	 * @param selection The selection with which @p source was opened.
+	 * @param dataDescId The data description id of the rows in @p source.
+	 * @param bufferRowOfMSRow For every row in the measurement set, the row in the
+	 * data and model buffers.
+	 * @param bufferChannelCount The number of values per row in the buffers.
+	 */
+	MemoryMS(MSProvider& source, const MSSelection& selection, size_t dataDescId, const std::vector<size_t>& bufferRowOfMSRow, size_t bufferChannelCount);
+
+	MemoryMS(const MemoryMS&) = delete;
+
+	MemoryMS& operator=(const MemoryMS&) = delete;
+
+	/**
+	 * Set the visibilities that are returned by ReadData(). The buffer should
+	 * stay valid while the visibilities are read. The visibilities are not
+	 * weighted; ReadData() applies the weights of the measurement set.
+	 */
+	void SetData(const std::complex<double>* data) { _data = data; }
+
+	/**
+	 * Set the buffer that WriteModel() writes to and ReadModel() reads from.
+	 */
+	void SetModel(std::complex<double>* model) { _model = model; }
+
+	virtual casacore::MeasurementSet &MS() final override { return _ms; }
+
+	virtual size_t RowId() const final override { return _rowId; }
+
+	virtual bool CurrentRowAvailable() final override { return _rowId < _rows.size(); }
+
+	virtual void NextRow() final override { ++_rowId; }
+
+	virtual void Reset() final override { _rowId = 0; }
+
+	virtual void ReadMeta(double& u, double& v, double& w, size_t& dataDescId) final override
+	{
+		const Row& row = _rows[_rowId];
+		u = row.u;
+		v = row.v;
+		w = row.w;
+		dataDescId = _dataDescId;
+	}
+
+	virtual void ReadMeta(double& u, double& v, double& w, size_t& dataDescId, size_t& antenna1, size_t& antenna2) final override
+	{
+		ReadMeta(u, v, w, dataDescId);
+		antenna1 = _rows[_rowId].antenna1;
+		antenna2 = _rows[_rowId].antenna2;
+	}
+
+	virtual void ReadData(std::complex<float>* buffer) final override;
+
+	virtual void ReadModel(std::complex<float>* buffer) final override;
+
+	virtual void WriteModel(size_t rowId, std::complex<float>* buffer) final override;
+
+	virtual void ReadWeights(float* buffer) final override;
+
+	virtual void ReadWeights(std::complex<float>* buffer) final override;
+
+	/**
+	 * The model is written to memory, so nothing needs to be reopened.
+	 */
+	virtual void ReopenRW() final override { }
+
+	virtual double StartTime() final override { return _startTime; }
+
+	virtual void MakeIdToMSRowMapping(std::vector<size_t>& idToMSRow) final override;
+
+	virtual PolarizationEnum Polarization() final override { return _polarization; }
+
+private:
+	struct Row
+	{
+		double u, v, w;
+		size_t antenna1, antenna2;
+		size_t msRow, bufferRow;
+	};
+
+	void readWeighted(std::complex<float>* buffer, const std::complex<double>* source) const;
+
+	std::vector<Row> _rows;
+	ao::uvector<float> _weights;
+	size_t _rowId;
+	size_t _dataDescId;
+	size_t _startChannel, _channelCount, _bufferChannelCount;
+	double _startTime;
+	PolarizationEnum _polarization;
+	casacore::MeasurementSet _ms;
+	const std::complex<double>* _data;
+	std::complex<double>* _model;
+};
+
+#endif
@@ -20,7 +20,7 @@ class MSSelection;
  * An MSProvider knows which rows are selected and doesn't read or write to unselected rows. 
  * It provides the visibilities weighted with the visibility weight and converts the visibilities
  * to a requested polarization.
- * Currently, the @ref ContiguousMS and @ref PartitionedMS classes implement the MSProvider interface.
+ * Currently, the @ref ContiguousMS, @ref PartitionedMS, @ref MemoryMS and @ref SyntheticMS classes implement the MSProvider interface.
  */
 class MSProvider
 {
@@ -3,6 +3,8 @@
 
 #include "../wsclean/logger.h"
 
+#include <casacore/casa/Arrays/Slicer.h>
+
 #include <casacore/ms/MeasurementSets/MeasurementSet.h>
 
 MSRowProvider::MSRowProvider(const string& msPath, const MSSelection& selection, const std::map<size_t,size_t>& selectedDataDescIds, const std::string &dataColumnName, bool requireModel) :
@@ -98,12 +100,36 @@ bool MSRowProvider::isCurrentRowSelected(int fieldId, int a1, int a2) const
 	return _selection.IsSelected(fieldId, _currentTimestep, a1, a2, _currentUVWArray) && isDataDescIdSelected;
 }
 
-void MSRowProvider::getCurrentWeights(WeightArray& weights)
+void MSRowProvider::getWeights(size_t row, WeightArray& weights)
 {
 	if(_msHasWeights)
-		_weightSpectrumColumn->get(_currentRow, weights);
+		_weightSpectrumColumn->get(row, weights);
 	else {
-		_weightScalarColumn->get(_currentRow, _scratchWeightScalarArray);
+		_weightScalarColumn->get(row, _scratchWeightScalarArray);
 		MSProvider::expandScalarWeights(_scratchWeightScalarArray, weights);
 	}
 }
+
+void MSRowProvider::getWeightRange(size_t startRow, size_t rowCount, WeightArray& weights)
+{
+	const casacore::Slicer rowRange(casacore::IPosition(1, startRow), casacore::IPosition(1, rowCount));
+	if(_msHasWeights)
+		_weightSpectrumColumn->getColumnRange(rowRange, weights);
+	else {
+		// The weight column holds one value per polarization, which is
+		// repeated for every channel
+		casacore::Array<float> scalarWeights(casacore::IPosition(2, _scratchWeightScalarArray.shape()[0], rowCount));
+		_weightScalarColumn->getColumnRange(rowRange, scalarWeights);
+		const size_t polarizationCount = _scratchWeightScalarArray.shape()[0];
+		const size_t rowSize = weights.shape()[0] * weights.shape()[1];
+		const float* source = scalarWeights.data();
+		float* dest = weights.data();
+		for(size_t row=0; row!=rowCount; ++row)
+		{
+			for(size_t i=0; i!=rowSize; ++i)
+				dest[i] = source[i % polarizationCount];
+			source += polarizationCount;
+			dest += rowSize;
+		}
+	}
+}
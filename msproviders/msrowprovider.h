@@ -63,7 +63,14 @@ protected:
 	casacore::ROScalarColumn<int> _dataDescIdColumn;
 	std::unique_ptr<casacore::ROArrayColumn<casacore::Complex>> _modelColumn;
 
-	void getCurrentWeights(WeightArray& weights);
+	void getCurrentWeights(WeightArray& weights) { getWeights(_currentRow, weights); }
+	void getWeights(size_t row, WeightArray& weights);
+	/**
+	 * Read the weights of @p rowCount consecutive rows with a single call. All rows
+	 * should have the shape of DataShape(); @p weights should have the shape
+	 * DataShape() x rowCount.
+	 */
+	void getWeightRange(size_t startRow, size_t rowCount, WeightArray& weights);
 	const std::map<size_t,size_t>& selectedDataDescIds() const { return _selectedDataDescIds; }
 	bool requireModel() const { return _requireModel; }
 	
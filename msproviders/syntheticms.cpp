@@ -0,0 +1,405 @@
+#include "syntheticms.h"
+
+#include "../threadpool.h"
+
+#include "../wsclean/logger.h"
+
+#include <casacore/measures/Measures/MFrequency.h>
+#include <casacore/measures/Measures/Stokes.h>
+
+#include <casacore/ms/MeasurementSets/MSColumns.h>
+
+#include <casacore/tables/Tables/SetupNewTab.h>
+#include <casacore/tables/Tables/TableCopy.h>
+
+#include <boost/filesystem/operations.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+
+namespace {
+	const double speedOfLight = 299792458.0;
+	const double earthRadius = 6378137.0;
+	const double siderealDay = 86164.0905;
+}
+
+SyntheticMS::Setup::Setup() :
+	antennaCount(32),
+	arrayRadius(3000.0),
+	longitude(116.67 * M_PI / 180.0),
+	latitude(-26.70 * M_PI / 180.0),
+	channelCount(16),
+	startFrequency(140e6),
+	channelWidth(160e3),
+	timestepCount(120),
+	startTime(57000.0 * 86400.0),
+	integrationTime(10.0),
+	phaseCentreRA(0.0),
+	phaseCentreDec(-27.0 * M_PI / 180.0),
+	sourceCount(10),
+	fieldOfView(10.0 * M_PI / 180.0),
+	noiseStdDev(1.0),
+	seed(42),
+	temporaryDirectory()
+{ }
+
+SyntheticMS::SyntheticMS(const Setup& setup) :
+	_setup(setup),
+	_rowId(0)
+{
+	if(_setup.antennaCount < 2 || _setup.channelCount == 0 || _setup.timestepCount == 0)
+		throw std::runtime_error("A synthetic measurement set needs at least two antennas, one channel and one timestep");
+
+	Logger::Info << "Generating synthetic data for " << _setup.antennaCount << " antennas, "
+		<< _setup.timestepCount << " timesteps and " << _setup.channelCount << " channels... ";
+	Logger::Info.Flush();
+	ao::uvector<double> localPositions, itrfPositions;
+	generateAntennas(localPositions, itrfPositions);
+	generateRows(localPositions);
+	generateSources();
+	generateData();
+	_model.assign(_data.size(), std::complex<float>(0.0, 0.0));
+	createMetaData(itrfPositions);
+	Logger::Info << "DONE (" << _rows.size() << " rows)\n";
+}
+
+void SyntheticMS::generateAntennas(ao::uvector<double>& localPositions, ao::uvector<double>& itrfPositions)
+{
+	// The antennas are spread uniformly over a flat disk around the array
+	// centre. Local positions are in the equatorial frame of the array's
+	// meridian (X towards hour angle 0, Z towards the pole), which is what the
+	// uvw coordinates are calculated from.
+	std::mt19937 rng(_setup.seed);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	const double
+		sinLat = std::sin(_setup.latitude), cosLat = std::cos(_setup.latitude),
+		sinLong = std::sin(_setup.longitude), cosLong = std::cos(_setup.longitude);
+	const double centre[3] = {
+		earthRadius * cosLat * cosLong,
+		earthRadius * cosLat * sinLong,
+		earthRadius * sinLat };
+	localPositions.resize(_setup.antennaCount * 3);
+	itrfPositions.resize(_setup.antennaCount * 3);
+	for(size_t a=0; a!=_setup.antennaCount; ++a)
+	{
+		const double
+			radius = _setup.arrayRadius * std::sqrt(uniform(rng)),
+			angle = 2.0 * M_PI * uniform(rng),
+			east = radius * std::cos(angle),
+			north = radius * std::sin(angle);
+		double* local = &localPositions[a * 3];
+		local[0] = -sinLat * north;
+		local[1] = east;
+		local[2] = cosLat * north;
+		double* itrf = &itrfPositions[a * 3];
+		itrf[0] = centre[0] + cosLong * local[0] - sinLong * local[1];
+		itrf[1] = centre[1] + sinLong * local[0] + cosLong * local[1];
+		itrf[2] = centre[2] + local[2];
+	}
+}
+
+void SyntheticMS::generateRows(const ao::uvector<double>& localPositions)
+{
+	const size_t nAntennas = _setup.antennaCount;
+	const double
+		sinDec = std::sin(_setup.phaseCentreDec), cosDec = std::cos(_setup.phaseCentreDec);
+	ao::uvector<double> antennaUVW(nAntennas * 3);
+	_rows.resize(_setup.timestepCount * BaselineCount());
+	std::vector<Row>::iterator row = _rows.begin();
+	for(size_t t=0; t!=_setup.timestepCount; ++t)
+	{
+		const double
+			hourAngle = (double(t) - 0.5 * double(_setup.timestepCount - 1)) * _setup.integrationTime * 2.0 * M_PI / siderealDay,
+			sinH = std::sin(hourAngle), cosH = std::cos(hourAngle);
+		for(size_t a=0; a!=nAntennas; ++a)
+		{
+			const double* pos = &localPositions[a * 3];
+			double* uvw = &antennaUVW[a * 3];
+			uvw[0] = sinH * pos[0] + cosH * pos[1];
+			uvw[1] = -sinDec * cosH * pos[0] + sinDec * sinH * pos[1] + cosDec * pos[2];
+			uvw[2] = cosDec * cosH * pos[0] - cosDec * sinH * pos[1] + sinDec * pos[2];
+		}
+		for(size_t a1=0; a1!=nAntennas; ++a1)
+		{
+			for(size_t a2=a1+1; a2!=nAntennas; ++a2)
+			{
+				for(size_t i=0; i!=3; ++i)
+					row->uvw[i] = antennaUVW[a2 * 3 + i] - antennaUVW[a1 * 3 + i];
+				row->antenna1 = a1;
+				row->antenna2 = a2;
+				++row;
+			}
+		}
+	}
+}
+
+void SyntheticMS::generateSources()
+{
+	// A different seed than for the antennas, so that the sources don't move
+	// when the number of antennas changes.
+	std::mt19937 rng(_setup.seed + 1);
+	std::uniform_real_distribution<double>
+		position(-0.5 * _setup.fieldOfView, 0.5 * _setup.fieldOfView),
+		flux(0.1, 1.0);
+	_sources.resize(_setup.sourceCount);
+	for(Source& source : _sources)
+	{
+		source.l = position(rng);
+		source.m = position(rng);
+		source.flux = flux(rng);
+	}
+}
+
+void SyntheticMS::generateData()
+{
+	const size_t nChannels = _setup.channelCount;
+	_data.assign(_rows.size() * nChannels, std::complex<float>(0.0, 0.0));
+	if(!_sources.empty())
+	{
+		// The phase of a source changes linearly with frequency, so the value of
+		// every next channel is found by a rotation instead of a sin/cos.
+		ThreadPool pool;
+		pool.for_each_range(_rows.size(), 64, [&](size_t start, size_t end) {
+			ao::uvector<std::complex<double>> rowData(nChannels);
+			for(size_t r=start; r!=end; ++r)
+			{
+				const double* uvw = _rows[r].uvw;
+				std::fill(rowData.begin(), rowData.end(), std::complex<double>(0.0, 0.0));
+				for(const Source& source : _sources)
+				{
+					const double
+						n = std::sqrt(1.0 - source.l*source.l - source.m*source.m),
+						pathPerWavelength = 2.0 * M_PI * (uvw[0]*source.l + uvw[1]*source.m + uvw[2]*(n - 1.0)) / speedOfLight;
+					std::complex<double>
+						value = std::polar(source.flux, pathPerWavelength * _setup.startFrequency);
+					const std::complex<double>
+						step = std::polar(1.0, pathPerWavelength * _setup.channelWidth);
+					for(size_t ch=0; ch!=nChannels; ++ch)
+					{
+						rowData[ch] += value;
+						value *= step;
+					}
+				}
+				std::copy(rowData.begin(), rowData.end(), &_data[r * nChannels]);
+			}
+		});
+	}
+	if(_setup.noiseStdDev != 0.0)
+	{
+		std::mt19937 rng(_setup.seed + 2);
+		std::normal_distribution<float> noise(0.0, _setup.noiseStdDev);
+		for(std::complex<float>& value : _data)
+			value += std::complex<float>(noise(rng), noise(rng));
+	}
+}
+
+void SyntheticMS::createMetaData(const ao::uvector<double>& itrfPositions)
+{
+	const boost::filesystem::path directory = _setup.temporaryDirectory.empty() ?
+		boost::filesystem::temp_directory_path() : boost::filesystem::path(_setup.temporaryDirectory);
+	const std::string path = (directory / boost::filesystem::unique_path("wsclean-synthetic-%%%%-%%%%.ms")).string();
+
+	// A scratch table is removed from disk when the last reference to it is gone
+	casacore::SetupNewTable newTable(path, casacore::MeasurementSet::requiredTableDesc(), casacore::Table::Scratch);
+	_ms = casacore::MeasurementSet(newTable, 1);
+	_ms.createDefaultSubtables(casacore::Table::Scratch);
+	casacore::MSColumns columns(_ms);
+
+	const size_t nAntennas = _setup.antennaCount;
+	_ms.antenna().addRow(nAntennas);
+	casacore::MSAntennaColumns& antennas = columns.antenna();
+	for(size_t a=0; a!=nAntennas; ++a)
+	{
+		const std::string name = "SYN" + std::to_string(a);
+		antennas.name().put(a, name);
+		antennas.station().put(a, name);
+		antennas.type().put(a, "GROUND-BASED");
+		antennas.mount().put(a, "ALT-AZ");
+		antennas.dishDiameter().put(a, 4.0);
+		casacore::Vector<double> position(3), offset(3, 0.0);
+		for(size_t i=0; i!=3; ++i)
+			position[i] = itrfPositions[a * 3 + i];
+		antennas.position().put(a, position);
+		antennas.offset().put(a, offset);
+	}
+
+	const size_t nChannels = _setup.channelCount;
+	_ms.spectralWindow().addRow();
+	casacore::MSSpWindowColumns& band = columns.spectralWindow();
+	casacore::Vector<double> frequencies(nChannels), widths(nChannels, _setup.channelWidth);
+	for(size_t ch=0; ch!=nChannels; ++ch)
+		frequencies[ch] = _setup.startFrequency + _setup.channelWidth * ch;
+	band.name().put(0, "SYNTHETIC");
+	band.numChan().put(0, nChannels);
+	band.chanFreq().put(0, frequencies);
+	band.chanWidth().put(0, widths);
+	band.effectiveBW().put(0, widths);
+	band.resolution().put(0, widths);
+	band.refFrequency().put(0, frequencies[nChannels / 2]);
+	band.totalBandwidth().put(0, _setup.channelWidth * nChannels);
+	band.measFreqRef().put(0, casacore::MFrequency::TOPO);
+
+	_ms.polarization().addRow();
+	casacore::MSPolarizationColumns& polarization = columns.polarization();
+	casacore::Vector<int> correlationTypes(4);
+	correlationTypes[0] = casacore::Stokes::XX;
+	correlationTypes[1] = casacore::Stokes::XY;
+	correlationTypes[2] = casacore::Stokes::YX;
+	correlationTypes[3] = casacore::Stokes::YY;
+	casacore::Matrix<int> correlationProducts(2, 4);
+	for(size_t p=0; p!=4; ++p)
+	{
+		correlationProducts(0, p) = p / 2;
+		correlationProducts(1, p) = p % 2;
+	}
+	polarization.numCorr().put(0, 4);
+	polarization.corrType().put(0, correlationTypes);
+	polarization.corrProduct().put(0, correlationProducts);
+
+	_ms.dataDescription().addRow();
+	columns.dataDescription().spectralWindowId().put(0, 0);
+	columns.dataDescription().polarizationId().put(0, 0);
+
+	_ms.field().addRow();
+	casacore::MSFieldColumns& field = columns.field();
+	casacore::Matrix<double> direction(2, 1);
+	direction(0, 0) = _setup.phaseCentreRA;
+	direction(1, 0) = _setup.phaseCentreDec;
+	field.name().put(0, "SYNTHETIC");
+	field.code().put(0, "");
+	field.time().put(0, _setup.startTime);
+	field.numPoly().put(0, 0);
+	field.delayDir().put(0, direction);
+	field.phaseDir().put(0, direction);
+	field.referenceDir().put(0, direction);
+	field.sourceId().put(0, -1);
+
+	_ms.observation().addRow();
+	casacore::MSObservationColumns& observation = columns.observation();
+	casacore::Vector<double> timeRange(2);
+	timeRange[0] = _setup.startTime;
+	timeRange[1] = _setup.startTime + _setup.integrationTime * _setup.timestepCount;
+	observation.telescopeName().put(0, "SYNTHETIC");
+	observation.observer().put(0, "wsclean");
+	observation.timeRange().put(0, timeRange);
+
+	// The main table only has a single row, which describes the first
+	// generated row. Code that reads the start time or the used data
+	// descriptions from the main table finds it here.
+	const Row& row = _rows.front();
+	casacore::Vector<double> uvw(3);
+	for(size_t i=0; i!=3; ++i)
+		uvw[i] = row.uvw[i];
+	columns.time().put(0, _setup.startTime + 0.5 * _setup.integrationTime);
+	columns.timeCentroid().put(0, _setup.startTime + 0.5 * _setup.integrationTime);
+	columns.interval().put(0, _setup.integrationTime);
+	columns.exposure().put(0, _setup.integrationTime);
+	columns.antenna1().put(0, row.antenna1);
+	columns.antenna2().put(0, row.antenna2);
+	columns.dataDescId().put(0, 0);
+	columns.fieldId().put(0, 0);
+	columns.uvw().put(0, uvw);
+}
+
+void SyntheticMS::WriteMeasurementSet(const std::string& path) const
+{
+	casacore::TableDesc description = casacore::MeasurementSet::requiredTableDesc();
+	casacore::MeasurementSet::addColumnToDesc(description, casacore::MSMainEnums::DATA, 2);
+	casacore::MeasurementSet::addColumnToDesc(description, casacore::MSMainEnums::WEIGHT_SPECTRUM, 2);
+	casacore::MeasurementSet::addColumnToDesc(description, casacore::MSMainEnums::MODEL_DATA, 2);
+	casacore::SetupNewTable newTable(path, description, casacore::Table::New);
+	casacore::MeasurementSet ms(newTable, _rows.size());
+	ms.createDefaultSubtables(casacore::Table::New);
+
+	// The subtables are the same as those of the scratch set
+	casacore::TableCopy::copyRows(ms.antenna(), _ms.antenna());
+	casacore::TableCopy::copyRows(ms.spectralWindow(), _ms.spectralWindow());
+	casacore::TableCopy::copyRows(ms.polarization(), _ms.polarization());
+	casacore::TableCopy::copyRows(ms.dataDescription(), _ms.dataDescription());
+	casacore::TableCopy::copyRows(ms.field(), _ms.field());
+	casacore::TableCopy::copyRows(ms.observation(), _ms.observation());
+
+	casacore::MSColumns columns(ms);
+	const size_t nChannels = _setup.channelCount;
+	const casacore::IPosition shape(2, 4, nChannels);
+	casacore::Array<casacore::Complex> data(shape), model(shape);
+	const casacore::Array<bool> flags(shape, false);
+	const casacore::Array<float> weights(shape, 1.0f);
+	const casacore::Vector<float> correlationWeights(4, 1.0f);
+	casacore::Vector<double> uvw(3);
+	for(size_t r=0; r!=_rows.size(); ++r)
+	{
+		const Row& row = _rows[r];
+		const double time = _setup.startTime + (double(r / BaselineCount()) + 0.5) * _setup.integrationTime;
+		for(size_t i=0; i!=3; ++i)
+			uvw[i] = row.uvw[i];
+		casacore::Complex
+			*values = data.data(),
+			*modelValues = model.data();
+		for(size_t ch=0; ch!=nChannels; ++ch)
+		{
+			const casacore::Complex
+				value = _data[r * nChannels + ch],
+				modelValue = _model[r * nChannels + ch];
+			values[ch * 4] = value;
+			values[ch * 4 + 1] = 0.0;
+			values[ch * 4 + 2] = 0.0;
+			values[ch * 4 + 3] = value;
+			modelValues[ch * 4] = modelValue;
+			modelValues[ch * 4 + 1] = 0.0;
+			modelValues[ch * 4 + 2] = 0.0;
+			modelValues[ch * 4 + 3] = modelValue;
+		}
+		columns.time().put(r, time);
+		columns.timeCentroid().put(r, time);
+		columns.interval().put(r, _setup.integrationTime);
+		columns.exposure().put(r, _setup.integrationTime);
+		columns.antenna1().put(r, row.antenna1);
+		columns.antenna2().put(r, row.antenna2);
+		columns.dataDescId().put(r, 0);
+		columns.fieldId().put(r, 0);
+		columns.uvw().put(r, uvw);
+		columns.data().put(r, data);
+		columns.modelData().put(r, model);
+		columns.flag().put(r, flags);
+		columns.weight().put(r, correlationWeights);
+		columns.sigma().put(r, correlationWeights);
+		columns.weightSpectrum().put(r, weights);
+	}
+}
+
+void SyntheticMS::ReadData(std::complex<float>* buffer)
+{
+	const std::complex<float>* values = &_data[_rowId * _setup.channelCount];
+	std::copy(values, values + _setup.channelCount, buffer);
+}
+
+void SyntheticMS::ReadModel(std::complex<float>* buffer)
+{
+	const std::complex<float>* values = &_model[_rowId * _setup.channelCount];
+	std::copy(values, values + _setup.channelCount, buffer);
+}
+
+void SyntheticMS::WriteModel(size_t rowId, std::complex<float>* buffer)
+{
+	std::copy(buffer, buffer + _setup.channelCount, &_model[rowId * _setup.channelCount]);
+}
+
+void SyntheticMS::ReadWeights(float* buffer)
+{
+	std::fill(buffer, buffer + _setup.channelCount, 1.0f);
+}
+
+void SyntheticMS::ReadWeights(std::complex<float>* buffer)
+{
+	std::fill(buffer, buffer + _setup.channelCount, std::complex<float>(1.0f, 0.0f));
+}
+
+void SyntheticMS::MakeIdToMSRowMapping(std::vector<size_t>& idToMSRow)
+{
+	idToMSRow.resize(_rows.size());
+	for(size_t i=0; i!=_rows.size(); ++i)
+		idToMSRow[i] = i;
+}
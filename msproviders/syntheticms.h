@@ -0,0 +1,157 @@
+#ifndef SYNTHETIC_MS_H
+#define SYNTHETIC_MS_H
+
+#include "msprovider.h"
+
+#include "../uvector.h"
+
+#include <casacore/ms/MeasurementSets/MeasurementSet.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * An MSProvider that generates its visibilities instead of reading them from a
+ * measurement set. It simulates an array with randomly placed antennas that
+ * tracks the phase centre, and fills the visibilities with a number of point
+ * sources and/or Gaussian noise. Everything is generated from a seed, so that
+ * runs with the same @ref Setup produce exactly the same data. This makes it
+ * possible to benchmark and test the gridders without a measurement set on disk.
+ *
+ * The provider only supports Stokes I and has a single band. The metadata that
+ * the gridders read from MS() (antennas, band, field and observation) is
+ * written to a small scratch measurement set with a single main row, that is
+ * removed when the provider is destructed.
+ */
+class SyntheticMS : public MSProvider
+{
+public:
+	struct Setup
+	{
+		Setup();
+
+		size_t antennaCount;
+		/** Radius of the disk in which the antennas are placed, in metres. */
+		double arrayRadius;
+		/** Geodetic position of the array centre, in radians. */
+		double longitude, latitude;
+		size_t channelCount;
+		/** Frequency of the first channel, and the channel width, in Hz. */
+		double startFrequency, channelWidth;
+		size_t timestepCount;
+		/** Start time in MJD seconds, and the integration time in seconds. */
+		double startTime, integrationTime;
+		/** J2000 phase centre in radians. The phase centre transits halfway through the observation. */
+		double phaseCentreRA, phaseCentreDec;
+		/** Number of point sources, placed at random within the field of view around the phase centre. */
+		size_t sourceCount;
+		/** Width of the square in which the sources are placed, in radians. */
+		double fieldOfView;
+		/** Standard deviation of the noise in each of the real and imaginary values. */
+		double noiseStdDev;
+		unsigned seed;
+		/** Directory for the scratch measurement set; empty for the system's temporary directory. */
+		std::string temporaryDirectory;
+	};
+
+	struct Source
+	{
+		double l, m, flux;
+	};
+
+	explicit SyntheticMS(const Setup& setup);
+
+	SyntheticMS(const SyntheticMS&) = delete;
+
+	SyntheticMS& operator=(const SyntheticMS&) = delete;
+
+	const Setup& GetSetup() const { return _setup; }
+
+	const std::vector<Source>& Sources() const { return _sources; }
+
+	size_t RowCount() const { return _rows.size(); }
+
+	size_t BaselineCount() const { return _setup.antennaCount * (_setup.antennaCount - 1) / 2; }
+
+	/**
+	 * Write the generated rows to a new measurement set on disk, for code that
+	 * opens measurement sets by path. The visibilities and the model (see
+	 * WriteModel()) are stored as XX = YY = Stokes I, with unit weights.
+	 */
+	void WriteMeasurementSet(const std::string& path) const;
+
+	virtual casacore::MeasurementSet &MS() final override { return _ms; }
+
+	virtual size_t RowId() const final override { return _rowId; }
+
+	virtual bool CurrentRowAvailable() final override { return _rowId < _rows.size(); }
+
+	virtual void NextRow() final override { ++_rowId; }
+
+	virtual void Reset() final override { _rowId = 0; }
+
+	virtual void ReadMeta(double& u, double& v, double& w, size_t& dataDescId) final override
+	{
+		const Row& row = _rows[_rowId];
+		u = row.uvw[0];
+		v = row.uvw[1];
+		w = row.uvw[2];
+		dataDescId = 0;
+	}
+
+	virtual void ReadMeta(double& u, double& v, double& w, size_t& dataDescId, size_t& antenna1, size_t& antenna2) final override
+	{
+		ReadMeta(u, v, w, dataDescId);
+		antenna1 = _rows[_rowId].antenna1;
+		antenna2 = _rows[_rowId].antenna2;
+	}
+
+	/**
+	 * All weights are one, so the weighted data are the generated visibilities.
+	 */
+	virtual void ReadData(std::complex<float>* buffer) final override;
+
+	virtual void ReadModel(std::complex<float>* buffer) final override;
+
+	virtual void WriteModel(size_t rowId, std::complex<float>* buffer) final override;
+
+	virtual void ReadWeights(float* buffer) final override;
+
+	virtual void ReadWeights(std::complex<float>* buffer) final override;
+
+	/**
+	 * The model is kept in memory, so nothing needs to be reopened.
+	 */
+	virtual void ReopenRW() final override { }
+
+	virtual double StartTime() final override { return _setup.startTime; }
+
+	/**
+	 * The rows don't exist in the measurement set, so the mapping is the identity.
+	 */
+	virtual void MakeIdToMSRowMapping(std::vector<size_t>& idToMSRow) final override;
+
+	virtual PolarizationEnum Polarization() final override { return Polarization::StokesI; }
+
+private:
+	struct Row
+	{
+		double uvw[3];
+		size_t antenna1, antenna2;
+	};
+
+	void generateAntennas(ao::uvector<double>& localPositions, ao::uvector<double>& itrfPositions);
+	void generateRows(const ao::uvector<double>& localPositions);
+	void generateSources();
+	void generateData();
+	void createMetaData(const ao::uvector<double>& itrfPositions);
+
+	const Setup _setup;
+	std::vector<Row> _rows;
+	std::vector<Source> _sources;
+	ao::uvector<std::complex<float>> _data, _model;
+	size_t _rowId;
+	casacore::MeasurementSet _ms;
+};
+
+#endif
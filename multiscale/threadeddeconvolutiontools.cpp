@@ -34,11 +34,12 @@ ThreadedDeconvolutionTools::~ThreadedDeconvolutionTools()
 	}
 }
 
-void ThreadedDeconvolutionTools::SubtractImage(double* image, const double* psf, size_t width, size_t height, size_t x, size_t y, double factor)
+template<typename NumT>
+void ThreadedDeconvolutionTools::SubtractImage(NumT* image, const NumT* psf, size_t width, size_t height, size_t x, size_t y, double factor)
 {
 	for(size_t thr=0; thr!=_threadCount; ++thr)
 	{
-		SubtractionTask* task = new SubtractionTask();
+		SubtractionTask<NumT>* task = new SubtractionTask<NumT>();
 		task->image = image;
 		task->psf = psf;
 		task->width = width;
@@ -65,12 +66,26 @@ void ThreadedDeconvolutionTools::SubtractImage(double* image, const double* psf,
 	}
 }
 
-ThreadedDeconvolutionTools::ThreadResult* ThreadedDeconvolutionTools::SubtractionTask::operator()()
+template<typename NumT>
+ThreadedDeconvolutionTools::ThreadResult* ThreadedDeconvolutionTools::SubtractionTask<NumT>::operator()()
 {
 	SimpleClean::PartialSubtractImage(image, psf, width, height, x, y, factor, startY, endY);
 	return 0;
 }
 
+#if defined __AVX__ && defined USE_INTRINSICS && !defined FORCE_NON_AVX
+template<>
+ThreadedDeconvolutionTools::ThreadResult* ThreadedDeconvolutionTools::SubtractionTask<float>::operator()()
+{
+	// Single-precision images use the AVX kernel that subtracts eight pixels at a time
+	SimpleClean::PartialSubtractImageAVX(image, width, height, psf, width, height, x, y, factor, startY, endY);
+	return 0;
+}
+#endif
+
+template void ThreadedDeconvolutionTools::SubtractImage<double>(double* image, const double* psf, size_t width, size_t height, size_t x, size_t y, double factor);
+template void ThreadedDeconvolutionTools::SubtractImage<float>(float* image, const float* psf, size_t width, size_t height, size_t x, size_t y, double factor);
+
 void ThreadedDeconvolutionTools::MultiScaleTransform(MultiScaleTransforms* msTransforms, const ao::uvector<double*>& images, double* scratch, double scale)
 {
 	size_t imageIndex = 0;
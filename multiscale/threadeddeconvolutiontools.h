@@ -20,7 +20,8 @@ public:
 		size_t x, y;
 	};
 	
-	void SubtractImage(double *image, const double *psf, size_t width, size_t height, size_t x, size_t y, double factor);
+	template<typename NumT>
+	void SubtractImage(NumT *image, const NumT *psf, size_t width, size_t height, size_t x, size_t y, double factor);
 	
 	// This one is for many transforms of the same scale
 	void MultiScaleTransform(class MultiScaleTransforms* msTransforms, const ao::uvector<double*>& images, double* scratch, double scale);
@@ -50,11 +51,12 @@ private:
 		virtual ThreadResult* operator()() = 0;
 		virtual ~ThreadTask() { }
 	};
+	template<typename NumT>
 	struct SubtractionTask : public ThreadTask {
 		virtual ThreadResult* operator()();
 		
-		double *image;
-		const double *psf;
+		NumT *image;
+		const NumT *psf;
 		size_t width, height, x, y;
 		double factor;
 		size_t startY, endY;
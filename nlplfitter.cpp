@@ -1,5 +1,7 @@
 #include "nlplfitter.h"
 
+#include <algorithm>
+#include <array>
 #include <stdexcept>
 #include <cmath>
 #include <limits>
@@ -17,8 +19,61 @@ public:
 	typedef ao::uvector<std::pair<double, double>> PointVec;
 	PointVec points;
 	size_t nTerms;
+	
+	/**
+	 * Workspace of the log-polynomial fit: the log10 of the x values, the y values
+	 * with their sign removed, and for the batch fit the x values for which
+	 * guessMatrix was calculated.
+	 */
+	ao::uvector<double> lg, y, batchX;
+	
+	/**
+	 * Maps the log10 of the y values onto the initial guess of the terms. Only
+	 * valid when all values have the same sign.
+	 */
+	ao::uvector<double> guessMatrix;
+	size_t guessTerms;
+	
+	/**
+	 * Scratch space of a single fit, kept here so that fitting many spectra does
+	 * not allocate per spectrum: the log10 of the y values and which of them are
+	 * used, and the normal matrix and powers of the log-linear fit.
+	 */
+	ao::uvector<double> logY, normalMatrix, powers;
+	ao::uvector<bool> isUsed;
+	
+	NLPLFitterData() : nTerms(0), guessTerms(0)
 #ifdef HAVE_GSL
+		, solver(nullptr), solverN(0), solverP(0)
+#endif
+	{ }
+	
+#ifdef HAVE_GSL
+	~NLPLFitterData()
+	{
+		if(solver)
+			gsl_multifit_fdfsolver_free(solver);
+	}
+	
+	/**
+	 * Get a solver for n points and p parameters. The solver is only
+	 * reallocated when the sizes change.
+	 */
+	gsl_multifit_fdfsolver* getSolver(size_t n, size_t p)
+	{
+		if(!solver || n != solverN || p != solverP)
+		{
+			if(solver)
+				gsl_multifit_fdfsolver_free(solver);
+			solver = gsl_multifit_fdfsolver_alloc(gsl_multifit_fdfsolver_lmsder, n, p);
+			solverN = n;
+			solverP = p;
+		}
+		return solver;
+	}
+	
 	gsl_multifit_fdfsolver *solver;
+	size_t solverN, solverP;
 	
 	static int fitting_func(const gsl_vector *xvec, void *data, gsl_vector *f)
 	{
@@ -197,13 +252,206 @@ public:
 #endif
 };
 
+namespace {
+	/**
+	 * Log-polynomials with at most this many terms are fitted with the
+	 * fixed-size solver below; more terms are fitted with GSL.
+	 */
+	const size_t maxFixedSizeTerms = 4;
+	
+	/**
+	 * Solve the n x n system a x = b with Gaussian elimination and partial
+	 * pivoting. The solution is stored in b.
+	 * @returns false if the system is singular.
+	 */
+	inline bool solveLinear(double* a, double* b, size_t n)
+	{
+		for(size_t col=0; col!=n; ++col)
+		{
+			size_t pivot = col;
+			for(size_t row=col+1; row!=n; ++row)
+			{
+				if(std::fabs(a[row*n + col]) > std::fabs(a[pivot*n + col]))
+					pivot = row;
+			}
+			if(a[pivot*n + col] == 0.0 || !std::isfinite(a[pivot*n + col]))
+				return false;
+			if(pivot != col)
+			{
+				for(size_t i=0; i!=n; ++i)
+					std::swap(a[col*n + i], a[pivot*n + i]);
+				std::swap(b[col], b[pivot]);
+			}
+			for(size_t row=col+1; row!=n; ++row)
+			{
+				const double factor = a[row*n + col] / a[col*n + col];
+				for(size_t i=col; i!=n; ++i)
+					a[row*n + i] -= factor * a[col*n + i];
+				b[row] -= factor * b[col];
+			}
+		}
+		for(size_t k=0; k!=n; ++k)
+		{
+			const size_t row = n-k-1;
+			for(size_t i=row+1; i!=n; ++i)
+				b[row] -= a[row*n + i] * b[i];
+			b[row] /= a[row*n + row];
+		}
+		return true;
+	}
+	
+	/**
+	 * Least-squares fit of a polynomial in lg to the used values of logY, which
+	 * gives the initial guess of the log-polynomial. When there are fewer used
+	 * values than terms, the higher terms are set to zero.
+	 * @param a Scratch space for the normal matrix.
+	 * @param powers Scratch space for the powers of lg.
+	 */
+	void logLinearFit(double* terms, size_t nTerms, const double* lg, const double* logY, const bool* isUsed, size_t n, ao::uvector<double>& a, ao::uvector<double>& powers)
+	{
+		std::fill(terms, terms + nTerms, 0.0);
+		size_t nUsed = 0;
+		for(size_t i=0; i!=n; ++i)
+			if(isUsed[i]) ++nUsed;
+		const size_t nFitted = std::min(nTerms, nUsed);
+		if(nFitted == 0)
+			return;
+		a.assign(nFitted * nFitted, 0.0);
+		powers.resize(nFitted);
+		for(size_t i=0; i!=n; ++i)
+		{
+			if(isUsed[i])
+			{
+				double f = 1.0;
+				for(size_t t=0; t!=nFitted; ++t)
+				{
+					powers[t] = f;
+					f *= lg[i];
+				}
+				for(size_t t=0; t!=nFitted; ++t)
+				{
+					terms[t] += powers[t] * logY[i];
+					for(size_t u=0; u!=nFitted; ++u)
+						a[t*nFitted + u] += powers[t] * powers[u];
+				}
+			}
+		}
+		if(!solveLinear(a.data(), terms, nFitted))
+		{
+			// Degenerate x values: only fit the mean
+			double sum = 0.0;
+			for(size_t i=0; i!=n; ++i)
+				if(isUsed[i]) sum += logY[i];
+			std::fill(terms, terms + nTerms, 0.0);
+			terms[0] = sum / double(nUsed);
+		}
+	}
+	
+	/**
+	 * Levenberg-Marquardt fit of y = 10^(t_0 + t_1 lg + t_2 lg^2 + ...) with N
+	 * terms. Because N is known at compile time, the normal equations are small
+	 * fixed-size arrays on the stack.
+	 * @param terms On input the initial guess, on output the fitted terms.
+	 */
+	template<size_t N>
+	void levenbergMarquardt(double* terms, const double* lg, const double* y, size_t n)
+	{
+		const size_t maxIterations = 500;
+		const double epsilon = 1e-6, ln10 = std::log(10.0);
+		
+		auto cost = [&](const std::array<double, N>& t) -> double
+		{
+			double sum = 0.0;
+			for(size_t i=0; i!=n; ++i)
+			{
+				double poly = 0.0;
+				for(size_t k=0; k!=N; ++k)
+					poly = poly * lg[i] + t[N-k-1];
+				const double r = exp10(poly) - y[i];
+				sum += r * r;
+			}
+			return sum;
+		};
+		
+		std::array<double, N> t, trial, jtr, delta;
+		std::array<double, N*N> jtj, a;
+		std::copy(terms, terms + N, t.begin());
+		double currentCost = cost(t);
+		double lambda = 1e-3;
+		for(size_t iteration=0; iteration!=maxIterations && std::isfinite(currentCost); ++iteration)
+		{
+			jtj.fill(0.0);
+			jtr.fill(0.0);
+			for(size_t i=0; i!=n; ++i)
+			{
+				double poly = 0.0;
+				for(size_t k=0; k!=N; ++k)
+					poly = poly * lg[i] + t[N-k-1];
+				const double f = exp10(poly);
+				const double r = f - y[i];
+				// d f / d t_j = ln(10) f lg^j
+				std::array<double, N> gradient;
+				double g = ln10 * f;
+				for(size_t j=0; j!=N; ++j)
+				{
+					gradient[j] = g;
+					g *= lg[i];
+				}
+				for(size_t j=0; j!=N; ++j)
+				{
+					jtr[j] += gradient[j] * r;
+					for(size_t k=0; k<=j; ++k)
+						jtj[j*N + k] += gradient[j] * gradient[k];
+				}
+			}
+			for(size_t j=0; j!=N; ++j)
+				for(size_t k=j+1; k!=N; ++k)
+					jtj[j*N + k] = jtj[k*N + j];
+			
+			bool isImproved = false;
+			while(!isImproved && lambda < 1e16)
+			{
+				a = jtj;
+				for(size_t j=0; j!=N; ++j)
+				{
+					a[j*N + j] += lambda * std::max(jtj[j*N + j], 1e-30);
+					delta[j] = -jtr[j];
+				}
+				if(solveLinear(a.data(), delta.data(), N))
+				{
+					for(size_t j=0; j!=N; ++j)
+						trial[j] = t[j] + delta[j];
+					const double trialCost = cost(trial);
+					if(trialCost <= currentCost)
+					{
+						t = trial;
+						currentCost = trialCost;
+						lambda = std::max(lambda * 0.1, 1e-12);
+						isImproved = true;
+					}
+				}
+				if(!isImproved)
+					lambda *= 10.0;
+			}
+			if(!isImproved)
+				break;
+			// Same criterion as gsl_multifit_test_delta()
+			bool isConverged = true;
+			for(size_t j=0; j!=N; ++j)
+				isConverged = isConverged && std::fabs(delta[j]) < epsilon + epsilon * std::fabs(t[j]);
+			if(isConverged)
+				break;
+		}
+		std::copy(t.begin(), t.end(), terms);
+	}
+}
+
 #ifdef HAVE_GSL
 void NonLinearPowerLawFitter::Fit(double& exponent, double& factor)
 {
 	if(_data->points.size() >= 2)
 	{
-		const gsl_multifit_fdfsolver_type *T = gsl_multifit_fdfsolver_lmsder;
-		_data->solver = gsl_multifit_fdfsolver_alloc (T, _data->points.size(), 2);
+		_data->getSolver(_data->points.size(), 2);
 		
 		gsl_multifit_function_fdf fdf;
 		fdf.f = &NLPLFitterData::fitting_func;
@@ -232,8 +480,6 @@ void NonLinearPowerLawFitter::Fit(double& exponent, double& factor)
 		
 		exponent = gsl_vector_get (_data->solver->x, 0);
 		factor = gsl_vector_get (_data->solver->x, 1);
-		
-		gsl_multifit_fdfsolver_free(_data->solver);
 	}
 	else {
 		exponent = 0.0;
@@ -251,8 +497,7 @@ void NonLinearPowerLawFitter::Fit(double& a, double& b, double& c)
 	
 	if(_data->points.size() >= 3)
 	{
-		const gsl_multifit_fdfsolver_type *T = gsl_multifit_fdfsolver_lmsder;
-		_data->solver = gsl_multifit_fdfsolver_alloc (T, _data->points.size(), 3);
+		_data->getSolver(_data->points.size(), 3);
 		
 		gsl_multifit_function_fdf fdf;
 		fdf.f = &NLPLFitterData::fitting_2nd_order;
@@ -282,16 +527,13 @@ void NonLinearPowerLawFitter::Fit(double& a, double& b, double& c)
 		a = gsl_vector_get (_data->solver->x, 0);
 		b = gsl_vector_get (_data->solver->x, 1);
 		c = gsl_vector_get (_data->solver->x, 2);
-		
-		gsl_multifit_fdfsolver_free(_data->solver);
 	}
 }
 
 void NonLinearPowerLawFitter::fit_implementation(ao::uvector<double>& terms, size_t nTerms)
 {
 	_data->nTerms = nTerms;
-	const gsl_multifit_fdfsolver_type *T = gsl_multifit_fdfsolver_lmsder;
-	_data->solver = gsl_multifit_fdfsolver_alloc (T, _data->points.size(), nTerms);
+	_data->getSolver(_data->points.size(), nTerms);
 	
 	gsl_multifit_function_fdf fdf;
 	fdf.f = &NLPLFitterData::fitting_multi_order;
@@ -325,8 +567,6 @@ void NonLinearPowerLawFitter::fit_implementation(ao::uvector<double>& terms, siz
 	}
 	for(size_t i=0; i!=nTerms; ++i)
 		terms[i] = gsl_vector_get (_data->solver->x, i);
-	
-	gsl_multifit_fdfsolver_free(_data->solver);
 }
 
 #else
@@ -342,7 +582,7 @@ void NonLinearPowerLawFitter::Fit(double& a, double& b, double& c)
 	throw std::runtime_error("Non-linear power law fitter was invoked, but GSL was not found during compilation, and is required for this");
 }
 
-void NonLinearPowerLawFitter::fit_implementation(std::vector<double>& terms, size_t nTerms)
+void NonLinearPowerLawFitter::fit_implementation(ao::uvector<double>& terms, size_t nTerms)
 {
 	throw std::runtime_error("Non-linear power law fitter was invoked, but GSL was not found during compilation, and is required for this");
 }
@@ -363,6 +603,11 @@ void NonLinearPowerLawFitter::AddDataPoint(double x, double y)
 	_data->points.push_back(std::make_pair(x, y));
 }
 
+void NonLinearPowerLawFitter::Clear()
+{
+	_data->points.clear();
+}
+
 void NonLinearPowerLawFitter::Fit(ao::uvector<double>& terms, size_t nTerms)
 {
 	terms.assign(nTerms, 0.0);
@@ -373,6 +618,142 @@ void NonLinearPowerLawFitter::Fit(ao::uvector<double>& terms, size_t nTerms)
 	if(nTerms == 0)
 		return;
 	
+	if(nTerms > maxFixedSizeTerms)
+	{
+		fitWithGSL(terms, nTerms);
+		return;
+	}
+	
+	const size_t n = _data->points.size();
+	_data->lg.resize(n);
+	_data->y.resize(n);
+	for(size_t i=0; i!=n; ++i)
+	{
+		_data->lg[i] = log10(_data->points[i].first);
+		_data->y[i] = _data->points[i].second;
+	}
+	fitLogPolynomial(terms.data(), nTerms, nullptr);
+}
+
+void NonLinearPowerLawFitter::FitBatch(double* terms, const double* spectra, size_t count, const double* xValues, size_t n, size_t nTerms)
+{
+	std::fill(terms, terms + count*nTerms, 0.0);
+	const size_t fittedTerms = std::min(nTerms, n);
+	if(fittedTerms == 0)
+		return;
+	
+	if(fittedTerms > maxFixedSizeTerms)
+	{
+		ao::uvector<double> spectrumTerms;
+		for(size_t s=0; s!=count; ++s)
+		{
+			Clear();
+			for(size_t i=0; i!=n; ++i)
+				AddDataPoint(xValues[i], spectra[s*n + i]);
+			fitWithGSL(spectrumTerms, fittedTerms);
+			std::copy(spectrumTerms.begin(), spectrumTerms.end(), &terms[s*nTerms]);
+		}
+		return;
+	}
+	
+	_data->lg.resize(n);
+	for(size_t i=0; i!=n; ++i)
+		_data->lg[i] = log10(xValues[i]);
+	// The initial guess is a linear least-squares fit to the log of the values.
+	// Because all spectra share the x values, its solution matrix is calculated
+	// once for the batch.
+	if(_data->guessTerms != fittedTerms || _data->batchX.size() != n || !std::equal(xValues, xValues+n, _data->batchX.begin()))
+	{
+		_data->batchX.assign(xValues, xValues+n);
+		_data->guessTerms = fittedTerms;
+		_data->guessMatrix.assign(fittedTerms * n, 0.0);
+		ao::uvector<double> unitValues(n, 0.0), unitTerms(fittedTerms);
+		_data->isUsed.assign(n, true);
+		for(size_t i=0; i!=n; ++i)
+		{
+			unitValues[i] = 1.0;
+			logLinearFit(unitTerms.data(), fittedTerms, _data->lg.data(), unitValues.data(), _data->isUsed.data(), n, _data->normalMatrix, _data->powers);
+			for(size_t t=0; t!=fittedTerms; ++t)
+				_data->guessMatrix[t*n + i] = unitTerms[t];
+			unitValues[i] = 0.0;
+		}
+	}
+	
+	_data->y.resize(n);
+	for(size_t s=0; s!=count; ++s)
+	{
+		const double* spectrum = &spectra[s*n];
+		std::copy(spectrum, spectrum + n, _data->y.begin());
+		fitLogPolynomial(&terms[s*nTerms], fittedTerms, _data->guessMatrix.data());
+	}
+}
+
+void NonLinearPowerLawFitter::fitLogPolynomial(double* terms, size_t nTerms, const double* guessMatrix)
+{
+	const size_t n = _data->lg.size();
+	double* y = _data->y.data();
+	
+	// The sign of the spectrum is fitted as a factor of -1 or 1, and the remaining
+	// values should be positive.
+	double sum = 0.0;
+	bool isZero = true;
+	for(size_t i=0; i!=n; ++i)
+	{
+		sum += y[i];
+		isZero = isZero && (y[i] == 0.0);
+	}
+	if(isZero)
+	{
+		std::fill(terms, terms + nTerms, 0.0);
+		return;
+	}
+	const bool isNegative = sum < 0.0;
+	bool allPositive = true;
+	ao::uvector<bool>& isUsed = _data->isUsed;
+	isUsed.resize(n);
+	for(size_t i=0; i!=n; ++i)
+	{
+		if(isNegative)
+			y[i] = -y[i];
+		isUsed[i] = y[i] > 0.0;
+		allPositive = allPositive && isUsed[i];
+	}
+	
+	// Initial guess with a closed-form fit of a polynomial to the log of the values
+	ao::uvector<double>& logY = _data->logY;
+	logY.resize(n);
+	for(size_t i=0; i!=n; ++i)
+		logY[i] = isUsed[i] ? log10(y[i]) : 0.0;
+	if(allPositive && guessMatrix != nullptr)
+	{
+		for(size_t t=0; t!=nTerms; ++t)
+		{
+			terms[t] = 0.0;
+			for(size_t i=0; i!=n; ++i)
+				terms[t] += guessMatrix[t*n + i] * logY[i];
+		}
+	}
+	else {
+		logLinearFit(terms, nTerms, _data->lg.data(), logY.data(), isUsed.data(), n, _data->normalMatrix, _data->powers);
+	}
+	
+	switch(nTerms)
+	{
+		case 1: levenbergMarquardt<1>(terms, _data->lg.data(), y, n); break;
+		case 2: levenbergMarquardt<2>(terms, _data->lg.data(), y, n); break;
+		case 3: levenbergMarquardt<3>(terms, _data->lg.data(), y, n); break;
+		case 4: levenbergMarquardt<4>(terms, _data->lg.data(), y, n); break;
+		default:
+			throw std::runtime_error("Invalid number of terms for fixed-size log-polynomial fit");
+	}
+	
+	terms[0] = isNegative ? -exp10(terms[0]) : exp10(terms[0]);
+}
+
+void NonLinearPowerLawFitter::fitWithGSL(ao::uvector<double>& terms, size_t nTerms)
+{
+	terms.assign(nTerms, 0.0);
+	
 	double a = 1.0, b = 0.0;
 	Fit(a, b);
 	bool isNegative = b < 0.0;
@@ -12,6 +12,9 @@
  * all values to be positive, which is not the case for e.g. spectral
  * energy distributions, because these have noise.
  * This fitter does not have this requirement.
+ *
+ * A fitter can be reused for many fits with Clear(): it keeps its workspace,
+ * including the GSL solver, between fits.
  */
 class NonLinearPowerLawFitter
 {
@@ -22,13 +25,35 @@ public:
 	
 	void AddDataPoint(double x, double y);
 	
+	/**
+	 * Remove the data points, so that a new fit can be made.
+	 */
+	void Clear();
+	
 	void Fit(double& exponent, double& factor);
 	
 	void Fit(double& a, double& b, double& c);
 	
+	/**
+	 * Fit a log-polynomial y = t_0 10^(t_1 lg + t_2 lg^2 + ...), with lg = log10(x),
+	 * to the data points. Up to four terms are fitted with a closed-form initial
+	 * guess and a fixed-size Levenberg-Marquardt solver; more terms are fitted
+	 * with GSL.
+	 */
 	void Fit(ao::uvector<double>& terms, size_t nTerms);
 	void FitStable(ao::uvector<double>& terms, size_t nTerms);
 	
+	/**
+	 * Fit log-polynomials to many spectra that are sampled at the same x values,
+	 * such as the pixels of the channel images. The data points of the fitter are
+	 * not used. The initial guesses of the batch are calculated with a single
+	 * matrix.
+	 * @param terms Output array of @p count x @p nTerms values.
+	 * @param spectra Array of @p count x @p n values: spectrum i starts at spectra[i * n].
+	 * @param xValues The @p n x values of the spectra.
+	 */
+	void FitBatch(double* terms, const double* spectra, size_t count, const double* xValues, size_t n, size_t nTerms);
+	
 	void FastFit(double& exponent, double& factor);
 	
 	static double Evaluate(double x, const ao::uvector<double>& terms, double referenceFrequencyHz=1.0);
@@ -51,6 +76,16 @@ public:
 private:
 	void fit_implementation(ao::uvector<double>& terms, size_t nTerms);
 	
+	void fitWithGSL(ao::uvector<double>& terms, size_t nTerms);
+	
+	/**
+	 * Fit the log-polynomial to the points in the lg and y workspace. The values
+	 * in y are overwritten.
+	 * @param guessMatrix Matrix for the initial guess, or nullptr to calculate
+	 * the guess for these points.
+	 */
+	void fitLogPolynomial(double* terms, size_t nTerms, const double* guessMatrix);
+	
 	std::unique_ptr<class NLPLFitterData> _data;
 };
 
@@ -1,16 +1,276 @@
 #include "rmsimage.h"
 #include "modelrenderer.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <functional>
+#include <limits>
+#include <type_traits>
+
+namespace {
+	/**
+	 * Recursive approximation of a normalized Gaussian, following van Vliet, Young
+	 * & Verbeek (1998). A causal and an anti-causal third-order filter are applied
+	 * after each other. The poles for sigma=2 are scaled such that the variance of
+	 * the filter matches the requested sigma exactly. The image is assumed to be
+	 * zero outside its borders; the state at the end of a line for the anti-causal
+	 * pass is calculated with a precalculated matrix, similar to Triggs & Sdika (2006).
+	 */
+	class RecursiveGaussian
+	{
+	public:
+		explicit RecursiveGaussian(double sigma)
+		{
+			// Find the scale q for which the poles d^(1/q) give the right variance
+			double qLow = 0.0, qHigh = std::max(1.0, sigma);
+			while(variance(qHigh) < sigma * sigma)
+				qHigh *= 2.0;
+			for(size_t i=0; i!=100; ++i)
+			{
+				const double q = 0.5 * (qLow + qHigh);
+				if(variance(q) < sigma * sigma)
+					qLow = q;
+				else
+					qHigh = q;
+			}
+			const double q = 0.5 * (qLow + qHigh);
+			const std::complex<double> d1 = std::pow(complexPole(), 1.0/q);
+			const double
+				d3 = std::pow(realPole(), 1.0/q),
+				m2 = std::norm(d1);
+			// Coefficients of 1 / ((1 - z^-1/d1) (1 - z^-1/d1*) (1 - z^-1/d3))
+			_c[0] = 2.0 * d1.real() / m2 + 1.0 / d3;
+			_c[1] = -(1.0 / m2 + 2.0 * d1.real() / (m2 * d3));
+			_c[2] = 1.0 / (m2 * d3);
+			_b = 1.0 - (_c[0] + _c[1] + _c[2]);
+			initializeEndMatrix();
+		}
+
+		/**
+		 * Filter @p count parallel lines of length @p n in place. Element i of line j
+		 * is stored at data[i*stride + j].
+		 */
+		void Filter(double* data, size_t n, size_t count, size_t stride) const
+		{
+			if(n == 0)
+				return;
+			const ao::uvector<double> zeros(count, 0.0);
+			const double c0 = _c[0], c1 = _c[1], c2 = _c[2], b = _b;
+			for(size_t i=0; i!=n; ++i)
+			{
+				double* cur = &data[i * stride];
+				const double
+					*p1 = (i >= 1) ? &data[(i-1) * stride] : zeros.data(),
+					*p2 = (i >= 2) ? &data[(i-2) * stride] : zeros.data(),
+					*p3 = (i >= 3) ? &data[(i-3) * stride] : zeros.data();
+				for(size_t j=0; j!=count; ++j)
+					cur[j] = b * cur[j] + c0 * p1[j] + c1 * p2[j] + c2 * p3[j];
+			}
+
+			// Anti-causal outputs just beyond the end of the lines
+			ao::uvector<double> end(3 * count, 0.0);
+			for(size_t m=0; m!=3 && m<n; ++m)
+			{
+				const double* w = &data[(n-1-m) * stride];
+				for(size_t k=0; k!=3; ++k)
+				{
+					double* e = &end[k * count];
+					for(size_t j=0; j!=count; ++j)
+						e[j] += _endMatrix[k][m] * w[j];
+				}
+			}
+			for(size_t i=n; i!=0; --i)
+			{
+				double* cur = &data[(i-1) * stride];
+				const double
+					*n1 = (i < n) ? &data[i * stride] : &end[(i-n) * count],
+					*n2 = (i+1 < n) ? &data[(i+1) * stride] : &end[(i+1-n) * count],
+					*n3 = (i+2 < n) ? &data[(i+2) * stride] : &end[(i+2-n) * count];
+				for(size_t j=0; j!=count; ++j)
+					cur[j] = b * cur[j] + c0 * n1[j] + c1 * n2[j] + c2 * n3[j];
+			}
+		}
+
+	private:
+		static std::complex<double> complexPole() { return std::complex<double>(1.41650, 1.00829); }
+		static double realPole() { return 1.86543; }
+
+		/**
+		 * Variance of the combined causal and anti-causal filter with poles d^(1/q):
+		 * each pole d contributes 2d/(d-1)^2.
+		 */
+		static double variance(double q)
+		{
+			const std::complex<double> d1 = std::pow(complexPole(), 1.0/q);
+			const double d3 = std::pow(realPole(), 1.0/q);
+			return 2.0 * (2.0 * (d1 / ((d1 - 1.0) * (d1 - 1.0))).real() + d3 / ((d3 - 1.0) * (d3 - 1.0)));
+		}
+
+		/**
+		 * Calculates how the last three causal outputs of a line determine the first
+		 * three anti-causal outputs beyond its end, by running the filters over
+		 * zeros until the response has decayed.
+		 */
+		void initializeEndMatrix()
+		{
+			for(size_t m=0; m!=3; ++m)
+			{
+				std::vector<double> w(3, 0.0);
+				w[2-m] = 1.0;
+				while(std::fabs(w[w.size()-1]) + std::fabs(w[w.size()-2]) + std::fabs(w[w.size()-3]) > 1e-20 && w.size() < 1000000)
+				{
+					const size_t s = w.size();
+					w.push_back(_c[0] * w[s-1] + _c[1] * w[s-2] + _c[2] * w[s-3]);
+				}
+				w.insert(w.end(), 3, 0.0);
+				for(size_t i=w.size()-3; i!=3; --i)
+				{
+					const size_t t = i-1;
+					w[t] = _b * w[t] + _c[0] * w[t+1] + _c[1] * w[t+2] + _c[2] * w[t+3];
+				}
+				for(size_t k=0; k!=3; ++k)
+					_endMatrix[k][m] = w[3+k];
+			}
+		}
+
+		double _b, _c[3];
+		// _endMatrix[k][m] is the contribution of causal output n-1-m to anti-causal output n+k
+		double _endMatrix[3][3];
+	};
+
+	template<typename Compare>
+	class SlidingExtremumFilter
+	{
+	public:
+		/**
+		 * Calculate the extremum over [i-h, i+h) for @p count parallel lines of length
+		 * @p n. Element i of line j is stored at data[i*stride + j].
+		 */
+		static void Filter(double* output, const double* input, size_t n, size_t count, size_t stride, size_t h)
+		{
+			const Compare compare;
+			const double outside = std::is_same<Compare, std::less<double>>::value ?
+				std::numeric_limits<double>::max() : std::numeric_limits<double>::lowest();
+			// The line is extended with h 'outside' values at both sides and divided
+			// in blocks of 2h. For every position, the prefix holds the extremum from
+			// the start of its block, and the suffix the extremum till the end of its block.
+			const size_t blockSize = 2*h, paddedSize = n + 2*h;
+			ao::uvector<double> prefix(paddedSize * count), suffix(paddedSize * count);
+			for(size_t p=0; p!=paddedSize; ++p)
+			{
+				const bool isStart = p % blockSize == 0;
+				step(compare, &prefix[p * count], isStart ? nullptr : &prefix[(p-1) * count],
+					(p >= h && p < h + n) ? &input[(p-h) * stride] : nullptr, count, outside);
+			}
+			for(size_t p=paddedSize; p!=0; --p)
+			{
+				const bool isEnd = p % blockSize == 0 || p == paddedSize;
+				step(compare, &suffix[(p-1) * count], isEnd ? nullptr : &suffix[p * count],
+					(p-1 >= h && p-1 < h + n) ? &input[(p-1-h) * stride] : nullptr, count, outside);
+			}
+			for(size_t i=0; i!=n; ++i)
+			{
+				const double
+					*suf = &suffix[i * count],
+					*pre = &prefix[(i + blockSize - 1) * count];
+				double* out = &output[i * stride];
+				for(size_t j=0; j!=count; ++j)
+					out[j] = select(compare, suf[j], pre[j]);
+			}
+		}
+	private:
+		static double select(const Compare& compare, double a, double b)
+		{
+			return compare(a, b) ? a : b;
+		}
+
+		/**
+		 * Sets dest to the extremum of previous and input. Either may be null, in which
+		 * case it is left out; a position outside the line is set to the outside value.
+		 */
+		static void step(const Compare& compare, double* dest, const double* previous, const double* input, size_t count, double outside)
+		{
+			if(input == nullptr)
+			{
+				for(size_t j=0; j!=count; ++j)
+					dest[j] = previous == nullptr ? outside : previous[j];
+			}
+			else if(previous == nullptr)
+			{
+				for(size_t j=0; j!=count; ++j)
+					dest[j] = input[j];
+			}
+			else {
+				for(size_t j=0; j!=count; ++j)
+					dest[j] = select(compare, previous[j], input[j]);
+			}
+		}
+	};
+
+	// Number of columns that are processed together in the vertical passes
+	const size_t columnStripSize = 64;
+}
 
 void RMSImage::Make(Image& rmsOutput, const Image& inputImage, double windowSize, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM)
+{
+	const long double
+		sigmaMaj = beamMaj * windowSize / (2.0L * sqrtl(2.0L * logl(2.0L))),
+		sigmaMin = beamMin * windowSize / (2.0L * sqrtl(2.0L * logl(2.0L)));
+	// With a position angle of zero, the major axis is along the m direction.
+	const bool
+		isCircular = beamMaj == beamMin,
+		isMajorAlongM = std::fabs(std::sin(double(beamPA))) < 1e-6,
+		isMajorAlongL = std::fabs(std::cos(double(beamPA))) < 1e-6;
+	const double
+		sigmaX = (isMajorAlongL ? sigmaMaj : sigmaMin) / pixelScaleL,
+		sigmaY = (isMajorAlongL ? sigmaMin : sigmaMaj) / pixelScaleM;
+	// The recursive filters are inaccurate for small windows
+	if(!(isCircular || isMajorAlongM || isMajorAlongL) || !(sigmaX >= 1.0 && sigmaY >= 1.0))
+	{
+		makeWithFFT(rmsOutput, inputImage, windowSize, beamMaj, beamMin, beamPA, pixelScaleL, pixelScaleM);
+		return;
+	}
+
+	const size_t width = inputImage.Width(), height = inputImage.Height();
+	rmsOutput = Image(width, height, inputImage.Allocator());
+	double* data = rmsOutput.data();
+	for(size_t i=0; i!=rmsOutput.size(); ++i)
+		data[i] = inputImage[i] * inputImage[i];
+
+	const RecursiveGaussian filterX(sigmaX), filterY(sigmaY);
+	ThreadPool pool;
+	pool.for_each_range(height, 1, [&](size_t start, size_t end) {
+		for(size_t y=start; y!=end; ++y)
+			filterX.Filter(&data[y * width], width, 1, 1);
+	});
+	pool.for_each_range(width, columnStripSize, [&](size_t start, size_t end) {
+		filterY.Filter(&data[start], height, end - start, width);
+	});
+
+	// Filtering a constant image gives the weight of the window that falls inside the image
+	ao::uvector<double> weightX(width, 1.0), weightY(height, 1.0);
+	filterX.Filter(weightX.data(), width, 1, 1);
+	filterY.Filter(weightY.data(), height, 1, 1);
+	for(size_t y=0; y!=height; ++y)
+	{
+		double* row = &data[y * width];
+		for(size_t x=0; x!=width; ++x)
+			row[x] = std::sqrt(std::max(0.0, row[x] / (weightX[x] * weightY[y])));
+	}
+}
+
+void RMSImage::makeWithFFT(Image& rmsOutput, const Image& inputImage, double windowSize, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM)
 {
 	Image image(inputImage);
 	rmsOutput = Image(image.Width(), image.Height(), 0.0, image.Allocator());
-	
+
 	for(double& val : image)
 		val *= val;
-	
+
 	ModelRenderer::Restore(rmsOutput.data(), image.data(), image.Width(), image.Height(), beamMaj*windowSize, beamMin*windowSize, beamPA, pixelScaleL, pixelScaleM);
-	
+
 	double s = sqrt(2.0 * M_PI);
 	const long double sigmaMaj = beamMaj / (2.0L * sqrtl(2.0L * logl(2.0L)));
 	const long double sigmaMin = beamMin / (2.0L * sqrtl(2.0L * logl(2.0L)));
@@ -19,35 +279,35 @@ void RMSImage::Make(Image& rmsOutput, const Image& inputImage, double windowSize
 		val = sqrt(val * norm);
 }
 
-void RMSImage::SlidingMinimum(Image& output, const Image& input, size_t windowSize)
+template<typename Compare>
+void RMSImage::slidingExtremum(Image& output, const Image& input, size_t windowSize)
 {
-	const size_t width = input.Width();
-	output = Image(width, input.Height(), input.Allocator());
-	Image temp(output);
-	for(size_t y=0; y!=input.Height(); ++y)
+	const size_t width = input.Width(), height = input.Height(), h = windowSize/2;
+	if(h == 0)
 	{
-		double *outRowptr = &temp[y*width];
-		const double* inRowptr = &input[y*width];
-		for(size_t x=0; x!=width; ++x)
-		{
-			size_t left = std::max(x, windowSize/2) - windowSize/2;
-			size_t right = std::min(x, width-windowSize/2) + windowSize/2;
-			outRowptr[x] = *std::min_element(inRowptr + left, inRowptr + right);
-		}
-	}
-	for(size_t x=0; x!=width; ++x)
-	{
-		ao::uvector<double> vals;
-		for(size_t y=0; y!=input.Height(); ++y)
-		{
-			size_t top = std::max(y, windowSize/2) - windowSize/2;
-			size_t bottom = std::min(y, input.Height()-windowSize/2) + windowSize/2;
-			vals.clear();
-			for(size_t winY=top; winY!=bottom; ++winY)
-				vals.push_back(temp[winY*width + x]);
-			output[y*width + x] = *std::min_element(vals.begin(), vals.end());
-		}
+		output = input;
+		return;
 	}
+	output = Image(width, height, input.Allocator());
+	Image temp(output);
+	ThreadPool pool;
+	pool.for_each_range(height, 1, [&](size_t start, size_t end) {
+		for(size_t y=start; y!=end; ++y)
+			SlidingExtremumFilter<Compare>::Filter(&temp[y * width], &input[y * width], width, 1, 1, h);
+	});
+	pool.for_each_range(width, columnStripSize, [&](size_t start, size_t end) {
+		SlidingExtremumFilter<Compare>::Filter(&output[start], &temp[start], height, end - start, width, h);
+	});
+}
+
+void RMSImage::SlidingMinimum(Image& output, const Image& input, size_t windowSize)
+{
+	slidingExtremum<std::less<double>>(output, input, windowSize);
+}
+
+void RMSImage::SlidingMaximum(Image& output, const Image& input, size_t windowSize)
+{
+	slidingExtremum<std::greater<double>>(output, input, windowSize);
 }
 
 void RMSImage::MakeWithNegativityLimit(Image& rmsOutput, const Image& inputImage, double windowSize, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM)
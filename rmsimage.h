@@ -6,20 +6,34 @@
 class RMSImage
 {
 public:
+	/**
+	 * Make an image with the local RMS, calculated over a Gaussian window of
+	 * @p windowSize times the given beam. Axis-aligned windows are calculated with
+	 * recursive (Young-van Vliet) Gaussian filters, whose cost is independent of
+	 * the window size. At the image borders, the RMS is calculated over the part of
+	 * the window inside the image. Other windows are convolved with an FFT.
+	 */
 	static void Make(Image& rmsOutput, const Image& inputImage, double windowSize, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM);
-	
+
+	/**
+	 * Calculate the minimum over a square window of windowSize x windowSize pixels
+	 * for every pixel, using the van Herk-Gil-Werman algorithm. This takes three
+	 * comparisons per pixel per dimension, independent of the window size.
+	 */
 	static void SlidingMinimum(Image& output, const Image& input, size_t windowSize);
-	
-	static void SlidingMaximum(Image& output, const Image& input, size_t windowSize)
-	{
-		Image flipped(input);
-		flipped.Negate();
-		SlidingMinimum(output, flipped, windowSize);
-		output.Negate();
-	}
-	
+
+	/**
+	 * Like SlidingMinimum(), but calculates the maximum.
+	 */
+	static void SlidingMaximum(Image& output, const Image& input, size_t windowSize);
+
 	static void MakeWithNegativityLimit(Image& rmsOutput, const Image& inputImage, double windowSize, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM);
+
+private:
+	static void makeWithFFT(Image& rmsOutput, const Image& inputImage, double windowSize, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM);
+
+	template<typename Compare>
+	static void slidingExtremum(Image& output, const Image& input, size_t windowSize);
 };
 
 #endif
-
@@ -2,11 +2,22 @@
 
 #include "../msproviders/averagingmsrowprovider.h"
 #include "../msproviders/directmsrowprovider.h"
+#include "../msproviders/syntheticms.h"
+
+#include "../banddata.h"
 
 #include <boost/filesystem/operations.hpp>
 
+#include <casacore/tables/Tables/ArrayColumn.h>
+#include <casacore/tables/Tables/ScalarColumn.h>
+
 #include "../wsclean/logger.h"
 
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <vector>
+
 BOOST_AUTO_TEST_SUITE(baseline_dependent_averaging)
 
 BOOST_AUTO_TEST_CASE( noAveraging )
@@ -74,6 +85,226 @@ BOOST_AUTO_TEST_CASE( noAveraging )
 	}
 }
 
+namespace {
+	/** The values of a row as read from, or expected of, the measurement set. */
+	struct AveragingTestRow
+	{
+		std::vector<std::complex<float>> data, model;
+		std::vector<bool> flags;
+		std::vector<float> weights;
+		double uvw[3];
+	};
+
+	/**
+	 * The weighted average of consecutive rows of a baseline, as the averaging
+	 * provider should calculate it. A sample only contributes when it is unflagged,
+	 * and the average is flagged when nothing contributed.
+	 */
+	AveragingTestRow averageRows(const std::vector<AveragingTestRow>& rows, size_t start, size_t end)
+	{
+		const size_t n = rows[start].data.size();
+		std::vector<std::complex<double>> dataSum(n), modelSum(n);
+		std::vector<double> weightSum(n, 0.0);
+		double uvw[3] = {0.0, 0.0, 0.0}, uvwSum[3] = {0.0, 0.0, 0.0}, uvwWeight = 0.0;
+		for(size_t r=start; r!=end; ++r)
+		{
+			double rowWeight = 0.0;
+			for(size_t i=0; i!=n; ++i)
+			{
+				const double weight = rows[r].flags[i] ? 0.0 : rows[r].weights[i];
+				dataSum[i] += std::complex<double>(rows[r].data[i]) * weight;
+				modelSum[i] += std::complex<double>(rows[r].model[i]) * weight;
+				weightSum[i] += weight;
+				rowWeight += weight;
+			}
+			rowWeight /= double(n);
+			for(size_t i=0; i!=3; ++i)
+			{
+				uvw[i] += rows[r].uvw[i] * rowWeight;
+				uvwSum[i] += rows[r].uvw[i];
+			}
+			uvwWeight += rowWeight;
+		}
+		AveragingTestRow average;
+		for(size_t i=0; i!=n; ++i)
+		{
+			const double factor = weightSum[i] == 0.0 ? 0.0 : 1.0 / weightSum[i];
+			average.data.push_back(std::complex<float>(dataSum[i] * factor));
+			average.model.push_back(std::complex<float>(modelSum[i] * factor));
+			average.flags.push_back(weightSum[i] == 0.0);
+			average.weights.push_back(weightSum[i]);
+		}
+		for(size_t i=0; i!=3; ++i)
+			average.uvw[i] = uvwWeight == 0.0 ? uvwSum[i] / double(end - start) : uvw[i] / uvwWeight;
+		return average;
+	}
+}
+
+BOOST_AUTO_TEST_CASE( synthetic_reference )
+{
+	Logger::SetVerbosity(Logger::QuietVerbosity);
+	const boost::filesystem::path directory =
+		boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("wsctest-averaging-%%%%-%%%%");
+	boost::filesystem::create_directory(directory);
+	const std::string filename = (directory / "synthetic.ms").string();
+	SyntheticMS::Setup setup;
+	setup.antennaCount = 7;
+	setup.channelCount = 3;
+	setup.timestepCount = 9;
+	setup.sourceCount = 3;
+	setup.noiseStdDev = 0.5;
+	setup.temporaryDirectory = directory.string();
+	{
+		SyntheticMS synthetic(setup);
+		synthetic.WriteMeasurementSet(filename);
+	}
+	const size_t nTimesteps = setup.timestepCount, n = 4 * setup.channelCount;
+
+	// Give the rows a model, varying weights and flags, and place the second
+	// antenna on top of the first to make a zero-length baseline.
+	std::map<std::pair<size_t, size_t>, std::vector<AveragingTestRow>> inputRows;
+	ao::uvector<double> positions(setup.antennaCount * 3);
+	double smallestWavelength;
+	{
+		casacore::MeasurementSet ms(filename, casacore::Table::Update);
+		casacore::ArrayColumn<double> positionColumn(ms.antenna(), casacore::MSAntenna::columnName(casacore::MSAntennaEnums::POSITION));
+		positionColumn.put(1, positionColumn(0));
+		for(size_t a=0; a!=setup.antennaCount; ++a)
+		{
+			const casacore::Array<double> position = positionColumn(a);
+			std::copy(position.data(), position.data() + 3, &positions[a * 3]);
+		}
+		smallestWavelength = BandData(ms.spectralWindow()).SmallestWavelength();
+
+		casacore::ROScalarColumn<int>
+			antenna1Column(ms, casacore::MS::columnName(casacore::MSMainEnums::ANTENNA1)),
+			antenna2Column(ms, casacore::MS::columnName(casacore::MSMainEnums::ANTENNA2));
+		casacore::ROArrayColumn<double> uvwColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::UVW));
+		casacore::ROArrayColumn<casacore::Complex> dataColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::DATA));
+		casacore::ArrayColumn<casacore::Complex> modelColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::MODEL_DATA));
+		casacore::ArrayColumn<bool> flagColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::FLAG));
+		casacore::ArrayColumn<float> weightColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::WEIGHT_SPECTRUM));
+		const casacore::IPosition shape(2, 4, setup.channelCount);
+		casacore::Array<casacore::Complex> data(shape), model(shape);
+		casacore::Array<bool> flags(shape);
+		casacore::Array<float> weights(shape);
+		for(size_t row=0; row!=ms.nrow(); ++row)
+		{
+			AveragingTestRow testRow;
+			dataColumn.get(row, data);
+			const casacore::Array<double> uvw = uvwColumn(row);
+			std::copy(uvw.data(), uvw.data() + 3, testRow.uvw);
+			for(size_t i=0; i!=n; ++i)
+			{
+				model.data()[i] = data.data()[i] * 0.5f + std::complex<float>(0.1f * i, 0.01f * row);
+				// Every sample of baseline (0, 2) is flagged in the first timesteps
+				flags.data()[i] = (row * 5 + i) % 7 == 0 ||
+					(antenna1Column(row) == 0 && antenna2Column(row) == 2 && row < 3 * ms.nrow() / nTimesteps);
+				weights.data()[i] = 0.5f + 0.25f * float((row * 3 + i) % 4);
+				testRow.data.push_back(data.data()[i]);
+				testRow.model.push_back(model.data()[i]);
+				testRow.flags.push_back(flags.data()[i]);
+				testRow.weights.push_back(weights.data()[i]);
+			}
+			modelColumn.put(row, model);
+			flagColumn.put(row, flags);
+			weightColumn.put(row, weights);
+			inputRows[std::make_pair(antenna1Column(row), antenna2Column(row))].push_back(testRow);
+		}
+	}
+
+	// The averaging factor of a baseline is the number of integrations in which
+	// the longest wavelength turns by less than the given number of wavelengths.
+	// The number of wavelengths is chosen such that factors between one and
+	// the number of timesteps occur.
+	const double integrationTime = setup.integrationTime / (24.0 * 60.0 * 60.0);
+	std::map<std::pair<size_t, size_t>, double> wavelengthsPerIntegration;
+	std::vector<double> sortedWavelengths;
+	for(const auto& baseline : inputRows)
+	{
+		const double* pos1 = &positions[baseline.first.first * 3];
+		const double* pos2 = &positions[baseline.first.second * 3];
+		const double
+			dx = pos1[0] - pos2[0],
+			dy = pos1[1] - pos2[1],
+			dz = pos1[2] - pos2[2],
+			dist = std::sqrt(dx*dx + dy*dy + dz*dz);
+		wavelengthsPerIntegration[baseline.first] = 2.0 * M_PI * dist / smallestWavelength * integrationTime;
+		sortedWavelengths.push_back(wavelengthsPerIntegration[baseline.first]);
+	}
+	std::sort(sortedWavelengths.begin(), sortedWavelengths.end());
+	const double nWavelengthsAveraging = sortedWavelengths[sortedWavelengths.size() / 2] * 3.5;
+	std::map<std::pair<size_t, size_t>, size_t> averagingFactors;
+	for(const auto& baseline : wavelengthsPerIntegration)
+	{
+		if(baseline.second * nTimesteps <= nWavelengthsAveraging)
+			averagingFactors[baseline.first] = nTimesteps;
+		else
+			averagingFactors[baseline.first] = std::max<size_t>(size_t(std::floor(nWavelengthsAveraging / baseline.second)), 1);
+	}
+	BOOST_CHECK_EQUAL(averagingFactors[std::make_pair(0, 1)], nTimesteps);
+
+	std::map<std::pair<size_t, size_t>, std::vector<AveragingTestRow>> outputRows;
+	{
+		MSSelection selection;
+		std::map<size_t, size_t> dataDescIds;
+		dataDescIds.insert(std::make_pair(0, 0));
+		AveragingMSRowProvider provider(nWavelengthsAveraging, filename, selection, dataDescIds, "DATA", true);
+		const casacore::IPosition shape(2, 4, setup.channelCount);
+		MSRowProvider::DataArray data(shape), model(shape);
+		MSRowProvider::FlagArray flags(shape);
+		MSRowProvider::WeightArray weights(shape);
+		while(!provider.AtEnd())
+		{
+			AveragingTestRow row;
+			uint32_t dataDescId, antenna1, antenna2;
+			provider.ReadData(data, flags, weights, row.uvw[0], row.uvw[1], row.uvw[2], dataDescId, antenna1, antenna2);
+			provider.ReadModel(model);
+			BOOST_CHECK_EQUAL(dataDescId, 0);
+			row.data.assign(data.data(), data.data() + n);
+			row.model.assign(model.data(), model.data() + n);
+			row.flags.assign(flags.data(), flags.data() + n);
+			row.weights.assign(weights.data(), weights.data() + n);
+			outputRows[std::make_pair(antenna1, antenna2)].push_back(row);
+			provider.NextRow();
+		}
+	}
+
+	size_t nAveragedBaselines = 0, nUnaveragedBaselines = 0;
+	for(const auto& baseline : inputRows)
+	{
+		const std::vector<AveragingTestRow>& input = baseline.second;
+		const std::vector<AveragingTestRow>& output = outputRows[baseline.first];
+		const size_t factor = averagingFactors[baseline.first];
+		if(factor == 1)
+			++nUnaveragedBaselines;
+		else if(factor < nTimesteps)
+			++nAveragedBaselines;
+		BOOST_REQUIRE_EQUAL(output.size(), (nTimesteps + factor - 1) / factor);
+		for(size_t r=0; r!=output.size(); ++r)
+		{
+			// Rows that are not averaged are passed on as they are
+			const AveragingTestRow expected = factor == 1 ?
+				input[r] : averageRows(input, r * factor, std::min((r+1) * factor, nTimesteps));
+			for(size_t i=0; i!=n; ++i)
+			{
+				const float tolerance = 1e-5 * (1.0 + std::abs(expected.data[i]));
+				BOOST_CHECK_SMALL(std::abs(output[r].data[i] - expected.data[i]), tolerance);
+				BOOST_CHECK_SMALL(std::abs(output[r].model[i] - expected.model[i]), tolerance);
+				BOOST_CHECK_EQUAL(output[r].flags[i], expected.flags[i]);
+				BOOST_CHECK_CLOSE_FRACTION(output[r].weights[i], expected.weights[i], 1e-5);
+			}
+			for(size_t i=0; i!=3; ++i)
+				BOOST_CHECK_SMALL(output[r].uvw[i] - expected.uvw[i], 1e-6 * (1.0 + std::fabs(expected.uvw[i])));
+		}
+	}
+	// Test both the rows that are passed on and the averaging over part of the observation
+	BOOST_CHECK_GT(nUnaveragedBaselines, 0);
+	BOOST_CHECK_GT(nAveragedBaselines, 0);
+
+	boost::filesystem::remove_all(directory);
+}
+
 /*
 BOOST_AUTO_TEST_CASE( extremeAveraging )
 {
@@ -0,0 +1,166 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../lofar/beamgridevaluator.h"
+#include "../units/imagecoordinates.h"
+
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(beam_grid_evaluator)
+
+/**
+ * Gaussian beams around a fixed ITRF direction, with a width and
+ * polarization leakage that differ per station.
+ */
+class AnalyticBeamModel : public BeamModel
+{
+public:
+	AnalyticBeamModel() : _evaluationCount(0) { }
+	
+	virtual size_t StationCount() const override { return 5; }
+	
+	virtual void Response(MC2x2* gains, double time, double frequency, const double* itrfDirection) const override
+	{
+		++_evaluationCount;
+		const double pointing[3] = { 0.6, 0.0, 0.8 };
+		const double distance = 1.0 - (pointing[0]*itrfDirection[0] + pointing[1]*itrfDirection[1] + pointing[2]*itrfDirection[2]);
+		for(size_t a=0; a!=StationCount(); ++a)
+		{
+			const double g = exp(-distance * frequency * 1e-6 * (1.0 + 0.1*a));
+			gains[a][0] = g;
+			gains[a][1] = std::complex<double>(0.0, 0.01 * a * g);
+			gains[a][2] = std::complex<double>(0.02 * a * g, 0.0);
+			gains[a][3] = 0.5 * g;
+		}
+	}
+	
+	size_t EvaluationCount() const { return _evaluationCount; }
+	
+private:
+	mutable std::atomic<size_t> _evaluationCount;
+};
+
+static const size_t width = 16, height = 12;
+static const double pixelSize = 0.02, ra = 0.3, dec = 0.9, frequency = 150e6;
+
+static void rotationZ(double angle, double* matrix)
+{
+	const double m[9] = {
+		cos(angle), -sin(angle), 0.0,
+		sin(angle), cos(angle), 0.0,
+		0.0, 0.0, 1.0 };
+	std::copy_n(m, 9, matrix);
+}
+
+static void checkSnapshot(BeamGridEvaluator& evaluator, const double* rotation, const double* reference)
+{
+	AnalyticBeamModel model;
+	const double weights[5] = { 1.0, 4.0, 0.0, 9.0, 1.0 };
+	std::vector<double> images[8];
+	double* imagePtrs[8];
+	for(size_t i=0; i!=8; ++i)
+	{
+		images[i].assign(width*height, 0.0);
+		imagePtrs[i] = images[i].data();
+	}
+	evaluator.MakeSnapshot(imagePtrs, weights, 0.0, frequency, rotation, reference);
+	
+	MC2x2 inverseCentral[5];
+	if(reference != nullptr)
+	{
+		model.Response(inverseCentral, 0.0, frequency, reference);
+		for(MC2x2& m : inverseCentral)
+			BOOST_REQUIRE(m.Invert());
+	}
+	for(size_t y=0; y!=height; ++y)
+	{
+		for(size_t x=0; x!=width; ++x)
+		{
+			double l, m, pixelRA, pixelDec;
+			ImageCoordinates::XYToLM<double>(x, y, pixelSize, pixelSize, width, height, l, m);
+			ImageCoordinates::LMToRaDec(l, m, ra, dec, pixelRA, pixelDec);
+			const double j2000[3] = { cos(pixelDec)*cos(pixelRA), cos(pixelDec)*sin(pixelRA), sin(pixelDec) };
+			double itrf[3];
+			for(size_t i=0; i!=3; ++i)
+				itrf[i] = rotation[i*3]*j2000[0] + rotation[i*3+1]*j2000[1] + rotation[i*3+2]*j2000[2];
+			MC2x2 gains[5];
+			model.Response(gains, 0.0, frequency, itrf);
+			MC2x2 expected = MC2x2::Zero();
+			for(size_t a=0; a!=5; ++a)
+			{
+				if(reference != nullptr)
+				{
+					MC2x2 diffBeam;
+					MC2x2::ATimesB(diffBeam, inverseCentral[a], gains[a]);
+					gains[a] = diffBeam;
+				}
+				expected.AddWithFactorAndAssign(gains[a], sqrt(weights[a]) / 7.0);
+			}
+			for(size_t p=0; p!=4; ++p)
+			{
+				BOOST_CHECK_SMALL(images[p*2][y*width + x] - expected[p].real(), 1e-9);
+				BOOST_CHECK_SMALL(images[p*2+1][y*width + x] - expected[p].imag(), 1e-9);
+			}
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE( snapshot )
+{
+	AnalyticBeamModel model;
+	BeamGridEvaluator evaluator(model, width, height, pixelSize, pixelSize, ra, dec, 0.0, 0.0);
+	double rotation[9];
+	rotationZ(0.2, rotation);
+	checkSnapshot(evaluator, rotation, nullptr);
+}
+
+BOOST_AUTO_TEST_CASE( differential_snapshot )
+{
+	AnalyticBeamModel model;
+	BeamGridEvaluator evaluator(model, width, height, pixelSize, pixelSize, ra, dec, 0.0, 0.0);
+	double rotation[9];
+	rotationZ(-0.1, rotation);
+	const double reference[3] = { 0.8, 0.0, 0.6 };
+	checkSnapshot(evaluator, rotation, reference);
+}
+
+BOOST_AUTO_TEST_CASE( reuse )
+{
+	AnalyticBeamModel model;
+	BeamGridEvaluator evaluator(model, width, height, pixelSize, pixelSize, ra, dec, 0.0, 0.0);
+	evaluator.SetReuseTolerance(1e-3, 1024*1024);
+	const double weights[5] = { 1.0, 1.0, 1.0, 1.0, 1.0 };
+	std::vector<double> images(8*width*height);
+	double* imagePtrs[8];
+	for(size_t i=0; i!=8; ++i)
+		imagePtrs[i] = &images[i*width*height];
+	double rotation[9];
+	
+	rotationZ(0.0, rotation);
+	evaluator.MakeSnapshot(imagePtrs, weights, 0.0, frequency, rotation, nullptr);
+	BOOST_CHECK(!evaluator.IsReused());
+	BOOST_CHECK_EQUAL(model.EvaluationCount(), width*height);
+	const std::vector<double> first(images);
+	
+	double previousRotation[9];
+	std::copy_n(rotation, 9, previousRotation);
+	rotationZ(5e-4, rotation);
+	BOOST_CHECK_CLOSE_FRACTION(BeamGridEvaluator::RotationAngle(rotation, previousRotation), 5e-4, 1e-6);
+	evaluator.MakeSnapshot(imagePtrs, weights, 10.0, frequency, rotation, nullptr);
+	BOOST_CHECK(evaluator.IsReused());
+	BOOST_CHECK_EQUAL(model.EvaluationCount(), width*height);
+	for(size_t i=0; i!=images.size(); ++i)
+		BOOST_CHECK_EQUAL(images[i], first[i]);
+	
+	rotationZ(2e-3, rotation);
+	evaluator.MakeSnapshot(imagePtrs, weights, 20.0, frequency, rotation, nullptr);
+	BOOST_CHECK(!evaluator.IsReused());
+	BOOST_CHECK_EQUAL(model.EvaluationCount(), 2*width*height);
+	
+	evaluator.MakeSnapshot(imagePtrs, weights, 20.0, frequency*2.0, rotation, nullptr);
+	BOOST_CHECK(!evaluator.IsReused());
+	BOOST_CHECK_EQUAL(model.EvaluationCount(), 3*width*height);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
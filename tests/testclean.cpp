@@ -174,4 +174,24 @@ BOOST_AUTO_TEST_CASE( partialSubtractImageAVXPerformance )
 }
 #endif
 
+#if defined __AVX__ && !defined FORCE_NON_AVX
+BOOST_AUTO_TEST_CASE( partialSubtractImageAVXFloat )
+{
+	const size_t n = 37;
+	ao::uvector<float> imgA(n * n), imgB, psf(n * n);
+	std::mt19937 mt(42);
+	std::normal_distribution<float> dist(0.0, 1.0);
+	for(size_t i=0; i!=n*n; ++i)
+	{
+		imgA[i] = dist(mt);
+		psf[i] = dist(mt);
+	}
+	imgB = imgA;
+	SimpleClean::PartialSubtractImage(imgA.data(), n, n, psf.data(), n, n, 20, 15, 0.3, 0, n);
+	SimpleClean::PartialSubtractImageAVX(imgB.data(), n, n, psf.data(), n, n, 20, 15, 0.3, 0, n);
+	for(size_t i=0; i!=n*n; ++i)
+		BOOST_CHECK_CLOSE_FRACTION(imgA[i], imgB[i], 1e-5);
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
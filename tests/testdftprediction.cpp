@@ -0,0 +1,91 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../dftpredictionalgorithm.h"
+
+#include <cmath>
+#include <random>
+
+BOOST_AUTO_TEST_SUITE(dft_prediction)
+
+BOOST_AUTO_TEST_CASE( sincos )
+{
+	const size_t n = 1001;
+	std::vector<double> x(n), s(n), c(n);
+	std::mt19937 rng;
+	std::uniform_real_distribution<double> dist(-1e5, 1e5);
+	for(size_t i=0; i!=n; ++i)
+		x[i] = (i < 100) ? (double(i) - 50.0) * 0.1 : dist(rng);
+	DFTPredictionAlgorithm::SinCos(x.data(), s.data(), c.data(), n);
+	for(size_t i=0; i!=n; ++i)
+	{
+		BOOST_CHECK_SMALL(s[i] - std::sin(x[i]), 1e-11);
+		BOOST_CHECK_SMALL(c[i] - std::cos(x[i]), 1e-11);
+	}
+}
+
+static void checkRow(DFTPredictionInput& input, const BandData& band)
+{
+	DFTPredictionAlgorithm algorithm(input, band);
+	const double uvw[3][3] = { { 0.0, 0.0, 0.0 }, { 1200.0, -300.0, 15.0 }, { -25000.0, 40000.0, -120.0 } };
+	std::vector<MC2x2> row(band.ChannelCount());
+	for(size_t i=0; i!=3; ++i)
+	{
+		algorithm.PredictRow(row.data(), uvw[i][0], uvw[i][1], uvw[i][2], 0, 1);
+		for(size_t ch=0; ch!=band.ChannelCount(); ++ch)
+		{
+			const double lambda = band.ChannelWavelength(ch);
+			MC2x2 expected;
+			algorithm.Predict(expected, uvw[i][0]/lambda, uvw[i][1]/lambda, uvw[i][2]/lambda, ch, 0, 1);
+			for(size_t p=0; p!=4; ++p)
+			{
+				BOOST_CHECK_SMALL(std::abs(row[ch][p] - expected[p]), 1e-8);
+			}
+		}
+	}
+}
+
+static void addComponents(DFTPredictionInput& input, size_t channelCount, bool polarized)
+{
+	for(size_t i=0; i!=11; ++i)
+	{
+		const double l = 0.01 * (double(i) - 5.0), m = 0.003 * double(i);
+		std::complex<double> linear[4] = { double(i+1), 0.0, 0.0, double(i+1) };
+		if(polarized)
+		{
+			linear[1] = std::complex<double>(0.1, 0.2);
+			linear[2] = std::complex<double>(0.1, -0.2);
+		}
+		DFTPredictionComponent component(0.0, 0.0, l, m, linear, channelCount);
+		if(i % 4 == 3)
+			component.SetGaussianInfo(0.3, 1e-4 * double(i), 0.5e-4 * double(i));
+		input.AddComponent(component);
+	}
+}
+
+BOOST_AUTO_TEST_CASE( row_stokes_i )
+{
+	const size_t channelCount = 37;
+	std::vector<double> frequencies(channelCount);
+	for(size_t ch=0; ch!=channelCount; ++ch)
+		frequencies[ch] = 120e6 + ch * 195312.5;
+	BandData band;
+	band.Set(channelCount, frequencies.data());
+	DFTPredictionInput input;
+	addComponents(input, channelCount, false);
+	checkRow(input, band);
+}
+
+BOOST_AUTO_TEST_CASE( row_polarized_irregular )
+{
+	const size_t channelCount = 9;
+	std::vector<double> frequencies(channelCount);
+	for(size_t ch=0; ch!=channelCount; ++ch)
+		frequencies[ch] = 120e6 + ch * ch * 1e6;
+	BandData band;
+	band.Set(channelCount, frequencies.data());
+	DFTPredictionInput input;
+	addComponents(input, channelCount, true);
+	checkRow(input, band);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
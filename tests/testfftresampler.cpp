@@ -0,0 +1,147 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../fftresampler.h"
+
+#include "../uvector.h"
+
+#include <cmath>
+#include <complex>
+#include <limits>
+#include <random>
+
+BOOST_AUTO_TEST_SUITE(fft_resampler)
+
+/**
+ * Resamples the way FFTResampler did before the spectrum was resized in place:
+ * the input spectrum is copied into a separate, zeroed output spectrum.
+ */
+static void outOfPlaceResample(const double* input, size_t inWidth, size_t inHeight, double* output, size_t outWidth, size_t outHeight)
+{
+	const size_t
+		inStride = inWidth/2+1,
+		outStride = outWidth/2+1;
+	ao::uvector<double> inputCopy(input, input + inWidth*inHeight);
+	for(double& value : inputCopy)
+	{
+		if(!std::isfinite(value))
+			value = 0.0;
+	}
+	std::complex<double>
+		*fftData = reinterpret_cast<std::complex<double>*>(fftw_malloc(inStride*inHeight*sizeof(std::complex<double>))),
+		*newFftData = reinterpret_cast<std::complex<double>*>(fftw_malloc(outStride*outHeight*sizeof(std::complex<double>)));
+	fftw_plan forward = fftw_plan_dft_r2c_2d(inHeight, inWidth, inputCopy.data(), reinterpret_cast<fftw_complex*>(fftData), FFTW_ESTIMATE);
+	fftw_plan backward = fftw_plan_dft_c2r_2d(outHeight, outWidth, reinterpret_cast<fftw_complex*>(newFftData), output, FFTW_ESTIMATE);
+	fftw_execute(forward);
+
+	std::fill_n(newFftData, outStride*outHeight, std::complex<double>(0.0));
+	const size_t
+		minWidth = std::min(inWidth, outWidth),
+		minHeight = std::min(inHeight, outHeight),
+		minMidX = minWidth/2,
+		minMidY = minHeight/2;
+	const double factor = 1.0 / (minWidth*minHeight);
+	for(size_t y=0; y!=minHeight; ++y)
+	{
+		size_t oldY = y-minMidY + inHeight;
+		size_t newY = y-minMidY + outHeight;
+		if(oldY >= inHeight) oldY -= inHeight;
+		if(newY >= outHeight) newY -= outHeight;
+		for(size_t x=0; x!=minMidX; ++x)
+			newFftData[x + newY*outStride] = fftData[x + oldY*inStride] * factor;
+		if(inWidth >= outWidth)
+			newFftData[outWidth/2 + newY*outStride] = fftData[inWidth/2 + oldY*inStride] * factor;
+	}
+
+	fftw_execute(backward);
+	fftw_destroy_plan(forward);
+	fftw_destroy_plan(backward);
+	fftw_free(fftData);
+	fftw_free(newFftData);
+}
+
+static void checkResample(size_t inWidth, size_t inHeight, size_t outWidth, size_t outHeight)
+{
+	std::mt19937 rnd(inWidth * 1000 + outHeight);
+	std::uniform_real_distribution<double> distribution(-1.0, 1.0);
+	ao::uvector<double> input(inWidth * inHeight);
+	for(double& value : input)
+		value = distribution(rnd);
+	input[inWidth + 1] = std::numeric_limits<double>::quiet_NaN();
+	const ao::uvector<double> originalInput(input);
+
+	ao::uvector<double> expected(outWidth * outHeight), output(outWidth * outHeight);
+	outOfPlaceResample(input.data(), inWidth, inHeight, expected.data(), outWidth, outHeight);
+
+	FFTResampler resampler(inWidth, inHeight, outWidth, outHeight, 1, false);
+	resampler.RunSingle(input.data(), output.data());
+
+	for(size_t i=0; i!=output.size(); ++i)
+		BOOST_CHECK_SMALL(output[i] - expected[i], 1e-10);
+	// The input image is no longer modified
+	BOOST_CHECK(std::isnan(input[inWidth + 1]));
+	for(size_t i=0; i!=input.size(); ++i)
+	{
+		if(i != inWidth + 1)
+			BOOST_CHECK_EQUAL(input[i], originalInput[i]);
+	}
+}
+
+BOOST_AUTO_TEST_CASE( same_size )
+{
+	checkResample(32, 24, 32, 24);
+}
+
+BOOST_AUTO_TEST_CASE( growing )
+{
+	checkResample(32, 24, 64, 48);
+}
+
+BOOST_AUTO_TEST_CASE( shrinking )
+{
+	checkResample(64, 48, 32, 24);
+}
+
+BOOST_AUTO_TEST_CASE( grow_width_shrink_height )
+{
+	checkResample(32, 48, 64, 24);
+}
+
+BOOST_AUTO_TEST_CASE( shrink_width_grow_height )
+{
+	checkResample(64, 24, 32, 48);
+}
+
+BOOST_AUTO_TEST_CASE( odd_sizes )
+{
+	checkResample(31, 27, 64, 50);
+	checkResample(63, 45, 40, 31);
+	checkResample(33, 20, 21, 35);
+}
+
+BOOST_AUTO_TEST_CASE( several_tasks )
+{
+	// Each thread reuses its buffer for the next tasks
+	const size_t inWidth = 30, inHeight = 22, outWidth = 45, outHeight = 33, taskCount = 5;
+	std::vector<ao::uvector<double>> inputs, outputs, expected;
+	for(size_t t=0; t!=taskCount; ++t)
+	{
+		inputs.emplace_back(inWidth * inHeight);
+		for(size_t i=0; i!=inputs.back().size(); ++i)
+			inputs.back()[i] = std::sin(double(i * (t+1)) * 0.01);
+		outputs.emplace_back(outWidth * outHeight);
+		expected.emplace_back(outWidth * outHeight);
+		outOfPlaceResample(inputs[t].data(), inWidth, inHeight, expected[t].data(), outWidth, outHeight);
+	}
+	FFTResampler resampler(inWidth, inHeight, outWidth, outHeight, 2, false);
+	resampler.Start();
+	for(size_t t=0; t!=taskCount; ++t)
+		resampler.AddTask(inputs[t].data(), outputs[t].data());
+	resampler.Finish();
+	for(size_t t=0; t!=taskCount; ++t)
+	{
+		for(size_t i=0; i!=outputs[t].size(); ++i)
+			BOOST_CHECK_SMALL(outputs[t][i] - expected[t][i], 1e-10);
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,50 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../wsclean/ffttimingtable.h"
+#include "../wsclean/smallinversionoptimization.h"
+
+#include <cstdio>
+
+BOOST_AUTO_TEST_SUITE(fft_timing_table)
+
+BOOST_AUTO_TEST_CASE( save_and_load )
+{
+	const std::string filename = "test-fft-timings.txt";
+	std::remove(filename.c_str());
+	{
+		FFTTimingTable table(filename);
+		BOOST_CHECK_EQUAL(table.Size(), 0u);
+		BOOST_CHECK_GT(table.TransformTime(128), 0.0);
+		table.SetTransformTime(100, 2.5e-6);
+		table.Save();
+	}
+	FFTTimingTable table(filename);
+	BOOST_CHECK_EQUAL(table.Size(), 2u);
+	BOOST_CHECK_CLOSE(table.TransformTime(100), 2.5e-6, 1e-6);
+	BOOST_CHECK_CLOSE(table.Transform2DTime(100, 100), 200.0 * 2.5e-6, 1e-6);
+	std::remove(filename.c_str());
+}
+
+BOOST_AUTO_TEST_CASE( fastest_size )
+{
+	FFTTimingTable table("");
+	// The smallest sizes with low prime factors are 256 x 128. Make 280 the
+	// fastest width, while other sizes get slower with their length.
+	const size_t widths[] = { 256, 280, 288, 300, 320, 324, 336, 360 };
+	const size_t heights[] = { 128, 140, 144, 160, 168, 180, 192, 196 };
+	for(size_t size : widths)
+		table.SetTransformTime(size, size == 280 ? 1e-6 : double(size) * 1e-8);
+	for(size_t size : heights)
+		table.SetTransformTime(size, double(size) * 1e-8);
+	size_t minWidth, minHeight, optWidth, optHeight;
+	const double beamSize = 1e-3, pixelScale = beamSize / 8.0;
+	SmallInversionOptimization::DetermineFastestSize(1024, 512, pixelScale, pixelScale, beamSize, table, minWidth, minHeight, optWidth, optHeight);
+	BOOST_CHECK_EQUAL(minWidth, 256u);
+	BOOST_CHECK_EQUAL(minHeight, 128u);
+	BOOST_CHECK_EQUAL(optWidth, 280u);
+	BOOST_CHECK_EQUAL(optHeight, 128u);
+	// Only the candidates were used, so nothing was measured
+	BOOST_CHECK_EQUAL(table.Size(), 16u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
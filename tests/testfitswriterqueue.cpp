@@ -0,0 +1,74 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../wsclean/fitswriterqueue.h"
+
+#include "../fitsreader.h"
+
+#include <boost/filesystem/operations.hpp>
+
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(fits_writer_queue)
+
+static void checkWriteAndRead(size_t threadCount, FitsWriter::Compression compression)
+{
+	const size_t width = 31, height = 17, imageCount = 5;
+	const boost::filesystem::path directory =
+		boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("wsctest-queue-%%%%-%%%%");
+	boost::filesystem::create_directory(directory);
+	std::vector<std::string> filenames;
+	for(size_t i=0; i!=imageCount; ++i)
+		filenames.push_back((directory / ("image" + std::to_string(i) + ".fits")).string());
+	FitsWriter writer;
+	writer.SetImageDimensions(width, height, 0.1, 0.2, 1e-4, 1e-4);
+	writer.SetCompression(compression, 0.0);
+	std::vector<double> image(width * height);
+	{
+		FitsWriterQueue queue(threadCount, 2);
+		for(size_t i=0; i!=imageCount; ++i)
+		{
+			for(size_t j=0; j!=image.size(); ++j)
+				image[j] = double(i) * 0.5 + double(j) * 0.25;
+			image[7] = std::numeric_limits<double>::max();
+			queue.Write(writer, filenames[i], image.data());
+		}
+		queue.Flush();
+	}
+	for(size_t i=0; i!=imageCount; ++i)
+	{
+		{
+			FitsReader reader(filenames[i]);
+			BOOST_CHECK_EQUAL(reader.ImageWidth(), width);
+			BOOST_CHECK_EQUAL(reader.ImageHeight(), height);
+			reader.Read(image.data());
+		}
+		for(size_t j=0; j!=image.size(); ++j)
+		{
+			if(j == 7)
+				BOOST_CHECK(!std::isfinite(image[j]));
+			else
+				BOOST_CHECK_EQUAL(image[j], double(i) * 0.5 + double(j) * 0.25);
+		}
+	}
+	boost::filesystem::remove_all(directory);
+}
+
+BOOST_AUTO_TEST_CASE( synchronous )
+{
+	checkWriteAndRead(0, FitsWriter::NoCompression);
+}
+
+BOOST_AUTO_TEST_CASE( background_threads )
+{
+	checkWriteAndRead(3, FitsWriter::NoCompression);
+}
+
+BOOST_AUTO_TEST_CASE( lossless_compression )
+{
+	checkWriteAndRead(2, FitsWriter::GZipCompression);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
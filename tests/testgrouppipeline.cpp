@@ -0,0 +1,56 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../wsclean/grouppipeline.h"
+
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(group_pipeline)
+
+static void checkOrder(bool enabled)
+{
+	std::vector<size_t> order;
+	const std::thread::id mainThread = std::this_thread::get_id();
+	bool ranOnMainThread = false;
+	{
+		GroupPipeline pipeline(enabled, 2);
+		for(size_t i=0; i!=20; ++i)
+		{
+			pipeline.Push([&order, &ranOnMainThread, mainThread, i]() {
+				if(std::this_thread::get_id() == mainThread)
+					ranOnMainThread = true;
+				order.push_back(i);
+			});
+		}
+		pipeline.Wait();
+		BOOST_CHECK_EQUAL(order.size(), 20);
+	}
+	for(size_t i=0; i!=order.size(); ++i)
+		BOOST_CHECK_EQUAL(order[i], i);
+	BOOST_CHECK_EQUAL(ranOnMainThread, !enabled);
+}
+
+BOOST_AUTO_TEST_CASE( disabled )
+{
+	checkOrder(false);
+}
+
+BOOST_AUTO_TEST_CASE( background )
+{
+	checkOrder(true);
+}
+
+BOOST_AUTO_TEST_CASE( error_is_rethrown )
+{
+	GroupPipeline pipeline(true, 1);
+	bool laterTaskRan = false;
+	pipeline.Push([]() { throw std::runtime_error("task failed"); });
+	pipeline.Push([&laterTaskRan]() { laterTaskRan = true; });
+	BOOST_CHECK_THROW(pipeline.Wait(), std::runtime_error);
+	BOOST_CHECK(laterTaskRan);
+	// The error is only reported once
+	pipeline.Wait();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,95 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../wsclean/imagebufferallocator.h"
+
+BOOST_AUTO_TEST_SUITE(image_buffer_allocator)
+
+BOOST_AUTO_TEST_CASE( reuse_alternating_sizes )
+{
+	ImageBufferAllocator allocator;
+	const size_t small = 1000, large = 1024*1024;
+	double* a = allocator.Allocate(small);
+	std::complex<double>* b = allocator.AllocateComplex(large);
+	a[small-1] = 1.0;
+	b[large-1] = 1.0;
+	allocator.Free(a);
+	allocator.Free(b);
+	const size_t allocated = allocator.AllocatedBytes();
+	BOOST_CHECK_EQUAL(allocator.UnusedBytes(), allocated);
+
+	// Changing between sizes should reuse the buffers instead of freeing them
+	for(size_t i=0; i!=3; ++i)
+	{
+		double* c = allocator.Allocate(small);
+		BOOST_CHECK_EQUAL(c, a);
+		allocator.Free(c);
+		std::complex<double>* d = allocator.AllocateComplex(large);
+		BOOST_CHECK_EQUAL(d, b);
+		allocator.Free(d);
+	}
+	BOOST_CHECK_EQUAL(allocator.AllocatedBytes(), allocated);
+
+	// A float image of the same number of bytes is in the same size class
+	float* e = allocator.AllocateFloat(small * 2);
+	BOOST_CHECK_EQUAL(reinterpret_cast<double*>(e), a);
+	allocator.Free(e);
+
+	allocator.FreeUnused();
+	BOOST_CHECK_EQUAL(allocator.AllocatedBytes(), 0);
+	BOOST_CHECK_EQUAL(allocator.UnusedBytes(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( huge_page_alignment )
+{
+	ImageBufferAllocator allocator;
+	const size_t size = ImageBufferAllocator::HugePageThreshold / sizeof(double) + 1;
+	BOOST_CHECK_EQUAL(ImageBufferAllocator::SizeClass(size * sizeof(double)), ImageBufferAllocator::HugePageThreshold + ImageBufferAllocator::HugePageSize);
+	double* a = allocator.Allocate(size);
+	BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(a) % ImageBufferAllocator::HugePageSize, 0);
+	for(size_t i=0; i!=size; ++i)
+		a[i] = i;
+	BOOST_CHECK_EQUAL(a[size-1], double(size-1));
+	allocator.Free(a);
+}
+
+BOOST_AUTO_TEST_CASE( budget_evicts_least_recently_used )
+{
+	ImageBufferAllocator allocator;
+	const size_t size = 1024, bytes = ImageBufferAllocator::SizeClass(size * sizeof(double));
+	allocator.SetMemoryBudget(bytes * 4);
+	double
+		*a = allocator.Allocate(size),
+		*b = allocator.Allocate(size),
+		*c = allocator.Allocate(size*2);
+	allocator.Free(b);
+	allocator.Free(a);
+	allocator.Free(c);
+	BOOST_CHECK_EQUAL(allocator.AllocatedBytes(), bytes * 4);
+
+	// A new size class does not fit, so the buffer that was freed first (b) should be evicted
+	double* d = allocator.Allocate(size/2);
+	BOOST_CHECK_EQUAL(allocator.AllocatedBytes(), bytes * 3 + bytes / 2);
+	double* e = allocator.Allocate(size);
+	BOOST_CHECK_EQUAL(e, a);
+	allocator.Free(d);
+	allocator.Free(e);
+
+	// Buffers in use are never evicted, even if the budget is exceeded
+	allocator.SetMemoryBudget(0);
+	BOOST_CHECK_EQUAL(allocator.AllocatedBytes(), 0);
+	double* f = allocator.Allocate(size);
+	BOOST_CHECK_EQUAL(allocator.AllocatedBytes(), bytes);
+	allocator.Free(f);
+	BOOST_CHECK_EQUAL(allocator.AllocatedBytes(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( invalid_free )
+{
+	ImageBufferAllocator allocator;
+	double* a = allocator.Allocate(100);
+	BOOST_CHECK_THROW(allocator.Free(reinterpret_cast<std::complex<double>*>(a)), std::runtime_error);
+	allocator.Free(a);
+	BOOST_CHECK_THROW(allocator.Free(a), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
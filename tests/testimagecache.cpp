@@ -0,0 +1,50 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../wsclean/imagecache.h"
+
+#include <string>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(image_cache)
+
+static void checkStoreAndLoad(size_t memoryBudget)
+{
+	const size_t n = 10000, imageCount = 5;
+	ImageCache cache("wsctest", n * sizeof(double), memoryBudget);
+	std::vector<double> image(n);
+	for(size_t repeat=0; repeat!=2; ++repeat)
+	{
+		for(size_t i=0; i!=imageCount; ++i)
+		{
+			for(size_t j=0; j!=n; ++j)
+				image[j] = double(i * n + j + repeat);
+			cache.Store(std::to_string(i), image.data());
+		}
+	}
+	BOOST_CHECK_LE(cache.MemoryImageCount() * n * sizeof(double), memoryBudget);
+	for(size_t i=0; i!=imageCount; ++i)
+	{
+		cache.Load(std::to_string(imageCount - 1 - i), image.data());
+		BOOST_CHECK_EQUAL(image[0], double((imageCount - 1 - i) * n + 1));
+		BOOST_CHECK_EQUAL(image[n-1], double((imageCount - i) * n));
+	}
+	cache.Flush();
+	BOOST_CHECK_THROW(cache.Load("missing", image.data()), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE( without_memory )
+{
+	checkStoreAndLoad(0);
+}
+
+BOOST_AUTO_TEST_CASE( partially_in_memory )
+{
+	checkStoreAndLoad(2 * 10000 * sizeof(double));
+}
+
+BOOST_AUTO_TEST_CASE( fully_in_memory )
+{
+	checkStoreAndLoad(100 * 10000 * sizeof(double));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
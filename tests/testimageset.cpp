@@ -110,4 +110,26 @@ BOOST_FIXTURE_TEST_CASE( interpolateAndStore , AdvImageSetFixture)
 	BOOST_CHECK_CLOSE_FRACTION(dset[1][0],-1.0, 1e-8);
 }
 
+BOOST_FIXTURE_TEST_CASE( floatLoadIntegrateAndStore , AdvImageSetFixture)
+{
+	FloatImageSet fset(&table, allocator, 2, false, 2, 2);
+	fset.LoadAndAverage(cSet);
+	BOOST_CHECK_CLOSE_FRACTION(fset[0][0], 2.0, 1e-6);
+	BOOST_CHECK_CLOSE_FRACTION(fset[3][0], -10.0, 1e-6);
+	
+	ao::uvector<double> integrated(4);
+	fset.GetLinearIntegrated(integrated.data());
+	ImageSet dset(&table, allocator, 2, false, 2, 2);
+	dset.LoadAndAverage(cSet);
+	ao::uvector<double> expected(4);
+	dset.GetLinearIntegrated(expected.data());
+	BOOST_CHECK_CLOSE_FRACTION(integrated[0], expected[0], 1e-6);
+	
+	fset[0][0] = 4.0;
+	SpectralFitter fitter(NoSpectralFitting, 2);
+	fset.InterpolateAndStore(cSet, fitter);
+	cSet.Load(image.data(), Polarization::XX, 0, false);
+	BOOST_CHECK_CLOSE_FRACTION(image[0], 4.0, 1e-8);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,121 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../wsclean/instrumentation.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+	std::string readFile(const std::string& filename)
+	{
+		std::ifstream file(filename);
+		return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	}
+	
+	size_t countOccurrences(const std::string& text, const std::string& pattern)
+	{
+		size_t count = 0;
+		for(size_t pos = text.find(pattern); pos != std::string::npos; pos = text.find(pattern, pos + pattern.size()))
+			++count;
+		return count;
+	}
+}
+
+BOOST_AUTO_TEST_SUITE(instrumentation)
+
+BOOST_AUTO_TEST_CASE( disabled )
+{
+	Instrumentation::Enable(false);
+	Instrumentation::Disable();
+	{
+		Instrumentation::ScopedTimer timer(Instrumentation::GriddingStage);
+		timer.AddItems(10);
+	}
+	Instrumentation::Accumulator accumulator(Instrumentation::MSReadStage);
+	BOOST_CHECK_EQUAL(Instrumentation::TotalItems(Instrumentation::GriddingStage), 0u);
+	BOOST_CHECK_EQUAL(Instrumentation::TotalSeconds(Instrumentation::GriddingStage), 0.0);
+}
+
+BOOST_AUTO_TEST_CASE( threads )
+{
+	Instrumentation::Enable(true);
+	std::vector<std::thread> threads;
+	for(size_t t=0; t!=4; ++t)
+	{
+		threads.emplace_back([t]() {
+			Instrumentation::ScopedTimer timer(Instrumentation::GriddingStage, t);
+			for(size_t i=0; i!=100; ++i)
+			{
+				Instrumentation::Accumulator read(Instrumentation::MSReadStage, 2);
+				timer.AddItems(1);
+			}
+		});
+	}
+	for(std::thread& thread : threads)
+		thread.join();
+	Instrumentation::Disable();
+
+	BOOST_CHECK_EQUAL(Instrumentation::TotalItems(Instrumentation::GriddingStage), 400u);
+	BOOST_CHECK_EQUAL(Instrumentation::TotalItems(Instrumentation::MSReadStage), 800u);
+	BOOST_CHECK_EQUAL(Instrumentation::TotalItems(Instrumentation::FFTStage), 0u);
+	BOOST_CHECK_GE(Instrumentation::TotalSeconds(Instrumentation::GriddingStage), Instrumentation::TotalSeconds(Instrumentation::MSReadStage));
+}
+
+BOOST_AUTO_TEST_CASE( finished_threads_are_reused )
+{
+	const std::string reportFile = "test-timing-threads.json";
+	Instrumentation::Enable(false);
+	std::thread([]() { Instrumentation::Add(Instrumentation::GriddingStage, std::chrono::milliseconds(1), 1); }).join();
+	Instrumentation::WriteReport(reportFile);
+	const std::string firstReport = readFile(reportFile);
+	
+	// Like the gridder, start a new thread for every pass
+	for(size_t pass=0; pass!=20; ++pass)
+		std::thread([]() { Instrumentation::Add(Instrumentation::GriddingStage, std::chrono::milliseconds(1), 1); }).join();
+	Instrumentation::Disable();
+	BOOST_CHECK_EQUAL(Instrumentation::TotalItems(Instrumentation::GriddingStage), 21u);
+	
+	Instrumentation::WriteReport(reportFile);
+	const std::string report = readFile(reportFile);
+	BOOST_CHECK_EQUAL(countOccurrences(report, "{ \"thread\": "), countOccurrences(firstReport, "{ \"thread\": "));
+	std::remove(reportFile.c_str());
+}
+
+BOOST_AUTO_TEST_CASE( report_and_trace )
+{
+	Instrumentation::Enable(true);
+	{
+		Instrumentation::ScopedTimer timer(Instrumentation::FFTStage, 7);
+		timer.AddItems(3);
+	}
+	Instrumentation::Add(Instrumentation::LaneWaitStage, std::chrono::milliseconds(5), 1);
+	Instrumentation::Disable();
+	BOOST_CHECK_CLOSE(Instrumentation::TotalSeconds(Instrumentation::LaneWaitStage), 0.005, 1e-6);
+
+	const std::string reportFile = "test-timing-report.json", traceFile = "test-timing-trace.json";
+	Instrumentation::WriteReport(reportFile);
+	Instrumentation::WriteTrace(traceFile);
+
+	const std::string report = readFile(reportFile);
+	BOOST_CHECK_NE(report.find("\"wall_seconds\""), std::string::npos);
+	BOOST_CHECK_NE(report.find("\"fft\": { \"seconds\": "), std::string::npos);
+	BOOST_CHECK_NE(report.find("\"lane-wait\": { \"seconds\": 0.005000, \"calls\": 1, \"items\": 1 }"), std::string::npos);
+	BOOST_CHECK_NE(report.find("\"threads\": ["), std::string::npos);
+
+	// Only scoped timers are written as trace events
+	const std::string trace = readFile(traceFile);
+	BOOST_CHECK_NE(trace.find("\"traceEvents\""), std::string::npos);
+	BOOST_CHECK_NE(trace.find("\"name\": \"fft\""), std::string::npos);
+	BOOST_CHECK_NE(trace.find("\"args\": {\"items\": 3, \"index\": 7}"), std::string::npos);
+	BOOST_CHECK_EQUAL(trace.find("lane-wait"), std::string::npos);
+
+	std::remove(reportFile.c_str());
+	std::remove(traceFile.c_str());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
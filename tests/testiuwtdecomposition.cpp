@@ -0,0 +1,62 @@
+#include "../iuwt/iuwtdecomposition.h"
+
+#include "../threadpool.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/test/floating_point_comparison.hpp>
+
+#include <random>
+
+BOOST_AUTO_TEST_SUITE(iuwt_decomposition)
+
+static void fillRandom(ao::uvector<double>& image)
+{
+	std::mt19937 rnd;
+	std::normal_distribution<double> dist;
+	for(double& v : image)
+		v = dist(rnd);
+}
+
+BOOST_AUTO_TEST_CASE( decompose_mt_equals_st )
+{
+	const size_t width = 160, height = 130;
+	const int scaleCount = 3;
+	ao::uvector<double> input(width*height), scratch(width*height);
+	fillRandom(input);
+	
+	IUWTDecomposition reference(scaleCount, width, height), tiled(scaleCount, width, height);
+	reference.DecomposeST(input.data(), scratch.data());
+	ThreadPool pool;
+	tiled.DecomposeMT(pool, input.data(), scratch.data(), true);
+	
+	for(int scale=0; scale!=scaleCount+1; ++scale)
+	{
+		for(size_t i=0; i!=width*height; ++i)
+			BOOST_CHECK_SMALL(tiled[scale][i] - reference[scale][i], 1e-12);
+	}
+}
+
+BOOST_AUTO_TEST_CASE( decompose_own_scale )
+{
+	// The input may be one of the scales of the decomposition itself
+	const size_t width = 128, height = 128;
+	const int scaleCount = 2;
+	ao::uvector<double> input(width*height), scratch(width*height);
+	fillRandom(input);
+	
+	ThreadPool pool;
+	IUWTDecomposition tiled(scaleCount, width, height), reference(scaleCount, width, height);
+	tiled.DecomposeMT(pool, input.data(), scratch.data(), false);
+	BOOST_CHECK(tiled[scaleCount].Coefficients().empty());
+	
+	ao::uvector<double> scaleOne = tiled[1].Coefficients();
+	reference.DecomposeST(scaleOne.data(), scratch.data());
+	tiled.DecomposeMT(pool, tiled[1].Coefficients().data(), scratch.data(), false);
+	for(int scale=0; scale!=scaleCount; ++scale)
+	{
+		for(size_t i=0; i!=width*height; ++i)
+			BOOST_CHECK_SMALL(tiled[scale][i] - reference[scale][i], 1e-12);
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
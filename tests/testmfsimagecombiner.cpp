@@ -0,0 +1,68 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../wsclean/mfsimagecombiner.h"
+
+#include <cmath>
+#include <limits>
+
+BOOST_AUTO_TEST_SUITE(mfs_image_combiner)
+
+BOOST_AUTO_TEST_CASE( weighted_average )
+{
+	const size_t width = 4, height = 3;
+	FitsWriter writer;
+	writer.SetImageDimensions(width, height);
+	ImageBufferAllocator allocator;
+	MFSImageCombiner combiner(allocator);
+	const double weights[3] = { 1.0, 2.0, 0.5 };
+	double image[width*height];
+	for(size_t ch=0; ch!=3; ++ch)
+	{
+		writer.SetFrequency(100e6 + ch * 10e6, 10e6);
+		for(size_t i=0; i!=width*height; ++i)
+			image[i] = double(ch + i);
+		// Non-finite values are left out of the average of their pixel
+		if(ch == 1)
+			image[5] = std::numeric_limits<double>::quiet_NaN();
+		combiner.Add(writer, image, weights[ch]);
+	}
+	BOOST_CHECK_EQUAL(combiner.ImageCount(), 3);
+	BOOST_CHECK_CLOSE_FRACTION(combiner.WeightSum(), 3.5, 1e-12);
+	
+	combiner.GetAverage(image);
+	for(size_t i=0; i!=width*height; ++i)
+	{
+		if(i == 5)
+			BOOST_CHECK_CLOSE_FRACTION(image[i], (5.0 * 1.0 + 7.0 * 0.5) / 1.5, 1e-12);
+		else
+			BOOST_CHECK_CLOSE_FRACTION(image[i], (double(i) * 1.0 + double(i+1) * 2.0 + double(i+2) * 0.5) / 3.5, 1e-12);
+	}
+	
+	FitsWriter mfsWriter = combiner.Writer();
+	BOOST_CHECK_CLOSE_FRACTION(mfsWriter.Frequency(), 110e6, 1e-12);
+	BOOST_CHECK_CLOSE_FRACTION(mfsWriter.Bandwidth(), 30e6, 1e-12);
+}
+
+BOOST_AUTO_TEST_CASE( sums_use_allocator )
+{
+	const size_t width = 4, height = 3;
+	FitsWriter writer;
+	writer.SetImageDimensions(width, height);
+	ImageBufferAllocator allocator;
+	double image[width*height];
+	for(size_t i=0; i!=width*height; ++i)
+		image[i] = double(i);
+	{
+		MFSImageCombiner combiner(allocator);
+		combiner.Add(writer, image, 1.0);
+		BOOST_CHECK_EQUAL(allocator.AllocatedBytes() - allocator.UnusedBytes(), ImageBufferAllocator::SizeClass(width*height*sizeof(double)));
+		
+		// The weight image is added by the first non-finite pixel
+		image[2] = std::numeric_limits<double>::quiet_NaN();
+		combiner.Add(writer, image, 1.0);
+		BOOST_CHECK_EQUAL(allocator.AllocatedBytes() - allocator.UnusedBytes(), 2*ImageBufferAllocator::SizeClass(width*height*sizeof(double)));
+	}
+	BOOST_CHECK_EQUAL(allocator.UnusedBytes(), allocator.AllocatedBytes());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,126 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../modelrenderer.h"
+#include "../uvector.h"
+
+#include <algorithm>
+#include <cmath>
+
+BOOST_AUTO_TEST_SUITE(model_renderer)
+
+static void checkSparseRestore(long double beamMaj, long double beamMin, long double beamPA)
+{
+	const size_t width = 64, height = 48;
+	const long double pixelScale = 1e-4;
+	ao::uvector<double> model(width*height, 0.0), image(width*height, 1.0);
+	// Include components near the edges, to test the wrapping
+	model[20*width + 30] = 2.0;
+	model[1*width + 62] = -1.0;
+	model[47*width + 0] = 0.5;
+	ModelRenderer::Restore(image.data(), model.data(), width, height, beamMaj, beamMin, beamPA, pixelScale, pixelScale);
+	
+	const long double
+		sigmaMaj = beamMaj / (2.0L * sqrtl(2.0L * logl(2.0L))),
+		sigmaMin = beamMin / (2.0L * sqrtl(2.0L * logl(2.0L)));
+	const double
+		s = std::sin(double(beamPA) + 0.5*M_PI), c = std::cos(double(beamPA) + 0.5*M_PI),
+		sigmaMax = std::max(std::fabs(double(sigmaMaj) * c), std::fabs(double(sigmaMaj) * s));
+	size_t boxSize = std::min<size_t>(std::ceil(sigmaMax * 40.0 / double(pixelScale)), height);
+	if(boxSize%2 != 0) ++boxSize;
+	const int half = boxSize/2;
+	ao::uvector<double> expected(width*height, 1.0);
+	for(size_t i=0; i!=width*height; ++i)
+	{
+		if(model[i] != 0.0)
+		{
+			const int x = i % width, y = i / width;
+			for(int dy=-half; dy!=half; ++dy)
+			{
+				for(int dx=-half; dx!=half; ++dx)
+				{
+					const double
+						l = -dx * double(pixelScale), m = dy * double(pixelScale),
+						lT = (l*c - m*s) / double(sigmaMaj),
+						mT = (l*s + m*c) / double(sigmaMin);
+					const size_t
+						ox = (x + dx + width) % width,
+						oy = (y + dy + height) % height;
+					expected[oy*width + ox] += model[i] * std::exp(-0.5 * (lT*lT + mT*mT));
+				}
+			}
+		}
+	}
+	for(size_t i=0; i!=width*height; ++i)
+		BOOST_CHECK_SMALL(image[i] - expected[i], 1e-12);
+}
+
+BOOST_AUTO_TEST_CASE( restore_sparse_circular )
+{
+	checkSparseRestore(3e-4, 3e-4, 0.0);
+}
+
+BOOST_AUTO_TEST_CASE( restore_sparse_elliptical )
+{
+	checkSparseRestore(3e-4, 1.5e-4, 0.4);
+}
+
+static void compareDirectAndFFTRestore(const ao::uvector<double>& model, size_t width, size_t height, long double beamMaj, long double beamMin, long double beamPA)
+{
+	const long double pixelScale = 1e-4;
+	ao::uvector<double>
+		direct(width*height, 1.0),
+		fft(width*height, 1.0);
+	ModelRenderer::Restore(direct.data(), model.data(), width, height, beamMaj, beamMin, beamPA, pixelScale, pixelScale, ModelRenderer::DirectRestore);
+	ModelRenderer::Restore(fft.data(), model.data(), width, height, beamMaj, beamMin, beamPA, pixelScale, pixelScale, ModelRenderer::FFTRestore);
+	double peak = 0.0;
+	for(size_t i=0; i!=width*height; ++i)
+		peak = std::max(peak, std::fabs(fft[i]));
+	for(size_t i=0; i!=width*height; ++i)
+		BOOST_CHECK_SMALL(direct[i] - fft[i], peak * 1e-9);
+}
+
+static void compareDirectAndFFTRestore(long double beamMaj, long double beamMin, long double beamPA)
+{
+	const size_t width = 64, height = 48;
+	// Point components, some of them near the edges
+	ao::uvector<double> points(width*height, 0.0);
+	points[20*width + 30] = 2.0;
+	points[1*width + 62] = -1.0;
+	points[47*width + 0] = 0.5;
+	compareDirectAndFFTRestore(points, width, height, beamMaj, beamMin, beamPA);
+	
+	// An elliptical Gaussian component, which wraps around the bottom edge
+	ao::uvector<double> gaussian(width*height, 0.0);
+	const int centreX = 40, centreY = 3;
+	const double s = std::sin(0.3), c = std::cos(0.3);
+	for(int dy=-7; dy<=7; ++dy)
+	{
+		for(int dx=-7; dx<=7; ++dx)
+		{
+			const double
+				u = (dx*c - dy*s) / 3.0,
+				v = (dx*s + dy*c) / 1.5;
+			const size_t y = (centreY + dy + height) % height;
+			gaussian[y*width + centreX + dx] = 1.5 * std::exp(-0.5 * (u*u + v*v));
+		}
+	}
+	compareDirectAndFFTRestore(gaussian, width, height, beamMaj, beamMin, beamPA);
+}
+
+BOOST_AUTO_TEST_CASE( restore_direct_equals_fft_small_beam )
+{
+	compareDirectAndFFTRestore(2e-4, 2e-4, 0.0);
+}
+
+BOOST_AUTO_TEST_CASE( restore_direct_equals_fft_elliptical_beam )
+{
+	compareDirectAndFFTRestore(5e-4, 2.5e-4, 0.4);
+}
+
+BOOST_AUTO_TEST_CASE( restore_direct_equals_fft_large_beam )
+{
+	// The beam box is limited by the image height
+	compareDirectAndFFTRestore(2e-3, 1e-3, -0.7);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
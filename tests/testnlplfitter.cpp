@@ -0,0 +1,104 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/test/floating_point_comparison.hpp>
+
+#include "../nlplfitter.h"
+
+BOOST_AUTO_TEST_SUITE(nlpl_fitter)
+
+namespace {
+	const size_t nPoints = 8;
+
+	ao::uvector<double> makeTerms(double factor, double alpha, double beta)
+	{
+		ao::uvector<double> terms(3);
+		terms[0] = factor;
+		terms[1] = alpha;
+		terms[2] = beta;
+		return terms;
+	}
+
+	double xValue(size_t i)
+	{
+		return 0.7 + 0.1 * double(i);
+	}
+}
+
+BOOST_AUTO_TEST_CASE( fit_log_polynomial )
+{
+	const ao::uvector<double> expected = makeTerms(2.5, -0.7, 0.3);
+	NonLinearPowerLawFitter fitter;
+	for(size_t i=0; i!=nPoints; ++i)
+		fitter.AddDataPoint(xValue(i), NonLinearPowerLawFitter::Evaluate(xValue(i), expected));
+	ao::uvector<double> terms;
+	fitter.Fit(terms, 3);
+	BOOST_REQUIRE_EQUAL(terms.size(), 3u);
+	for(size_t t=0; t!=3; ++t)
+		BOOST_CHECK_CLOSE_FRACTION(terms[t], expected[t], 1e-4);
+
+	// Reuse the fitter for a negative spectrum with two terms
+	fitter.Clear();
+	for(size_t i=0; i!=nPoints; ++i)
+		fitter.AddDataPoint(xValue(i), -3.0 * std::pow(xValue(i), -0.8));
+	fitter.Fit(terms, 2);
+	BOOST_REQUIRE_EQUAL(terms.size(), 2u);
+	BOOST_CHECK_CLOSE_FRACTION(terms[0], -3.0, 1e-4);
+	BOOST_CHECK_CLOSE_FRACTION(terms[1], -0.8, 1e-4);
+}
+
+BOOST_AUTO_TEST_CASE( fit_noisy_values )
+{
+	// One value has a different sign than the rest: the initial guess can not
+	// use it, but the fit should still be close to the noiseless spectrum
+	const ao::uvector<double> expected = makeTerms(1.0, -0.7, 0.0);
+	NonLinearPowerLawFitter fitter;
+	for(size_t i=0; i!=nPoints; ++i)
+	{
+		double y = NonLinearPowerLawFitter::Evaluate(xValue(i), expected);
+		if(i == 3)
+			y = -0.01;
+		fitter.AddDataPoint(xValue(i), y);
+	}
+	ao::uvector<double> terms;
+	fitter.Fit(terms, 2);
+	BOOST_CHECK_GT(terms[0], 0.7);
+	BOOST_CHECK_LT(terms[0], 1.3);
+	BOOST_CHECK_LT(terms[1], 0.0);
+}
+
+BOOST_AUTO_TEST_CASE( fit_batch )
+{
+	const size_t count = 5, nTerms = 3;
+	ao::uvector<double> xValues(nPoints), spectra(count * nPoints);
+	for(size_t i=0; i!=nPoints; ++i)
+		xValues[i] = xValue(i);
+	for(size_t s=0; s!=count; ++s)
+	{
+		const ao::uvector<double> spectrumTerms = makeTerms(double(s) - 2.0, -0.5 + 0.1*s, 0.05*s);
+		for(size_t i=0; i!=nPoints; ++i)
+			spectra[s * nPoints + i] = NonLinearPowerLawFitter::Evaluate(xValue(i), spectrumTerms);
+	}
+
+	NonLinearPowerLawFitter batchFitter;
+	ao::uvector<double> batchTerms(count * nTerms);
+	batchFitter.FitBatch(batchTerms.data(), spectra.data(), count, xValues.data(), nPoints, nTerms);
+
+	for(size_t s=0; s!=count; ++s)
+	{
+		NonLinearPowerLawFitter fitter;
+		for(size_t i=0; i!=nPoints; ++i)
+			fitter.AddDataPoint(xValues[i], spectra[s * nPoints + i]);
+		ao::uvector<double> terms;
+		fitter.Fit(terms, nTerms);
+		for(size_t t=0; t!=nTerms; ++t)
+		{
+			if(s == 2)
+				BOOST_CHECK_EQUAL(batchTerms[s * nTerms + t], 0.0);
+			else
+				BOOST_CHECK_SMALL(batchTerms[s * nTerms + t] - terms[t], 1e-6);
+		}
+	}
+	BOOST_CHECK_CLOSE_FRACTION(batchTerms[0], -2.0, 1e-4);
+	BOOST_CHECK_CLOSE_FRACTION(batchTerms[1], -0.5, 1e-4);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
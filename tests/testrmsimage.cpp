@@ -0,0 +1,98 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../rmsimage.h"
+
+#include <cmath>
+#include <random>
+
+BOOST_AUTO_TEST_SUITE(rms_image)
+
+static Image makeNoise(ImageBufferAllocator& allocator, size_t width, size_t height)
+{
+	Image image(width, height, allocator);
+	std::mt19937 rng;
+	std::normal_distribution<double> dist;
+	for(double& value : image)
+		value = dist(rng);
+	return image;
+}
+
+BOOST_AUTO_TEST_CASE( make )
+{
+	ImageBufferAllocator allocator;
+	const size_t width = 80, height = 64;
+	Image input = makeNoise(allocator, width, height);
+	// Make the noise increase along x
+	for(size_t y=0; y!=height; ++y)
+	{
+		for(size_t x=0; x!=width; ++x)
+			input[y*width + x] *= 1.0 + double(x) * 0.1;
+	}
+
+	const double pixelScale = 1e-4, beam = 2.0 * pixelScale, windowSize = 5.0;
+	Image rms;
+	RMSImage::Make(rms, input, windowSize, beam, beam, 0.0, pixelScale, pixelScale);
+	BOOST_REQUIRE_EQUAL(rms.Width(), width);
+	BOOST_REQUIRE_EQUAL(rms.Height(), height);
+
+	// Compare with a direct convolution, normalized by the window inside the image
+	const double sigma = beam * windowSize / (2.0 * sqrt(2.0 * log(2.0)) * pixelScale);
+	const int reach = ceil(sigma * 6.0);
+	for(size_t y=0; y<height; y+=7)
+	{
+		for(size_t x=0; x<width; x+=5)
+		{
+			double sum = 0.0, weight = 0.0;
+			for(int dy=-reach; dy<=reach; ++dy)
+			{
+				for(int dx=-reach; dx<=reach; ++dx)
+				{
+					const int sx = int(x) + dx, sy = int(y) + dy;
+					if(sx >= 0 && sx < int(width) && sy >= 0 && sy < int(height))
+					{
+						const double g = exp(-0.5 * (dx*dx + dy*dy) / (sigma*sigma));
+						const double value = input[sy*width + sx];
+						sum += g * value * value;
+						weight += g;
+					}
+				}
+			}
+			const double expected = sqrt(sum / weight);
+			BOOST_CHECK_CLOSE_FRACTION(rms[y*width + x], expected, 0.02);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE( sliding_minimum_and_maximum )
+{
+	ImageBufferAllocator allocator;
+	const size_t width = 37, height = 29;
+	const Image input = makeNoise(allocator, width, height);
+	for(size_t windowSize : { 2, 5, 8, 41 })
+	{
+		Image minimum, maximum;
+		RMSImage::SlidingMinimum(minimum, input, windowSize);
+		RMSImage::SlidingMaximum(maximum, input, windowSize);
+		const int h = windowSize / 2;
+		for(size_t y=0; y!=height; ++y)
+		{
+			for(size_t x=0; x!=width; ++x)
+			{
+				double expectedMin = std::numeric_limits<double>::max();
+				double expectedMax = std::numeric_limits<double>::lowest();
+				for(int sy=std::max(0, int(y)-h); sy!=std::min(int(height), int(y)+h); ++sy)
+				{
+					for(int sx=std::max(0, int(x)-h); sx!=std::min(int(width), int(x)+h); ++sx)
+					{
+						expectedMin = std::min(expectedMin, input[sy*width + sx]);
+						expectedMax = std::max(expectedMax, input[sy*width + sx]);
+					}
+				}
+				BOOST_CHECK_EQUAL(minimum[y*width + x], expectedMin);
+				BOOST_CHECK_EQUAL(maximum[y*width + x], expectedMax);
+			}
+		}
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
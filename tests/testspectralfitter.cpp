@@ -0,0 +1,142 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/test/floating_point_comparison.hpp>
+
+#include "../deconvolution/spectralfitter.h"
+#include "../polynomialfitter.h"
+
+#include <cmath>
+
+BOOST_AUTO_TEST_SUITE(spectral_fitter)
+
+namespace {
+	const size_t nChannels = 6, nTerms = 3;
+	const double frequencies[nChannels] = { 100e6, 110e6, 120e6, 130e6, 140e6, 150e6 };
+	const double weights[nChannels] = { 1.0, 2.0, 0.5, 1.0, 0.0, 1.5 };
+
+	double pixelValue(size_t px, size_t ch)
+	{
+		return double((px * 7 + ch * 3) % 11) - 4.0 + 0.1 * double(px % 5) * double(ch);
+	}
+}
+
+BOOST_AUTO_TEST_CASE( polynomial_fit )
+{
+	SpectralFitter fitter(PolynomialSpectralFitting, nTerms);
+	fitter.SetFrequencies(frequencies, weights, nChannels);
+	const double values[nChannels] = { 3.0, 2.5, 2.25, 2.0, 100.0, 1.75 };
+
+	PolynomialFitter reference;
+	for(size_t ch=0; ch!=nChannels; ++ch)
+		reference.AddDataPoint(frequencies[ch] / fitter.ReferenceFrequency() - 1.0, values[ch], weights[ch]);
+	ao::uvector<double> expected, terms;
+	reference.Fit(expected, nTerms);
+	fitter.Fit(terms, values);
+	BOOST_REQUIRE_EQUAL(terms.size(), nTerms);
+	for(size_t t=0; t!=nTerms; ++t)
+		BOOST_CHECK_CLOSE_FRACTION(terms[t], expected[t], 1e-8);
+
+	ao::uvector<double> fitted(values, values + nChannels);
+	fitter.FitAndEvaluate(fitted.data());
+	for(size_t ch=0; ch!=nChannels; ++ch)
+	{
+		BOOST_CHECK_CLOSE_FRACTION(fitted[ch], PolynomialFitter::Evaluate(frequencies[ch] / fitter.ReferenceFrequency() - 1.0, expected), 1e-8);
+		BOOST_CHECK_CLOSE_FRACTION(fitted[ch], fitter.Evaluate(terms, frequencies[ch]), 1e-8);
+	}
+}
+
+BOOST_AUTO_TEST_CASE( polynomial_fit_block )
+{
+	SpectralFitter fitter(PolynomialSpectralFitting, nTerms);
+	fitter.SetFrequencies(frequencies, weights, nChannels);
+	// More than one block, and not a multiple of the block size
+	const size_t count = 1000;
+	std::vector<ao::uvector<float>> images(nChannels, ao::uvector<float>(count));
+	ao::uvector<const float*> imagePtrs(nChannels);
+	for(size_t ch=0; ch!=nChannels; ++ch)
+	{
+		for(size_t px=0; px!=count; ++px)
+			images[ch][px] = pixelValue(px, ch);
+		imagePtrs[ch] = images[ch].data();
+	}
+	std::vector<ao::uvector<double>> blockTerms(nTerms, ao::uvector<double>(count)), imageTerms(blockTerms);
+	ao::uvector<double*> blockPtrs(nTerms), imageTermPtrs(nTerms);
+	for(size_t t=0; t!=nTerms; ++t)
+	{
+		blockPtrs[t] = blockTerms[t].data();
+		imageTermPtrs[t] = imageTerms[t].data();
+	}
+	fitter.FitBlock(blockPtrs.data(), imagePtrs.data(), count);
+	fitter.FitImages(imageTermPtrs.data(), imagePtrs.data(), count);
+
+	ao::uvector<double> evaluated(count);
+	ao::uvector<const double*> constTermPtrs(imageTermPtrs.begin(), imageTermPtrs.end());
+	fitter.EvaluateBlock(evaluated.data(), constTermPtrs.data(), count, 125e6);
+
+	ao::uvector<double> spectrum(nChannels), terms;
+	for(size_t px=0; px!=count; ++px)
+	{
+		for(size_t ch=0; ch!=nChannels; ++ch)
+			spectrum[ch] = images[ch][px];
+		fitter.Fit(terms, spectrum.data());
+		for(size_t t=0; t!=nTerms; ++t)
+		{
+			BOOST_CHECK_CLOSE_FRACTION(blockTerms[t][px], terms[t], 1e-8);
+			BOOST_CHECK_EQUAL(imageTerms[t][px], blockTerms[t][px]);
+		}
+		BOOST_CHECK_CLOSE_FRACTION(evaluated[px], fitter.Evaluate(terms, 125e6), 1e-8);
+	}
+}
+
+BOOST_AUTO_TEST_CASE( log_polynomial_fit_block )
+{
+	SpectralFitter fitter(LogPolynomialSpectralFitting, 2);
+	fitter.SetFrequencies(frequencies, weights, nChannels);
+	const size_t count = 300;
+	std::vector<ao::uvector<double>> images(nChannels, ao::uvector<double>(count));
+	ao::uvector<const double*> imagePtrs(nChannels);
+	for(size_t ch=0; ch!=nChannels; ++ch)
+	{
+		for(size_t px=0; px!=count; ++px)
+			images[ch][px] = (px % 3 == 0) ? 0.0 : (double(px % 7) - 3.5) * std::pow(frequencies[ch] / 120e6, -0.1 * double(px % 9));
+		imagePtrs[ch] = images[ch].data();
+	}
+	std::vector<ao::uvector<double>> blockTerms(2, ao::uvector<double>(count));
+	ao::uvector<double*> blockPtrs(2);
+	for(size_t t=0; t!=2; ++t)
+		blockPtrs[t] = blockTerms[t].data();
+	fitter.FitBlock(blockPtrs.data(), imagePtrs.data(), count);
+
+	ao::uvector<double> spectrum(nChannels), terms;
+	for(size_t px=0; px!=count; ++px)
+	{
+		for(size_t ch=0; ch!=nChannels; ++ch)
+			spectrum[ch] = images[ch][px];
+		if(px % 3 == 0)
+		{
+			BOOST_CHECK_EQUAL(blockTerms[0][px], 0.0);
+			BOOST_CHECK_EQUAL(blockTerms[1][px], 0.0);
+		}
+		else {
+			fitter.Fit(terms, spectrum.data());
+			BOOST_CHECK_CLOSE_FRACTION(blockTerms[0][px], terms[0], 1e-6);
+			BOOST_CHECK_SMALL(blockTerms[1][px] - terms[1], 1e-6);
+			BOOST_CHECK_SMALL(blockTerms[1][px] + 0.1 * double(px % 9), 1e-4);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE( more_terms_than_channels )
+{
+	SpectralFitter fitter(PolynomialSpectralFitting, 4);
+	fitter.SetFrequencies(frequencies, weights, 2);
+	const double values[2] = { 1.0, 3.0 };
+	ao::uvector<double> terms;
+	fitter.Fit(terms, values);
+	BOOST_REQUIRE_EQUAL(terms.size(), 4u);
+	BOOST_CHECK_CLOSE_FRACTION(terms[0], 3.0, 1e-8);
+	BOOST_CHECK_CLOSE_FRACTION(terms[1], -2.0 / (100.0/110.0 - 1.0), 1e-8);
+	BOOST_CHECK_EQUAL(terms[2], 0.0);
+	BOOST_CHECK_EQUAL(terms[3], 0.0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
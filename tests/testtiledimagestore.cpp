@@ -0,0 +1,40 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../wsclean/tiledimagestore.h"
+
+BOOST_AUTO_TEST_SUITE(tiled_image_store)
+
+BOOST_AUTO_TEST_CASE( store_and_reuse )
+{
+	const size_t n = 100000;
+	TiledImageStore store("wsctest", n * sizeof(double));
+	BOOST_CHECK_EQUAL(store.ImageBytes(), n * sizeof(double));
+
+	double* a = static_cast<double*>(store.Allocate());
+	double* b = static_cast<double*>(store.Allocate());
+	BOOST_CHECK_EQUAL(store.Size(), 2);
+	for(size_t i=0; i!=n; ++i)
+	{
+		a[i] = i;
+		b[i] = -double(i);
+	}
+
+	store.Free(a);
+	BOOST_CHECK_EQUAL(store.Size(), 1);
+	double* c = static_cast<double*>(store.Allocate());
+	BOOST_CHECK_EQUAL(c, a);
+
+	// Growing the store should not invalidate earlier images
+	double* d = static_cast<double*>(store.Allocate());
+	d[n-1] = 1.0;
+	BOOST_CHECK_EQUAL(b[n-1], -double(n-1));
+	BOOST_CHECK_EQUAL(b[0], 0.0);
+
+	store.Free(b);
+	store.Free(c);
+	store.Free(d);
+	BOOST_CHECK_EQUAL(store.Size(), 0);
+	BOOST_CHECK_THROW(store.Free(d), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
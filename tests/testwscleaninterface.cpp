@@ -0,0 +1,144 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../interface/wscleaninterface.h"
+
+#include "../msproviders/syntheticms.h"
+
+#include <boost/filesystem/operations.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(wsclean_interface)
+
+static std::set<std::string> listDirectory(const boost::filesystem::path& directory)
+{
+	std::set<std::string> names;
+	for(boost::filesystem::directory_iterator i(directory); i!=boost::filesystem::directory_iterator(); ++i)
+		names.insert(i->path().filename().string());
+	return names;
+}
+
+/**
+ * Predicts the model and images the predicted visibilities, i.e. calculates
+ * Aᴴ A of the model image.
+ */
+static void applyOperators(void* userData, const std::vector<double>& model, std::vector<std::complex<double>>& visibilities, std::vector<double>& image, int& result)
+{
+	result = wsclean_operator_A(userData, visibilities.data(), model.data());
+	if(result == 0)
+		result = wsclean_operator_At(userData, image.data(), visibilities.data());
+}
+
+BOOST_AUTO_TEST_CASE( concurrent_handles )
+{
+	const boost::filesystem::path directory =
+		boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("wsctest-interface-%%%%-%%%%");
+	boost::filesystem::create_directory(directory);
+	const std::string msPath = (directory / "synthetic.ms").string();
+	{
+		SyntheticMS::Setup setup;
+		setup.antennaCount = 8;
+		setup.channelCount = 4;
+		setup.timestepCount = 8;
+		setup.sourceCount = 2;
+		setup.fieldOfView = 0.01;
+		setup.noiseStdDev = 0.0;
+		setup.temporaryDirectory = directory.string();
+		SyntheticMS synthetic(setup);
+		synthetic.WriteMeasurementSet(msPath);
+	}
+	// The operators used to write temporary images to the working directory
+	const boost::filesystem::path oldWorkingDirectory = boost::filesystem::current_path();
+	boost::filesystem::current_path(directory);
+	const std::set<std::string> filesBefore = listDirectory(directory);
+
+	const size_t width = 64, height = 64;
+	imaging_parameters parameters;
+	parameters.msPath = msPath.c_str();
+	parameters.imageWidth = width;
+	parameters.imageHeight = height;
+	parameters.pixelScaleX = wsclean_parse_angle("1amin");
+	parameters.pixelScaleY = parameters.pixelScaleX;
+	parameters.extraParameters = "-weight natural";
+	void* handles[2];
+	imaging_data data[2];
+	for(size_t h=0; h!=2; ++h)
+		BOOST_REQUIRE_EQUAL(wsclean_initialize(&handles[h], &parameters, &data[h]), 0);
+	BOOST_REQUIRE_EQUAL(data[0].dataSize, data[1].dataSize);
+	const size_t dataSize = data[0].dataSize;
+	BOOST_REQUIRE_GT(dataSize, 0);
+
+	std::vector<double> model(width * height, 0.0);
+	model[height/2 * width + width/2] = 1.0;
+	model[(height/2 + 5) * width + width/2 - 3] = 0.5;
+
+	std::vector<std::complex<double>> referenceVisibilities(dataSize);
+	std::vector<double> referenceImage(width * height);
+	int referenceResult;
+	applyOperators(handles[0], model, referenceVisibilities, referenceImage, referenceResult);
+	BOOST_REQUIRE_EQUAL(referenceResult, 0);
+
+	std::vector<std::complex<double>> visibilities[2];
+	std::vector<double> images[2];
+	int results[2];
+	std::vector<std::thread> threads;
+	for(size_t h=0; h!=2; ++h)
+	{
+		visibilities[h].resize(dataSize);
+		images[h].resize(width * height);
+		threads.emplace_back(applyOperators, handles[h], std::cref(model), std::ref(visibilities[h]), std::ref(images[h]), std::ref(results[h]));
+	}
+	for(std::thread& thread : threads)
+		thread.join();
+
+	double maxVisibility = 0.0, maxPixel = 0.0;
+	for(const std::complex<double>& value : referenceVisibilities)
+		maxVisibility = std::max(maxVisibility, std::abs(value));
+	for(double value : referenceImage)
+		maxPixel = std::max(maxPixel, std::fabs(value));
+	BOOST_CHECK_GT(maxVisibility, 0.0);
+	BOOST_CHECK_GT(maxPixel, 0.0);
+	for(size_t h=0; h!=2; ++h)
+	{
+		BOOST_CHECK_EQUAL(results[h], 0);
+		for(size_t i=0; i!=dataSize; ++i)
+			BOOST_CHECK_SMALL(std::abs(visibilities[h][i] - referenceVisibilities[i]), 1e-6 * maxVisibility);
+		for(size_t i=0; i!=width * height; ++i)
+			BOOST_CHECK_SMALL(images[h][i] - referenceImage[i], 1e-6 * maxPixel);
+	}
+
+	for(size_t h=0; h!=2; ++h)
+		BOOST_CHECK_EQUAL(wsclean_deinitialize(handles[h]), 0);
+
+	const std::set<std::string> filesAfter = listDirectory(directory);
+	BOOST_CHECK(filesBefore == filesAfter);
+	boost::filesystem::current_path(oldWorkingDirectory);
+	boost::filesystem::remove_all(directory);
+}
+
+BOOST_AUTO_TEST_CASE( errors_are_returned )
+{
+	imaging_parameters parameters;
+	parameters.msPath = "/nonexisting/wsctest-interface.ms";
+	parameters.imageWidth = 64;
+	parameters.imageHeight = 64;
+	parameters.pixelScaleX = wsclean_parse_angle("1amin");
+	parameters.pixelScaleY = parameters.pixelScaleX;
+	parameters.extraParameters = "";
+	void* userData = &parameters;
+	imaging_data data;
+	BOOST_CHECK_NE(wsclean_initialize(&userData, &parameters, &data), 0);
+	BOOST_CHECK(userData == nullptr);
+	BOOST_CHECK(std::string(wsclean_last_error()).find("wsclean_initialize") != std::string::npos);
+
+	BOOST_CHECK(std::isnan(wsclean_parse_angle("not an angle")));
+	BOOST_CHECK(std::string(wsclean_last_error()).find("wsclean_parse_angle") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,385 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../wsclean/imagebufferallocator.h"
+#include "../wsclean/wsmsgridder.h"
+#include "../wsclean/wstackinggridder.h"
+
+#include "../msproviders/contiguousms.h"
+#include "../msproviders/msprovider.h"
+#include "../msproviders/syntheticms.h"
+
+#include "../imageweights.h"
+#include "../msselection.h"
+#include "../polarization.h"
+#include "../uvector.h"
+
+#include <boost/filesystem/operations.hpp>
+
+#include <casacore/casa/Arrays/Array.h>
+#include <casacore/tables/Tables/ArrayColumn.h>
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <random>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(wsmsgridder)
+
+static const size_t imageSize = 64, wLayerCount = 16;
+static const double pixelScale = 1.0 * M_PI / (180.0 * 60.0);
+
+static SyntheticMS::Setup syntheticSetup()
+{
+	SyntheticMS::Setup setup;
+	setup.antennaCount = 8;
+	setup.channelCount = 4;
+	setup.timestepCount = 8;
+	setup.sourceCount = 2;
+	setup.fieldOfView = 0.01;
+	setup.noiseStdDev = 0.0;
+	return setup;
+}
+
+static std::unique_ptr<ImageWeights> makeWeights(SyntheticMS& ms, WeightMode mode)
+{
+	std::unique_ptr<ImageWeights> weights(new ImageWeights(mode, imageSize, imageSize, pixelScale, pixelScale));
+	weights->Grid(ms, MSSelection());
+	weights->FinishGridding();
+	return weights;
+}
+
+static void setupGridder(WSMSGridder& gridder, MSProvider& ms, const WeightMode& mode, ImageWeights& weights)
+{
+	gridder.SetImageWidth(imageSize);
+	gridder.SetImageHeight(imageSize);
+	gridder.SetPixelSizeX(pixelScale);
+	gridder.SetPixelSizeY(pixelScale);
+	gridder.SetWGridSize(wLayerCount);
+	gridder.SetWeighting(mode);
+	gridder.SetPrecalculatedWeightInfo(&weights);
+	gridder.AddMeasurementSet(&ms, MSSelection());
+}
+
+static void checkImagesEqual(const double* image, const double* reference, double tolerance = 1e-6)
+{
+	double maxPixel = 0.0;
+	for(size_t i=0; i!=imageSize*imageSize; ++i)
+		maxPixel = std::max(maxPixel, std::fabs(reference[i]));
+	BOOST_CHECK_GT(maxPixel, 0.0);
+	for(size_t i=0; i!=imageSize*imageSize; ++i)
+		BOOST_CHECK_SMALL(image[i] - reference[i], tolerance * maxPixel);
+}
+
+/**
+ * Finds a memory limit for which splitting the memory over @p gridderCount gridders
+ * multiplies the number of passes by at least @p gridderCount, in which case the
+ * gridder images the PSF or the polarizations one after the other. The limit is
+ * converted to the gridder's memory in the same way as WSMSGridder does.
+ * @returns The limit in GB, or zero when no such limit was found.
+ */
+static double splitMemoryLimit(size_t gridderCount)
+{
+	const double bytesPerGB = 1024.0*1024.0*1024.0;
+	for(size_t step=1; step!=256; ++step)
+	{
+		const double limit = double(step * imageSize * imageSize * sizeof(double)) / bytesPerGB;
+		const double memory = double(int64_t(limit * bytesPerGB)) * (7.0/10.0);
+		const size_t
+			singlePassCount = WStackingGridder::PassCount(imageSize, imageSize, 1, wLayerCount, memory),
+			splitPassCount = WStackingGridder::PassCount(imageSize, imageSize, 1, wLayerCount, memory/double(gridderCount));
+		if(splitPassCount >= singlePassCount*gridderCount)
+			return limit;
+	}
+	return 0.0;
+}
+
+/**
+ * Compares @ref WSMSGridder::InvertWithPSF() with imaging the PSF and the
+ * data with separate calls to @ref WSMSGridder::Invert().
+ * @param absMemLimit Memory limit of the gridders in GB, or zero for no limit.
+ */
+static void checkInvertWithPSF(double absMemLimit)
+{
+	SyntheticMS ms(syntheticSetup());
+	const WeightMode mode(WeightMode::UniformWeighted);
+	std::unique_ptr<ImageWeights> weights = makeWeights(ms, mode);
+	ImageBufferAllocator allocator;
+
+	ao::uvector<double> psf(imageSize*imageSize), dirty(imageSize*imageSize);
+	{
+		WSMSGridder gridder(&allocator, 1, 1.0, absMemLimit);
+		setupGridder(gridder, ms, mode, *weights);
+		gridder.SetDoImagePSF(true);
+		gridder.Invert();
+		std::copy_n(gridder.ImageRealResult(), imageSize*imageSize, psf.begin());
+		gridder.SetDoImagePSF(false);
+		gridder.Invert();
+		std::copy_n(gridder.ImageRealResult(), imageSize*imageSize, dirty.begin());
+	}
+
+	WSMSGridder gridder(&allocator, 1, 1.0, absMemLimit);
+	setupGridder(gridder, ms, mode, *weights);
+	BOOST_REQUIRE(gridder.SupportsInvertWithPSF());
+	gridder.InvertWithPSF();
+	checkImagesEqual(gridder.PSFImageResult(), psf.data());
+	checkImagesEqual(gridder.ImageRealResult(), dirty.data());
+	BOOST_CHECK(!gridder.DoImagePSF());
+}
+
+BOOST_AUTO_TEST_CASE( invert_with_psf )
+{
+	// Without a memory limit, all w-layers fit in a single pass, so the PSF and
+	// the data are gridded in the same pass.
+	checkInvertWithPSF(0.0);
+}
+
+BOOST_AUTO_TEST_CASE( invert_with_psf_fallback )
+{
+	const double absMemLimit = splitMemoryLimit(2);
+	BOOST_REQUIRE_GT(absMemLimit, 0.0);
+	checkInvertWithPSF(absMemLimit);
+}
+
+/**
+ * Largest absolute value of the model visibilities of the provider.
+ */
+static double maxModelValue(SyntheticMS& ms)
+{
+	ao::uvector<std::complex<float>> buffer(ms.GetSetup().channelCount);
+	double maxValue = 0.0;
+	for(ms.Reset(); ms.CurrentRowAvailable(); ms.NextRow())
+	{
+		ms.ReadModel(buffer.data());
+		for(const std::complex<float>& value : buffer)
+			maxValue = std::max(maxValue, double(std::abs(value)));
+	}
+	ms.Reset();
+	return maxValue;
+}
+
+/**
+ * Compares @ref WSMSGridder::PredictAndInvert() with writing the prediction to
+ * the provider with @ref WSMSGridder::Predict() and inverting with model subtraction.
+ * Only the latter should store the model visibilities in the provider.
+ */
+static void checkPredictAndInvert(const WeightMode& mode)
+{
+	// The model differs from the simulated sources, so that the residual is not empty
+	ao::uvector<double> model(imageSize*imageSize, 0.0);
+	model[imageSize/2 * imageSize + imageSize/2] = 1.0;
+	model[(imageSize/2 - 7) * imageSize + imageSize/2 + 4] = 0.5;
+	ImageBufferAllocator allocator;
+
+	ao::uvector<double> residual(imageSize*imageSize);
+	{
+		SyntheticMS ms(syntheticSetup());
+		std::unique_ptr<ImageWeights> weights = makeWeights(ms, mode);
+		WSMSGridder gridder(&allocator, 1, 1.0, 0.0);
+		setupGridder(gridder, ms, mode, *weights);
+		ao::uvector<double> modelCopy(model);
+		gridder.Predict(modelCopy.data());
+		BOOST_CHECK_GT(maxModelValue(ms), 0.0);
+		gridder.SetDoSubtractModel(true);
+		gridder.Invert();
+		std::copy_n(gridder.ImageRealResult(), imageSize*imageSize, residual.begin());
+	}
+
+	SyntheticMS ms(syntheticSetup());
+	std::unique_ptr<ImageWeights> weights = makeWeights(ms, mode);
+	WSMSGridder gridder(&allocator, 1, 1.0, 0.0);
+	setupGridder(gridder, ms, mode, *weights);
+	// Model subtraction is switched off during the combined pass, and restored afterwards
+	gridder.SetDoSubtractModel(true);
+	gridder.PredictAndInvert(model.data(), nullptr);
+	// The model visibilities are single precision when they are stored
+	checkImagesEqual(gridder.ImageRealResult(), residual.data(), 1e-5);
+	BOOST_CHECK_EQUAL(maxModelValue(ms), 0.0);
+	BOOST_CHECK(gridder.DoSubtractModel());
+}
+
+BOOST_AUTO_TEST_CASE( predict_and_invert_natural )
+{
+	checkPredictAndInvert(WeightMode(WeightMode::NaturalWeighted));
+}
+
+BOOST_AUTO_TEST_CASE( predict_and_invert_uniform )
+{
+	checkPredictAndInvert(WeightMode(WeightMode::UniformWeighted));
+}
+
+/**
+ * Gives access to the conversions of the MS providers, which
+ * @ref WSMSGridder::FormPolarization() should reproduce.
+ */
+struct MSProviderConversions : public MSProvider
+{
+	using MSProvider::copyWeightedData;
+	using MSProvider::copyWeights;
+};
+
+static void checkPolarizationProducts(const std::vector<PolarizationEnum>& msPolarizations, const std::vector<PolarizationEnum>& polarizations)
+{
+	// Channel 0 is unflagged, channels 1 to 4 have one flagged correlation
+	// each, channel 5 has a non-finite value and channel 6 is fully flagged.
+	const size_t channelCount = 7;
+	const casacore::IPosition shape(2, 4, channelCount);
+	casacore::Array<std::complex<float>> data(shape);
+	casacore::Array<float> weights(shape);
+	casacore::Array<bool> flags(shape, false);
+	std::mt19937 rnd(42);
+	std::uniform_real_distribution<float> distribution(-1.0, 1.0);
+	for(size_t i=0; i!=4*channelCount; ++i)
+	{
+		data.data()[i] = std::complex<float>(distribution(rnd), distribution(rnd));
+		weights.data()[i] = 1.5f + distribution(rnd);
+	}
+	for(size_t p=0; p!=4; ++p)
+	{
+		flags.data()[(p+1)*4 + p] = true;
+		flags.data()[6*4 + p] = true;
+	}
+	data.data()[5*4 + 2] = std::complex<float>(std::numeric_limits<float>::quiet_NaN(), 0.0);
+
+	// The instrumental polarizations as the gridder receives them
+	ao::uvector<std::complex<float>> instrumentalData(4*channelCount);
+	ao::uvector<float> instrumentalWeights(4*channelCount);
+	MSProviderConversions::copyWeightedData(instrumentalData.data(), 0, channelCount, msPolarizations, data, weights, flags, Polarization::Instrumental);
+	MSProviderConversions::copyWeights(instrumentalWeights.data(), 0, channelCount, msPolarizations, data, weights, flags, Polarization::Instrumental);
+
+	for(PolarizationEnum polarization : polarizations)
+	{
+		ao::uvector<std::complex<float>> expectedData(channelCount), formedData(channelCount);
+		ao::uvector<float> expectedWeights(channelCount), formedWeights(channelCount);
+		MSProviderConversions::copyWeightedData(expectedData.data(), 0, channelCount, msPolarizations, data, weights, flags, polarization);
+		MSProviderConversions::copyWeights(expectedWeights.data(), 0, channelCount, msPolarizations, data, weights, flags, polarization);
+
+		const WSMSGridder::PolarizationProduct product = WSMSGridder::GetPolarizationProduct(polarization, msPolarizations);
+		WSMSGridder::FormPolarization(product, channelCount, instrumentalData.data(), instrumentalWeights.data(), formedData.data(), formedWeights.data());
+		for(size_t ch=0; ch!=channelCount; ++ch)
+		{
+			BOOST_CHECK_SMALL(std::abs(formedData[ch] - expectedData[ch]), 1e-6f);
+			BOOST_CHECK_EQUAL(formedWeights[ch], expectedWeights[ch]);
+		}
+		BOOST_CHECK_NE(std::abs(formedData[0]), 0.0f);
+		BOOST_CHECK_NE(formedWeights[0], 0.0f);
+		BOOST_CHECK_EQUAL(formedWeights[6], 0.0f);
+		if(product.operation != WSMSGridder::PolarizationProduct::Copy)
+		{
+			// When only the first correlation is flagged, the sample is zero while its
+			// weight is the weight of the second correlation. When the second correlation
+			// is flagged, the weight is zero.
+			const size_t flaggedA = product.indexA + 1, flaggedB = product.indexB + 1;
+			BOOST_CHECK_EQUAL(formedData[flaggedA], std::complex<float>(0.0, 0.0));
+			BOOST_CHECK_EQUAL(formedWeights[flaggedA], weights.data()[flaggedA*4 + product.indexB]);
+			BOOST_CHECK_EQUAL(formedData[flaggedB], std::complex<float>(0.0, 0.0));
+			BOOST_CHECK_EQUAL(formedWeights[flaggedB], 0.0f);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE( polarization_products_linear )
+{
+	const std::vector<PolarizationEnum> msPolarizations { Polarization::XX, Polarization::XY, Polarization::YX, Polarization::YY };
+	checkPolarizationProducts(msPolarizations, { Polarization::StokesI, Polarization::StokesQ, Polarization::StokesU, Polarization::StokesV, Polarization::XY });
+	BOOST_CHECK_THROW(WSMSGridder::GetPolarizationProduct(Polarization::RR, msPolarizations), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE( polarization_products_circular )
+{
+	const std::vector<PolarizationEnum> msPolarizations { Polarization::RR, Polarization::RL, Polarization::LR, Polarization::LL };
+	checkPolarizationProducts(msPolarizations, { Polarization::StokesI, Polarization::StokesQ, Polarization::StokesU, Polarization::StokesV, Polarization::LR });
+	BOOST_CHECK_THROW(WSMSGridder::GetPolarizationProduct(Polarization::XX, msPolarizations), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE( joint_polarizations )
+{
+	const boost::filesystem::path directory =
+		boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("wsctest-gridder-%%%%-%%%%");
+	boost::filesystem::create_directory(directory);
+	const std::string msPath = (directory / "synthetic.ms").string();
+	SyntheticMS::Setup setup = syntheticSetup();
+	setup.temporaryDirectory = directory.string();
+	{
+		SyntheticMS synthetic(setup);
+		synthetic.WriteMeasurementSet(msPath);
+	}
+	// Give all correlations a signal, and give them different weights and flags,
+	// so that the Stokes parameters and their weights differ.
+	{
+		casacore::MeasurementSet ms(msPath, casacore::Table::Update);
+		casacore::ArrayColumn<casacore::Complex> dataColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::DATA));
+		casacore::ArrayColumn<bool> flagColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::FLAG));
+		casacore::ArrayColumn<float> weightColumn(ms, casacore::MS::columnName(casacore::MSMainEnums::WEIGHT_SPECTRUM));
+		const casacore::IPosition shape(2, 4, setup.channelCount);
+		casacore::Array<casacore::Complex> data(shape);
+		casacore::Array<bool> flags(shape);
+		casacore::Array<float> weights(shape);
+		for(size_t row=0; row!=ms.nrow(); ++row)
+		{
+			dataColumn.get(row, data);
+			for(size_t ch=0; ch!=setup.channelCount; ++ch)
+			{
+				casacore::Complex* correlations = &data.data()[ch*4];
+				const casacore::Complex stokesI = correlations[0];
+				correlations[1] = stokesI * casacore::Complex(0.2, 0.3);
+				correlations[2] = stokesI * casacore::Complex(0.1, -0.4);
+				correlations[3] = stokesI * 0.6f;
+			}
+			for(size_t i=0; i!=4*setup.channelCount; ++i)
+			{
+				flags.data()[i] = (row * 5 + i) % 11 == 0;
+				weights.data()[i] = 0.5f + 0.25f * float((row * 3 + i) % 4);
+			}
+			dataColumn.put(row, data);
+			flagColumn.put(row, flags);
+			weightColumn.put(row, weights);
+		}
+	}
+
+	const std::vector<PolarizationEnum> polarizations { Polarization::StokesI, Polarization::StokesQ, Polarization::StokesU, Polarization::StokesV };
+	const WeightMode mode(WeightMode::NaturalWeighted);
+	ImageBufferAllocator allocator;
+	std::vector<ao::uvector<double>> separateImages;
+	double stokesIWeight = 0.0;
+	for(PolarizationEnum polarization : polarizations)
+	{
+		ContiguousMS ms(msPath, "DATA", MSSelection(), polarization, 0, false);
+		ImageWeights weights(mode, imageSize, imageSize, pixelScale, pixelScale);
+		weights.Grid(ms, MSSelection());
+		weights.FinishGridding();
+		WSMSGridder gridder(&allocator, 1, 1.0, 0.0);
+		setupGridder(gridder, ms, mode, weights);
+		gridder.SetPolarization(polarization);
+		gridder.Invert();
+		separateImages.emplace_back(gridder.ImageRealResult(), gridder.ImageRealResult() + imageSize*imageSize);
+		if(polarization == Polarization::StokesI)
+			stokesIWeight = gridder.ImageWeight();
+	}
+
+	// Without a memory limit, the polarizations are gridded in the same pass. With the
+	// split limit, splitting the memory over the gridders costs more passes than it
+	// saves, and the polarizations are imaged one after the other.
+	const double splitLimit = splitMemoryLimit(polarizations.size());
+	BOOST_REQUIRE_GT(splitLimit, 0.0);
+	for(double absMemLimit : { 0.0, splitLimit })
+	{
+		ContiguousMS ms(msPath, "DATA", MSSelection(), Polarization::Instrumental, 0, false);
+		ImageWeights weights(mode, imageSize, imageSize, pixelScale, pixelScale);
+		weights.Grid(ms, MSSelection());
+		weights.FinishGridding();
+		WSMSGridder gridder(&allocator, 1, 1.0, absMemLimit);
+		setupGridder(gridder, ms, mode, weights);
+		BOOST_REQUIRE(gridder.SupportsJointPolarizations());
+		gridder.InvertPolarizations(polarizations, std::vector<double*>(), std::vector<double*>());
+		for(size_t i=0; i!=polarizations.size(); ++i)
+			checkImagesEqual(gridder.JointImageRealResult(i), separateImages[i].data());
+		BOOST_CHECK_CLOSE(gridder.ImageWeight(), stokesIWeight, 1e-6);
+	}
+	boost::filesystem::remove_all(directory);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
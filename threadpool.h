@@ -8,6 +8,7 @@
 #include <boost/thread/thread.hpp>
 #include <boost/function.hpp>
 
+#include <algorithm>
 #include <queue>
 
 class ThreadPool
@@ -47,6 +48,23 @@ public:
 	
 	size_t size() const { return _threads.size(); }
 	
+	/**
+	 * Splits [0, n) in consecutive ranges of at least minRangeSize elements,
+	 * calls f(start, end) for each range in parallel and waits for all of them
+	 * to finish.
+	 */
+	template<typename func>
+	void for_each_range(size_t n, size_t minRangeSize, func f)
+	{
+		const size_t rangeSize = std::max<size_t>(std::max<size_t>(minRangeSize, 1), (n + size()*4 - 1) / (size()*4));
+		for(size_t start=0; start<n; start+=rangeSize)
+		{
+			const size_t end = std::min(n, start + rangeSize);
+			queue([f, start, end]() { f(start, end); });
+		}
+		wait_for_all_tasks();
+	}
+	
 private:
 	void init_threads(size_t n)
 	{
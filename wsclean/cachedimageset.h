@@ -2,17 +2,23 @@
 #define CACHED_IMAGE_SET_H
 
 #include "../fitswriter.h"
-#include "../fitsreader.h"
 
 #include "imagebufferallocator.h"
+#include "imagecache.h"
 
 #include <string.h>
-#include <set>
+#include <memory>
 
+/**
+ * Keeps the images of a group between inversion, deconvolution and prediction.
+ * A single image is kept in memory; when there are more images, they are kept
+ * in an @ref ImageCache, so that they can be paged out to a scratch file. Up to
+ * a given amount of memory, recently used images are also kept in memory.
+ */
 class CachedImageSet
 {
 public:
-	CachedImageSet() : _polCount(0), _freqCount(0), _allocator(0), _image(0)
+	CachedImageSet() : _polCount(0), _freqCount(0), _cacheMemory(0), _allocator(0), _image(0)
 	{
 	}
 	
@@ -20,23 +26,24 @@ public:
 	{
 		if(_allocator != 0)
 			_allocator->Free(_image);
-		
-		for(std::set<std::string>::const_iterator filenamePtr=_storedNames.begin(); filenamePtr!=_storedNames.end(); ++filenamePtr)
-		{
-			std::remove(filenamePtr->c_str());
-		}
 	}
 	
-	void Initialize(const FitsWriter& writer, size_t polCount, size_t freqCount, const std::string& prefix, ImageBufferAllocator& allocator)
+	/**
+	 * @param cacheMemory Number of bytes of images that may be kept in memory, when
+	 * there is more than one image.
+	 */
+	void Initialize(const FitsWriter& writer, size_t polCount, size_t freqCount, const std::string& prefix, ImageBufferAllocator& allocator, size_t cacheMemory = 0)
 	{
 		_writer = writer;
 		_polCount = polCount;
 		_freqCount = freqCount;
 		_prefix = prefix;
+		_cacheMemory = cacheMemory;
 		if(_allocator != 0)
 			_allocator->Free(_image);
 		_image = 0;
 		_allocator = &allocator;
+		_cache.reset();
 	}
 	
 	void SetFitsWriter(const FitsWriter& writer)
@@ -55,8 +62,9 @@ public:
 			else
 				memcpy(image, _image, _writer.Width() * _writer.Height() * sizeof(double));
 		else {
-			FitsReader reader(name(polarization, freqIndex, isImaginary));
-			reader.Read(image);
+			if(!_cache)
+				throw std::runtime_error("Loading image before store");
+			_cache->Load(name(polarization, freqIndex, isImaginary), image);
 		}
 	}
 	
@@ -72,9 +80,12 @@ public:
 			memcpy(_image, image, _writer.Width() * _writer.Height() * sizeof(double));
 		}
 		else {
-			std::string n = name(polarization, freqIndex, isImaginary);
-			_writer.Write(n, image);
-			_storedNames.insert(n);
+			const size_t imageBytes = _writer.Width() * _writer.Height() * sizeof(double);
+			if(!_cache)
+				_cache.reset(new ImageCache(_prefix, imageBytes, _cacheMemory));
+			else if(_cache->ImageBytes() != imageBytes)
+				throw std::runtime_error("Image size changed while storing image in cache");
+			_cache->Store(name(polarization, freqIndex, isImaginary), image);
 		}
 	}
 	
@@ -84,9 +95,9 @@ private:
 		if(_freqCount == 1)
 		{
 			if(isImaginary)
-				return _prefix + '-' + Polarization::TypeToShortString(polarization) + "i-tmp.fits";
+				return _prefix + '-' + Polarization::TypeToShortString(polarization) + "i-tmp";
 			else
-				return _prefix + '-' + Polarization::TypeToShortString(polarization) + "-tmp.fits";
+				return _prefix + '-' + Polarization::TypeToShortString(polarization) + "-tmp";
 		}
 		else {
 			std::ostringstream str;
@@ -97,17 +108,18 @@ private:
 			if(freqIndex < 10) str << '0';
 			if(freqIndex < 100) str << '0';
 			if(freqIndex < 1000) str << '0';
-			str << freqIndex << "-tmp.fits";
+			str << freqIndex << "-tmp";
 			return str.str();
 		}
 	}
 	FitsWriter _writer;
 	size_t _polCount, _freqCount;
 	std::string _prefix;
+	size_t _cacheMemory;
 	
 	ImageBufferAllocator* _allocator;
 	double *_image;
-	std::set<std::string> _storedNames;
+	std::unique_ptr<ImageCache> _cache;
 };
 
 #endif
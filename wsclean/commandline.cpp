@@ -33,6 +33,9 @@ void CommandLine::printHelp()
 		"   Default: 100.\n"
 		"-absmem <memory limit>\n"
 		"   Like -mem, but this specifies a fixed amount of memory in gigabytes.\n"
+		"-image-cache-memory <gigabytes>\n"
+		"   Keep up to this amount of temporary model, residual and psf images in memory. Other\n"
+		"   temporary images are only kept in a scratch file. Default: 0.\n"
 		"-verbose (or -v)\n"
 		"   Increase verbosity of output.\n"
 		"-log-time\n"
@@ -53,6 +56,24 @@ void CommandLine::printHelp()
 		"   the model data column.\n"
 		"-no-dirty\n"
 		"   Do not save the dirty image.\n"
+		"-write-threads <threads>\n"
+		"   Write the output images with this many background threads, such that imaging continues while\n"
+		"   images are written. Default: 0 (write before continuing).\n"
+		"-pipeline-groups\n"
+		"   Restore and write the images of an independent group (e.g. an output channel or interval) in the\n"
+		"   background, while the next group is imaged. The output is the same. Uses extra memory for the\n"
+		"   images of one group. Ignored when cfitsio was not built to be reentrant.\n"
+		"-fits-compression <none, rice or gzip>\n"
+		"   Write output images with cfitsio tile compression. Rice compression quantizes the values;\n"
+		"   gzip compression is lossless with a quantize level of 0. Default: none.\n"
+		"-fits-quantize-level <level>\n"
+		"   Quantization level of compressed images (see the cfitsio documentation). Default: 4.\n"
+		"-timing-report <file>\n"
+		"   Measure the time spent in each stage, such as reading, gridding, FFTs, cleaning and\n"
+		"   writing images, and write the totals per stage and per thread to the given JSON file.\n"
+		"-timing-trace <file>\n"
+		"   Write the measured stages of every thread in the Chrome trace format to the given file,\n"
+		"   which can be opened in chrome://tracing or Perfetto.\n"
 		"-saveweights\n"
 		"   Save the gridded weights in the a fits file named <image-prefix>-weights.fits.\n"
 		"-saveuv\n"
@@ -67,6 +88,9 @@ void CommandLine::printHelp()
 		"   If a primary beam image exists on disk, reuse those images.\n"
 		"-use-differential-lofar-beam\n"
 		"   Assume the visibilities have already been beam-corrected for the reference direction.\n"
+		"-beam-reuse-tolerance <angle>\n"
+		"   Reuse the LOFAR station responses of the previous beam snapshot when the sky has rotated less than\n"
+		"   this angle with respect to the earth. Default: 0 (always recalculate).\n"
 		"-save-psf-pb\n"
 		"   When applying beam correction, also save the primary-beam corrected PSF image.\n"
 		"\n"
@@ -139,6 +163,9 @@ void CommandLine::printHelp()
 		"   Perform inversion at the Nyquist resolution and upscale the image to the requested image size afterwards.\n"
 		"   This speeds up inversion considerably, but makes aliasing slightly worse. This effect is\n"
 		"   in most cases <1%. Default: on.\n"
+		"-fft-timing-file <file>\n"
+		"   Select the small inversion size by the measured speed of the FFT, instead of by its prime factors.\n"
+		"   FFT timings are read from and added to the given file, so that each size is measured once per machine.\n"
 		"-gridmode <\"nn\", \"kb\" or \"rect\">\n"
 		"   Kernel and mode used for gridding: kb = Kaiser-Bessel (default with 7 pixels), nn = nearest\n"
 		"   neighbour (no kernel), rect = rectangular window. Default: kb.\n"
@@ -179,6 +206,11 @@ void CommandLine::printHelp()
 		"   telescopes with non-orthogonal feeds, such as MWA and LOFAR. The 'xy' polarization will output both\n"
 		"   a real and an imaginary image, which allows calculating true Stokes polarizations for those\n"
 		"   telescopes.\n"
+		"-joint-pol-gridding\n"
+		"   Read the visibilities once for all polarizations of an output channel, and grid the polarizations\n"
+		"   in a single pass, instead of once per polarization. Requires four correlations in the measurement\n"
+		"   sets. Complex polarizations (xy and yx) are gridded together, separately from the others. When set,\n"
+		"   the measurement sets are not reordered just because four polarizations are imaged.\n"
 		"-interval <start-index> <end-index>\n"
 		"   Only image the given time interval. Indices specify the timesteps, end index is exclusive.\n"
 		"   Default: image all time steps.\n"
@@ -301,6 +333,14 @@ void CommandLine::printHelp()
 		"   Decrease the number of channels as specified by -channelsout to the given number for\n"
 		"   deconvolution. Only possible in combination with one of the -fit-spectral options.\n"
 		"   Proper residuals/restored images will only be returned when mgain < 1.\n"
+		"-deconvolution-single-precision\n"
+		"   Store the images in single precision during deconvolution, which halves the memory\n"
+		"   used by the deconvolution. Integrated images and fits are still calculated in\n"
+		"   double precision. Only the default clean algorithm supports this; multi-scale,\n"
+		"   IUWT and MoreSane fall back to double precision.\n"
+		"-deconvolution-out-of-core\n"
+		"   Keep the deconvolution images in a memory-mapped scratch file (in the -tempdir if given)\n"
+		"   instead of in memory, so that only the parts that are used are resident.\n"
 		"-squared-channel-joining\n"
 		"   Use with -joinchannels to perform peak finding in the sum of squared values over\n"
 		"   channels, instead of the normal sum. This is useful for imaging QU polarizations\n"
@@ -367,17 +407,16 @@ size_t CommandLine::parse_size_t(const char* param, const char* name)
 	return v;
 }
 
-int CommandLine::Run(int argc, char* argv[])
+bool CommandLine::Parse(WSCleanSettings& settings, int argc, char* argv[], int& returnValue)
 {
 	if(argc < 2)
 	{
 		printHeader();
 		printHelp();
-		return -1;
+		returnValue = -1;
+		return false;
 	}
 	
-	WSClean wsclean;
-	WSCleanSettings& settings = wsclean.Settings();
 	int argi = 1;
 	bool mfsWeighting = false, noMFSWeighting = false;
 	bool hasCleanBorder = false;
@@ -393,13 +432,15 @@ int CommandLine::Run(int argc, char* argv[])
 #ifdef HAVE_IDG
 			Logger::Info << "IDG is available.\n";
 #endif
-			return 0;
+			returnValue = 0;
+			return false;
 		}
 		else if(param == "help")
 		{
 			printHeader();
 			printHelp();
-			return -1;
+			returnValue = -1;
+			return false;
 		}
 		else if(param == "quiet")
 		{
@@ -563,6 +604,10 @@ int CommandLine::Run(int argc, char* argv[])
 			++argi;
 			settings.polarizations = Polarization::ParseList(argv[argi]);
 		}
+		else if(param == "joint-pol-gridding")
+		{
+			settings.jointPolarizationGridding = true;
+		}
 		else if(param == "apply-primary-beam")
 		{
 			settings.applyPrimaryBeam = true;
@@ -575,6 +620,11 @@ int CommandLine::Run(int argc, char* argv[])
 		{
 			settings.useDifferentialLofarBeam = true;
 		}
+		else if(param == "beam-reuse-tolerance")
+		{
+			++argi;
+			settings.beamReuseTolerance = Angle::Parse(argv[argi], "beam reuse tolerance", Angle::Degrees);
+		}
 		else if(param == "save-psf-pb")
 		{
 			settings.savePsfPb = true;
@@ -670,6 +720,11 @@ int CommandLine::Run(int argc, char* argv[])
 		{
 			settings.smallInversion = false;
 		}
+		else if(param == "fft-timing-file")
+		{
+			++argi;
+			settings.fftTimingFile = argv[argi];
+		}
 		else if(param == "interval")
 		{
 			settings.startTimestep = parse_size_t(argv[argi+1], "interval");
@@ -825,6 +880,14 @@ int CommandLine::Run(int argc, char* argv[])
 			++argi;
 			settings.deconvolutionChannelCount = parse_size_t(argv[argi], "deconvolution-channels");
 		}
+		else if(param == "deconvolution-single-precision")
+		{
+			settings.deconvolutionSinglePrecision = true;
+		}
+		else if(param == "deconvolution-out-of-core")
+		{
+			settings.deconvolutionOutOfCore = true;
+		}
 		else if(param == "squared-channel-joining")
 		{
 			settings.squaredJoins = true;
@@ -955,6 +1018,11 @@ int CommandLine::Run(int argc, char* argv[])
 			++argi;
 			settings.absMemLimit = atof(argv[argi]);
 		}
+		else if(param == "image-cache-memory")
+		{
+			++argi;
+			settings.imageCacheMemory = atof(argv[argi]);
+		}
 		else if(param == "maxuvw-m")
 		{
 			++argi;
@@ -1020,6 +1088,43 @@ int CommandLine::Run(int argc, char* argv[])
 		{
 			settings.isDirtySaved = false;
 		}
+		else if(param == "write-threads")
+		{
+			++argi;
+			settings.writeThreadCount = parse_size_t(argv[argi], "write-threads");
+		}
+		else if(param == "pipeline-groups")
+		{
+			settings.pipelineGroups = true;
+		}
+		else if(param == "timing-report")
+		{
+			++argi;
+			settings.timingReportFile = argv[argi];
+		}
+		else if(param == "timing-trace")
+		{
+			++argi;
+			settings.timingTraceFile = argv[argi];
+		}
+		else if(param == "fits-compression")
+		{
+			++argi;
+			std::string method = argv[argi];
+			if(method == "none")
+				settings.fitsCompression = FitsWriter::NoCompression;
+			else if(method == "rice")
+				settings.fitsCompression = FitsWriter::RiceCompression;
+			else if(method == "gzip")
+				settings.fitsCompression = FitsWriter::GZipCompression;
+			else
+				throw std::runtime_error("Unknown FITS compression method: " + method);
+		}
+		else if(param == "fits-quantize-level")
+		{
+			++argi;
+			settings.fitsQuantizeLevel = atof(argv[argi]);
+		}
 		else {
 			throw std::runtime_error("Unknown parameter: " + param);
 		}
@@ -1041,6 +1146,17 @@ int CommandLine::Run(int argc, char* argv[])
 	for(int i=argi; i != argc; ++i)
 		settings.filenames.push_back(argv[i]);
 	
+	return true;
+}
+
+int CommandLine::Run(int argc, char* argv[])
+{
+	WSClean wsclean;
+	WSCleanSettings& settings = wsclean.Settings();
+	int returnValue = 0;
+	if(!Parse(settings, argc, argv, returnValue))
+		return returnValue;
+	
 	std::ostringstream commandLineStr;
 	commandLineStr << "wsclean";
 	for(int i=1; i!=argc; ++i)
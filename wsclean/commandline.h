@@ -4,9 +4,18 @@
 #include <string>
 #include <cstring>
 
+class WSCleanSettings;
+
 class CommandLine
 {
 public:
+	/**
+	 * Fill the settings from the command line, without running anything.
+	 * @returns false when the command line asks to only print the version or
+	 * help text; in that case @p returnValue is set to the exit code.
+	 */
+	static bool Parse(WSCleanSettings& settings, int argc, char* argv[], int& returnValue);
+	
 	static int Run(int argc, char *argv[]);
 	
 private:
@@ -0,0 +1,254 @@
+#include "../imagebufferallocator.h"
+#include "../imagingtable.h"
+#include "../instrumentation.h"
+#include "../logger.h"
+#include "../wsmsgridder.h"
+
+#include "../../deconvolution/genericclean.h"
+#include "../../deconvolution/imageset.h"
+
+#include "../../msproviders/syntheticms.h"
+
+#include "../../fftconvolver.h"
+#include "../../fftwmultithreadenabler.h"
+#include "../../imageweights.h"
+#include "../../msselection.h"
+#include "../../stopwatch.h"
+#include "../../system.h"
+#include "../../uvector.h"
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+
+/**
+ * Times the main computational parts of wsclean on reproducible, synthetic
+ * data: imaging weights, inversion, prediction, the combined prediction and
+ * inversion of a major iteration, FFT convolution and the minor loop. The data are generated by @ref SyntheticMS, so no measurement
+ * set is needed and runs with the same parameters process the same data.
+ */
+
+namespace {
+	void printSyntax()
+	{
+		SyntheticMS::Setup setup;
+		std::cout <<
+			"Syntax: wsclean-bench [options]\n"
+			"Options:\n"
+			"-antennas <count>\n   Number of antennas (default: " << setup.antennaCount << ").\n"
+			"-radius <metres>\n   Radius of the array (default: " << setup.arrayRadius << ").\n"
+			"-channels <count>\n   Number of channels (default: " << setup.channelCount << ").\n"
+			"-timesteps <count>\n   Number of timesteps (default: " << setup.timestepCount << ").\n"
+			"-sources <count>\n   Number of point sources (default: " << setup.sourceCount << ").\n"
+			"-noise <stddev>\n   Noise level of the visibilities (default: " << setup.noiseStdDev << ").\n"
+			"-seed <value>\n   Seed for the synthetic data (default: " << setup.seed << ").\n"
+			"-size <pixels>\n   Width and height of the images (default: 2048).\n"
+			"-scale <arcmin>\n   Pixel scale (default: 0.5).\n"
+			"-nwlayers <count>\n   Number of w-layers (default: determined by the gridder).\n"
+			"-niter <count>\n   Number of minor iterations (default: 1000).\n"
+			"-repeat <count>\n   Number of times each benchmark is run; the fastest run is reported (default: 1).\n"
+			"-j <threads>\n   Number of threads (default: all cores).\n"
+			"-timing-report <file>\n   Write the per-stage timing report of all runs to a JSON file.\n"
+			"-v\n   Show the output of the gridders.\n";
+	}
+
+	struct BenchmarkOptions
+	{
+		BenchmarkOptions() :
+			imageSize(2048),
+			pixelScale(0.5 * M_PI / (180.0 * 60.0)),
+			nWLayers(0),
+			nIter(1000),
+			repeatCount(1),
+			threadCount(System::ProcessorCount()),
+			timingReportFile(),
+			verbose(false)
+		{ }
+		size_t imageSize;
+		double pixelScale;
+		size_t nWLayers, nIter, repeatCount, threadCount;
+		std::string timingReportFile;
+		bool verbose;
+	};
+
+	/**
+	 * Runs @p function the requested number of times and prints the fastest run.
+	 * @param items The number of items (e.g. visibilities) processed by a run.
+	 */
+	template<typename Function>
+	void benchmark(const std::string& name, const BenchmarkOptions& options, size_t items, const std::string& unit, Function function)
+	{
+		double fastest = 0.0;
+		for(size_t i=0; i!=options.repeatCount; ++i)
+		{
+			Stopwatch watch(true);
+			function();
+			const double seconds = watch.Seconds();
+			if(i == 0 || seconds < fastest)
+				fastest = seconds;
+		}
+		std::cout << std::left << std::setw(20) << name << std::right << std::fixed << std::setprecision(3)
+			<< std::setw(10) << fastest << " s";
+		if(items != 0)
+			std::cout << std::setw(12) << std::setprecision(2) << double(items) / fastest * 1e-6 << " M" << unit << "/s";
+		std::cout << '\n';
+	}
+
+	void setupGridder(WSMSGridder& gridder, const BenchmarkOptions& options, ImageWeights& weights)
+	{
+		gridder.SetImageWidth(options.imageSize);
+		gridder.SetImageHeight(options.imageSize);
+		gridder.SetPixelSizeX(options.pixelScale);
+		gridder.SetPixelSizeY(options.pixelScale);
+		if(options.nWLayers != 0)
+			gridder.SetWGridSize(options.nWLayers);
+		else
+			gridder.SetNoWGridSize();
+		gridder.SetPrecalculatedWeightInfo(&weights);
+		gridder.SetVerbose(options.verbose);
+	}
+
+	void run(const SyntheticMS::Setup& setup, const BenchmarkOptions& options)
+	{
+		SyntheticMS ms(setup);
+		const size_t
+			nVisibilities = ms.RowCount() * setup.channelCount,
+			imageSize = options.imageSize * options.imageSize;
+		const MSSelection selection;
+		ImageBufferAllocator allocator;
+		std::cout << "Data: " << ms.RowCount() << " rows x " << setup.channelCount << " channels, image: "
+			<< options.imageSize << " x " << options.imageSize << ", threads: " << options.threadCount << "\n";
+
+		std::unique_ptr<ImageWeights> weights;
+		benchmark("weights", options, nVisibilities, "vis", [&]() {
+			weights.reset(new ImageWeights(WeightMode(WeightMode::UniformWeighted), options.imageSize, options.imageSize, options.pixelScale, options.pixelScale));
+			weights->Grid(ms, selection);
+			weights->FinishGridding();
+		});
+
+		ao::uvector<double> psf(imageSize), dirty(imageSize);
+		{
+			WSMSGridder gridder(&allocator, options.threadCount, 1.0, 0.0);
+			setupGridder(gridder, options, *weights);
+			gridder.AddMeasurementSet(&ms, selection);
+			gridder.SetDoImagePSF(true);
+			benchmark("invert-psf", options, nVisibilities, "vis", [&]() { gridder.Invert(); });
+			std::copy_n(gridder.ImageRealResult(), imageSize, psf.begin());
+			gridder.SetDoImagePSF(false);
+			benchmark("invert", options, nVisibilities, "vis", [&]() { gridder.Invert(); });
+			std::copy_n(gridder.ImageRealResult(), imageSize, dirty.begin());
+
+			// Predict the dirty image back, which has about the same w-range and
+			// amount of emission as a model image would have
+			ao::uvector<double> model(imageSize);
+			benchmark("predict", options, nVisibilities, "vis", [&]() {
+				std::copy(dirty.begin(), dirty.end(), model.begin());
+				gridder.Predict(model.data());
+			});
+			benchmark("predict-invert", options, nVisibilities, "vis", [&]() {
+				std::copy(dirty.begin(), dirty.end(), model.begin());
+				gridder.PredictAndInvert(model.data(), nullptr);
+			});
+		}
+
+		ao::uvector<double> kernel(imageSize), convolved(imageSize);
+		FFTConvolver::PrepareKernel(kernel.data(), psf.data(), options.imageSize, options.imageSize);
+		benchmark("fft-convolve", options, imageSize, "px", [&]() {
+			std::copy(dirty.begin(), dirty.end(), convolved.begin());
+			FFTConvolver::ConvolveSameSize(convolved.data(), kernel.data(), options.imageSize, options.imageSize);
+		});
+
+		ImagingTable table;
+		ImagingTableEntry& entry = table.AddEntry();
+		entry.index = 0;
+		entry.joinedGroupIndex = 0;
+		entry.outputChannelIndex = 0;
+		entry.squaredDeconvolutionIndex = 0;
+		entry.polarization = Polarization::StokesI;
+		entry.lowestFrequency = setup.startFrequency;
+		entry.highestFrequency = setup.startFrequency + setup.channelWidth * setup.channelCount;
+		entry.bandStartFrequency = entry.lowestFrequency;
+		entry.bandEndFrequency = entry.highestFrequency;
+		entry.imageCount = 1;
+		table.Update();
+		ImageSet residual(&table, allocator, 1, false, options.imageSize, options.imageSize),
+			model(&table, allocator, 1, false, options.imageSize, options.imageSize);
+		ao::uvector<const double*> psfs(1, psf.data());
+		const ao::uvector<double> frequencies(1, setup.startFrequency + 0.5 * setup.channelWidth * setup.channelCount), frequencyWeights(1, 1.0);
+		for(bool useClark : { false, true })
+		{
+			GenericClean clean(allocator, useClark);
+			clean.SetMaxNIter(options.nIter);
+			clean.SetThreshold(0.0);
+			clean.SetThreadCount(options.threadCount);
+			clean.SetSpectralFittingMode(NoSpectralFitting, 0);
+			clean.InitializeFrequencies(frequencies, frequencyWeights);
+			benchmark(useClark ? "minor-loop-clark" : "minor-loop-hogbom", options, options.nIter, "iter", [&]() {
+				residual.Set(0, dirty.data());
+				model = 0.0;
+				clean.SetIterationNumber(0);
+				bool reachedMajorThreshold = false;
+				clean.ExecuteMajorIteration(residual, model, psfs, options.imageSize, options.imageSize, reachedMajorThreshold);
+			});
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	SyntheticMS::Setup setup;
+	BenchmarkOptions options;
+	for(int argi=1; argi!=argc; ++argi)
+	{
+		const std::string param = argv[argi][0] == '-' ? std::string(&argv[argi][1]) : std::string();
+		if(param == "v")
+			options.verbose = true;
+		else if(argi + 1 == argc || param.empty())
+		{
+			printSyntax();
+			return -1;
+		}
+		else {
+			++argi;
+			const char* value = argv[argi];
+			if(param == "antennas") setup.antennaCount = atoi(value);
+			else if(param == "radius") setup.arrayRadius = atof(value);
+			else if(param == "channels") setup.channelCount = atoi(value);
+			else if(param == "timesteps") setup.timestepCount = atoi(value);
+			else if(param == "sources") setup.sourceCount = atoi(value);
+			else if(param == "noise") setup.noiseStdDev = atof(value);
+			else if(param == "seed") setup.seed = atoi(value);
+			else if(param == "size") options.imageSize = atoi(value);
+			else if(param == "scale") options.pixelScale = atof(value) * M_PI / (180.0 * 60.0);
+			else if(param == "nwlayers") options.nWLayers = atoi(value);
+			else if(param == "niter") options.nIter = atoi(value);
+			else if(param == "repeat") options.repeatCount = std::max(1, atoi(value));
+			else if(param == "j") options.threadCount = atoi(value);
+			else if(param == "timing-report") options.timingReportFile = value;
+			else {
+				printSyntax();
+				return -1;
+			}
+		}
+	}
+
+	Logger::SetVerbosity(options.verbose ? Logger::NormalVerbosity : Logger::QuietVerbosity);
+	FFTWMultiThreadEnabler fftwMultiThreading(false);
+	if(!options.timingReportFile.empty())
+		Instrumentation::Enable(false);
+	try {
+		run(setup, options);
+	} catch(std::exception& e)
+	{
+		std::cerr << "Benchmark failed: " << e.what() << '\n';
+		return -1;
+	}
+	if(!options.timingReportFile.empty())
+	{
+		Instrumentation::Disable();
+		Instrumentation::WriteReport(options.timingReportFile);
+	}
+	return 0;
+}
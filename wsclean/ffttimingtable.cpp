@@ -0,0 +1,95 @@
+#include "ffttimingtable.h"
+
+#include "logger.h"
+
+#include <fftw3.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+
+FFTTimingTable::FFTTimingTable(const std::string& filename) :
+	_filename(filename),
+	_isChanged(false)
+{
+	if(!_filename.empty())
+	{
+		std::ifstream file(_filename);
+		size_t length;
+		double seconds;
+		while(file >> length >> seconds)
+			_times[length] = seconds;
+		if(!_times.empty())
+			Logger::Debug << "Read " << _times.size() << " FFT timings from " << _filename << ".\n";
+	}
+}
+
+void FFTTimingTable::Save()
+{
+	if(_isChanged && !_filename.empty())
+	{
+		// Write to a temporary file first, so that a concurrent run never reads a
+		// partially written table.
+		const std::string tempFilename = _filename + ".tmp";
+		{
+			std::ofstream file(tempFilename);
+			file.precision(9);
+			for(const std::pair<const size_t, double>& time : _times)
+				file << time.first << ' ' << time.second << '\n';
+			if(!file)
+				throw std::runtime_error("Could not write FFT timings to " + tempFilename);
+		}
+		if(std::rename(tempFilename.c_str(), _filename.c_str()) != 0)
+			throw std::runtime_error("Could not rename " + tempFilename + " to " + _filename);
+		_isChanged = false;
+	}
+}
+
+double FFTTimingTable::TransformTime(size_t length)
+{
+	std::map<size_t, double>::const_iterator iter = _times.find(length);
+	if(iter != _times.end())
+		return iter->second;
+	const double seconds = measure(length);
+	Logger::Debug << "Measured FFT of length " << length << ": " << seconds*1e6 << " us.\n";
+	_times.emplace(length, seconds);
+	_isChanged = true;
+	return seconds;
+}
+
+double FFTTimingTable::measure(size_t length)
+{
+	// Transform a batch of rows, so that short transforms take long enough to be
+	// timed, and repeat until the total time is long enough.
+	const size_t batchSize = std::max<size_t>(1, 65536 / length);
+	fftw_complex* data = reinterpret_cast<fftw_complex*>(fftw_malloc(length * batchSize * sizeof(fftw_complex)));
+	for(size_t i=0; i!=length*batchSize; ++i)
+	{
+		data[i][0] = double(i % 7);
+		data[i][1] = 0.0;
+	}
+	int n = length;
+	fftw_plan plan = fftw_plan_many_dft(1, &n, batchSize,
+		data, nullptr, 1, n,
+		data, nullptr, 1, n,
+		FFTW_FORWARD, FFTW_ESTIMATE);
+	
+	typedef std::chrono::steady_clock clock;
+	const clock::duration minimumDuration = std::chrono::milliseconds(20);
+	// The first execution is not timed, to exclude cold caches
+	fftw_execute(plan);
+	size_t repeatCount = 0;
+	const clock::time_point start = clock::now();
+	clock::duration duration;
+	do {
+		fftw_execute(plan);
+		++repeatCount;
+		duration = clock::now() - start;
+	} while(duration < minimumDuration || repeatCount < 3);
+	
+	fftw_destroy_plan(plan);
+	fftw_free(data);
+	return std::chrono::duration<double>(duration).count() / double(repeatCount * batchSize);
+}
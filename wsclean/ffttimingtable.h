@@ -0,0 +1,63 @@
+#ifndef FFT_TIMING_TABLE_H
+#define FFT_TIMING_TABLE_H
+
+#include <map>
+#include <string>
+
+/**
+ * Table with the measured time of one-dimensional complex FFTs, per transform
+ * length. Timings that are not in the table are measured when they are
+ * requested, with the same planner flags as used by the gridder. The table can
+ * be stored in a file, such that every size is measured only once per machine.
+ *
+ * The time of a two-dimensional FFT is estimated from the row and column
+ * transforms that it consists of.
+ */
+class FFTTimingTable
+{
+public:
+	/**
+	 * Construct a table and read the timings from @p filename, if the file exists.
+	 * When @p filename is empty, timings are not stored.
+	 */
+	explicit FFTTimingTable(const std::string& filename);
+	
+	/**
+	 * Writes the table to its file when new sizes were measured.
+	 * @throws std::runtime_error when the file can not be written.
+	 */
+	void Save();
+	
+	/**
+	 * Time in seconds of one complex FFT of the given length.
+	 */
+	double TransformTime(size_t length);
+	
+	/**
+	 * Estimated time in seconds of a complex FFT of width x height.
+	 */
+	double Transform2DTime(size_t width, size_t height)
+	{
+		return height * TransformTime(width) + width * TransformTime(height);
+	}
+	
+	/**
+	 * Sets the time for a transform length, instead of measuring it.
+	 */
+	void SetTransformTime(size_t length, double seconds)
+	{
+		_times[length] = seconds;
+		_isChanged = true;
+	}
+	
+	size_t Size() const { return _times.size(); }
+	
+private:
+	static double measure(size_t length);
+	
+	std::string _filename;
+	std::map<size_t, double> _times;
+	bool _isChanged;
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include "fitswriterqueue.h"
+
+#include "logger.h"
+
+#include "../fitsiochecker.h"
+
+#include <stdexcept>
+
+FitsWriterQueue::FitsWriterQueue(size_t threadCount, size_t maxQueuedImages) :
+	_maxQueuedImages(std::max<size_t>(maxQueuedImages, 1)),
+	_activeWrites(0),
+	_stop(false)
+{
+	// The main thread keeps reading and writing FITS files, so even a single
+	// background writer needs a reentrant cfitsio.
+	if(threadCount != 0 && !FitsIOChecker::IsThreadSafe())
+	{
+		Logger::Warn << "WARNING: cfitsio was not built to be reentrant; images are written without background threads.\n";
+		threadCount = 0;
+	}
+	for(size_t i=0; i!=threadCount; ++i)
+		_threads.emplace_back(&FitsWriterQueue::writeThreadFunction, this);
+}
+
+FitsWriterQueue::~FitsWriterQueue()
+{
+	try {
+		Flush();
+	} catch(std::exception& e) {
+		Logger::Error << "Error while writing image: " << e.what() << '\n';
+	}
+	{
+		std::lock_guard<std::mutex> guard(_mutex);
+		_stop = true;
+	}
+	_changed.notify_all();
+	for(std::thread& thread : _threads)
+		thread.join();
+}
+
+void FitsWriterQueue::Write(const FitsWriter& writer, const std::string& filename, const double* image)
+{
+	if(_threads.empty())
+	{
+		writer.Write(filename, image);
+		return;
+	}
+	
+	std::unique_ptr<Task> task(new Task(writer, filename, image));
+	std::unique_lock<std::mutex> lock(_mutex);
+	rethrowError();
+	while(_queue.size() >= _maxQueuedImages)
+		_changed.wait(lock);
+	_queue.push_back(std::move(task));
+	_changed.notify_all();
+}
+
+void FitsWriterQueue::Flush()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	while(!_queue.empty() || _activeWrites != 0)
+		_changed.wait(lock);
+	rethrowError();
+}
+
+void FitsWriterQueue::rethrowError()
+{
+	if(_error)
+	{
+		std::exception_ptr error = _error;
+		_error = std::exception_ptr();
+		std::rethrow_exception(error);
+	}
+}
+
+void FitsWriterQueue::writeThreadFunction()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	while(true)
+	{
+		while(_queue.empty() && !_stop)
+			_changed.wait(lock);
+		if(_queue.empty())
+			break;
+		
+		std::unique_ptr<Task> task = std::move(_queue.front());
+		_queue.pop_front();
+		++_activeWrites;
+		_changed.notify_all();
+		lock.unlock();
+		
+		std::exception_ptr error;
+		try {
+			task->writer.Write(task->filename, task->data.data());
+		} catch(...) {
+			error = std::current_exception();
+		}
+		task.reset();
+		
+		lock.lock();
+		if(error && !_error)
+			_error = error;
+		--_activeWrites;
+		_changed.notify_all();
+	}
+}
@@ -0,0 +1,81 @@
+#ifndef FITS_WRITER_QUEUE_H
+#define FITS_WRITER_QUEUE_H
+
+#include "../fitswriter.h"
+#include "../uvector.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Writes FITS images on background threads, so that the imaging can continue
+ * while the output is being converted, compressed and written. Write() copies
+ * the image and the writer with its metadata, and returns as soon as the
+ * number of waiting images is below the queue limit. Several threads allow
+ * the (possibly compressed) images to be written in parallel.
+ *
+ * Images are only guaranteed to be on disk after Flush() returned. An error
+ * in one of the writing threads is rethrown by the next call to Write() or
+ * Flush().
+ *
+ * With zero threads, Write() writes the image before it returns. This is also
+ * done when cfitsio is not reentrant, because the writing threads would use
+ * cfitsio at the same time as the caller.
+ */
+class FitsWriterQueue
+{
+public:
+	/**
+	 * @param threadCount Number of writing threads. Ignored when cfitsio is not
+	 * reentrant, see @ref FitsIOChecker::IsThreadSafe().
+	 * @param maxQueuedImages Maximum number of images that wait to be written.
+	 */
+	FitsWriterQueue(size_t threadCount, size_t maxQueuedImages);
+	
+	/**
+	 * Writes the remaining images and stops the threads. Errors are reported
+	 * to the log, as they can not be thrown from the destructor.
+	 */
+	~FitsWriterQueue();
+	
+	FitsWriterQueue(const FitsWriterQueue&) = delete;
+	FitsWriterQueue& operator=(const FitsWriterQueue&) = delete;
+	
+	void Write(const FitsWriter& writer, const std::string& filename, const double* image);
+	
+	/**
+	 * Blocks until all queued images have been written.
+	 */
+	void Flush();
+	
+private:
+	struct Task
+	{
+		Task(const FitsWriter& imageWriter, const std::string& imageFilename, const double* image) :
+			writer(imageWriter), filename(imageFilename), data(image, image + imageWriter.Width()*imageWriter.Height())
+		{ }
+		FitsWriter writer;
+		std::string filename;
+		ao::uvector<double> data;
+	};
+	
+	void writeThreadFunction();
+	void rethrowError();
+	
+	size_t _maxQueuedImages;
+	std::deque<std::unique_ptr<Task>> _queue;
+	size_t _activeWrites;
+	bool _stop;
+	std::exception_ptr _error;
+	std::mutex _mutex;
+	std::condition_variable _changed;
+	std::vector<std::thread> _threads;
+};
+
+#endif
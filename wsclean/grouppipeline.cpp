@@ -0,0 +1,100 @@
+#include "grouppipeline.h"
+
+#include "logger.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+GroupPipeline::GroupPipeline(bool enabled, size_t maxQueuedTasks) :
+	_maxQueuedTasks(std::max<size_t>(maxQueuedTasks, 1)),
+	_isRunning(false),
+	_stop(false)
+{
+	if(enabled)
+		_thread = std::thread(&GroupPipeline::threadFunction, this);
+}
+
+GroupPipeline::~GroupPipeline()
+{
+	try {
+		Wait();
+	} catch(std::exception& e) {
+		Logger::Error << "Error while finishing imaging group: " << e.what() << '\n';
+	}
+	if(_thread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> guard(_mutex);
+			_stop = true;
+		}
+		_changed.notify_all();
+		_thread.join();
+	}
+}
+
+void GroupPipeline::Push(const std::function<void()>& task)
+{
+	if(!_thread.joinable())
+	{
+		task();
+		return;
+	}
+	
+	std::unique_lock<std::mutex> lock(_mutex);
+	rethrowError();
+	while(_queue.size() >= _maxQueuedTasks)
+		_changed.wait(lock);
+	_queue.push_back(task);
+	_changed.notify_all();
+}
+
+void GroupPipeline::Wait()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	while(!_queue.empty() || _isRunning)
+		_changed.wait(lock);
+	rethrowError();
+}
+
+void GroupPipeline::rethrowError()
+{
+	if(_error)
+	{
+		std::exception_ptr error = _error;
+		_error = std::exception_ptr();
+		std::rethrow_exception(error);
+	}
+}
+
+void GroupPipeline::threadFunction()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	while(true)
+	{
+		while(_queue.empty() && !_stop)
+			_changed.wait(lock);
+		if(_queue.empty())
+			break;
+		
+		std::function<void()> task = std::move(_queue.front());
+		_queue.pop_front();
+		_isRunning = true;
+		_changed.notify_all();
+		lock.unlock();
+		
+		std::exception_ptr error;
+		try {
+			task();
+		} catch(...) {
+			error = std::current_exception();
+		}
+		// Release what the task holds (e.g. images) before reporting that it finished
+		task = std::function<void()>();
+		
+		lock.lock();
+		if(error && !_error)
+			_error = error;
+		_isRunning = false;
+		_changed.notify_all();
+	}
+}
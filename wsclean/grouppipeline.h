@@ -0,0 +1,64 @@
+#ifndef GROUP_PIPELINE_H
+#define GROUP_PIPELINE_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/**
+ * Runs the final stage of independent imaging groups (restoring, primary beam
+ * correction and writing the output) on a background thread, so that the
+ * next group can already be gridded meanwhile. Tasks are run one at a time and
+ * in the order in which they were pushed, so the output is the same as when
+ * the groups are processed one after another.
+ *
+ * Push() returns as soon as the number of waiting tasks is below the limit; this
+ * bounds the memory that is held by the tasks, which normally contain the images
+ * of a group. An error in a task is rethrown by the next call to Push() or
+ * Wait().
+ *
+ * When the pipeline is disabled, Push() runs the task before it returns.
+ */
+class GroupPipeline
+{
+public:
+	/**
+	 * @param enabled Whether to run the tasks on a background thread.
+	 * @param maxQueuedTasks Maximum number of tasks that wait to be run, not
+	 * counting the task that is running.
+	 */
+	GroupPipeline(bool enabled, size_t maxQueuedTasks);
+	
+	/**
+	 * Runs the remaining tasks and stops the thread. Errors are reported to the
+	 * log, as they can not be thrown from the destructor.
+	 */
+	~GroupPipeline();
+	
+	GroupPipeline(const GroupPipeline&) = delete;
+	GroupPipeline& operator=(const GroupPipeline&) = delete;
+	
+	void Push(const std::function<void()>& task);
+	
+	/**
+	 * Blocks until all pushed tasks have finished. Must not be called from a task.
+	 */
+	void Wait();
+	
+private:
+	void threadFunction();
+	void rethrowError();
+	
+	size_t _maxQueuedTasks;
+	std::deque<std::function<void()>> _queue;
+	bool _isRunning, _stop;
+	std::exception_ptr _error;
+	std::mutex _mutex;
+	std::condition_variable _changed;
+	std::thread _thread;
+};
+
+#endif
@@ -0,0 +1,328 @@
+#include "imagebufferallocator.h"
+
+#ifndef USE_DIRECT_ALLOCATOR
+
+#include "logger.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+	/** Alignment of small buffers: a cache line, which is also enough for vector instructions. */
+	const size_t smallAlignment = 64;
+
+	std::string errorString()
+	{
+		int errsv = errno;
+		char buffer[1024];
+		return strerror_r(errsv, buffer, 1024);
+	}
+}
+
+ImageBufferAllocator::ImageBufferAllocator() :
+	_usedBuffers(),
+	_freeBuffers(),
+	_allocatedBytes(0),
+	_unusedBytes(0),
+	_memoryBudget(0),
+	_releaseCounter(0),
+	_nReal(0), _nComplex(0), _nRealMax(0), _nComplexMax(0),
+	_reuseCount(0), _allocationCount(0), _evictionCount(0), _maxAllocatedBytes(0)
+{
+	long pageCount = sysconf(_SC_PHYS_PAGES), pageSize = sysconf(_SC_PAGE_SIZE);
+	if(pageCount > 0 && pageSize > 0)
+		_memoryBudget = size_t(pageCount) * size_t(pageSize) / 2;
+	else
+		_memoryBudget = std::numeric_limits<size_t>::max();
+}
+
+ImageBufferAllocator::~ImageBufferAllocator()
+{
+	std::lock_guard<std::mutex> guard(_mutex);
+	if(!_usedBuffers.empty())
+	{
+		std::ostringstream str;
+		for(const std::pair<void* const, Buffer>& used : _usedBuffers)
+			str << "Still used: buffer of " << used.second.size << " bytes\n";
+		std::cerr << str.str() << _usedBuffers.size() << " image buffer(s) were still in use when image buffer allocator was destroyed!\n";
+		for(const std::pair<void* const, Buffer>& used : _usedBuffers)
+			releaseMemory(used.second.ptr, used.second.size);
+	}
+	for(const std::pair<const size_t, std::vector<Buffer>>& sizeClass : _freeBuffers)
+	{
+		for(const Buffer& buffer : sizeClass.second)
+			releaseMemory(buffer.ptr, buffer.size);
+	}
+}
+
+void ImageBufferAllocator::ReportStatistics() const
+{
+	std::lock_guard<std::mutex> guard(_mutex);
+	size_t unusedCount = 0;
+	for(const std::pair<const size_t, std::vector<Buffer>>& sizeClass : _freeBuffers)
+		unusedCount += sizeClass.second.size();
+	Logger::Info << "Image buf alloc stats:\n"
+		"         max alloc'd images = " << _nRealMax << " real + " << _nComplexMax << " complex\n"
+		"  allocations / reuses / evictions = " << _allocationCount << " / " << _reuseCount << " / " << _evictionCount << "\n"
+		"     current buffers in use = " << _usedBuffers.size() << " + " << unusedCount << " unused\n"
+		"      current allocated mem = " << round(_allocatedBytes/1e8)/10.0 << " GB (" << round(_unusedBytes/1e8)/10.0 << " GB unused)\n"
+		"          max allocated mem = " << round(_maxAllocatedBytes/1e8)/10.0 << " GB\n";
+}
+
+size_t ImageBufferAllocator::SizeClass(size_t bytes)
+{
+	if(bytes < HugePageThreshold)
+		return std::max<size_t>(1, (bytes + smallAlignment - 1) / smallAlignment) * smallAlignment;
+	else
+		return ((bytes + HugePageSize - 1) / HugePageSize) * HugePageSize;
+}
+
+void* ImageBufferAllocator::allocateBuffer(size_t bytes, BufferType type)
+{
+	const size_t size = SizeClass(bytes);
+	const unsigned node = currentNode();
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	if(type == RealBuffer)
+	{
+		++_nReal;
+		if(_nReal > _nRealMax) _nRealMax = _nReal;
+	}
+	else {
+		++_nComplex;
+		if(_nComplex > _nComplexMax) _nComplexMax = _nComplex;
+	}
+
+	std::map<size_t, std::vector<Buffer>>::iterator sizeClass = _freeBuffers.find(size);
+	if(sizeClass != _freeBuffers.end())
+	{
+		// Take the most recently freed buffer on this node, since it is most likely
+		// to be in cache; if there is none, take one from another node.
+		std::vector<Buffer>& list = sizeClass->second;
+		size_t index = list.size() - 1;
+		for(size_t i=list.size(); i!=0; --i)
+		{
+			if(list[i-1].node == node)
+			{
+				index = i-1;
+				break;
+			}
+		}
+		Buffer buffer = list[index];
+		list.erase(list.begin() + index);
+		if(list.empty())
+			_freeBuffers.erase(sizeClass);
+		buffer.type = type;
+		_unusedBytes -= size;
+		_usedBuffers.emplace(buffer.ptr, buffer);
+		++_reuseCount;
+		return buffer.ptr;
+	}
+
+	makeRoom(size);
+	// Mapping a large buffer can take a while; the bookkeeping is already done
+	// for this allocation, so the lock is not needed meanwhile.
+	_allocatedBytes += size;
+	if(_allocatedBytes > _maxAllocatedBytes) _maxAllocatedBytes = _allocatedBytes;
+	++_allocationCount;
+	lock.unlock();
+
+	Buffer buffer;
+	try {
+		buffer.ptr = allocateMemory(size);
+	} catch(...) {
+		lock.lock();
+		_allocatedBytes -= size;
+		if(type == RealBuffer) --_nReal; else --_nComplex;
+		throw;
+	}
+	buffer.size = size;
+	buffer.type = type;
+	buffer.node = node;
+	buffer.releaseIndex = 0;
+
+	lock.lock();
+	_usedBuffers.emplace(buffer.ptr, buffer);
+	return buffer.ptr;
+}
+
+void ImageBufferAllocator::freeBuffer(void* ptr, BufferType type)
+{
+	std::lock_guard<std::mutex> guard(_mutex);
+	std::unordered_map<void*, Buffer>::iterator used = _usedBuffers.find(ptr);
+	if(used == _usedBuffers.end() || used->second.type != type)
+	{
+		const char* message = (type == RealBuffer) ?
+			"Invalid or double call to ImageBufferAllocator::Free(double*)." :
+			"Invalid or double call to ImageBufferAllocator::Free(std::complex<double>*).";
+		std::cerr << message << '\n';
+		throw std::runtime_error(message);
+	}
+	Buffer buffer = used->second;
+	_usedBuffers.erase(used);
+	if(type == RealBuffer) --_nReal; else --_nComplex;
+
+	buffer.releaseIndex = _releaseCounter;
+	++_releaseCounter;
+	_freeBuffers[buffer.size].push_back(buffer);
+	_unusedBytes += buffer.size;
+	// The budget may have been lowered, or used buffers may have been allocated
+	// beyond it, so make sure that the unused buffers don't keep it exceeded.
+	makeRoom(0);
+}
+
+void ImageBufferAllocator::FreeUnused()
+{
+	std::lock_guard<std::mutex> guard(_mutex);
+	size_t unusedCount = 0;
+	while(!_freeBuffers.empty())
+	{
+		evict(_freeBuffers.begin(), 0);
+		++unusedCount;
+	}
+	if(unusedCount != 0)
+	{
+		Logger::Debug << "Freed " << unusedCount << " image buffer(s).\n";
+	}
+}
+
+void ImageBufferAllocator::SetMemoryBudget(size_t bytes)
+{
+	std::lock_guard<std::mutex> guard(_mutex);
+	_memoryBudget = bytes;
+	makeRoom(0);
+}
+
+size_t ImageBufferAllocator::AllocatedBytes() const
+{
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _allocatedBytes;
+}
+
+size_t ImageBufferAllocator::UnusedBytes() const
+{
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _unusedBytes;
+}
+
+void ImageBufferAllocator::evict(std::map<size_t, std::vector<Buffer>>::iterator sizeClass, size_t index)
+{
+	std::vector<Buffer>& list = sizeClass->second;
+	const Buffer buffer = list[index];
+	list.erase(list.begin() + index);
+	if(list.empty())
+		_freeBuffers.erase(sizeClass);
+	_unusedBytes -= buffer.size;
+	_allocatedBytes -= buffer.size;
+	++_evictionCount;
+	releaseMemory(buffer.ptr, buffer.size);
+}
+
+void ImageBufferAllocator::makeRoom(size_t bytes)
+{
+	while(_unusedBytes != 0 && _allocatedBytes + bytes > _memoryBudget)
+	{
+		// Evict the buffer that was freed the longest ago. There are only
+		// a few unused buffers, so a linear search is fine.
+		std::map<size_t, std::vector<Buffer>>::iterator oldestClass = _freeBuffers.end();
+		size_t oldestIndex = 0;
+		for(std::map<size_t, std::vector<Buffer>>::iterator i=_freeBuffers.begin(); i!=_freeBuffers.end(); ++i)
+		{
+			for(size_t j=0; j!=i->second.size(); ++j)
+			{
+				if(oldestClass == _freeBuffers.end() || i->second[j].releaseIndex < oldestClass->second[oldestIndex].releaseIndex)
+				{
+					oldestClass = i;
+					oldestIndex = j;
+				}
+			}
+		}
+		evict(oldestClass, oldestIndex);
+	}
+}
+
+void* ImageBufferAllocator::allocateMemory(size_t size)
+{
+	if(size < HugePageThreshold)
+	{
+		void* ptr;
+		int errVal = posix_memalign(&ptr, smallAlignment, size);
+		if(errVal != 0)
+		{
+			std::ostringstream msg;
+			msg << "posix_memalign() failed when allocating " << size << " bytes: ";
+			switch(errVal)
+			{
+				case EINVAL:
+					msg << "the alignment argument was not a power of two, or was not a multiple of sizeof(void *)";
+					break;
+				case ENOMEM:
+					msg << "there was insufficient memory to fulfill the allocation request.";
+					break;
+				default:
+					msg << "an unknown error value was returned";
+					break;
+			}
+			throw std::runtime_error(msg.str());
+		}
+		return ptr;
+	}
+	else {
+		// Map one huge page more than needed, so that the start can be aligned to a
+		// huge page, and unmap the parts before and after the aligned range. The
+		// pages are not touched here, so they are placed on the node that
+		// writes to them first.
+		const size_t mappedSize = size + HugePageSize;
+		char* mapped = reinterpret_cast<char*>(mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+		if(mapped == MAP_FAILED)
+		{
+			std::ostringstream msg;
+			msg << "mmap() failed when allocating " << size << " bytes: " << errorString();
+			throw std::runtime_error(msg.str());
+		}
+		const size_t offset = (HugePageSize - reinterpret_cast<uintptr_t>(mapped) % HugePageSize) % HugePageSize;
+		char* ptr = mapped + offset;
+		if(offset != 0)
+			munmap(mapped, offset);
+		if(offset != HugePageSize)
+			munmap(ptr + size, HugePageSize - offset);
+#ifdef MADV_HUGEPAGE
+		// Only a hint: it fails when transparent huge pages are disabled, which is fine
+		madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+		return ptr;
+	}
+}
+
+void ImageBufferAllocator::releaseMemory(void* ptr, size_t size)
+{
+	if(size < HugePageThreshold)
+		std::free(ptr);
+	else
+		munmap(ptr, size);
+}
+
+unsigned ImageBufferAllocator::currentNode()
+{
+#ifdef SYS_getcpu
+	unsigned cpu, node;
+	if(syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+		return node;
+#endif
+	return 0;
+}
+
+#endif // USE_DIRECT_ALLOCATOR
@@ -3,15 +3,34 @@
 
 #include <complex>
 #include <iostream>
+#include <map>
 #include <vector>
 #include <stdexcept>
 #include <mutex>
+#include <unordered_map>
 #include "logger.h"
 
 //#define USE_DIRECT_ALLOCATOR
 
 #ifndef USE_DIRECT_ALLOCATOR
 
+/**
+ * Allocates image buffers and keeps freed buffers for reuse, since the same image
+ * sizes are allocated and freed many times (e.g. in every major iteration).
+ *
+ * Buffers are rounded up to a size class and freed buffers are kept in a free
+ * list per size class, so that alternating between different image sizes
+ * (PSF, scratch images, w-layers) does not cause buffers to be released and
+ * reallocated. Unused buffers are only released when the total allocated memory
+ * would exceed the memory budget, starting with the buffer that has been unused
+ * the longest.
+ *
+ * Large buffers are mapped directly and aligned to huge pages, and transparent
+ * huge pages are requested for them. The allocator never touches the memory of a
+ * new buffer, so that the memory is placed on the NUMA node of the thread that
+ * first writes to it; the node is remembered, and a freed buffer is preferably
+ * reused by a thread running on the same node.
+ */
 class ImageBufferAllocator
 {
 public:
@@ -52,45 +71,11 @@ public:
 		ImageBufferAllocator* _allocator;
 	};
 	
-	ImageBufferAllocator() : _buffers(), _nReal(0), _nComplex(0), _nRealMax(0), _nComplexMax(0), _previousSize(0)
-	{ }
+	ImageBufferAllocator();
 	
-	~ImageBufferAllocator()
-	{
-		std::lock_guard<std::mutex> guard(_mutex);
-		size_t usedCount = 0;
-		std::ostringstream str;
-		for(std::vector<Buffer>::iterator i=_buffers.begin(); i!=_buffers.end(); ++i)
-		{
-			if(i->isFirstHalfUsed) {
-				++usedCount;
-				str << "Still used: buffer of " << i->size << '\n';
-			}
-			if(i->isSecondHalfUsed) {
-				++usedCount;
-				str << "Still used: buffer of " << i->size << '\n';
-			}
-			free(i->ptr);
-		}
-		if(usedCount != 0)
-		{
-			std::cerr << usedCount << " image buffer(s) were still in use when image buffer allocator was destroyed!\n";
-		}
-	}
+	~ImageBufferAllocator();
 	
-	void ReportStatistics() const
-	{
-		std::lock_guard<std::mutex> guard(_mutex);
-		double totalSize = 0.0;
-		for(std::vector<Buffer>::const_iterator i=_buffers.begin(); i!=_buffers.end(); ++i)
-		{
-			totalSize += double(i->size) * double(sizeof(double)*2);
-		}
-		Logger::Info << "Image buf alloc stats:\n"
-			"         max alloc'd images = " << _nRealMax << " real + " << _nComplexMax << " complex\n"
-			"       max allocated chunks = " << _buffers.size() << "\n"
-			"      current allocated mem = " << round(totalSize/1e8)/10.0 << " GB \n";
-	}
+	void ReportStatistics() const;
 	
 	void Allocate(size_t size, Ptr& ptr)
 	{
@@ -99,182 +84,105 @@ public:
 	
 	double* Allocate(size_t size)
 	{
-		if(size%2==1) ++size;
-		std::lock_guard<std::mutex> guard(_mutex);
-		
-		if(size != _previousSize)
-		{
-			FreeUnused();
-			_previousSize = size;
-		}
-		
-		++_nReal;
-		if(_nReal > _nRealMax) _nRealMax = _nReal;
-		for(std::vector<Buffer>::iterator i=_buffers.begin(); i!=_buffers.end(); ++i)
-		{
-			if(i->size == size)
-			{
-				if(!i->isFirstHalfUsed)
-				{
-					i->isFirstHalfUsed = true;
-					return i->ptr;
-				}
-				if(!i->isSecondHalfUsed)
-				{
-					i->isSecondHalfUsed = true;
-					return i->ptr + size;
-				}
-			}
-		}
-		Buffer* newBuffer = allocateNewBuffer(size);
-		newBuffer->isFirstHalfUsed = true;
-		return newBuffer->ptr;
+		return reinterpret_cast<double*>(allocateBuffer(size * sizeof(double), RealBuffer));
+	}
+	
+	/**
+	 * Allocate a single-precision image of the given number of values. The
+	 * buffer is taken from the same pool as double images, so a float image
+	 * occupies half the memory of its double counterpart.
+	 */
+	float* AllocateFloat(size_t size)
+	{
+		return reinterpret_cast<float*>(allocateBuffer(size * sizeof(float), RealBuffer));
 	}
 	
 	std::complex<double>* AllocateComplex(size_t size)
 	{
-		if(size%2==1) ++size;
-		std::lock_guard<std::mutex> guard(_mutex);
-		
-		if(size != _previousSize)
-		{
-			FreeUnused();
-			_previousSize = size;
-		}
-		
-		++_nComplex;
-		if(_nComplex > _nComplexMax) _nComplexMax = _nComplex;
-		for(std::vector<Buffer>::iterator i=_buffers.begin(); i!=_buffers.end(); ++i)
-		{
-			if(i->size == size)
-			{
-				if(!i->isFirstHalfUsed && !i->isSecondHalfUsed)
-				{
-					i->isFirstHalfUsed = true;
-					i->isSecondHalfUsed = true;
-					return reinterpret_cast<std::complex<double>*>(i->ptr);
-				}
-			}
-		}
-		Buffer* newBuffer = allocateNewBuffer(size);
-		newBuffer->isFirstHalfUsed = true;
-		newBuffer->isSecondHalfUsed = true;
-		return reinterpret_cast<std::complex<double>*>(newBuffer->ptr);
+		return reinterpret_cast<std::complex<double>*>(allocateBuffer(size * sizeof(std::complex<double>), ComplexBuffer));
 	}
 	
 	void Free(double* buffer)
 	{
-		if(buffer != 0)
-		{
-			std::lock_guard<std::mutex> guard(_mutex);
-			bool found = false;
-			for(std::vector<Buffer>::iterator i=_buffers.begin(); i!=_buffers.end(); ++i)
-			{
-				if(i->ptr == buffer)
-				{
-					found = true;
-					i->isFirstHalfUsed = false;
-					break;
-				}
-				else if(i->ptr + i->size == buffer)
-				{
-					found = true;
-					i->isSecondHalfUsed = false;
-					break;
-				}
-			}
-			if(!found)
-			{
-				std::cerr << "Invalid or double call to ImageBufferAllocator::Free(double*).\n";
-				throw std::runtime_error("Invalid or double call to ImageBufferAllocator::Free(double*).");
-			}
-			--_nReal;
-		}
+		if(buffer != nullptr)
+			freeBuffer(buffer, RealBuffer);
 	}
 	
-	void Free(std::complex<double>* buffer)
+	void Free(float* buffer)
 	{
-		if(buffer != 0)
-		{
-			std::lock_guard<std::mutex> guard(_mutex);
-			bool found = false;
-			for(std::vector<Buffer>::iterator i=_buffers.begin(); i!=_buffers.end(); ++i)
-			{
-				if(i->ptr == reinterpret_cast<double*>(buffer))
-				{
-					found = true;
-					i->isFirstHalfUsed = false;
-					i->isSecondHalfUsed = false;
-					break;
-				}
-			}
-			if(!found)
-			{
-				std::cerr << "Invalid or double call to ImageBufferAllocator::Free(std::complex<double>*).\n";
-				throw std::runtime_error("Invalid or double call to ImageBufferAllocator::Free(std::complex<double>*).");
-			}
-			--_nComplex;
-		}
+		if(buffer != nullptr)
+			freeBuffer(buffer, RealBuffer);
 	}
 	
-	void FreeUnused()
+	void Free(std::complex<double>* buffer)
 	{
-		size_t unusedCount = 0;
-		std::vector<Buffer>::iterator i=_buffers.begin();
-		while(i!=_buffers.end())
-		{
-			if(!i->isFirstHalfUsed && !i->isSecondHalfUsed)
-			{
-				free(i->ptr);
-				_buffers.erase(i);
-				i = _buffers.begin();
-				++unusedCount;
-			} else {
-				++i;
-			}
-		}
-		if(unusedCount != 0)
-		{
-			Logger::Debug << "Freed " << unusedCount << " image buffer(s).\n";
-		}
+		if(buffer != nullptr)
+			freeBuffer(buffer, ComplexBuffer);
 	}
 	
+	/**
+	 * Release all buffers that are not in use.
+	 */
+	void FreeUnused();
+	
+	/**
+	 * Set the number of bytes that the allocator may keep allocated, including
+	 * unused buffers. When an allocation would exceed the budget, unused buffers
+	 * are released. Buffers in use are never released, so the budget may be
+	 * exceeded when the buffers that are in use take more memory. The default is
+	 * half of the physical memory.
+	 */
+	void SetMemoryBudget(size_t bytes);
+	
+	size_t MemoryBudget() const { return _memoryBudget; }
+	
+	/** Total number of bytes of all allocated buffers, used or unused. */
+	size_t AllocatedBytes() const;
+	
+	/** Number of bytes of the buffers that are allocated but not used. */
+	size_t UnusedBytes() const;
+	
+	/** Size class of a request for the given number of bytes: the number of bytes that is actually reserved. */
+	static size_t SizeClass(size_t bytes);
+	
+	/** Buffers of this size or larger are mapped directly and use huge pages. */
+	static const size_t HugePageThreshold = 4*1024*1024;
+	
+	static const size_t HugePageSize = 2*1024*1024;
+	
 private:
+	enum BufferType { RealBuffer, ComplexBuffer };
+	
 	struct Buffer
 	{
-		double* ptr;
+		void* ptr;
 		size_t size;
-		bool isFirstHalfUsed, isSecondHalfUsed;
+		BufferType type;
+		/** NUMA node of the thread that allocated the buffer, which is where the memory was first touched. */
+		unsigned node;
+		/** Value of _releaseCounter when the buffer was freed, to find the least recently used buffer. */
+		size_t releaseIndex;
 	};
 	
-	Buffer* allocateNewBuffer(size_t size)
-	{
-		_buffers.push_back(Buffer());
-		Buffer* buffer = &_buffers.back();
-		int errVal = posix_memalign(reinterpret_cast<void**>(&buffer->ptr), sizeof(double)*2, size*sizeof(double) * 2);
-		if(errVal != 0)
-		{
-			std::ostringstream msg;
-			msg << "posix_memalign() failed when allocating " << size*sizeof(double) * 2 << " bytes: ";
-			switch(errVal)
-			{
-				case EINVAL:
-					msg << "the alignment argument was not a power of two, or was not a multiple of sizeof(void *)";
-				case ENOMEM:
-					msg << "there was insufficient memory to fulfill the allocation request.";
-				default:
-					msg << "an unknown error value was returned";
-			}
-			throw std::runtime_error(msg.str());
-		}
-		buffer->size = size;
-		buffer->isFirstHalfUsed = false;
-		buffer->isSecondHalfUsed = false;
-		return buffer;
-	}
-	
-	std::vector<Buffer> _buffers;
-	size_t _nReal, _nComplex, _nRealMax, _nComplexMax, _previousSize;
+	void* allocateBuffer(size_t bytes, BufferType type);
+	void freeBuffer(void* ptr, BufferType type);
+	
+	/** Remove the unused buffer at the given position from the free lists and release its memory. */
+	void evict(std::map<size_t, std::vector<Buffer>>::iterator sizeClass, size_t index);
+	/** Evict unused buffers until allocating @p bytes more fits in the budget, or no unused buffers remain. */
+	void makeRoom(size_t bytes);
+	
+	static void* allocateMemory(size_t size);
+	static void releaseMemory(void* ptr, size_t size);
+	static unsigned currentNode();
+	
+	/** Buffers that are in use, by pointer. */
+	std::unordered_map<void*, Buffer> _usedBuffers;
+	/** Unused buffers, by size class. The most recently freed buffer is at the back. */
+	std::map<size_t, std::vector<Buffer>> _freeBuffers;
+	size_t _allocatedBytes, _unusedBytes, _memoryBudget, _releaseCounter;
+	size_t _nReal, _nComplex, _nRealMax, _nComplexMax;
+	size_t _reuseCount, _allocationCount, _evictionCount, _maxAllocatedBytes;
 	mutable std::mutex _mutex;
 };
 
@@ -297,6 +205,11 @@ public:
 		return new std::complex<double>[size];
 	}
 	
+	float* AllocateFloat(size_t size)
+	{
+		return new float[size];
+	}
+	
 	void Free(double* buffer)
 	{
 		delete[] buffer;
@@ -306,6 +219,11 @@ public:
 	{
 		delete[] buffer;
 	}
+	
+	void Free(float* buffer)
+	{
+		delete[] buffer;
+	}
 };
 
 #endif // USE_DIRECT_ALLOCATOR
@@ -0,0 +1,171 @@
+#include "imagecache.h"
+
+#include "logger.h"
+
+#include <string.h>
+
+#include <stdexcept>
+
+ImageCache::ImageCache(const std::string& prefix, size_t imageBytes, size_t memoryBudget) :
+	_store(prefix, imageBytes),
+	_memoryCapacity(imageBytes == 0 ? 0 : memoryBudget / imageBytes),
+	_stop(false)
+{
+	if(_memoryCapacity != 0)
+	{
+		Logger::Debug << "Keeping up to " << _memoryCapacity << " cached images in memory.\n";
+		_writeThread = std::thread(&ImageCache::writeThreadFunction, this);
+	}
+}
+
+ImageCache::~ImageCache()
+{
+	{
+		std::lock_guard<std::mutex> guard(_mutex);
+		_stop = true;
+	}
+	_changed.notify_all();
+	if(_writeThread.joinable())
+		_writeThread.join();
+}
+
+void ImageCache::Store(const std::string& name, const void* image)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	Entry& entry = _entries[name];
+	if(entry.stored == 0)
+		entry.stored = _store.Allocate();
+	if(_memoryCapacity == 0)
+	{
+		memcpy(entry.stored, image, ImageBytes());
+		return;
+	}
+
+	if(entry.memory.empty())
+	{
+		makeRoom(lock);
+		entry.memory.resize(ImageBytes());
+		_lru.push_front(&entry);
+		entry.lruPosition = _lru.begin();
+	}
+	else {
+		// Don't change the image while it is being written
+		while(entry.isWriting)
+			_changed.wait(lock);
+		touch(entry);
+	}
+	memcpy(entry.memory.data(), image, ImageBytes());
+	if(!entry.isDirty)
+	{
+		entry.isDirty = true;
+		_writeQueue.push_back(&entry);
+		_changed.notify_all();
+	}
+}
+
+void ImageCache::Load(const std::string& name, void* image)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	std::map<std::string, Entry>::iterator iter = _entries.find(name);
+	if(iter == _entries.end())
+		throw std::runtime_error("Loading image before store");
+	Entry& entry = iter->second;
+	if(entry.memory.empty())
+	{
+		if(_memoryCapacity == 0)
+		{
+			memcpy(image, entry.stored, ImageBytes());
+			return;
+		}
+		// An image that is not in memory has been written, so it can be read back
+		// from the store.
+		makeRoom(lock);
+		entry.memory.resize(ImageBytes());
+		memcpy(entry.memory.data(), entry.stored, ImageBytes());
+		_lru.push_front(&entry);
+		entry.lruPosition = _lru.begin();
+	}
+	else {
+		touch(entry);
+	}
+	memcpy(image, entry.memory.data(), ImageBytes());
+}
+
+size_t ImageCache::MemoryImageCount() const
+{
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _lru.size();
+}
+
+void ImageCache::Flush()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	bool isFinished;
+	do {
+		isFinished = true;
+		for(const Entry* entry : _lru)
+		{
+			if(entry->isDirty || entry->isWriting)
+			{
+				isFinished = false;
+				_changed.wait(lock);
+				break;
+			}
+		}
+	} while(!isFinished);
+}
+
+void ImageCache::writeThreadFunction()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	while(true)
+	{
+		while(_writeQueue.empty() && !_stop)
+			_changed.wait(lock);
+		if(_writeQueue.empty())
+			break;
+		Entry* entry = _writeQueue.front();
+		_writeQueue.pop_front();
+		// The entry might have been written already to make room
+		if(entry->isDirty)
+		{
+			entry->isDirty = false;
+			entry->isWriting = true;
+			lock.unlock();
+			memcpy(entry->stored, entry->memory.data(), ImageBytes());
+			lock.lock();
+			entry->isWriting = false;
+			_changed.notify_all();
+		}
+	}
+}
+
+/**
+ * Removes least recently used images from memory until there is room for
+ * one more. Dirty images are written before they are removed. The lock might be
+ * temporarily released while waiting for the writer thread.
+ */
+void ImageCache::makeRoom(std::unique_lock<std::mutex>& lock)
+{
+	while(_lru.size() >= _memoryCapacity)
+	{
+		Entry& victim = *_lru.back();
+		if(victim.isWriting)
+			_changed.wait(lock);
+		else {
+			if(victim.isDirty)
+			{
+				memcpy(victim.stored, victim.memory.data(), ImageBytes());
+				victim.isDirty = false;
+			}
+			ao::uvector<char>().swap(victim.memory);
+			_lru.pop_back();
+			_changed.notify_all();
+		}
+	}
+}
+
+void ImageCache::touch(Entry& entry)
+{
+	_lru.splice(_lru.begin(), _lru, entry.lruPosition);
+}
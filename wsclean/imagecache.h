@@ -0,0 +1,91 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include "tiledimagestore.h"
+
+#include "../uvector.h"
+
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * Keeps named images of a fixed size. Every image has a page in a
+ * @ref TiledImageStore, in which it is stored as raw (native, little-endian)
+ * values. On top of that, the most recently used images are kept in memory, up
+ * to a configurable memory budget. Images in memory are written to their page
+ * by a background thread, so that Store() does not have to wait for the
+ * (possibly paged-out) store. When the budget is exceeded, the least recently
+ * used image is removed from memory, after it has been written.
+ *
+ * With a budget of zero, images are directly written to and read from the store.
+ */
+class ImageCache
+{
+public:
+	/**
+	 * @param prefix Prefix of the scratch file, which may include a directory.
+	 * @param imageBytes Size of a single image in bytes.
+	 * @param memoryBudget Maximum number of bytes of images to keep in memory.
+	 */
+	ImageCache(const std::string& prefix, size_t imageBytes, size_t memoryBudget);
+
+	/**
+	 * Waits for the writer thread to finish.
+	 */
+	~ImageCache();
+
+	ImageCache(const ImageCache&) = delete;
+	ImageCache& operator=(const ImageCache&) = delete;
+
+	void Store(const std::string& name, const void* image);
+
+	/**
+	 * Copies a stored image into @p image.
+	 * @throws std::runtime_error when no image with this name was stored.
+	 */
+	void Load(const std::string& name, void* image);
+
+	size_t ImageBytes() const { return _store.ImageBytes(); }
+
+	/**
+	 * Number of images that are currently held in memory.
+	 */
+	size_t MemoryImageCount() const;
+
+	/**
+	 * Blocks until all images in memory have been written to the store.
+	 */
+	void Flush();
+
+private:
+	struct Entry
+	{
+		Entry() : stored(0), isDirty(false), isWriting(false) { }
+		void* stored;
+		ao::uvector<char> memory;
+		bool isDirty, isWriting;
+		std::list<Entry*>::iterator lruPosition;
+	};
+
+	void writeThreadFunction();
+	void makeRoom(std::unique_lock<std::mutex>& lock);
+	void touch(Entry& entry);
+
+	TiledImageStore _store;
+	size_t _memoryCapacity;
+	std::map<std::string, Entry> _entries;
+	// Images that are held in memory, most recently used first
+	std::list<Entry*> _lru;
+	std::deque<Entry*> _writeQueue;
+	bool _stop;
+	mutable std::mutex _mutex;
+	std::condition_variable _changed;
+	std::thread _writeThread;
+};
+
+#endif
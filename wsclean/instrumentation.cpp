@@ -0,0 +1,253 @@
+#include "instrumentation.h"
+
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+std::atomic<bool> Instrumentation::_enabled(false);
+
+struct Instrumentation::ThreadRecord
+{
+	struct Event
+	{
+		Stage stage;
+		Clock::time_point start, end;
+		size_t items, index;
+	};
+	
+	explicit ThreadRecord(size_t threadIndex) : index(threadIndex)
+	{
+		Clear();
+	}
+	
+	void Clear()
+	{
+		for(size_t i=0; i!=StageCount; ++i)
+		{
+			durations[i] = Clock::duration::zero();
+			calls[i] = 0;
+			items[i] = 0;
+		}
+		events.clear();
+	}
+	
+	size_t index;
+	Clock::duration durations[StageCount];
+	size_t calls[StageCount], items[StageCount];
+	std::vector<Event> events;
+};
+
+struct Instrumentation::Registry
+{
+	Registry() : recordTrace(false), startTime(Clock::now())
+	{ }
+	
+	std::mutex mutex;
+	// Records are never removed, but the records of finished threads are
+	// in freeRecords and are reused by new threads
+	std::vector<std::unique_ptr<ThreadRecord>> records;
+	std::vector<ThreadRecord*> freeRecords;
+	std::atomic<bool> recordTrace;
+	Clock::time_point startTime;
+};
+
+Instrumentation::Registry& Instrumentation::registry()
+{
+	static Registry registry;
+	return registry;
+}
+
+Instrumentation::ThreadRecord& Instrumentation::threadRecord()
+{
+	// Gives the record back when the thread finishes. The gridders start new
+	// threads for every pass, so the number of records would otherwise grow with
+	// the number of passes instead of with the number of concurrent threads.
+	struct RecordSlot
+	{
+		RecordSlot() : record(nullptr) { }
+		~RecordSlot()
+		{
+			if(record != nullptr)
+			{
+				Registry& reg = registry();
+				std::lock_guard<std::mutex> lock(reg.mutex);
+				reg.freeRecords.push_back(record);
+			}
+		}
+		ThreadRecord* record;
+	};
+	// The registry should be constructed before, and thus destructed after, the slot
+	Registry& reg = registry();
+	static thread_local RecordSlot slot;
+	if(slot.record == nullptr)
+	{
+		std::lock_guard<std::mutex> lock(reg.mutex);
+		if(reg.freeRecords.empty())
+		{
+			reg.records.emplace_back(new ThreadRecord(reg.records.size()));
+			slot.record = reg.records.back().get();
+		}
+		else {
+			slot.record = reg.freeRecords.back();
+			reg.freeRecords.pop_back();
+		}
+	}
+	return *slot.record;
+}
+
+void Instrumentation::Enable(bool recordTrace)
+{
+	Registry& reg = registry();
+	std::lock_guard<std::mutex> lock(reg.mutex);
+	for(std::unique_ptr<ThreadRecord>& record : reg.records)
+		record->Clear();
+	reg.recordTrace.store(recordTrace, std::memory_order_relaxed);
+	reg.startTime = Clock::now();
+	_enabled.store(true, std::memory_order_relaxed);
+}
+
+const char* Instrumentation::StageName(Stage stage)
+{
+	switch(stage)
+	{
+		case ReorderStage: return "reordering";
+		case MSReadStage: return "ms-read";
+		case LaneWaitStage: return "lane-wait";
+		case GriddingStage: return "gridding";
+		case DegriddingStage: return "degridding";
+		case FFTStage: return "fft";
+		case PredictWriteStage: return "prediction-write";
+		case MinorLoopStage: return "minor-loop";
+		case FitsIOStage: return "fits-io";
+		default: return "unknown";
+	}
+}
+
+void Instrumentation::Add(Stage stage, Clock::duration duration, size_t items)
+{
+	ThreadRecord& record = threadRecord();
+	record.durations[stage] += duration;
+	++record.calls[stage];
+	record.items[stage] += items;
+}
+
+void Instrumentation::AddEvent(Stage stage, Clock::time_point start, Clock::time_point end, size_t items, size_t index)
+{
+	Add(stage, end - start, items);
+	if(registry().recordTrace.load(std::memory_order_relaxed))
+	{
+		ThreadRecord::Event event;
+		event.stage = stage;
+		event.start = start;
+		event.end = end;
+		event.items = items;
+		event.index = index;
+		threadRecord().events.push_back(event);
+	}
+}
+
+double Instrumentation::TotalSeconds(Stage stage)
+{
+	Registry& reg = registry();
+	std::lock_guard<std::mutex> lock(reg.mutex);
+	Clock::duration sum = Clock::duration::zero();
+	for(const std::unique_ptr<ThreadRecord>& record : reg.records)
+		sum += record->durations[stage];
+	return std::chrono::duration<double>(sum).count();
+}
+
+size_t Instrumentation::TotalItems(Stage stage)
+{
+	Registry& reg = registry();
+	std::lock_guard<std::mutex> lock(reg.mutex);
+	size_t sum = 0;
+	for(const std::unique_ptr<ThreadRecord>& record : reg.records)
+		sum += record->items[stage];
+	return sum;
+}
+
+void Instrumentation::WriteReport(const std::string& filename)
+{
+	Registry& reg = registry();
+	std::lock_guard<std::mutex> lock(reg.mutex);
+	std::ofstream file(filename);
+	if(!file)
+		throw std::runtime_error("Could not open timing report file " + filename);
+	file << std::fixed << std::setprecision(6);
+	
+	const double wallSeconds = std::chrono::duration<double>(Clock::now() - reg.startTime).count();
+	Clock::duration durations[StageCount];
+	size_t calls[StageCount], items[StageCount];
+	for(size_t i=0; i!=StageCount; ++i)
+	{
+		durations[i] = Clock::duration::zero();
+		calls[i] = 0;
+		items[i] = 0;
+		for(const std::unique_ptr<ThreadRecord>& record : reg.records)
+		{
+			durations[i] += record->durations[i];
+			calls[i] += record->calls[i];
+			items[i] += record->items[i];
+		}
+	}
+	
+	file << "{\n  \"wall_seconds\": " << wallSeconds << ",\n  \"stages\": {";
+	for(size_t i=0; i!=StageCount; ++i)
+	{
+		file << (i==0 ? "\n" : ",\n") << "    \"" << StageName(Stage(i)) << "\": { \"seconds\": "
+			<< std::chrono::duration<double>(durations[i]).count()
+			<< ", \"calls\": " << calls[i] << ", \"items\": " << items[i] << " }";
+	}
+	file << "\n  },\n  \"threads\": [";
+	bool isFirstThread = true;
+	for(const std::unique_ptr<ThreadRecord>& record : reg.records)
+	{
+		file << (isFirstThread ? "\n" : ",\n") << "    { \"thread\": " << record->index << ", \"stages\": {";
+		isFirstThread = false;
+		bool isFirstStage = true;
+		for(size_t i=0; i!=StageCount; ++i)
+		{
+			if(record->calls[i] != 0)
+			{
+				file << (isFirstStage ? " " : ", ") << '"' << StageName(Stage(i)) << "\": { \"seconds\": "
+					<< std::chrono::duration<double>(record->durations[i]).count()
+					<< ", \"calls\": " << record->calls[i] << ", \"items\": " << record->items[i] << " }";
+				isFirstStage = false;
+			}
+		}
+		file << " } }";
+	}
+	file << "\n  ]\n}\n";
+}
+
+void Instrumentation::WriteTrace(const std::string& filename)
+{
+	Registry& reg = registry();
+	std::lock_guard<std::mutex> lock(reg.mutex);
+	std::ofstream file(filename);
+	if(!file)
+		throw std::runtime_error("Could not open trace file " + filename);
+	// Times are in microseconds
+	file << std::fixed << std::setprecision(3);
+	
+	file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+	bool isFirst = true;
+	for(const std::unique_ptr<ThreadRecord>& record : reg.records)
+	{
+		for(const ThreadRecord::Event& event : record->events)
+		{
+			const double
+				start = std::chrono::duration<double, std::micro>(event.start - reg.startTime).count(),
+				duration = std::chrono::duration<double, std::micro>(event.end - event.start).count();
+			file << (isFirst ? "\n" : ",\n")
+				<< "{\"name\": \"" << StageName(event.stage) << "\", \"cat\": \"wsclean\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << record->index
+				<< ", \"ts\": " << start << ", \"dur\": " << duration
+				<< ", \"args\": {\"items\": " << event.items << ", \"index\": " << event.index << "}}";
+			isFirst = false;
+		}
+	}
+	file << "\n]}\n";
+}
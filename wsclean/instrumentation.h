@@ -0,0 +1,158 @@
+#ifndef INSTRUMENTATION_H
+#define INSTRUMENTATION_H
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string>
+
+/**
+ * Collects the time spent in the stages of imaging, such as reading the
+ * measurement set, gridding and Fourier transforming, to find out what limits
+ * the speed of a run. Times and item counts are aggregated per thread. The
+ * record of a finished thread is continued by the next new thread, so the
+ * threads of the report are the concurrent workers rather than OS threads.
+ * They can be written as a JSON report, and the individual scopes can be
+ * written as a trace that can be opened in Chrome's about:tracing or Perfetto.
+ *
+ * Instrumentation is disabled by default. In that case the timers only test
+ * a flag.
+ *
+ * Stage times are inclusive: e.g. the gridding time of a thread includes the
+ * time that the thread waited for new samples, which is also reported as lane
+ * wait time.
+ */
+class Instrumentation
+{
+public:
+	enum Stage {
+		ReorderStage,
+		MSReadStage,
+		LaneWaitStage,
+		GriddingStage,
+		DegriddingStage,
+		FFTStage,
+		PredictWriteStage,
+		MinorLoopStage,
+		FitsIOStage,
+		StageCount
+	};
+
+	typedef std::chrono::steady_clock Clock;
+
+	/**
+	 * Start collecting. Previously collected values are cleared.
+	 * @param recordTrace Whether to store every ScopedTimer scope for WriteTrace().
+	 */
+	static void Enable(bool recordTrace);
+
+	static void Disable() { _enabled.store(false, std::memory_order_relaxed); }
+
+	static bool IsEnabled() { return _enabled.load(std::memory_order_relaxed); }
+
+	static const char* StageName(Stage stage);
+
+	/**
+	 * Add a duration and number of processed items to the totals of the calling thread.
+	 */
+	static void Add(Stage stage, Clock::duration duration, size_t items);
+
+	/**
+	 * Like Add(), but also stores the scope for the trace when tracing.
+	 * @param index An index that is shown with the trace event, such as a
+	 * w-layer or pass index.
+	 */
+	static void AddEvent(Stage stage, Clock::time_point start, Clock::time_point end, size_t items, size_t index);
+
+	/**
+	 * Total time in seconds that all threads spent in the stage.
+	 */
+	static double TotalSeconds(Stage stage);
+
+	/**
+	 * Total number of items that all threads processed in the stage.
+	 */
+	static size_t TotalItems(Stage stage);
+
+	/**
+	 * Write the totals per stage and per thread as a JSON file. This
+	 * should only be called when no instrumented code is running.
+	 */
+	static void WriteReport(const std::string& filename);
+
+	/**
+	 * Write the recorded scopes in the Chrome trace event format. Requires
+	 * that tracing was enabled.
+	 */
+	static void WriteTrace(const std::string& filename);
+
+	/**
+	 * Adds the time of its lifetime to a stage, without storing a trace event.
+	 * Used for short scopes that are entered very often, such as reading a row.
+	 */
+	class Accumulator
+	{
+	public:
+		explicit Accumulator(Stage stage, size_t items = 1) :
+			_stage(stage), _items(items), _enabled(IsEnabled())
+		{
+			if(_enabled)
+				_start = Clock::now();
+		}
+
+		~Accumulator()
+		{
+			if(_enabled)
+				Add(_stage, Clock::now() - _start, _items);
+		}
+
+		Accumulator(const Accumulator&) = delete;
+		Accumulator& operator=(const Accumulator&) = delete;
+	private:
+		Stage _stage;
+		size_t _items;
+		bool _enabled;
+		Clock::time_point _start;
+	};
+
+	/**
+	 * Adds the time of its lifetime to a stage, and stores it as a trace event.
+	 */
+	class ScopedTimer
+	{
+	public:
+		explicit ScopedTimer(Stage stage, size_t index = 0) :
+			_stage(stage), _items(0), _index(index), _enabled(IsEnabled())
+		{
+			if(_enabled)
+				_start = Clock::now();
+		}
+
+		~ScopedTimer()
+		{
+			if(_enabled)
+				AddEvent(_stage, _start, Clock::now(), _items, _index);
+		}
+
+		void AddItems(size_t items) { _items += items; }
+
+		ScopedTimer(const ScopedTimer&) = delete;
+		ScopedTimer& operator=(const ScopedTimer&) = delete;
+	private:
+		Stage _stage;
+		size_t _items, _index;
+		bool _enabled;
+		Clock::time_point _start;
+	};
+
+private:
+	struct ThreadRecord;
+	struct Registry;
+
+	static Registry& registry();
+	static ThreadRecord& threadRecord();
+
+	static std::atomic<bool> _enabled;
+};
+
+#endif
@@ -8,6 +8,7 @@
 #include "../weightmode.h"
 
 #include <cmath>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -79,6 +80,7 @@ class MeasurementSetGridder
 		bool DoSubtractModel() const { return _doSubtractModel; }
 		bool AddToModel() const { return _addToModel; }
 		bool SmallInversion() const { return _smallInversion; }
+		const std::string& FFTTimingFile() const { return _fftTimingFile; }
 		PolarizationEnum Polarization() const { return _polarization; }
 		WeightMode Weighting() const { return _weighting; }
 		class ImageWeights* PrecalculatedWeightInfo() const { return _precalculatedWeightInfo; }
@@ -147,6 +149,14 @@ class MeasurementSetGridder
 		{ 
 			_smallInversion = smallInversion;
 		}
+		/**
+		 * When set, the small inversion size is selected using the FFT timings in
+		 * this file, and newly measured timings are added to it.
+		 */
+		void SetFFTTimingFile(const std::string& fftTimingFile)
+		{
+			_fftTimingFile = fftTimingFile;
+		}
 		void SetPrecalculatedWeightInfo(class ImageWeights* precalculatedWeightInfo)
 		{ 
 			_precalculatedWeightInfo = precalculatedWeightInfo;
@@ -180,7 +190,93 @@ class MeasurementSetGridder
 		
 		virtual void Predict(double* image) = 0;
 		virtual void Predict(double* real, double* imaginary) = 0;
+
+		/**
+		 * Predicts the visibilities of a model image and images the residual
+		 * visibilities, i.e. the data minus the prediction. The default implementation
+		 * writes the prediction to the MS providers with @ref Predict() and inverts with
+		 * model subtraction, which passes over the visibilities twice. Gridders
+		 * that override this subtract the prediction in memory instead, in which case
+		 * the model is not written to the MS providers.
+		 * @param imaginary Imaginary part of the model, or @c nullptr for a non-complex prediction.
+		 */
+		virtual void PredictAndInvert(double* real, double* imaginary)
+		{
+			if(imaginary == nullptr)
+				Predict(real);
+			else
+				Predict(real, imaginary);
+			const bool doSubtractModel = _doSubtractModel;
+			_doSubtractModel = true;
+			Invert();
+			_doSubtractModel = doSubtractModel;
+		}
+
+		/**
+		 * Whether the gridder implements @ref InvertPolarizations().
+		 */
+		virtual bool SupportsJointPolarizations() const { return false; }
+		
+		/**
+		 * Images several polarizations in a single pass over the visibilities, instead of
+		 * reading and gridding the visibilities once per polarization. The MS providers should
+		 * provide the instrumental polarizations (@ref Polarization::Instrumental). The
+		 * requested polarizations are formed from the correlations of each row in the same
+		 * way as the MS providers form a single polarization, and are weighted with their
+		 * own visibility weights. Afterwards, the images are available from
+		 * @ref JointImageRealResult(), while methods like @ref ImageWeight() describe the first
+		 * polarization. The PSF can not be imaged jointly.
+		 * @param polarizations The polarizations to image. They should either all be complex
+		 * or all be non-complex, as set with @ref SetIsComplex().
+		 * @param modelsReal Per polarization a model image that is predicted and subtracted
+		 * from the visibilities while they are gridded, as in @ref PredictAndInvert(). If empty,
+		 * nothing is predicted, and the model is subtracted when @ref DoSubtractModel() is set.
+		 * @param modelsImaginary Imaginary parts of the models of complex polarizations.
+		 */
+		virtual void InvertPolarizations(const std::vector<PolarizationEnum>& polarizations, const std::vector<double*>& modelsReal, const std::vector<double*>& modelsImaginary)
+		{
+			throw std::runtime_error("This gridder can not image polarizations jointly");
+		}
+		
+		/**
+		 * Image of a polarization after @ref InvertPolarizations().
+		 * @param index Index of the polarization in the list given to @ref InvertPolarizations().
+		 */
+		virtual double *JointImageRealResult(size_t index)
+		{
+			throw std::runtime_error("This gridder can not image polarizations jointly");
+		}
+		virtual double *JointImageImaginaryResult(size_t index)
+		{
+			throw std::runtime_error("This gridder can not image polarizations jointly");
+		}
 		
+		/**
+		 * Whether the gridder implements @ref InvertWithPSF().
+		 */
+		virtual bool SupportsInvertWithPSF() const { return false; }
+
+		/**
+		 * Images the PSF and the data in the same pass over the visibilities, instead
+		 * of calling @ref Invert() once with and once without @ref DoImagePSF(). The
+		 * PSF and the data are weighted identically, so methods like @ref ImageWeight()
+		 * describe both. Afterwards, the PSF is available from @ref PSFImageResult() and the
+		 * data from @ref ImageRealResult(). The model is subtracted from the data, but not
+		 * from the PSF, when @ref DoSubtractModel() is set. @ref DoImagePSF() is ignored.
+		 */
+		virtual void InvertWithPSF()
+		{
+			throw std::runtime_error("This gridder can not image the PSF and the data in a single pass");
+		}
+
+		/**
+		 * Image of the PSF after @ref InvertWithPSF().
+		 */
+		virtual double *PSFImageResult()
+		{
+			throw std::runtime_error("This gridder can not image the PSF and the data in a single pass");
+		}
+
 		virtual double *ImageRealResult() = 0;
 		virtual double *ImageImaginaryResult() = 0;
 		virtual double PhaseCentreRA() const = 0;
@@ -240,6 +336,7 @@ class MeasurementSetGridder
 		std::vector<MSProvider*> _measurementSets;
 		std::string _dataColumnName;
 		bool _doImagePSF, _doSubtractModel, _addToModel, _smallInversion;
+		std::string _fftTimingFile;
 		double _wLimit;
 		class ImageWeights *_precalculatedWeightInfo;
 		PolarizationEnum _polarization;
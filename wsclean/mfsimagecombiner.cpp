@@ -0,0 +1,77 @@
+#include "mfsimagecombiner.h"
+
+#include <algorithm>
+#include <cmath>
+
+void MFSImageCombiner::Add(const FitsWriter& channelWriter, const double* image, double weight)
+{
+	const size_t size = channelWriter.Width() * channelWriter.Height();
+	const double
+		lowFrequency = channelWriter.Frequency() - channelWriter.Bandwidth()*0.5,
+		highFrequency = channelWriter.Frequency() + channelWriter.Bandwidth()*0.5;
+	if(_imageCount == 0)
+	{
+		_writer = channelWriter;
+		_size = size;
+		_allocator.Allocate(size, _sum);
+		std::fill_n(_sum.data(), size, 0.0);
+		_lowestFrequency = lowFrequency;
+		_highestFrequency = highFrequency;
+	}
+	else {
+		_lowestFrequency = std::min(_lowestFrequency, lowFrequency);
+		_highestFrequency = std::max(_highestFrequency, highFrequency);
+	}
+	
+	if(!_weightImage)
+	{
+		// Switch to a per-pixel weight when this image has a non-finite pixel
+		const bool isFinite = std::all_of(image, image + size, [](double value) { return std::isfinite(value); });
+		if(!isFinite)
+		{
+			_allocator.Allocate(size, _weightImage);
+			std::fill_n(_weightImage.data(), size, _weightSum);
+		}
+	}
+	if(!_weightImage)
+	{
+		for(size_t i=0; i!=size; ++i)
+			_sum[i] += image[i] * weight;
+	}
+	else {
+		for(size_t i=0; i!=size; ++i)
+		{
+			if(std::isfinite(image[i]))
+			{
+				_sum[i] += image[i] * weight;
+				_weightImage[i] += weight;
+			}
+		}
+	}
+	
+	_weightSum += weight;
+	++_imageCount;
+}
+
+void MFSImageCombiner::GetAverage(double* image) const
+{
+	if(!_weightImage)
+	{
+		for(size_t i=0; i!=_size; ++i)
+			image[i] = _sum[i] / _weightSum;
+	}
+	else {
+		for(size_t i=0; i!=_size; ++i)
+			image[i] = _sum[i] / _weightImage[i];
+	}
+}
+
+FitsWriter MFSImageCombiner::Writer() const
+{
+	FitsWriter writer(_writer);
+	writer.SetFrequency((_lowestFrequency+_highestFrequency)*0.5, _highestFrequency-_lowestFrequency);
+	writer.SetExtraKeyword("WSCIMGWG", _weightSum);
+	writer.RemoveExtraKeyword("WSCCHANS");
+	writer.RemoveExtraKeyword("WSCCHANE");
+	return writer;
+}
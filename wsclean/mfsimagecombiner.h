@@ -0,0 +1,62 @@
+#ifndef MFS_IMAGE_COMBINER_H
+#define MFS_IMAGE_COMBINER_H
+
+#include "../fitswriter.h"
+
+#include "imagebufferallocator.h"
+
+/**
+ * Keeps the running weighted sum of the channel images of one MFS image, so
+ * that the MFS image can be made as soon as the last channel image has been
+ * added. Non-finite pixels of a channel image are excluded from the
+ * average of that pixel. A per-pixel weight image is only kept after the
+ * first non-finite pixel was added. The sum and weight image are taken
+ * from the allocator, so that they count against its memory budget.
+ */
+class MFSImageCombiner
+{
+public:
+	explicit MFSImageCombiner(ImageBufferAllocator& allocator) :
+		_allocator(allocator),
+		_imageCount(0),
+		_size(0),
+		_weightSum(0.0),
+		_lowestFrequency(0.0), _highestFrequency(0.0)
+	{ }
+	
+	MFSImageCombiner(const MFSImageCombiner&) = delete;
+	MFSImageCombiner& operator=(const MFSImageCombiner&) = delete;
+	
+	/**
+	 * Add a channel image.
+	 * @param channelWriter Writer of the channel image. The writer of the first
+	 * channel is used as the template for the MFS image.
+	 */
+	void Add(const FitsWriter& channelWriter, const double* image, double weight);
+	
+	/**
+	 * Calculate the weighted average of the added images. Pixels that were
+	 * never finite are NaN.
+	 */
+	void GetAverage(double* image) const;
+	
+	size_t ImageCount() const { return _imageCount; }
+	
+	/**
+	 * A writer with the metadata of the first channel image and the
+	 * frequency range of all added images.
+	 */
+	FitsWriter Writer() const;
+	
+	double WeightSum() const { return _weightSum; }
+	
+private:
+	ImageBufferAllocator& _allocator;
+	size_t _imageCount, _size;
+	FitsWriter _writer;
+	ImageBufferAllocator::Ptr _sum, _weightImage;
+	double _weightSum;
+	double _lowestFrequency, _highestFrequency;
+};
+
+#endif
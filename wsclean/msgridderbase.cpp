@@ -17,6 +17,10 @@
 #include <casacore/measures/TableMeasures/ScalarMeasColumn.h>
 #include <casacore/tables/Tables/ArrColDesc.h>
 
+#include <algorithm>
+
+boost::mutex MSGridderBase::_metaDataMutex;
+
 MSGridderBase::MSData::MSData() : msIndex(0), matchingRows(0), totalRowsProcessed(0)
 { }
 
@@ -35,10 +39,7 @@ MSGridderBase::MSGridderBase() :
 	_phaseCentreRA(0.0), _phaseCentreDec(0.0),
 	_phaseCentreDL(0.0), _phaseCentreDM(0.0),
 	_denormalPhaseCentre(false),
-	_griddedVisibilityCount(0),
-	_totalWeight(0.0),
-	_maxGriddedWeight(0.0),
-	_visibilityWeightSum(0.0)
+	_visibilityCounters()
 {
 }
 
@@ -204,15 +205,18 @@ void MSGridderBase::initializeMeasurementSet(MSGridderBase::MSData& msData)
 	MSProvider& msProvider = MeasurementSet(msData.msIndex);
 	msData.msProvider = &msProvider;
 	casacore::MeasurementSet& ms(msProvider.MS());
-	if(ms.nrow() == 0) throw std::runtime_error("Table has no rows (no data)");
-	
-	initializeBandData(ms, msData);
-	
-	calculateMSLimits(msData.SelectedBand(), msProvider.StartTime());
-	
-	initializePhaseCentre(ms, Selection(msData.msIndex).FieldId());
-	
-	initializeMetaData(ms, Selection(msData.msIndex).FieldId());
+	{
+		boost::mutex::scoped_lock lock(_metaDataMutex);
+		if(ms.nrow() == 0) throw std::runtime_error("Table has no rows (no data)");
+		
+		initializeBandData(ms, msData);
+		
+		calculateMSLimits(msData.SelectedBand(), msProvider.StartTime());
+		
+		initializePhaseCentre(ms, Selection(msData.msIndex).FieldId());
+		
+		initializeMetaData(ms, Selection(msData.msIndex).FieldId());
+	}
 	
 	if (msProvider.Polarization() == Polarization::Instrumental)
 		calculateWLimits<4>(msData);
@@ -260,8 +264,16 @@ void MSGridderBase::calculateOverallMetaData(const MSData* msDataVector)
 	if(SmallInversion())
 	{
 		size_t optWidth, optHeight, minWidth, minHeight;
-		SmallInversionOptimization::DetermineOptimalSize(_actualInversionWidth, _actualPixelSizeX, _theoreticalBeamSize, minWidth, optWidth);
-		SmallInversionOptimization::DetermineOptimalSize(_actualInversionHeight, _actualPixelSizeY, _theoreticalBeamSize, minHeight, optHeight);
+		if(FFTTimingFile().empty())
+		{
+			SmallInversionOptimization::DetermineOptimalSize(_actualInversionWidth, _actualPixelSizeX, _theoreticalBeamSize, minWidth, optWidth);
+			SmallInversionOptimization::DetermineOptimalSize(_actualInversionHeight, _actualPixelSizeY, _theoreticalBeamSize, minHeight, optHeight);
+		}
+		else {
+			FFTTimingTable timingTable(FFTTimingFile());
+			SmallInversionOptimization::DetermineFastestSize(_actualInversionWidth, _actualInversionHeight, _actualPixelSizeX, _actualPixelSizeY, _theoreticalBeamSize, timingTable, minWidth, minHeight, optWidth, optHeight);
+			timingTable.Save();
+		}
 		if(optWidth < _actualInversionWidth || optHeight < _actualInversionHeight)
 		{
 			size_t newWidth = std::max(std::min(optWidth, _actualInversionWidth), size_t(32));
@@ -286,17 +298,33 @@ void MSGridderBase::calculateOverallMetaData(const MSData* msDataVector)
 }
 
 template<size_t PolarizationCount>
-void MSGridderBase::readAndWeightVisibilities(MSProvider& msProvider, InversionRow& rowData, const BandData& curBand, float* weightBuffer, std::complex<float>* modelBuffer, const bool* isSelected)
+void MSGridderBase::rotatePSFVisibilities(InversionRow& rowData, const BandData& curBand) const
+{
+	if(HasDenormalPhaseCentre())
+	{
+		double lmsqrt = sqrt(1.0-PhaseCentreDL()*PhaseCentreDL()- PhaseCentreDM()*PhaseCentreDM());
+		double shiftFactor = 2.0*M_PI* (rowData.uvw[2] * (lmsqrt-1.0));
+		rotateVisibilities<PolarizationCount>(curBand, shiftFactor, rowData.data);
+	}
+}
+
+template<size_t PolarizationCount>
+void MSGridderBase::readPSFVisibilities(MSProvider& msProvider, InversionRow& rowData, const BandData& curBand)
+{
+	msProvider.ReadWeights(rowData.data);
+	rotatePSFVisibilities<PolarizationCount>(rowData, curBand);
+}
+
+template void MSGridderBase::readPSFVisibilities<1>(MSProvider& msProvider, InversionRow& rowData, const BandData& curBand);
+
+template void MSGridderBase::readPSFVisibilities<4>(MSProvider& msProvider, InversionRow& rowData, const BandData& curBand);
+
+template<size_t PolarizationCount>
+void MSGridderBase::readVisibilities(MSProvider& msProvider, InversionRow& rowData, const BandData& curBand, float* weightBuffer, std::complex<float>* modelBuffer, const bool* isSelected, InversionRow* psfRowData)
 {
 	if(DoImagePSF())
 	{
-		msProvider.ReadWeights(rowData.data);
-		if(HasDenormalPhaseCentre())
-		{
-			double lmsqrt = sqrt(1.0-PhaseCentreDL()*PhaseCentreDL()- PhaseCentreDM()*PhaseCentreDM());
-			double shiftFactor = 2.0*M_PI* (rowData.uvw[2] * (lmsqrt-1.0));
-			rotateVisibilities<PolarizationCount>(curBand, shiftFactor, rowData.data);
-		}
+		readPSFVisibilities<PolarizationCount>(msProvider, rowData, curBand);
 	}
 	else {
 		msProvider.ReadData(rowData.data);
@@ -315,6 +343,14 @@ void MSGridderBase::readAndWeightVisibilities(MSProvider& msProvider, InversionR
 	
 	msProvider.ReadWeights(weightBuffer);
 	
+	// The PSF is made from all weights, like readPSFVisibilities() does, so it
+	// is copied before the weights of unselected visibilities are zeroed.
+	if(psfRowData != nullptr)
+	{
+		std::copy_n(weightBuffer, curBand.ChannelCount()*PolarizationCount, psfRowData->data);
+		rotatePSFVisibilities<PolarizationCount>(*psfRowData, curBand);
+	}
+	
 	// Any visibilities that are not gridded in this pass
 	// should not contribute to the weight sum, so set these
 	// to have zero weight.
@@ -323,6 +359,19 @@ void MSGridderBase::readAndWeightVisibilities(MSProvider& msProvider, InversionR
 		if(!isSelected[ch])
 			weightBuffer[ch] = 0.0;
 	}
+}
+
+template void MSGridderBase::readVisibilities<1>(MSProvider& msProvider, InversionRow& newItem, const BandData& curBand, float* weightBuffer, std::complex<float>* modelBuffer, const bool* isSelected, InversionRow* psfRowData);
+
+template void MSGridderBase::readVisibilities<4>(MSProvider& msProvider, InversionRow& newItem, const BandData& curBand, float* weightBuffer, std::complex<float>* modelBuffer, const bool* isSelected, InversionRow* psfRowData);
+
+template<size_t PolarizationCount>
+void MSGridderBase::weightVisibilities(InversionRow& rowData, const BandData& curBand, float* weightBuffer, const double* imagingWeights, float* modelFactors, VisibilityCounters& counters)
+{
+	// The MS provider returns a model that is weighted the same way as the data,
+	// so a model that is subtracted later starts with the visibility weight
+	if(modelFactors != nullptr)
+		std::copy_n(weightBuffer, curBand.ChannelCount() * PolarizationCount, modelFactors);
 	
 	switch(VisibilityWeightingMode())
 	{
@@ -334,6 +383,11 @@ void MSGridderBase::readAndWeightVisibilities(MSProvider& msProvider, InversionR
 		case SquaredVisibilityWeighting:
 			for(size_t chp=0; chp!=curBand.ChannelCount() * PolarizationCount; ++chp)
 				rowData.data[chp] *= weightBuffer[chp];
+			if(modelFactors != nullptr)
+			{
+				for(size_t chp=0; chp!=curBand.ChannelCount() * PolarizationCount; ++chp)
+					modelFactors[chp] *= weightBuffer[chp];
+			}
 			break;
 		case UnitVisibilityWeighting:
 			for(size_t chp=0; chp!=curBand.ChannelCount() * PolarizationCount; ++chp)
@@ -343,6 +397,11 @@ void MSGridderBase::readAndWeightVisibilities(MSProvider& msProvider, InversionR
 				else
 					rowData.data[chp] /= weightBuffer[chp];
 			}
+			if(modelFactors != nullptr)
+			{
+				for(size_t chp=0; chp!=curBand.ChannelCount() * PolarizationCount; ++chp)
+					modelFactors[chp] = (weightBuffer[chp] == 0.0) ? 0.0 : 1.0;
+			}
 			break;
 	}
 	switch(Weighting().Mode())
@@ -355,17 +414,24 @@ void MSGridderBase::readAndWeightVisibilities(MSProvider& msProvider, InversionR
 			float* weightIter = weightBuffer;
 			for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
 			{
-				double
-					u = rowData.uvw[0] / curBand.ChannelWavelength(ch),
-					v = rowData.uvw[1] / curBand.ChannelWavelength(ch),
+				double weight;
+				if(imagingWeights == nullptr)
+				{
+					double
+						u = rowData.uvw[0] / curBand.ChannelWavelength(ch),
+						v = rowData.uvw[1] / curBand.ChannelWavelength(ch);
 					weight = PrecalculatedWeightInfo()->GetWeight(u, v);
+				}
+				else {
+					weight = imagingWeights[ch];
+				}
 				double cumWeight = weight * *weightIter;
 				if(cumWeight != 0.0)
 				{
-					_visibilityWeightSum += *weightIter * 0.5;
-					++_griddedVisibilityCount;
-					_maxGriddedWeight = std::max(cumWeight, _maxGriddedWeight);
-					_totalWeight += cumWeight;
+					counters.visibilityWeightSum += *weightIter * 0.5;
+					++counters.griddedVisibilityCount;
+					counters.maxGriddedWeight = std::max(cumWeight, counters.maxGriddedWeight);
+					counters.totalWeight += cumWeight;
 				}
 				for(size_t p=0; p!=PolarizationCount; ++p)
 				{
@@ -373,14 +439,19 @@ void MSGridderBase::readAndWeightVisibilities(MSProvider& msProvider, InversionR
 					++dataIter;
 					++weightIter;
 				}
+				if(modelFactors != nullptr)
+				{
+					for(size_t p=0; p!=PolarizationCount; ++p)
+						modelFactors[ch*PolarizationCount + p] *= weight;
+				}
 			}
 		} break;
 	}
 }
 
-template void MSGridderBase::readAndWeightVisibilities<1>(MSProvider& msProvider, InversionRow& newItem, const BandData& curBand, float* weightBuffer, std::complex<float>* modelBuffer, const bool* isSelected);
+template void MSGridderBase::weightVisibilities<1>(InversionRow& rowData, const BandData& curBand, float* weightBuffer, const double* imagingWeights, float* modelFactors, VisibilityCounters& counters);
 
-template void MSGridderBase::readAndWeightVisibilities<4>(MSProvider& msProvider, InversionRow& newItem, const BandData& curBand, float* weightBuffer, std::complex<float>* modelBuffer, const bool* isSelected);
+template void MSGridderBase::weightVisibilities<4>(InversionRow& rowData, const BandData& curBand, float* weightBuffer, const double* imagingWeights, float* modelFactors, VisibilityCounters& counters);
 
 template<size_t PolarizationCount>
 void MSGridderBase::rotateVisibilities(const BandData& bandData, double shiftFactor, std::complex<float>* dataIter)
@@ -4,6 +4,8 @@
 #include "inversionalgorithm.h"
 #include "../multibanddata.h"
 
+#include <boost/thread/mutex.hpp>
+
 class MSGridderBase : public MeasurementSetGridder
 {
 public:
@@ -15,9 +17,9 @@ public:
 	virtual double PhaseCentreDL() const final override { return _phaseCentreDL; }
 	virtual double PhaseCentreDM() const final override { return _phaseCentreDM; }
 	virtual bool HasDenormalPhaseCentre() const final override { return _denormalPhaseCentre; }
-	virtual double ImageWeight() const final override { return _totalWeight*0.5; }
+	virtual double ImageWeight() const final override { return _visibilityCounters.totalWeight*0.5; }
 	virtual double NormalizationFactor() const final override {
-		return NormalizeForWeighting() ? _totalWeight*0.5 : 1.0;
+		return NormalizeForWeighting() ? _visibilityCounters.totalWeight*0.5 : 1.0;
 	}
 	virtual double BeamSize() const final override { return _theoreticalBeamSize; }
 	
@@ -25,15 +27,15 @@ public:
 	 * This is the sum of the weights as given by the measurement set, before the
 	 * image weighting is applied.
 	 */
-	double VisibilityWeightSum() const { return _visibilityWeightSum; }
+	double VisibilityWeightSum() const { return _visibilityCounters.visibilityWeightSum; }
 	/**
 	 * The number of visibilities that were gridded.
 	 */
-	size_t GriddedVisibilityCount() const { return _griddedVisibilityCount; }
+	size_t GriddedVisibilityCount() const { return _visibilityCounters.griddedVisibilityCount; }
 	/**
 	 * The maximum weight, after having applied the imaging weighting.
 	 */
-	double MaxGriddedWeight() const { return _maxGriddedWeight; }
+	double MaxGriddedWeight() const { return _visibilityCounters.maxGriddedWeight; }
 	/**
 	 * The effective number of visibilities, taking into account imaging weighting
 	 * and visibility weighting. This number is relative to the "best" visibility:
@@ -50,6 +52,14 @@ public:
 	const std::string& Observer() const { return _observer; }
 	
 	const std::string& FieldName() const { return _fieldName; }
+	
+	/**
+	 * Casacore is not thread safe. Gridders in different threads (e.g. from separate
+	 * handles of the operator interface) lock this mutex while reading the
+	 * metadata tables, and other code that reads tables concurrently with a
+	 * gridder should do the same.
+	 */
+	static boost::mutex& MetaDataMutex() { return _metaDataMutex; }
 protected:
 	struct MSData
 	{
@@ -77,6 +87,20 @@ protected:
 		size_t dataDescId;
 		std::complex<float>* data;
 	};
+	
+	/**
+	 * Sums over the gridded visibilities, from which the normalization of the image
+	 * and the statistics of the imaging are calculated.
+	 */
+	struct VisibilityCounters
+	{
+		VisibilityCounters() : griddedVisibilityCount(0), totalWeight(0.0), maxGriddedWeight(0.0), visibilityWeightSum(0.0)
+		{ }
+		size_t griddedVisibilityCount;
+		double totalWeight;
+		double maxGriddedWeight;
+		double visibilityWeightSum;
+	};
 		
 	void resetMetaData()
 	{
@@ -109,8 +133,52 @@ protected:
 	
 	void calculateOverallMetaData(const MSData* msDataVector);
 	
+	/**
+	 * Reads the data (or weights when imaging the PSF) of the current row, and applies
+	 * the visibility and imaging weights to it.
+	 * @param modelFactors If not @c nullptr, receives per visibility the factor with which
+	 * a predicted, unweighted model visibility should be multiplied to be subtracted
+	 * from the weighted data, i.e., the visibility weight times the weighting factors
+	 * that were applied to the data. The factor is zero for unselected visibilities.
+	 */
 	template<size_t PolarizationCount>
-	void readAndWeightVisibilities(MSProvider& msProvider, InversionRow& rowData, const BandData& curBand, float* weightBuffer, std::complex<float>* modelBuffer, const bool* isSelected);
+	void readAndWeightVisibilities(MSProvider& msProvider, InversionRow& rowData, const BandData& curBand, float* weightBuffer, std::complex<float>* modelBuffer, const bool* isSelected, float* modelFactors = nullptr)
+	{
+		readVisibilities<PolarizationCount>(msProvider, rowData, curBand, weightBuffer, modelBuffer, isSelected);
+		weightVisibilities<PolarizationCount>(rowData, curBand, weightBuffer, nullptr, modelFactors, _visibilityCounters);
+	}
+	
+	/**
+	 * The first half of @ref readAndWeightVisibilities(): reads the data (or the weights
+	 * when imaging the PSF) of the current row, subtracts the model if requested, and
+	 * reads the visibility weights. Weights of visibilities that are not selected are
+	 * set to zero.
+	 * @param psfRowData If not @c nullptr, receives the visibilities of the PSF, which
+	 * are made from the weights that are read for the data, as in
+	 * @ref readPSFVisibilities(). Its uvw should already be set.
+	 */
+	template<size_t PolarizationCount>
+	void readVisibilities(MSProvider& msProvider, InversionRow& rowData, const BandData& curBand, float* weightBuffer, std::complex<float>* modelBuffer, const bool* isSelected, InversionRow* psfRowData = nullptr);
+	
+	/**
+	 * Reads the visibilities of the PSF for the current row, which are its weights,
+	 * phase rotated when the phase centre is denormal. This is what
+	 * @ref readVisibilities() reads when imaging the PSF.
+	 */
+	template<size_t PolarizationCount>
+	void readPSFVisibilities(MSProvider& msProvider, InversionRow& rowData, const BandData& curBand);
+	
+	/**
+	 * The second half of @ref readAndWeightVisibilities(): applies the visibility
+	 * weighting mode and the imaging weights to the row, and adds the row to the counters.
+	 * @param imagingWeights If not @c nullptr, the imaging weight of each channel,
+	 * e.g. when they are shared by several calls for the same row; otherwise they are
+	 * looked up.
+	 * @param counters The counters to which the weighted visibilities are added, normally
+	 * those of @ref visibilityCounters().
+	 */
+	template<size_t PolarizationCount>
+	void weightVisibilities(InversionRow& rowData, const BandData& curBand, float* weightBuffer, const double* imagingWeights, float* modelFactors, VisibilityCounters& counters);
 
 	double _maxW, _minW;
 	double _theoreticalBeamSize;
@@ -120,12 +188,14 @@ protected:
 	virtual size_t getSuggestedWGridSize() const = 0;
 	
 	void resetVisibilityCounters() {
-		_griddedVisibilityCount = 0;
-		_totalWeight = 0.0;
-		_maxGriddedWeight = 0.0;
+		_visibilityCounters.griddedVisibilityCount = 0;
+		_visibilityCounters.totalWeight = 0.0;
+		_visibilityCounters.maxGriddedWeight = 0.0;
 	}
 	
-	double totalWeight() const { return _totalWeight; }
+	double totalWeight() const { return _visibilityCounters.totalWeight; }
+	
+	VisibilityCounters& visibilityCounters() { return _visibilityCounters; }
 	
 	void initializeMSDataVector(std::vector<MSData>& msDataVector, size_t nPolInMSProvider);
 	
@@ -133,6 +203,12 @@ private:
 	template<size_t PolarizationCount>
 	static void rotateVisibilities(const BandData &bandData, double shiftFactor, std::complex<float>* dataIter);
 	
+	/**
+	 * Phase rotates the PSF visibilities of a row when the phase centre is denormal.
+	 */
+	template<size_t PolarizationCount>
+	void rotatePSFVisibilities(InversionRow& rowData, const BandData& curBand) const;
+	
 	void initializePhaseCentre(casacore::MeasurementSet& ms, size_t fieldId);
 	
 	void initializeBandData(casacore::MeasurementSet& ms, MSGridderBase::MSData& msData);
@@ -148,10 +224,9 @@ private:
 	bool _denormalPhaseCentre;
 	std::string _telescopeName, _observer, _fieldName;
 	
-	size_t _griddedVisibilityCount;
-	double _totalWeight;
-	double _maxGriddedWeight;
-	double _visibilityWeightSum;
+	VisibilityCounters _visibilityCounters;
+	
+	static boost::mutex _metaDataMutex;
 };
 
 #endif
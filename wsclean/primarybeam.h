@@ -194,6 +194,7 @@ private:
 		for(size_t i=0; i!=_msProviders.size(); ++i)
 			lbeam.AddMS(_msProviders[i].first, &_msProviders[i].second, i);
 		lbeam.SetUseDifferentialBeam(_settings.useDifferentialLofarBeam);
+		lbeam.SetBeamReuseTolerance(_settings.beamReuseTolerance);
 		lbeam.SetImageDetails(_settings.trimmedImageWidth, _settings.trimmedImageHeight, _settings.pixelScaleX, _settings.pixelScaleY, _phaseCentreRA, _phaseCentreDec, _phaseCentreDL, _phaseCentreDM);
 		lbeam.SetImageWeight(imageWeightCache);
 		lbeam.Make(beamImages);
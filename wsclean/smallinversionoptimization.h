@@ -1,6 +1,11 @@
 #ifndef SMALL_INVERSION_SIZE_H
 #define SMALL_INVERSION_SIZE_H
 
+#include "ffttimingtable.h"
+
+#include <cmath>
+#include <vector>
+
 class SmallInversionOptimization
 {
 public:
@@ -18,7 +23,57 @@ public:
 		if(optimalSize > size) optimalSize = size;
 	}
 	
+	/**
+	 * Like DetermineOptimalSize(), but selects the width and height with the
+	 * lowest FFT time according to the timing table, out of the first
+	 * @p maxCandidates sizes with low prime factors in each direction.
+	 *
+	 * With w-stacking, the number of w-layers and the kernel size are set by the
+	 * field of view, the w-range and the requested accuracy, which do not depend
+	 * on the inversion size. The time spent in FFTs (one per w-layer, plus one for
+	 * resampling) is therefore proportional to the time of a single FFT, which is
+	 * the cost that is minimized.
+	 */
+	static void DetermineFastestSize(size_t width, size_t height, double pixelScaleX, double pixelScaleY, double beamSize, FFTTimingTable& timingTable, size_t& minimalWidth, size_t& minimalHeight, size_t& optimalWidth, size_t& optimalHeight, size_t maxCandidates = 8)
+	{
+		size_t heuristicWidth, heuristicHeight;
+		DetermineOptimalSize(width, pixelScaleX, beamSize, minimalWidth, heuristicWidth);
+		DetermineOptimalSize(height, pixelScaleY, beamSize, minimalHeight, heuristicHeight);
+		const std::vector<size_t>
+			widths = candidateSizes(heuristicWidth, width, maxCandidates),
+			heights = candidateSizes(heuristicHeight, height, maxCandidates);
+		double bestTime = 0.0;
+		for(size_t w : widths)
+		{
+			for(size_t h : heights)
+			{
+				double time = timingTable.Transform2DTime(w, h);
+				if(bestTime == 0.0 || time < bestTime)
+				{
+					bestTime = time;
+					optimalWidth = w;
+					optimalHeight = h;
+				}
+			}
+		}
+	}
+	
 private:
+	/**
+	 * Sizes that are a multiple of 4 with low prime factors, starting at the
+	 * smallest such size, and not larger than @p maxSize.
+	 */
+	static std::vector<size_t> candidateSizes(size_t smallestSize, size_t maxSize, size_t maxCandidates)
+	{
+		std::vector<size_t> sizes(1, smallestSize);
+		for(size_t size = smallestSize+4; size < maxSize && sizes.size() < maxCandidates; size += 4)
+		{
+			if(hasLowPrimeFactors(size))
+				sizes.push_back(size);
+		}
+		return sizes;
+	}
+	
 	static bool hasLowPrimeFactors(size_t number)
 	{
 		while(number > 7)
@@ -0,0 +1,115 @@
+#include "tiledimagestore.h"
+
+#include "logger.h"
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+namespace {
+	std::string errorString()
+	{
+		int errsv = errno;
+		char buffer[1024];
+		return strerror_r(errsv, buffer, 1024);
+	}
+}
+
+TiledImageStore::TiledImageStore(const std::string& prefix, size_t imageBytes) :
+	_imageBytes(imageBytes),
+	_slotBytes(((imageBytes + TileSize - 1) / TileSize) * TileSize),
+	_fd(-1)
+{
+	if(_slotBytes == 0)
+		_slotBytes = TileSize;
+	std::string templ = prefix + "-tiles-XXXXXX";
+	std::vector<char> filename(templ.begin(), templ.end());
+	filename.push_back(0);
+	_fd = mkstemp(filename.data());
+	if(_fd == -1)
+		throw std::runtime_error("Error creating temporary image store '" + templ + "': " + errorString());
+	// The file is only accessed through its descriptor, so it can be unlinked
+	// directly; this makes sure it is removed even when wsclean crashes.
+	unlink(filename.data());
+	Logger::Debug << "Created tiled image store for images of " << _imageBytes << " bytes.\n";
+}
+
+TiledImageStore::~TiledImageStore()
+{
+	for(Slot& slot : _slots)
+		munmap(slot.data, _slotBytes);
+	if(_fd != -1)
+		close(_fd);
+}
+
+void* TiledImageStore::Allocate()
+{
+	std::lock_guard<std::mutex> guard(_mutex);
+	for(Slot& slot : _slots)
+	{
+		if(!slot.isUsed)
+		{
+			slot.isUsed = true;
+			return slot.data;
+		}
+	}
+
+	const size_t offset = _slots.size() * _slotBytes;
+	if(ftruncate(_fd, offset + _slotBytes) != 0)
+		throw std::runtime_error("Error resizing temporary image store: " + errorString());
+	void* data = mmap(NULL, _slotBytes, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, offset);
+	if(data == MAP_FAILED)
+		throw std::runtime_error("Error creating memory map to temporary image store: mmap() returned MAP_FAILED with error message: " + errorString());
+	_slots.push_back(Slot());
+	_slots.back().data = data;
+	_slots.back().isUsed = true;
+	return data;
+}
+
+void TiledImageStore::Free(void* image)
+{
+	if(image != 0)
+	{
+		std::lock_guard<std::mutex> guard(_mutex);
+		for(size_t i=0; i!=_slots.size(); ++i)
+		{
+			if(_slots[i].data == image && _slots[i].isUsed)
+			{
+				_slots[i].isUsed = false;
+				discard(i);
+				return;
+			}
+		}
+		throw std::runtime_error("Invalid or double call to TiledImageStore::Free()");
+	}
+}
+
+size_t TiledImageStore::Size() const
+{
+	std::lock_guard<std::mutex> guard(_mutex);
+	size_t count = 0;
+	for(const Slot& slot : _slots)
+	{
+		if(slot.isUsed)
+			++count;
+	}
+	return count;
+}
+
+void TiledImageStore::discard(size_t slotIndex)
+{
+	// The content of a freed image is no longer needed: drop its tiles from memory
+	// and, when supported, from the file, so that they are never written back.
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if(fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, slotIndex * _slotBytes, _slotBytes) == 0)
+		return;
+#endif
+	madvise(_slots[slotIndex].data, _slotBytes, MADV_DONTNEED);
+}
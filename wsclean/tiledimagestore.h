@@ -0,0 +1,68 @@
+#ifndef TILED_IMAGE_STORE_H
+#define TILED_IMAGE_STORE_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Stores fixed-size images in a memory-mapped scratch file, such that the
+ * images do not need to be resident in memory. The file is divided into tiles of
+ * @ref TileSize bytes, and every image occupies a whole number of consecutive
+ * tiles. Each image is mapped separately, so pointers returned by Allocate() stay
+ * valid while the store grows. Only the tiles that are touched are paged
+ * in, and the kernel can write clean tiles back to the file when memory is
+ * needed. The scratch file is unlinked directly after creation, so it is
+ * removed automatically when the store is destroyed or the process ends.
+ *
+ * The interface mirrors that of @ref ImageBufferAllocator: Allocate() returns
+ * a buffer and Free() gives it back. Freed tiles are discarded from the file
+ * and reused by later allocations.
+ */
+class TiledImageStore
+{
+public:
+	/**
+	 * @param prefix Prefix of the scratch file, which may include a directory.
+	 * @param imageBytes Size of a single image in bytes.
+	 */
+	TiledImageStore(const std::string& prefix, size_t imageBytes);
+
+	~TiledImageStore();
+
+	TiledImageStore(const TiledImageStore&) = delete;
+	TiledImageStore& operator=(const TiledImageStore&) = delete;
+
+	/**
+	 * Returns a buffer of at least ImageBytes() bytes. The initial content of
+	 * the buffer is undefined.
+	 */
+	void* Allocate();
+
+	void Free(void* image);
+
+	size_t ImageBytes() const { return _imageBytes; }
+
+	/**
+	 * Number of images that are currently allocated.
+	 */
+	size_t Size() const;
+
+	static const size_t TileSize = 256*1024;
+
+private:
+	struct Slot
+	{
+		void* data;
+		bool isUsed;
+	};
+
+	void discard(size_t slotIndex);
+
+	std::vector<Slot> _slots;
+	size_t _imageBytes, _slotBytes;
+	int _fd;
+	mutable std::mutex _mutex;
+};
+
+#endif
@@ -1,5 +1,6 @@
 #include "wscfitswriter.h"
 
+#include "fitswriterqueue.h"
 #include "imagefilename.h"
 #include "msgridderbase.h"
 
@@ -8,29 +9,33 @@
 
 #include "../deconvolution/deconvolution.h"
 
-WSCFitsWriter::WSCFitsWriter(const ImagingTableEntry& entry, bool isImaginary, const WSCleanSettings& settings, const class Deconvolution& deconvolution, size_t majorIterationNr, const MSGridderBase& gridder, const std::string& commandLine, const OutputChannelInfo& channelInfo)
+WSCFitsWriter::WSCFitsWriter(const ImagingTableEntry& entry, bool isImaginary, const WSCleanSettings& settings, const class Deconvolution& deconvolution, size_t majorIterationNr, const MSGridderBase& gridder, const std::string& commandLine, const OutputChannelInfo& channelInfo) :
+	_queue(nullptr)
 {
 	_filenamePrefix = ImageFilename::GetPrefix(settings, entry.polarization, entry.outputChannelIndex, entry.outputIntervalIndex, isImaginary);
 	setGridderKeywords(settings, gridder);
 	SetSettingsKeywords(settings, commandLine);
+	_writer.SetCompression(settings.fitsCompression, settings.fitsQuantizeLevel);
 	setChannelKeywords(entry, entry.polarization, channelInfo);
 	setDeconvolutionKeywords(settings);
 	if(deconvolution.IsInitialized())
 		setDeconvolutionResultKeywords(deconvolution.GetAlgorithm().IterationNumber(), majorIterationNr);
 }
 
-WSCFitsWriter::WSCFitsWriter(const ImagingTableEntry& entry, PolarizationEnum polarization, bool isImaginary, const WSCleanSettings& settings, const class Deconvolution& deconvolution, size_t majorIterationNr, const MSGridderBase& gridder, const std::string& commandLine, const OutputChannelInfo& channelInfo)
+WSCFitsWriter::WSCFitsWriter(const ImagingTableEntry& entry, PolarizationEnum polarization, bool isImaginary, const WSCleanSettings& settings, const class Deconvolution& deconvolution, size_t majorIterationNr, const MSGridderBase& gridder, const std::string& commandLine, const OutputChannelInfo& channelInfo) :
+	_queue(nullptr)
 {
 	_filenamePrefix = ImageFilename::GetPrefix(settings, polarization, entry.outputChannelIndex, entry.outputIntervalIndex, isImaginary);
 	setGridderKeywords(settings, gridder);
 	SetSettingsKeywords(settings, commandLine);
+	_writer.SetCompression(settings.fitsCompression, settings.fitsQuantizeLevel);
 	setChannelKeywords(entry, polarization, channelInfo);
 	setDeconvolutionKeywords(settings);
 	if(deconvolution.IsInitialized())
 		setDeconvolutionResultKeywords(deconvolution.GetAlgorithm().IterationNumber(), majorIterationNr);
 }
 
-WSCFitsWriter::WSCFitsWriter(FitsReader& templateReader) : _writer(templateReader)
+WSCFitsWriter::WSCFitsWriter(FitsReader& templateReader) : _writer(templateReader), _queue(nullptr)
 {
 	copyWSCleanKeywords(templateReader);
 }
@@ -135,7 +140,7 @@ void WSCFitsWriter::copyWSCleanKeywords(FitsReader& reader)
 void WSCFitsWriter::WriteImage(const std::string& suffix, const double* image)
 {
 	std::string name = _filenamePrefix + '-' + suffix;
-	_writer.Write(name, image);
+	write(name, image);
 }
 
 void WSCFitsWriter::WriteUV(const std::string& suffix, const double* image)
@@ -144,14 +149,22 @@ void WSCFitsWriter::WriteUV(const std::string& suffix, const double* image)
 	FitsWriter::Unit unit = _writer.GetUnit();
 	_writer.SetIsUV(true);
 	_writer.SetUnit(FitsWriter::Jansky);
-	_writer.Write(name, image);
+	write(name, image);
 	_writer.SetIsUV(false);
 	_writer.SetUnit(unit);
 }
 
 void WSCFitsWriter::WritePSF(const std::string& fullname, const double* image)
 {
-	_writer.Write(fullname, image);
+	write(fullname, image);
+}
+
+void WSCFitsWriter::write(const std::string& filename, const double* image)
+{
+	if(_queue == nullptr)
+		_writer.Write(filename, image);
+	else
+		_queue->Write(_writer, filename, image);
 }
 
 void WSCFitsWriter::Restore(const WSCleanSettings& settings)
@@ -22,6 +22,11 @@ public:
 	
 	FitsWriter& Writer() { return _writer; }
 	
+	/**
+	 * Write the images through the given queue, or directly when queue is null.
+	 */
+	void SetQueue(class FitsWriterQueue* queue) { _queue = queue; }
+	
 	void WriteImage(const std::string& suffix, const double* image);
 	
 	void WriteUV(const std::string& suffix, const double* image);
@@ -47,9 +52,12 @@ private:
 	
 	void copyWSCleanKeywords(class FitsReader& reader);
 	
+	void write(const std::string& filename, const double* image);
+	
 private:
 	FitsWriter _writer;
 	std::string _filenamePrefix;
+	class FitsWriterQueue* _queue;
 };
 
 #endif
@@ -1,7 +1,10 @@
 #include "wsclean.h"
 
 #include "binneduvoutput.h"
+#include "fitswriterqueue.h"
+#include "grouppipeline.h"
 #include "imageweightcache.h"
+#include "instrumentation.h"
 #include "inversionalgorithm.h"
 #include "logger.h"
 #include "wscfitswriter.h"
@@ -15,6 +18,7 @@
 #include "../areaset.h"
 #include "../dftpredictionalgorithm.h"
 #include "../fftresampler.h"
+#include "../fitsiochecker.h"
 #include "../fitswriter.h"
 #include "../gaussianfitter.h"
 #include "../image.h"
@@ -39,13 +43,15 @@
 #include <iostream>
 #include <memory>
 
+#include <unistd.h>
+
 std::string commandLine;
 
 WSClean::WSClean() :
 	_globalSelection(),
 	_commandLine(),
 	_inversionWatch(false), _predictingWatch(false), _deconvolutionWatch(false),
-	_isFirstInversion(true), _doReorder(false),
+	_isFirstInversion(true), _doReorder(false), _gridPolarizationsJointly(false),
 	_majorIterationNr(0),
 	_deconvolution(_settings)
 {
@@ -64,7 +70,6 @@ void WSClean::multiplyImage(double factor, double* image) const
 
 void WSClean::imagePSF(ImagingTableEntry& entry)
 {
-	size_t channelIndex = entry.outputChannelIndex;
 	Logger::Info.Flush();
 	Logger::Info << " == Constructing PSF ==\n";
 	_inversionWatch.Start();
@@ -72,29 +77,52 @@ void WSClean::imagePSF(ImagingTableEntry& entry)
 	_gridder->SetDoSubtractModel(false);
 	_gridder->SetVerbose(_isFirstInversion);
 	_gridder->Invert();
+	_inversionWatch.Pause();
+	
+	storePSFImage(entry, _gridder->ImageRealResult());
+}
+
+void WSClean::imagePSFAndMainFirst(ImagingTableEntry& entry)
+{
+	Logger::Info.Flush();
+	Logger::Info << " == Constructing PSF and image ==\n";
+	_inversionWatch.Start();
+	_gridder->SetDoImagePSF(false);
+	_gridder->SetDoSubtractModel(_settings.subtractModel || _settings.continuedRun);
+	_gridder->SetVerbose(_isFirstInversion);
+	_gridder->InvertWithPSF();
+	_inversionWatch.Pause();
+	_gridder->SetVerbose(false);
 	
+	// The PSF sets the normalization factor of the residual
+	storePSFImage(entry, _gridder->PSFImageResult());
+	storeResidualImages(entry.polarization, entry.outputChannelIndex);
+}
+
+void WSClean::storePSFImage(ImagingTableEntry& entry, double* psf)
+{
+	size_t channelIndex = entry.outputChannelIndex;
 	size_t centralIndex = _settings.trimmedImageWidth/2 + (_settings.trimmedImageHeight/2) * _settings.trimmedImageWidth;
 	if(_settings.normalizeForWeighting)
 	{
 		double normFactor;
-		if(_gridder->ImageRealResult()[centralIndex] != 0.0)
-			normFactor = 1.0/_gridder->ImageRealResult()[centralIndex];
+		if(psf[centralIndex] != 0.0)
+			normFactor = 1.0/psf[centralIndex];
 		else
 			normFactor = 0.0;
 		_infoPerChannel[channelIndex].psfNormalizationFactor = normFactor;
-		multiplyImage(normFactor, _gridder->ImageRealResult());
+		multiplyImage(normFactor, psf);
 		Logger::Debug << "Normalized PSF by factor of " << normFactor << ".\n";
 	}
 		
-	DeconvolutionAlgorithm::RemoveNaNsInPSF(_gridder->ImageRealResult(), _settings.trimmedImageWidth, _settings.trimmedImageHeight);
+	DeconvolutionAlgorithm::RemoveNaNsInPSF(psf, _settings.trimmedImageWidth, _settings.trimmedImageHeight);
 	_psfImages.SetFitsWriter(createWSCFitsWriter(entry, false).Writer());
-	_psfImages.Store(_gridder->ImageRealResult(), *_settings.polarizations.begin(), channelIndex, false);
-	_inversionWatch.Pause();
+	_psfImages.Store(psf, *_settings.polarizations.begin(), channelIndex, false);
 	
 	_isFirstInversion = false;
 	
 	double bMaj, bMin, bPA;
-	determineBeamSize(bMaj, bMin, bPA, _gridder->ImageRealResult(), _gridder->BeamSize());
+	determineBeamSize(bMaj, bMin, bPA, psf, _gridder->BeamSize());
 	entry.imageWeight = _gridder->ImageWeight();
 	_infoPerChannel[channelIndex].theoreticBeamSize = _gridder->BeamSize();
 	_infoPerChannel[channelIndex].beamMaj = bMaj;
@@ -109,14 +137,15 @@ void WSClean::imagePSF(ImagingTableEntry& entry)
 		
 	if(_settings.isUVImageSaved)
 	{
-		saveUVImage(_gridder->ImageRealResult(), *_settings.polarizations.begin(), entry, false, "uvpsf");
+		saveUVImage(psf, *_settings.polarizations.begin(), entry, false, "uvpsf");
 	}
 	
 	Logger::Info << "Writing psf image... ";
 	Logger::Info.Flush();
 	const std::string name(ImageFilename::GetPSFPrefix(_settings, channelIndex, entry.outputIntervalIndex) + "-psf.fits");
 	WSCFitsWriter fitsFile = createWSCFitsWriter(entry, false);
-	fitsFile.WritePSF(name, _gridder->ImageRealResult());
+	fitsFile.WritePSF(name, psf);
+	addToMFSImage("psf.fits", entry, false, true, fitsFile.Writer(), psf);
 	Logger::Info << "DONE\n";
 }
 
@@ -145,13 +174,7 @@ void WSClean::imageMainFirst(PolarizationEnum polarization, size_t joinedChannel
 	_inversionWatch.Pause();
 	_gridder->SetVerbose(false);
 	
-	multiplyImage(_infoPerChannel[joinedChannelIndex].psfNormalizationFactor, _gridder->ImageRealResult());
-	storeAndCombineXYandYX(_residualImages, polarization, joinedChannelIndex, false, _gridder->ImageRealResult());
-	if(Polarization::IsComplex(polarization))
-	{
-		multiplyImage(_infoPerChannel[joinedChannelIndex].psfNormalizationFactor, _gridder->ImageImaginaryResult());
-		storeAndCombineXYandYX(_residualImages, polarization, joinedChannelIndex, true, _gridder->ImageImaginaryResult());
-	}
+	storeResidualImages(polarization, joinedChannelIndex);
 }
 
 void WSClean::imageMainNonFirst(PolarizationEnum polarization, size_t joinedChannelIndex)
@@ -163,12 +186,90 @@ void WSClean::imageMainNonFirst(PolarizationEnum polarization, size_t joinedChan
 	_gridder->Invert();
 	_inversionWatch.Pause();
 	
-	multiplyImage(_infoPerChannel[joinedChannelIndex].psfNormalizationFactor, _gridder->ImageRealResult());
-	storeAndCombineXYandYX(_residualImages, polarization, joinedChannelIndex, false, _gridder->ImageRealResult());
+	storeResidualImages(polarization, joinedChannelIndex);
+}
+
+void WSClean::predictAndImageMainNonFirst(PolarizationEnum polarization, size_t joinedChannelIndex)
+{
+	Logger::Info.Flush();
+	Logger::Info << " == Converting model image to visibilities and constructing residual image ==\n";
+	double *modelImageReal, *modelImageImaginary;
+	loadPredictionModel(polarization, joinedChannelIndex, modelImageReal, modelImageImaginary);
+	
+	_inversionWatch.Start();
+	_gridder->SetAddToModel(false);
+	_gridder->SetDoSubtractModel(true);
+	_gridder->PredictAndInvert(modelImageReal, modelImageImaginary);
+	_inversionWatch.Pause();
+	_imageAllocator.Free(modelImageReal);
+	_imageAllocator.Free(modelImageImaginary);
+	
+	storeResidualImages(polarization, joinedChannelIndex);
+}
+
+void WSClean::imageMainJointly(const ImagingTable& squaredGroup, const std::vector<size_t>& entryIndices, bool isFirstInversion, bool predictModels)
+{
+	Logger::Info.Flush();
+	if(predictModels)
+		Logger::Info << " == Converting model images to visibilities and constructing residual images of " << entryIndices.size() << " polarizations ==\n";
+	else
+		Logger::Info << " == Constructing images of " << entryIndices.size() << " polarizations ==\n";
+	const size_t channelIndex = squaredGroup.Front().outputChannelIndex;
+	std::vector<PolarizationEnum> polarizations;
+	std::vector<double*> modelsReal, modelsImaginary;
+	for(size_t index : entryIndices)
+	{
+		const PolarizationEnum polarization = squaredGroup[index].polarization;
+		polarizations.push_back(polarization);
+		if(predictModels)
+		{
+			double *modelImageReal, *modelImageImaginary;
+			loadPredictionModel(polarization, channelIndex, modelImageReal, modelImageImaginary);
+			modelsReal.push_back(modelImageReal);
+			modelsImaginary.push_back(modelImageImaginary);
+		}
+	}
+	
+	_inversionWatch.Start();
+	if(isFirstInversion)
+	{
+		_gridder->SetDoImagePSF(false);
+		_gridder->SetDoSubtractModel(_settings.subtractModel || _settings.continuedRun);
+		_gridder->SetVerbose(_isFirstInversion);
+	}
+	else {
+		_gridder->SetAddToModel(false);
+		_gridder->SetDoSubtractModel(true);
+	}
+	_gridder->InvertPolarizations(polarizations, modelsReal, modelsImaginary);
+	_inversionWatch.Pause();
+	_gridder->SetVerbose(false);
+	for(double* model : modelsReal)
+		_imageAllocator.Free(model);
+	for(double* model : modelsImaginary)
+		_imageAllocator.Free(model);
+	
+	for(size_t i=0; i!=polarizations.size(); ++i)
+	{
+		storeResidualImages(polarizations[i], channelIndex, _gridder->JointImageRealResult(i),
+			Polarization::IsComplex(polarizations[i]) ? _gridder->JointImageImaginaryResult(i) : nullptr);
+	}
+}
+
+void WSClean::storeResidualImages(PolarizationEnum polarization, size_t joinedChannelIndex)
+{
+	storeResidualImages(polarization, joinedChannelIndex, _gridder->ImageRealResult(),
+		Polarization::IsComplex(polarization) ? _gridder->ImageImaginaryResult() : nullptr);
+}
+
+void WSClean::storeResidualImages(PolarizationEnum polarization, size_t joinedChannelIndex, double* realImage, double* imaginaryImage)
+{
+	multiplyImage(_infoPerChannel[joinedChannelIndex].psfNormalizationFactor, realImage);
+	storeAndCombineXYandYX(_residualImages, polarization, joinedChannelIndex, false, realImage);
 	if(Polarization::IsComplex(polarization))
 	{
-		multiplyImage(_infoPerChannel[joinedChannelIndex].psfNormalizationFactor, _gridder->ImageImaginaryResult());
-		storeAndCombineXYandYX(_residualImages, polarization, joinedChannelIndex, true, _gridder->ImageImaginaryResult());
+		multiplyImage(_infoPerChannel[joinedChannelIndex].psfNormalizationFactor, imaginaryImage);
+		storeAndCombineXYandYX(_residualImages, polarization, joinedChannelIndex, true, imaginaryImage);
 	}
 }
 
@@ -198,14 +299,11 @@ void WSClean::storeAndCombineXYandYX(CachedImageSet& dest, PolarizationEnum pola
 	}
 }
 
-void WSClean::predict(PolarizationEnum polarization, size_t joinedChannelIndex)
+void WSClean::loadPredictionModel(PolarizationEnum polarization, size_t joinedChannelIndex, double*& modelImageReal, double*& modelImageImaginary)
 {
-	Logger::Info.Flush();
-	Logger::Info << " == Converting model image to visibilities ==\n";
 	const size_t size = _settings.trimmedImageWidth*_settings.trimmedImageHeight;
-	double
-		*modelImageReal = _imageAllocator.Allocate(size),
-		*modelImageImaginary = 0;
+	modelImageReal = _imageAllocator.Allocate(size);
+	modelImageImaginary = 0;
 		
 	if(polarization == Polarization::YX)
 	{
@@ -223,6 +321,14 @@ void WSClean::predict(PolarizationEnum polarization, size_t joinedChannelIndex)
 			_modelImages.Load(modelImageImaginary, polarization, joinedChannelIndex, true);
 		}
 	}
+}
+
+void WSClean::predict(PolarizationEnum polarization, size_t joinedChannelIndex)
+{
+	Logger::Info.Flush();
+	Logger::Info << " == Converting model image to visibilities ==\n";
+	double *modelImageReal, *modelImageImaginary;
+	loadPredictionModel(polarization, joinedChannelIndex, modelImageReal, modelImageImaginary);
 	
 	_predictingWatch.Start();
 	_gridder->SetAddToModel(false);
@@ -371,12 +477,14 @@ void WSClean::prepareInversionAlgorithm(PolarizationEnum polarization)
 	_gridder->SetWeighting(_settings.weightMode);
 	_gridder->SetWLimit(_settings.wLimit/100.0);
 	_gridder->SetSmallInversion(_settings.smallInversion);
+	_gridder->SetFFTTimingFile(_settings.fftTimingFile);
 	_gridder->SetNormalizeForWeighting(_settings.normalizeForWeighting);
 	_gridder->SetVisibilityWeightingMode(_settings.visibilityWeightingMode);
 }
 
 void WSClean::performReordering(bool isPredictMode)
 {
+	Instrumentation::ScopedTimer timer(Instrumentation::ReorderStage);
 	_partitionedMSHandles.clear();
 	for(size_t i=0; i != _settings.filenames.size(); ++i)
 	{
@@ -412,6 +520,7 @@ void WSClean::performReordering(bool isPredictMode)
 		bool useModel = _settings.deconvolutionMGain != 1.0 || isPredictMode || _settings.subtractModel || _settings.continuedRun;
 		bool initialModelRequired = _settings.subtractModel || _settings.continuedRun;
 		_partitionedMSHandles.push_back(PartitionedMS::Partition(_settings.filenames[i], channels, _globalSelection, _settings.dataColumnName, useModel, initialModelRequired, _settings));
+		timer.AddItems(1);
 	}
 }
 
@@ -432,10 +541,28 @@ void WSClean::RunClean()
 	}
 
 	_settings.Propogate();
+	applyMemoryLimit();
 	
 	_settings.GetMSSelection(_globalSelection);
 	MSSelection fullSelection = _globalSelection;
 	
+	startInstrumentation();
+	
+	// Images are written while the next group is imaged; the queue holds up to
+	// two images per thread.
+	_fitsWriterQueue.reset(new FitsWriterQueue(_settings.writeThreadCount, 2*_settings.writeThreadCount));
+	// The pipeline thread reads and writes FITS files (e.g. for the primary beam
+	// correction) while the main thread does too.
+	bool pipelineGroups = _settings.pipelineGroups;
+	if(pipelineGroups && !FitsIOChecker::IsThreadSafe())
+	{
+		Logger::Warn << "WARNING: cfitsio was not built to be reentrant; groups are not pipelined.\n";
+		pipelineGroups = false;
+	}
+	// Each task holds the residual and model of one image; allowing the images of one
+	// group to wait bounds the extra memory to about one group.
+	_groupPipeline.reset(new GroupPipeline(pipelineGroups, 2*_settings.polarizations.size()));
+	
 	for(size_t intervalIndex=0; intervalIndex!=_settings.intervalsOut; ++intervalIndex)
 	{
 		makeImagingTable(intervalIndex);
@@ -458,11 +585,15 @@ void WSClean::RunClean()
 		else
 			_gridder.reset(new WSMSGridder(&_imageAllocator, _settings.threadCount, _settings.memFraction, _settings.absMemLimit));
 		
+		_gridPolarizationsJointly = canGridPolarizationsJointly();
+		
 		for(size_t groupIndex=0; groupIndex!=_imagingTable.IndependentGroupCount(); ++groupIndex)
 		{
 			ImagingTable group = _imagingTable.GetIndependentGroup(groupIndex);
 			runIndependentGroup(group);
 		}
+		// The MFS images are made from the restored images of all groups
+		_groupPipeline->Wait();
 
 		// Needs to be destructed before image allocator, or image allocator will report error caused by leaked memory
 		_gridder.reset();
@@ -527,7 +658,10 @@ void WSClean::RunClean()
 				}
 			}
 		}
+		_mfsImages.clear();
 	}
+	waitForImageWrites();
+	writeInstrumentation();
 }
 
 ImageWeightCache* WSClean::createWeightCache()
@@ -545,6 +679,20 @@ ImageWeightCache* WSClean::createWeightCache()
 	return cache;
 }
 
+void WSClean::applyMemoryLimit()
+{
+	// The image buffers, including the sums of the MFS images, are kept
+	// within the memory limit that also limits the gridder
+	if(_settings.memFraction != 1.0 || _settings.absMemLimit != 0.0)
+	{
+		long pageCount = sysconf(_SC_PHYS_PAGES), pageSize = sysconf(_SC_PAGE_SIZE);
+		double limit = double(pageCount) * double(pageSize) * _settings.memFraction;
+		if(_settings.absMemLimit != 0.0)
+			limit = std::min(limit, _settings.absMemLimit * (1024.0*1024.0*1024.0));
+		_imageAllocator.SetMemoryBudget(std::min(_imageAllocator.MemoryBudget(), size_t(limit)));
+	}
+}
+
 void WSClean::RunPredict()
 {
 	if(_settings.joinedFrequencyCleaning)
@@ -555,10 +703,13 @@ void WSClean::RunPredict()
 	_settings.dataColumnName = "DATA";
 	
 	_settings.Propogate();
+	applyMemoryLimit();
 	
 	_settings.GetMSSelection(_globalSelection);
 	MSSelection fullSelection = _globalSelection;
 	
+	startInstrumentation();
+	
 	for(size_t intervalIndex=0; intervalIndex!=_settings.intervalsOut; ++intervalIndex)
 	{
 		makeImagingTable(intervalIndex);
@@ -589,6 +740,7 @@ void WSClean::RunPredict()
 		// Needs to be destructed before image allocator, or image allocator will report error caused by leaked memory
 		_gridder.reset();
 	}
+	writeInstrumentation();
 }
 
 bool WSClean::selectChannels(MSSelection& selection, size_t msIndex, size_t dataDescId, const ImagingTableEntry& entry)
@@ -648,20 +800,81 @@ double WSClean::minTheoreticalBeamSize(const ImagingTable& table) const
 	return beam;
 }
 
+bool WSClean::canGridPolarizationsJointly() const
+{
+	if(!_settings.jointPolarizationGridding || _settings.polarizations.size() < 2)
+		return false;
+	if(!_gridder->SupportsJointPolarizations())
+	{
+		Logger::Warn << "WARNING: The gridder can not grid polarizations jointly; polarizations are gridded separately.\n";
+		return false;
+	}
+	if(_doReorder)
+	{
+		Logger::Warn << "WARNING: Polarizations can only be gridded jointly without reordering (-no-reorder); polarizations are gridded separately.\n";
+		return false;
+	}
+	for(const std::string& filename : _settings.filenames)
+	{
+		casacore::MeasurementSet ms(filename);
+		if(MSProvider::GetMSPolarizations(ms).size() != 4)
+		{
+			Logger::Warn << "WARNING: Polarizations can only be gridded jointly when all measurement sets have four correlations; polarizations are gridded separately.\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+std::vector<std::vector<size_t>> WSClean::jointPolarizationSets(const ImagingTable& squaredGroup) const
+{
+	std::vector<std::vector<size_t>> sets;
+	if(_gridPolarizationsJointly)
+	{
+		std::vector<size_t> nonComplexSet, complexSet;
+		for(size_t i=0; i!=squaredGroup.EntryCount(); ++i)
+		{
+			if(Polarization::IsComplex(squaredGroup[i].polarization))
+				complexSet.push_back(i);
+			else
+				nonComplexSet.push_back(i);
+		}
+		if(!nonComplexSet.empty())
+			sets.push_back(std::move(nonComplexSet));
+		if(!complexSet.empty())
+			sets.push_back(std::move(complexSet));
+		// The first entry of the group is imaged first, like without joint gridding,
+		// because it sets the weight and beam info of the channel
+		if(sets.size() == 2 && sets.back().front() == 0)
+			std::swap(sets.front(), sets.back());
+	}
+	else {
+		for(size_t i=0; i!=squaredGroup.EntryCount(); ++i)
+			sets.emplace_back(1, i);
+	}
+	return sets;
+}
+
 void WSClean::runIndependentGroup(ImagingTable& groupTable)
 {
 	WSCFitsWriter writer(createWSCFitsWriter(groupTable.Front(), false));
-	_modelImages.Initialize(writer.Writer(), _settings.polarizations.size(), _settings.channelsOut, _settings.prefixName + "-model", _imageAllocator);
-	_residualImages.Initialize(writer.Writer(), _settings.polarizations.size(), _settings.channelsOut, _settings.prefixName + "-residual", _imageAllocator);
+	// The image cache memory is shared between the model, residual and psf images
+	const size_t cacheMemory = size_t(_settings.imageCacheMemory * (1024.0*1024.0*1024.0) / 3.0);
+	_modelImages.Initialize(writer.Writer(), _settings.polarizations.size(), _settings.channelsOut, _settings.prefixName + "-model", _imageAllocator, cacheMemory);
+	_residualImages.Initialize(writer.Writer(), _settings.polarizations.size(), _settings.channelsOut, _settings.prefixName + "-residual", _imageAllocator, cacheMemory);
 	if(groupTable.Front().polarization == *_settings.polarizations.begin())
-		_psfImages.Initialize(writer.Writer(), 1, groupTable.SquaredGroupCount(), _settings.prefixName + "-psf", _imageAllocator);
+		_psfImages.Initialize(writer.Writer(), 1, groupTable.SquaredGroupCount(), _settings.prefixName + "-psf", _imageAllocator, cacheMemory);
 	
-	const std::string rootPrefix = _settings.prefixName;
-		
-	for(size_t joinedIndex=0; joinedIndex!=groupTable.EntryCount(); ++joinedIndex)
+	for(size_t sGroupIndex=0; sGroupIndex!=groupTable.SquaredGroupCount(); ++sGroupIndex)
 	{
-		ImagingTableEntry& entry = groupTable[joinedIndex];
-		runFirstInversion(entry);
+		ImagingTable sGroupTable = groupTable.GetSquaredGroup(sGroupIndex);
+		for(const std::vector<size_t>& polarizationSet : jointPolarizationSets(sGroupTable))
+		{
+			if(polarizationSet.size() == 1)
+				runFirstInversion(sGroupTable[polarizationSet.front()]);
+			else
+				runJointFirstInversion(sGroupTable, polarizationSet);
+		}
 	}
 	
 	_deconvolution.InitializeDeconvolutionAlgorithm(groupTable, *_settings.polarizations.begin(), &_imageAllocator, _settings.trimmedImageWidth, _settings.trimmedImageHeight, _settings.pixelScaleX, _settings.pixelScaleY, minTheoreticalBeamSize(groupTable), _settings.threadCount);
@@ -694,28 +907,62 @@ void WSClean::runIndependentGroup(ImagingTable& groupTable)
 						if(_settings.dftPrediction)
 						{
 							dftPredict(sGroupTable);
-							for(size_t e=0; e!=sGroupTable.EntryCount(); ++e)
+							for(const std::vector<size_t>& polarizationSet : jointPolarizationSets(sGroupTable))
 							{
-								prepareInversionAlgorithm(sGroupTable[e].polarization);
-								initializeCurMSProviders(sGroupTable[e]);
-								initializeImageWeights(sGroupTable[e]);
-			
-								imageMainNonFirst(sGroupTable[e].polarization, currentChannelIndex);
+								const ImagingTableEntry& entry = sGroupTable[polarizationSet.front()];
+								prepareInversionAlgorithm(entry.polarization);
+								initializeCurMSProviders(entry);
+								initializeImageWeights(entry);
+								
+								if(polarizationSet.size() == 1)
+									imageMainNonFirst(entry.polarization, currentChannelIndex);
+								else {
+									clearCurMSProviders();
+									initializeCurMSProviders(entry, Polarization::Instrumental);
+									imageMainJointly(sGroupTable, polarizationSet, false, false);
+								}
 								clearCurMSProviders();
 							}
 						}
 						else {
-							for(size_t e=0; e!=sGroupTable.EntryCount(); ++e)
+							// The model visibilities are only stored when they are written back
+							// after the last major iteration. Otherwise, the prediction is
+							// subtracted during the inversion, which saves a pass over the data.
+							const bool storeModel = _settings.modelUpdateRequired && !reachedMajorThreshold;
+							if(storeModel)
 							{
-								prepareInversionAlgorithm(sGroupTable[e].polarization);
-								initializeCurMSProviders(sGroupTable[e]);
-								initializeImageWeights(sGroupTable[e]);
-			
-								predict(sGroupTable[e].polarization, currentChannelIndex);
-								
-								imageMainNonFirst(sGroupTable[e].polarization, currentChannelIndex);
-								clearCurMSProviders();
-							} // end of polarization loop
+								for(size_t e=0; e!=sGroupTable.EntryCount(); ++e)
+								{
+									prepareInversionAlgorithm(sGroupTable[e].polarization);
+									initializeCurMSProviders(sGroupTable[e]);
+									initializeImageWeights(sGroupTable[e]);
+									
+									predict(sGroupTable[e].polarization, currentChannelIndex);
+									
+									imageMainNonFirst(sGroupTable[e].polarization, currentChannelIndex);
+									clearCurMSProviders();
+								} // end of polarization loop
+							}
+							else {
+								// Polarizations that are gridded jointly share a set, and are predicted and
+								// imaged together. The other sets hold a single polarization each.
+								for(const std::vector<size_t>& polarizationSet : jointPolarizationSets(sGroupTable))
+								{
+									const ImagingTableEntry& entry = sGroupTable[polarizationSet.front()];
+									prepareInversionAlgorithm(entry.polarization);
+									initializeCurMSProviders(entry);
+									initializeImageWeights(entry);
+									
+									if(polarizationSet.size() == 1)
+										predictAndImageMainNonFirst(entry.polarization, currentChannelIndex);
+									else {
+										clearCurMSProviders();
+										initializeCurMSProviders(entry, Polarization::Instrumental);
+										imageMainJointly(sGroupTable, polarizationSet, false, true);
+									}
+									clearCurMSProviders();
+								} // end of polarization loop
+							}
 						}
 					} // end of joined channels loop
 					
@@ -743,8 +990,6 @@ void WSClean::runIndependentGroup(ImagingTable& groupTable)
 	
 	_imageAllocator.ReportStatistics();
 	Logger::Info << "Inversion: " << _inversionWatch.ToString() << ", prediction: " << _predictingWatch.ToString() << ", deconvolution: " << _deconvolutionWatch.ToString() << '\n';
-	
-	_settings.prefixName = rootPrefix;
 }
 
 void WSClean::saveRestoredImagesForGroup(const ImagingTableEntry& tableEntry) const
@@ -754,21 +999,23 @@ void WSClean::saveRestoredImagesForGroup(const ImagingTableEntry& tableEntry) co
 		tableEntry.outputChannelIndex;
 	
 	PolarizationEnum curPol = tableEntry.polarization;
+	const size_t imageSize = _settings.trimmedImageWidth*_settings.trimmedImageHeight;
 	for(size_t imageIter=0; imageIter!=tableEntry.imageCount; ++imageIter)
 	{
+		// Everything that depends on the state of the imaging (the image caches,
+		// the gridder for the fits keywords and the channel info) is read here.
+		// The rendering and writing is pushed to the group pipeline, which runs it
+		// while the next group is imaged when pipelining is enabled.
 		bool isImaginary = (imageIter == 1);
 		WSCFitsWriter writer(createWSCFitsWriter(tableEntry, isImaginary));
-		double* restoredImage = _imageAllocator.Allocate(_settings.trimmedImageWidth*_settings.trimmedImageHeight);
-		_residualImages.Load(restoredImage, curPol, currentChannelIndex, isImaginary);
-		
-		if(_settings.deconvolutionIterationCount != 0)
-			writer.WriteImage("residual.fits", restoredImage);
+		std::shared_ptr<double> restoredImage(_imageAllocator.Allocate(imageSize), [this](double* image) { _imageAllocator.Free(image); });
+		_residualImages.Load(restoredImage.get(), curPol, currentChannelIndex, isImaginary);
 		
 		if(_settings.isUVImageSaved)
-			saveUVImage(restoredImage, curPol, tableEntry, isImaginary, "uv");
+			saveUVImage(restoredImage.get(), curPol, tableEntry, isImaginary, "uv");
 		
-		double* modelImage = _imageAllocator.Allocate(_settings.trimmedImageWidth*_settings.trimmedImageHeight);
-		_modelImages.Load(modelImage, curPol, currentChannelIndex, isImaginary);
+		std::shared_ptr<double> modelImage(_imageAllocator.Allocate(imageSize), [this](double* image) { _imageAllocator.Free(image); });
+		_modelImages.Load(modelImage.get(), curPol, currentChannelIndex, isImaginary);
 		double beamMaj = _infoPerChannel[currentChannelIndex].beamMaj;
 		double beamMin, beamPA;
 		std::string beamStr;
@@ -784,30 +1031,42 @@ void WSClean::saveRestoredImagesForGroup(const ImagingTableEntry& tableEntry) co
 			beamStr = "(beam is neither fitted nor estimated -- using delta scales!)";
 			beamMaj = 0.0; beamMin = 0.0; beamPA = 0.0;
 		}
-		Logger::Info << "Rendering sources to restored image " + beamStr + "... ";
-		Logger::Info.Flush();
-		ModelRenderer::Restore(restoredImage, modelImage, _settings.trimmedImageWidth, _settings.trimmedImageHeight, beamMaj, beamMin, beamPA, _settings.pixelScaleX, _settings.pixelScaleY);
-		Logger::Info << "DONE\n";
-		_imageAllocator.Free(modelImage);
-		
-		Logger::Info << "Writing restored image... ";
-		Logger::Info.Flush();
-		writer.WriteImage("image.fits", restoredImage);
-		Logger::Info << "DONE\n";
-		_imageAllocator.Free(restoredImage);
 		
-		if(curPol == *_settings.polarizations.rbegin() && _settings.applyPrimaryBeam)
-		{
-			ImageFilename imageName = ImageFilename(currentChannelIndex, tableEntry.outputIntervalIndex);
-			_primaryBeam->CorrectImages(writer.Writer(), imageName, "image", _imageAllocator);
-			if(_settings.savePsfPb)
-				_primaryBeam->CorrectImages(writer.Writer(), imageName, "psf", _imageAllocator);
+		const bool correctBeam = curPol == *_settings.polarizations.rbegin() && _settings.applyPrimaryBeam;
+		std::shared_ptr<PrimaryBeam> primaryBeam = _primaryBeam;
+		// Reported here, because lines that the pipeline thread logs would end up
+		// in the middle of the lines of the main thread.
+		Logger::Info << "Rendering sources to restored image " + beamStr + " and writing it...\n";
+		_groupPipeline->Push([=]() mutable {
 			if(_settings.deconvolutionIterationCount != 0)
 			{
-				_primaryBeam->CorrectImages(writer.Writer(), imageName, "residual", _imageAllocator);
-				_primaryBeam->CorrectImages(writer.Writer(), imageName, "model", _imageAllocator);
+				writer.WriteImage("residual.fits", restoredImage.get());
+				addToMFSImage("residual.fits", tableEntry, isImaginary, false, writer.Writer(), restoredImage.get());
+				addToMFSImage("model.fits", tableEntry, isImaginary, false, writer.Writer(), modelImage.get());
 			}
-		}
+			
+			ModelRenderer::Restore(restoredImage.get(), modelImage.get(), _settings.trimmedImageWidth, _settings.trimmedImageHeight, beamMaj, beamMin, beamPA, _settings.pixelScaleX, _settings.pixelScaleY);
+			modelImage.reset();
+			
+			writer.WriteImage("image.fits", restoredImage.get());
+			addToMFSImage("image.fits", tableEntry, isImaginary, false, writer.Writer(), restoredImage.get());
+			restoredImage.reset();
+			
+			if(correctBeam)
+			{
+				// The beam correction reads the images that were just written
+				waitForImageWrites();
+				ImageFilename imageName = ImageFilename(currentChannelIndex, tableEntry.outputIntervalIndex);
+				primaryBeam->CorrectImages(writer.Writer(), imageName, "image", _imageAllocator);
+				if(_settings.savePsfPb)
+					primaryBeam->CorrectImages(writer.Writer(), imageName, "psf", _imageAllocator);
+				if(_settings.deconvolutionIterationCount != 0)
+				{
+					primaryBeam->CorrectImages(writer.Writer(), imageName, "residual", _imageAllocator);
+					primaryBeam->CorrectImages(writer.Writer(), imageName, "model", _imageAllocator);
+				}
+			}
+		});
 	}
 }
 
@@ -857,6 +1116,7 @@ void WSClean::writeModelImages(const ImagingTable& groupTable) const
 
 void WSClean::readEarlierModelImages(const ImagingTableEntry& entry)
 {
+	waitForImageWrites();
 	// load image(s) from disk and store them in the model-image cache.
 	for(size_t i=0; i!=entry.imageCount; ++i)
 	{
@@ -925,7 +1185,8 @@ void WSClean::predictGroup(const ImagingTable& imagingGroup)
 {
 	_modelImages.Initialize(
 		createWSCFitsWriter(imagingGroup.Front(), false).Writer(),
-		_settings.polarizations.size(), 1, _settings.prefixName + "-model", _imageAllocator
+		_settings.polarizations.size(), 1, _settings.prefixName + "-model", _imageAllocator,
+		size_t(_settings.imageCacheMemory * (1024.0*1024.0*1024.0))
 	);
 	
 	const std::string rootPrefix = _settings.prefixName;
@@ -954,6 +1215,11 @@ void WSClean::predictGroup(const ImagingTable& imagingGroup)
 MSProvider* WSClean::initializeMSProvider(const ImagingTableEntry& entry, const MSSelection& selection, size_t filenameIndex, size_t dataDescId)
 {
 	PolarizationEnum pol = _settings.useIDG ? Polarization::Instrumental : entry.polarization;
+	return initializeMSProvider(entry, pol, selection, filenameIndex, dataDescId);
+}
+
+MSProvider* WSClean::initializeMSProvider(const ImagingTableEntry& entry, PolarizationEnum pol, const MSSelection& selection, size_t filenameIndex, size_t dataDescId)
+{
 	if(_doReorder)
 		return new PartitionedMS(_partitionedMSHandles[filenameIndex], entry.msData[filenameIndex].bands[dataDescId].partIndex, pol, dataDescId);
 	else
@@ -961,6 +1227,11 @@ MSProvider* WSClean::initializeMSProvider(const ImagingTableEntry& entry, const
 }
 
 void WSClean::initializeCurMSProviders(const ImagingTableEntry& entry)
+{
+	initializeCurMSProviders(entry, _settings.useIDG ? Polarization::Instrumental : entry.polarization);
+}
+
+void WSClean::initializeCurMSProviders(const ImagingTableEntry& entry, PolarizationEnum polarization)
 {
 	_gridder->ClearMeasurementSetList();
 	for(size_t i=0; i != _settings.filenames.size(); ++i)
@@ -970,7 +1241,7 @@ void WSClean::initializeCurMSProviders(const ImagingTableEntry& entry)
 			MSSelection selection(_globalSelection);
 			if(selectChannels(selection, i, d, entry))
 			{
-				MSProvider* msProvider = initializeMSProvider(entry, selection, i, d);
+				MSProvider* msProvider = initializeMSProvider(entry, polarization, selection, i, d);
 				_gridder->AddMeasurementSet(msProvider, selection);
 				_currentPolMSes.push_back(msProvider);
 			}
@@ -1010,16 +1281,85 @@ void WSClean::runFirstInversion(ImagingTableEntry& entry)
 	prepareInversionAlgorithm(entry.polarization);
 	
 	const bool firstBeforePSF = _isFirstInversion;
+	
+	// When possible, the PSF is imaged in the same pass over the data as the image
+	bool isFirstPol = entry.polarization == *_settings.polarizations.begin();
+	bool doMakePSF = _settings.deconvolutionIterationCount > 0 || _settings.makePSF || _settings.makePSFOnly;
+	const bool imagePSFWithMain = doMakePSF && isFirstPol && !_settings.makePSFOnly && _gridder->SupportsInvertWithPSF();
+	
+	makePSFAndBeamImages(entry, !imagePSFWithMain);
+		
+	if(!_settings.makePSFOnly)
+	{
+		FitsWriter writer(createWSCFitsWriter(entry, false).Writer());
+		_modelImages.SetFitsWriter(writer);
+		_residualImages.SetFitsWriter(writer);
+		
+		if(imagePSFWithMain)
+			imagePSFAndMainFirst(entry);
+		else
+			imageMainFirst(entry.polarization, entry.outputChannelIndex);
+		
+		finishFirstInversion(entry, firstBeforePSF);
+	}
+	
+	clearCurMSProviders();
+}
 
+void WSClean::runJointFirstInversion(ImagingTable& squaredGroup, const std::vector<size_t>& entryIndices)
+{
+	const bool firstBeforePSF = _isFirstInversion;
+	
+	for(size_t index : entryIndices)
+	{
+		ImagingTableEntry& entry = squaredGroup[index];
+		bool isFirstPol = entry.polarization == *_settings.polarizations.begin();
+		bool isLastPol = entry.polarization == *_settings.polarizations.rbegin();
+		if(isFirstPol || isLastPol)
+		{
+			initializeCurMSProviders(entry);
+			initializeImageWeights(entry);
+			prepareInversionAlgorithm(entry.polarization);
+			makePSFAndBeamImages(entry, true);
+			clearCurMSProviders();
+		}
+	}
+	
+	if(!_settings.makePSFOnly)
+	{
+		// The image weights are calculated with the providers of the first polarization,
+		// after which the gridder reads all correlations.
+		ImagingTableEntry& front = squaredGroup[entryIndices.front()];
+		initializeCurMSProviders(front);
+		initializeImageWeights(front);
+		clearCurMSProviders();
+		prepareInversionAlgorithm(front.polarization);
+		initializeCurMSProviders(front, Polarization::Instrumental);
+		
+		FitsWriter writer(createWSCFitsWriter(front, false).Writer());
+		_modelImages.SetFitsWriter(writer);
+		_residualImages.SetFitsWriter(writer);
+		
+		imageMainJointly(squaredGroup, entryIndices, true, false);
+		
+		for(size_t i=0; i!=entryIndices.size(); ++i)
+			finishFirstInversion(squaredGroup[entryIndices[i]], firstBeforePSF && i==0);
+		
+		clearCurMSProviders();
+	}
+}
+
+void WSClean::makePSFAndBeamImages(ImagingTableEntry& entry, bool includePSF)
+{
 	bool isFirstPol = entry.polarization == *_settings.polarizations.begin();
 	bool isLastPol = entry.polarization == *_settings.polarizations.rbegin();
 	bool doMakePSF = _settings.deconvolutionIterationCount > 0 || _settings.makePSF || _settings.makePSFOnly;
-	if(doMakePSF && isFirstPol)
+	if(doMakePSF && isFirstPol && includePSF)
 		imagePSF(entry);
 	
 	if(isLastPol && (_settings.applyPrimaryBeam || _settings.dftWithBeam))
 	{
-		_primaryBeam.reset(new PrimaryBeam(_settings));
+		_primaryBeam = std::make_shared<PrimaryBeam>(_settings);
 		initializeMSProvidersForPB(entry, *_primaryBeam);
 		// we don't have to call initializeImageWeights(entry), because they're still set ok.
 		double ra, dec, dl, dm;
@@ -1030,126 +1370,142 @@ void WSClean::runFirstInversion(ImagingTableEntry& entry)
 		clearCurMSProviders();
 		initializeCurMSProviders(entry);
 	}
-		
-	if(!_settings.makePSFOnly)
+}
+
+void WSClean::finishFirstInversion(ImagingTableEntry& entry, bool firstBeforePSF)
+{
+	bool isFirstPol = entry.polarization == *_settings.polarizations.begin();
+	bool doMakePSF = _settings.deconvolutionIterationCount > 0 || _settings.makePSF || _settings.makePSFOnly;
+	// If this was the first polarization of this channel, we need to set
+	// the info for this channel
+	if(isFirstPol)
 	{
-		FitsWriter writer(createWSCFitsWriter(entry, false).Writer());
-		_modelImages.SetFitsWriter(writer);
-		_residualImages.SetFitsWriter(writer);
-		
-		imageMainFirst(entry.polarization, entry.outputChannelIndex);
-		
-		// If this was the first polarization of this channel, we need to set
-		// the info for this channel
-		if(isFirstPol)
+		entry.imageWeight = _gridder->ImageWeight();
+		_infoPerChannel[entry.outputChannelIndex].weight = entry.imageWeight;
+		// If no PSF is made, also set the beam size. If the PSF was made, these would already be set
+		// after imaging the PSF.
+		if(!doMakePSF)
 		{
-			entry.imageWeight = _gridder->ImageWeight();
-			_infoPerChannel[entry.outputChannelIndex].weight = entry.imageWeight;
-			// If no PSF is made, also set the beam size. If the PSF was made, these would already be set
-			// after imaging the PSF.
-			if(!doMakePSF)
-			{
-				if(_settings.theoreticBeam) {
-					_infoPerChannel[entry.outputChannelIndex].beamMaj = _gridder->BeamSize();
-					_infoPerChannel[entry.outputChannelIndex].beamMin = _gridder->BeamSize();
-					_infoPerChannel[entry.outputChannelIndex].beamPA = 0.0;
-				}
-				else if(_settings.manualBeamMajorSize != 0.0) {
-					_infoPerChannel[entry.outputChannelIndex].beamMaj = _settings.manualBeamMajorSize;
-					_infoPerChannel[entry.outputChannelIndex].beamMin = _settings.manualBeamMinorSize;
-					_infoPerChannel[entry.outputChannelIndex].beamPA = _settings.manualBeamPA;
-				}
-				else {
-					_infoPerChannel[entry.outputChannelIndex].beamMaj = std::numeric_limits<double>::quiet_NaN();
-					_infoPerChannel[entry.outputChannelIndex].beamMin = std::numeric_limits<double>::quiet_NaN();
-					_infoPerChannel[entry.outputChannelIndex].beamPA = std::numeric_limits<double>::quiet_NaN();
-				}
+			if(_settings.theoreticBeam) {
+				_infoPerChannel[entry.outputChannelIndex].beamMaj = _gridder->BeamSize();
+				_infoPerChannel[entry.outputChannelIndex].beamMin = _gridder->BeamSize();
+				_infoPerChannel[entry.outputChannelIndex].beamPA = 0.0;
+			}
+			else if(_settings.manualBeamMajorSize != 0.0) {
+				_infoPerChannel[entry.outputChannelIndex].beamMaj = _settings.manualBeamMajorSize;
+				_infoPerChannel[entry.outputChannelIndex].beamMin = _settings.manualBeamMinorSize;
+				_infoPerChannel[entry.outputChannelIndex].beamPA = _settings.manualBeamPA;
+			}
+			else {
+				_infoPerChannel[entry.outputChannelIndex].beamMaj = std::numeric_limits<double>::quiet_NaN();
+				_infoPerChannel[entry.outputChannelIndex].beamMin = std::numeric_limits<double>::quiet_NaN();
+				_infoPerChannel[entry.outputChannelIndex].beamPA = std::numeric_limits<double>::quiet_NaN();
 			}
 		}
-		
-		if(_settings.isGriddingImageSaved && firstBeforePSF && _gridder->HasGriddingCorrectionImage())
-			imageGridding();
-		
-		_isFirstInversion = false;
-		
-		if(_settings.continuedRun)
+	}
+	
+	if(_settings.isGriddingImageSaved && firstBeforePSF && _gridder->HasGriddingCorrectionImage())
+		imageGridding();
+	
+	_isFirstInversion = false;
+	
+	if(_settings.continuedRun)
+	{
+		readEarlierModelImages(entry);
+	}
+	else {
+		// Set model to zero: already done if this is YX of XY/YX imaging combi
+		if(!(entry.polarization == Polarization::YX && _settings.polarizations.count(Polarization::XY)!=0))
 		{
-			readEarlierModelImages(entry);
+			double* modelImage = _imageAllocator.Allocate(_settings.trimmedImageWidth * _settings.trimmedImageHeight);
+			memset(modelImage, 0, _settings.trimmedImageWidth * _settings.trimmedImageHeight * sizeof(double));
+			_modelImages.Store(modelImage, entry.polarization, entry.outputChannelIndex, false);
+			if(Polarization::IsComplex(entry.polarization))
+				_modelImages.Store(modelImage, entry.polarization, entry.outputChannelIndex, true);
+			_imageAllocator.Free(modelImage);
 		}
-		else {
-			// Set model to zero: already done if this is YX of XY/YX imaging combi
-			if(!(entry.polarization == Polarization::YX && _settings.polarizations.count(Polarization::XY)!=0))
-			{
-				double* modelImage = _imageAllocator.Allocate(_settings.trimmedImageWidth * _settings.trimmedImageHeight);
-				memset(modelImage, 0, _settings.trimmedImageWidth * _settings.trimmedImageHeight * sizeof(double));
-				_modelImages.Store(modelImage, entry.polarization, entry.outputChannelIndex, false);
-				if(Polarization::IsComplex(entry.polarization))
-					_modelImages.Store(modelImage, entry.polarization, entry.outputChannelIndex, true);
-				_imageAllocator.Free(modelImage);
-			}
+	}
+	
+	if(_settings.isDirtySaved)
+	{
+		for(size_t imageIndex=0; imageIndex!=entry.imageCount; ++imageIndex)
+		{
+			bool isImaginary = (imageIndex==1);
+			WSCFitsWriter writer(createWSCFitsWriter(entry, isImaginary));
+			double* dirtyImage = _imageAllocator.Allocate(_settings.trimmedImageWidth * _settings.trimmedImageHeight);
+			_residualImages.Load(dirtyImage, entry.polarization, entry.outputChannelIndex, isImaginary);
+			Logger::Info << "Writing dirty image...\n";
+			writer.WriteImage("dirty.fits", dirtyImage);
+			addToMFSImage("dirty.fits", entry, isImaginary, false, writer.Writer(), dirtyImage);
+			_imageAllocator.Free(dirtyImage);
 		}
-		
-		if(_settings.isDirtySaved)
+	}
+}
+
+void WSClean::addToMFSImage(const std::string& suffix, const ImagingTableEntry& entry, bool isImaginary, bool isPSF, const FitsWriter& writer, const double* image) const
+{
+	// YX is combined with XY, and has no MFS image of its own
+	const bool isCombinedYX = entry.polarization == Polarization::YX && _settings.polarizations.count(Polarization::XY) != 0;
+	if(_settings.channelsOut > 1 && !isCombinedYX)
+	{
+		const PolarizationEnum pol = isPSF ? *_settings.polarizations.begin() : entry.polarization;
+		const std::string mfsName(ImageFilename::GetMFSPrefix(_settings, pol, entry.outputIntervalIndex, isImaginary, isPSF) + '-' + suffix);
+		std::lock_guard<std::mutex> guard(_mfsMutex);
+		std::map<std::string, std::unique_ptr<MFSImageCombiner>>::iterator mfsImage = _mfsImages.find(mfsName);
+		if(mfsImage == _mfsImages.end())
 		{
-			for(size_t imageIndex=0; imageIndex!=entry.imageCount; ++imageIndex)
-			{
-				bool isImaginary = (imageIndex==1);
-				WSCFitsWriter writer(createWSCFitsWriter(entry, isImaginary));
-				double* dirtyImage = _imageAllocator.Allocate(_settings.trimmedImageWidth * _settings.trimmedImageHeight);
-				_residualImages.Load(dirtyImage, entry.polarization, entry.outputChannelIndex, isImaginary);
-				Logger::Info << "Writing dirty image...\n";
-				writer.WriteImage("dirty.fits", dirtyImage);
-				_imageAllocator.Free(dirtyImage);
-			}
+			// The sum is only kept when it fits in the memory budget, next to the
+			// buffers that are in use
+			const size_t
+				usedBytes = _imageAllocator.AllocatedBytes() - _imageAllocator.UnusedBytes(),
+				sumBytes = ImageBufferAllocator::SizeClass(writer.Width() * writer.Height() * sizeof(double));
+			std::unique_ptr<MFSImageCombiner> combiner;
+			if(usedBytes + sumBytes <= _imageAllocator.MemoryBudget())
+				combiner.reset(new MFSImageCombiner(_imageAllocator));
+			else
+				Logger::Debug << "Sum of " << mfsName << " does not fit in the memory budget, will combine the channel images from disk.\n";
+			mfsImage = _mfsImages.emplace(mfsName, std::move(combiner)).first;
 		}
+		if(mfsImage->second)
+			mfsImage->second->Add(writer, image, _infoPerChannel[entry.outputChannelIndex].weight);
 	}
-	
-	clearCurMSProviders();
 }
 
 void WSClean::makeMFSImage(const string& suffix, size_t intervalIndex, PolarizationEnum pol, bool isImaginary, bool isPSF)
 {
-	double lowestFreq = 0.0, highestFreq = 0.0;
 	const size_t size = _settings.trimmedImageWidth * _settings.trimmedImageHeight;
-	ao::uvector<double> mfsImage(size, 0.0), addedImage(size), weightImage(size, 0.0);
-	double weightSum = 0.0;
-	FitsWriter writer;
-	for(size_t ch=0; ch!=_settings.channelsOut; ++ch)
+	const std::string mfsName(ImageFilename::GetMFSPrefix(_settings, pol, intervalIndex, isImaginary, isPSF) + '-' + suffix);
+	std::unique_ptr<MFSImageCombiner>& combinerPtr = _mfsImages[mfsName];
+	if(combinerPtr == nullptr || combinerPtr->ImageCount() != _settings.channelsOut)
 	{
-		std::string prefixStr = isPSF ?
-			ImageFilename::GetPSFPrefix(_settings, ch, intervalIndex) :
-			ImageFilename::GetPrefix(_settings, pol, ch, intervalIndex, isImaginary);
-		const std::string name(prefixStr + '-' + suffix);
-		FitsReader reader(name);
-		if(ch == 0)
-		{
-			WSCFitsWriter wscWriter(reader);
-			writer = wscWriter.Writer();
-			lowestFreq = reader.Frequency() - reader.Bandwidth()*0.5;
-			highestFreq = reader.Frequency() + reader.Bandwidth()*0.5;
-		}
-		else {
-			lowestFreq = std::min(lowestFreq, reader.Frequency() - reader.Bandwidth()*0.5);
-			highestFreq = std::max(highestFreq, reader.Frequency() + reader.Bandwidth()*0.5);
-		}
-		double weight;
-		if(!reader.ReadDoubleKeyIfExists("WSCIMGWG", weight))
-		{
-			Logger::Error << "Error: image " << name << " did not have the WSCIMGWG keyword.\n";
-			weight = 0.0;
-		}
-		weightSum += weight;
-		reader.Read(addedImage.data());
-		for(size_t i=0; i!=size; ++i)
+		// Images that were not summed while they were made (like the primary-beam
+		// corrected images, or sums that did not fit in the memory budget) are
+		// combined from the channel images on disk.
+		combinerPtr.reset(new MFSImageCombiner(_imageAllocator));
+		waitForImageWrites();
+		ao::uvector<double> channelImage(size);
+		for(size_t ch=0; ch!=_settings.channelsOut; ++ch)
 		{
-			if(std::isfinite(addedImage[i])) {
-				mfsImage[i] += addedImage[i] * weight;
-				weightImage[i] += weight;
+			std::string prefixStr = isPSF ?
+				ImageFilename::GetPSFPrefix(_settings, ch, intervalIndex) :
+				ImageFilename::GetPrefix(_settings, pol, ch, intervalIndex, isImaginary);
+			const std::string name(prefixStr + '-' + suffix);
+			FitsReader reader(name);
+			double weight;
+			if(!reader.ReadDoubleKeyIfExists("WSCIMGWG", weight))
+			{
+				Logger::Error << "Error: image " << name << " did not have the WSCIMGWG keyword.\n";
+				weight = 0.0;
 			}
+			reader.Read(channelImage.data());
+			FitsWriter channelWriter(WSCFitsWriter(reader).Writer());
+			channelWriter.SetCompression(_settings.fitsCompression, _settings.fitsQuantizeLevel);
+			combinerPtr->Add(channelWriter, channelImage.data(), weight);
 		}
 	}
-	for(size_t i=0; i!=size; ++i)
-		mfsImage[i] /= weightImage[i];
+	const MFSImageCombiner& combiner = *combinerPtr;
+	ao::uvector<double> mfsImage(size);
+	combiner.GetAverage(mfsImage.data());
 	
 	if(isPSF)
 	{
@@ -1169,18 +1525,19 @@ void WSClean::makeMFSImage(const string& suffix, size_t intervalIndex, Polarizat
 		_infoForMFS.beamMin = bMin;
 		_infoForMFS.beamPA = bPA;
 	}
+	FitsWriter writer(combiner.Writer());
 	if(std::isfinite(_infoForMFS.beamMaj))
 		writer.SetBeamInfo(_infoForMFS.beamMaj, _infoForMFS.beamMin, _infoForMFS.beamPA);
 	else
 		writer.SetNoBeamInfo();
 	
-	std::string mfsName(ImageFilename::GetMFSPrefix(_settings, pol, intervalIndex, isImaginary, isPSF) + '-' + suffix);
 	Logger::Info << "Writing " << mfsName << "...\n";
-	writer.SetFrequency((lowestFreq+highestFreq)*0.5, highestFreq-lowestFreq);
-	writer.SetExtraKeyword("WSCIMGWG", weightSum);
-	writer.RemoveExtraKeyword("WSCCHANS");
-	writer.RemoveExtraKeyword("WSCCHANE");
-	writer.Write(mfsName, mfsImage.data());
+	writeFits(writer, mfsName, mfsImage.data());
+	
+	// Only the residual and model are used again, by renderMFSImage()
+	const bool isRestoreInput = suffix.compare(0, 8, "residual") == 0 || suffix.compare(0, 5, "model") == 0;
+	if(!isRestoreInput)
+		_mfsImages.erase(mfsName);
 }
 
 void WSClean::renderMFSImage(size_t intervalIndex, PolarizationEnum pol, bool isImaginary, bool isPBCorrected) const
@@ -1189,11 +1546,15 @@ void WSClean::renderMFSImage(size_t intervalIndex, PolarizationEnum pol, bool is
 	
 	std::string mfsPrefix(ImageFilename::GetMFSPrefix(_settings, pol, intervalIndex, isImaginary, false));
 	std::string postfix = isPBCorrected ? "-pb.fits" : ".fits";
-	FitsReader residualReader(mfsPrefix + "-residual" + postfix);
-	FitsReader modelReader(mfsPrefix + "-model" + postfix);
+	// The MFS residual and model were combined by makeMFSImage()
+	std::map<std::string, std::unique_ptr<MFSImageCombiner>>::const_iterator
+		residual = _mfsImages.find(mfsPrefix + "-residual" + postfix),
+		model = _mfsImages.find(mfsPrefix + "-model" + postfix);
+	if(residual == _mfsImages.end() || model == _mfsImages.end())
+		throw std::runtime_error("MFS residual and model images should be made before the MFS restored image");
 	ao::uvector<double> image(size), modelImage(size);
-	residualReader.Read(image.data());
-	modelReader.Read(modelImage.data());
+	residual->second->GetAverage(image.data());
+	model->second->GetAverage(modelImage.data());
 	
 	double beamMaj = _infoForMFS.beamMaj;
 	double beamMin, beamPA;
@@ -1216,8 +1577,12 @@ void WSClean::renderMFSImage(size_t intervalIndex, PolarizationEnum pol, bool is
 	Logger::Info << "DONE\n";
 	
 	Logger::Info << "Writing " << mfsPrefix << "-image" << postfix << "...\n";
-	FitsWriter imageWriter(residualReader);
-	imageWriter.Write(mfsPrefix + "-image" + postfix, image.data());
+	FitsWriter imageWriter(residual->second->Writer());
+	if(std::isfinite(_infoForMFS.beamMaj))
+		imageWriter.SetBeamInfo(_infoForMFS.beamMaj, _infoForMFS.beamMin, _infoForMFS.beamPA);
+	else
+		imageWriter.SetNoBeamInfo();
+	writeFits(imageWriter, mfsPrefix + "-image" + postfix, image.data());
 }
 
 MSSelection WSClean::selectInterval(MSSelection& fullSelection, size_t intervalIndex)
@@ -1478,10 +1843,52 @@ void WSClean::determineBeamSize(double& bMaj, double& bMin, double& bPA, const d
 
 WSCFitsWriter WSClean::createWSCFitsWriter(const ImagingTableEntry& entry, bool isImaginary) const
 {
-	return WSCFitsWriter(entry, isImaginary, _settings, _deconvolution, _majorIterationNr, *_gridder, _commandLine, _infoPerChannel[entry.outputChannelIndex]);
+	WSCFitsWriter writer(entry, isImaginary, _settings, _deconvolution, _majorIterationNr, *_gridder, _commandLine, _infoPerChannel[entry.outputChannelIndex]);
+	writer.SetQueue(_fitsWriterQueue.get());
+	return writer;
 }
 
 WSCFitsWriter WSClean::createWSCFitsWriter(const ImagingTableEntry& entry, PolarizationEnum polarization, bool isImaginary) const
 {
-	return WSCFitsWriter(entry, polarization, isImaginary, _settings, _deconvolution, _majorIterationNr, *_gridder, _commandLine, _infoPerChannel[entry.outputChannelIndex]);
+	WSCFitsWriter writer(entry, polarization, isImaginary, _settings, _deconvolution, _majorIterationNr, *_gridder, _commandLine, _infoPerChannel[entry.outputChannelIndex]);
+	writer.SetQueue(_fitsWriterQueue.get());
+	return writer;
+}
+
+void WSClean::writeFits(const FitsWriter& writer, const std::string& filename, const double* image) const
+{
+	if(_fitsWriterQueue)
+		_fitsWriterQueue->Write(writer, filename, image);
+	else
+		writer.Write(filename, image);
+}
+
+void WSClean::waitForImageWrites() const
+{
+	if(_fitsWriterQueue)
+		_fitsWriterQueue->Flush();
+}
+
+void WSClean::startInstrumentation()
+{
+	if(!_settings.timingReportFile.empty() || !_settings.timingTraceFile.empty())
+		Instrumentation::Enable(!_settings.timingTraceFile.empty());
+}
+
+void WSClean::writeInstrumentation()
+{
+	if(Instrumentation::IsEnabled())
+	{
+		Instrumentation::Disable();
+		if(!_settings.timingReportFile.empty())
+		{
+			Logger::Info << "Writing timing report to " << _settings.timingReportFile << "...\n";
+			Instrumentation::WriteReport(_settings.timingReportFile);
+		}
+		if(!_settings.timingTraceFile.empty())
+		{
+			Logger::Info << "Writing timing trace to " << _settings.timingTraceFile << "...\n";
+			Instrumentation::WriteTrace(_settings.timingTraceFile);
+		}
+	}
 }
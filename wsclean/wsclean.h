@@ -14,10 +14,14 @@
 #include "cachedimageset.h"
 #include "imagebufferallocator.h"
 #include "imagingtable.h"
+#include "mfsimagecombiner.h"
 #include "outputchannelinfo.h"
 #include "wscfitswriter.h"
 #include "wscleansettings.h"
 
+#include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 
 class WSClean
@@ -40,6 +44,17 @@ private:
 	void predictGroup(const ImagingTable& imagingGroup);
 	
 	void runFirstInversion(ImagingTableEntry& entry);
+	/**
+	 * Performs the first inversion of several polarizations of a squared group in a single
+	 * pass over the visibilities; see @ref jointPolarizationSets().
+	 */
+	void runJointFirstInversion(ImagingTable& squaredGroup, const std::vector<size_t>& entryIndices);
+	/**
+	 * Images the PSF if this is the first polarization and @p includePSF is set, and
+	 * the primary beam if this is the last polarization.
+	 */
+	void makePSFAndBeamImages(ImagingTableEntry& entry, bool includePSF);
+	void finishFirstInversion(ImagingTableEntry& entry, bool firstBeforePSF);
 	void prepareInversionAlgorithm(PolarizationEnum polarization);
 	
 	void performReordering(bool isPredictMode);
@@ -47,7 +62,9 @@ private:
 	void initializeImageWeights(const ImagingTableEntry& entry);
 	void initializeMFSImageWeights();
 	MSProvider* initializeMSProvider(const ImagingTableEntry& entry, const MSSelection& selection, size_t filenameIndex, size_t dataDescId);
+	MSProvider* initializeMSProvider(const ImagingTableEntry& entry, PolarizationEnum polarization, const MSSelection& selection, size_t filenameIndex, size_t dataDescId);
 	void initializeCurMSProviders(const ImagingTableEntry& entry);
+	void initializeCurMSProviders(const ImagingTableEntry& entry, PolarizationEnum polarization);
 	void initializeMSProvidersForPB(const ImagingTableEntry& entry, class PrimaryBeam& pb);
 	void clearCurMSProviders();
 	void storeAndCombineXYandYX(CachedImageSet& dest, PolarizationEnum polarization, size_t joinedChannelIndex, bool isImaginary, const double* image);
@@ -62,14 +79,61 @@ private:
 	
 	void multiplyImage(double factor, double* image) const;
 	void imagePSF(ImagingTableEntry& entry);
+	/**
+	 * Normalizes, stores and writes the PSF of the entry, and sets the beam and weight info
+	 * of its channel.
+	 */
+	void storePSFImage(ImagingTableEntry& entry, double* psf);
 	void imageGridding();
 	void imageMainFirst(PolarizationEnum polarization, size_t channelIndex);
+	/**
+	 * Performs the work of @ref imagePSF() and @ref imageMainFirst() with a single pass over
+	 * the visibilities, see @ref MeasurementSetGridder::InvertWithPSF().
+	 */
+	void imagePSFAndMainFirst(ImagingTableEntry& entry);
 	void imageMainNonFirst(PolarizationEnum polarization, size_t channelIndex);
+	void storeResidualImages(PolarizationEnum polarization, size_t channelIndex);
+	void storeResidualImages(PolarizationEnum polarization, size_t channelIndex, double* realImage, double* imaginaryImage);
+	void loadPredictionModel(PolarizationEnum polarization, size_t channelIndex, double*& modelImageReal, double*& modelImageImaginary);
 	void predict(PolarizationEnum polarization, size_t channelIndex);
+	/**
+	 * Predict the model and image the residual in one step, without storing the
+	 * model visibilities; see @ref MeasurementSetGridder::PredictAndInvert().
+	 */
+	void predictAndImageMainNonFirst(PolarizationEnum polarization, size_t channelIndex);
+	/**
+	 * Images several polarizations of a squared group in a single pass over the visibilities,
+	 * with @ref MeasurementSetGridder::InvertPolarizations(). The instrumental MS providers
+	 * should have been initialized.
+	 * @param predictModels Whether the model images are predicted and subtracted during
+	 * the gridding. Otherwise, the model data is subtracted in a non-first inversion.
+	 */
+	void imageMainJointly(const ImagingTable& squaredGroup, const std::vector<size_t>& entryIndices, bool isFirstInversion, bool predictModels);
+	/**
+	 * Divides the entries of a squared group into sets of polarizations that are gridded
+	 * in a single pass. Complex polarizations are layered differently in the uv-grid, so
+	 * they are gridded separately from the others. Without joint gridding, each set holds
+	 * a single entry.
+	 * @returns Sets of indices into @p squaredGroup, ordered by their first entry.
+	 */
+	std::vector<std::vector<size_t>> jointPolarizationSets(const ImagingTable& squaredGroup) const;
+	bool canGridPolarizationsJointly() const;
 	void dftPredict(const ImagingTable& squaredGroup);
 	
+	/**
+	 * Limit the memory budget of the image allocator to the memory limit
+	 * of the settings, when one was given.
+	 */
+	void applyMemoryLimit();
+	
 	void makeMFSImage(const string& suffix, size_t intervalIndex, PolarizationEnum pol, bool isImaginary, bool isPSF = false);
 	void renderMFSImage(size_t intervalIndex, PolarizationEnum pol, bool isImaginary, bool isPBCorrected) const;
+	/**
+	 * Add a channel image to the running sum of its MFS image, so that the
+	 * MFS image does not have to be read back from the channel images. The
+	 * sum is not kept when it does not fit in the memory budget of the allocator.
+	 */
+	void addToMFSImage(const std::string& suffix, const ImagingTableEntry& entry, bool isImaginary, bool isPSF, const FitsWriter& writer, const double* image) const;
 	void saveUVImage(const double* image, PolarizationEnum pol, const ImagingTableEntry& entry, bool isImaginary, const std::string& prefix) const;
 	void writeFirstResidualImages(const ImagingTable& groupTable) const;
 	void writeModelImages(const ImagingTable& groupTable) const;
@@ -84,11 +148,24 @@ private:
 	
 	WSCFitsWriter createWSCFitsWriter(const ImagingTableEntry& entry, PolarizationEnum polarization, bool isImaginary) const;
 	
+	/**
+	 * Write an image through the output queue.
+	 */
+	void writeFits(const FitsWriter& writer, const std::string& filename, const double* image) const;
+	
+	/**
+	 * Wait until the queued output images are written, before reading them back.
+	 */
+	void waitForImageWrites() const;
+	
+	void startInstrumentation();
+	void writeInstrumentation();
+	
 	bool preferReordering() const
 	{
 		return (
 			(_settings.channelsOut != 1) ||
-			(_settings.polarizations.size()>=4) ||
+			(_settings.polarizations.size()>=4 && !_settings.jointPolarizationGridding) ||
 			(_settings.deconvolutionMGain != 1.0) ||
 			(_settings.baselineDependentAveragingInWavelengths != 0.0) ||
 			_settings.simulateNoise ||
@@ -104,13 +181,20 @@ private:
 	
 	std::vector<OutputChannelInfo> _infoPerChannel;
 	OutputChannelInfo _infoForMFS;
+	// Running sums of the MFS images of the current interval, by filename. A null
+	// combiner means that the sum did not fit in the memory budget of the
+	// allocator, and that the MFS image is made from the channel images on disk.
+	mutable std::map<std::string, std::unique_ptr<MFSImageCombiner>> _mfsImages;
+	mutable std::mutex _mfsMutex;
 	
 	std::unique_ptr<class MSGridderBase> _gridder;
 	std::unique_ptr<class ImageWeightCache> _imageWeightCache;
-	std::unique_ptr<class PrimaryBeam> _primaryBeam;
+	/** Shared with the group pipeline, which corrects the images of a group while the next group is imaged. */
+	std::shared_ptr<class PrimaryBeam> _primaryBeam;
+	std::unique_ptr<class FitsWriterQueue> _fitsWriterQueue;
 	mutable ImageBufferAllocator _imageAllocator;
 	Stopwatch _inversionWatch, _predictingWatch, _deconvolutionWatch;
-	bool _isFirstInversion, _doReorder;
+	bool _isFirstInversion, _doReorder, _gridPolarizationsJointly;
 	size_t _majorIterationNr;
 	CachedImageSet _psfImages, _modelImages, _residualImages;
 	std::vector<PartitionedMS::Handle> _partitionedMSHandles;
@@ -118,6 +202,8 @@ private:
 	std::vector<MultiBandData> _msBands;
 	Deconvolution _deconvolution;
 	ImagingTable _imagingTable;
+	// Declared last, so that it finishes its tasks before the members they use are destructed
+	std::unique_ptr<class GroupPipeline> _groupPipeline;
 };
 
 #endif
@@ -4,6 +4,7 @@
 #include "wstackinggridder.h"
 #include "inversionalgorithm.h"
 
+#include "../fitswriter.h"
 #include "../msselection.h"
 #include "../system.h"
 
@@ -50,11 +51,36 @@ public:
 	WeightMode weightMode;
 	std::string prefixName;
 	bool smallInversion, makePSF, makePSFOnly, isWeightImageSaved, isUVImageSaved, isDirtySaved, isGriddingImageSaved;
+	std::string fftTimingFile;
+	/**
+	 * When set, the time spent in each stage of imaging is measured and
+	 * written to these files as a JSON report and as a Chrome trace.
+	 */
+	std::string timingReportFile, timingTraceFile;
+	/**
+	 * Number of threads that write output images in the background. With zero
+	 * threads, images are written before the imaging continues.
+	 */
+	size_t writeThreadCount;
+	/**
+	 * When set, the restoring and writing of an independent group of images
+	 * happens in the background while the next group is imaged.
+	 */
+	bool pipelineGroups;
+	/**
+	 * When set, the polarizations of an output channel are gridded in a single pass
+	 * over the measurement sets, instead of one pass per polarization. Measurement sets
+	 * are then not reordered just because several polarizations are imaged.
+	 */
+	bool jointPolarizationGridding;
+	FitsWriter::Compression fitsCompression;
+	double fitsQuantizeLevel;
 	bool dftPrediction, dftWithBeam;
 	std::string temporaryDirectory;
 	bool forceReorder, forceNoReorder, subtractModel, modelUpdateRequired, mfsWeighting;
 	bool normalizeForWeighting;
 	bool applyPrimaryBeam, reusePrimaryBeam, useDifferentialLofarBeam, savePsfPb, useIDG;
+	double beamReuseTolerance;
 	enum GridModeEnum gridMode;
 	enum MeasurementSetGridder::VisibilityWeightingMode visibilityWeightingMode;
 	double baselineDependentAveragingInWavelengths;
@@ -96,6 +122,22 @@ public:
 	 * It is 0 when all channels should be used.
 	 */
 	size_t deconvolutionChannelCount;
+	/**
+	 * Whether deconvolution images are stored in single precision. Algorithms
+	 * that do not support this fall back to double precision.
+	 */
+	bool deconvolutionSinglePrecision;
+	/**
+	 * Whether deconvolution images are placed in a memory-mapped scratch
+	 * file (in the temporary directory, if set) instead of in memory.
+	 */
+	bool deconvolutionOutOfCore;
+	/**
+	 * Amount of memory in gigabytes that may be used to keep the cached model,
+	 * residual and psf images of a group in memory. Images that don't fit are only
+	 * kept in the scratch file.
+	 */
+	double imageCacheMemory;
 	/**
 	 * @}
 	 */
@@ -151,6 +193,10 @@ inline WSCleanSettings::WSCleanSettings() :
 	prefixName("wsclean"),
 	smallInversion(true), makePSF(false), makePSFOnly(false), isWeightImageSaved(false),
 	isUVImageSaved(false), isDirtySaved(true), isGriddingImageSaved(false),
+	writeThreadCount(0),
+	pipelineGroups(false),
+	jointPolarizationGridding(false),
+	fitsCompression(FitsWriter::NoCompression), fitsQuantizeLevel(4.0),
 	dftPrediction(false), dftWithBeam(false),
 	temporaryDirectory(),
 	forceReorder(false), forceNoReorder(false),
@@ -162,6 +208,7 @@ inline WSCleanSettings::WSCleanSettings() :
 	useDifferentialLofarBeam(false),
 	savePsfPb(false),
 	useIDG(false),
+	beamReuseTolerance(0.0),
 	gridMode(KaiserBesselKernel),
 	visibilityWeightingMode(MeasurementSetGridder::NormalVisibilityWeighting),
 	baselineDependentAveragingInWavelengths(0.0),
@@ -204,7 +251,10 @@ inline WSCleanSettings::WSCleanSettings() :
 	moreSaneArgs(),
 	spectralFittingMode(NoSpectralFitting),
 	spectralFittingTerms(0),
-	deconvolutionChannelCount(0)
+	deconvolutionChannelCount(0),
+	deconvolutionSinglePrecision(false),
+	deconvolutionOutOfCore(false),
+	imageCacheMemory(0.0)
 {
 	polarizations.insert(Polarization::StokesI);
 }
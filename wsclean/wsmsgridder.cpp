@@ -1,6 +1,7 @@
 #include "wsmsgridder.h"
 
 #include "imagebufferallocator.h"
+#include "instrumentation.h"
 #include "logger.h"
 
 #include "../imageweights.h"
@@ -12,6 +13,7 @@
 
 #include <casacore/ms/MeasurementSets/MeasurementSet.h>
 
+#include <cmath>
 #include <iostream>
 #include <stdexcept>
 
@@ -128,6 +130,8 @@ void WSMSGridder::gridMeasurementSet(MSData &msData)
 	ao::uvector<std::complex<float>> modelBuffer(selectedBand.MaxChannels());
 	ao::uvector<float> weightBuffer(selectedBand.MaxChannels());
 	ao::uvector<bool> isSelected(selectedBand.MaxChannels());
+	const bool subtractPrediction = (_predictionGridder != nullptr);
+	ao::uvector<float> modelFactors(subtractPrediction ? selectedBand.MaxChannels() : 0);
 	
 	// Samples of the same w-layer are collected in a buffer
 	// before they are written into the lane. This is done because writing
@@ -174,13 +178,17 @@ void WSMSGridder::gridMeasurementSet(MSData &msData)
 				isSelected[ch] = _gridder->IsInLayerRange(w);
 			}
 	
-			readAndWeightVisibilities<1>(*msData.msProvider, newItem, curBand, weightBuffer.data(), modelBuffer.data(), isSelected.data());
+			{
+				Instrumentation::Accumulator read(Instrumentation::MSReadStage);
+				readAndWeightVisibilities<1>(*msData.msProvider, newItem, curBand, weightBuffer.data(), modelBuffer.data(), isSelected.data(), subtractPrediction ? modelFactors.data() : nullptr);
+			}
 			
 			InversionWorkSample sampleData;
 			for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
 			{
 				double wavelength = curBand.ChannelWavelength(ch);
 				sampleData.sample = newItem.data[ch];
+				sampleData.modelFactor = subtractPrediction ? modelFactors[ch] : 0.0;
 				sampleData.uInLambda = newItem.uvw[0] / wavelength;
 				sampleData.vInLambda = newItem.uvw[1] / wavelength;
 				sampleData.wInLambda = newItem.uvw[2] / wavelength;
@@ -202,7 +210,7 @@ void WSMSGridder::gridMeasurementSet(MSData &msData)
 	msData.totalRowsProcessed += rowsRead;
 }
 
-void WSMSGridder::startInversionWorkThreads(size_t maxChannelCount)
+void WSMSGridder::startInversionWorkThreads(size_t maxChannelCount, size_t pass)
 {
 	_inversionCPULanes.reset(new ao::lane<InversionWorkSample>[_cpuCount]);
 	boost::thread_group group;
@@ -211,7 +219,31 @@ void WSMSGridder::startInversionWorkThreads(size_t maxChannelCount)
 	{
 		_inversionCPULanes[i].resize(maxChannelCount * _laneBufferSize);
 		set_lane_debug_name(_inversionCPULanes[i], "Work lane (buffered) containing individual visibility samples");
-		_threadGroup->add_thread(new boost::thread(&WSMSGridder::workThreadPerSample, this, &_inversionCPULanes[i]));
+		_threadGroup->add_thread(new boost::thread(&WSMSGridder::workThreadPerSample, this, &_inversionCPULanes[i], pass));
+	}
+}
+
+void WSMSGridder::startJointInversionWorkThreads(size_t maxChannelCount, size_t pass)
+{
+	_jointInversionCPULanes.reset(new ao::lane<JointInversionWorkSample>[_cpuCount]);
+	_threadGroup.reset(new boost::thread_group());
+	for(size_t i=0; i!=_cpuCount; ++i)
+	{
+		_jointInversionCPULanes[i].resize(maxChannelCount * _laneBufferSize);
+		set_lane_debug_name(_jointInversionCPULanes[i], "Work lane (buffered) containing the polarizations of individual visibility samples");
+		_threadGroup->add_thread(new boost::thread(&WSMSGridder::jointWorkThreadPerSample, this, &_jointInversionCPULanes[i], pass));
+	}
+}
+
+void WSMSGridder::startPSFInversionWorkThreads(size_t maxChannelCount, size_t pass)
+{
+	_psfInversionCPULanes.reset(new ao::lane<PSFInversionWorkSample>[_cpuCount]);
+	_threadGroup.reset(new boost::thread_group());
+	for(size_t i=0; i!=_cpuCount; ++i)
+	{
+		_psfInversionCPULanes[i].resize(maxChannelCount * _laneBufferSize);
+		set_lane_debug_name(_psfInversionCPULanes[i], "Work lane (buffered) containing the data and PSF of individual visibility samples");
+		_threadGroup->add_thread(new boost::thread(&WSMSGridder::psfWorkThreadPerSample, this, &_psfInversionCPULanes[i], pass));
 	}
 }
 
@@ -220,18 +252,69 @@ void WSMSGridder::finishInversionWorkThreads()
 	_threadGroup->join_all();
 	_threadGroup.reset();
 	_inversionCPULanes.reset();
+	_jointInversionCPULanes.reset();
+	_psfInversionCPULanes.reset();
 }
 
-void WSMSGridder::workThreadPerSample(ao::lane<InversionWorkSample>* workLane)
+void WSMSGridder::workThreadPerSample(ao::lane<InversionWorkSample>* workLane, size_t pass)
 {
+	Instrumentation::ScopedTimer timer(Instrumentation::GriddingStage, pass);
 	size_t bufferSize = std::max<size_t>(8u, workLane->capacity()/8);
 	bufferSize = std::min<size_t>(128,std::min(bufferSize, workLane->capacity()));
 	lane_read_buffer<InversionWorkSample> buffer(workLane, bufferSize);
 	InversionWorkSample sampleData;
+	size_t sampleCount = 0;
 	while(buffer.read(sampleData))
 	{
+		if(sampleData.modelFactor != 0.0)
+		{
+			// The sample is subtracted here instead of in the reading thread, so that
+			// the prediction is spread over the gridding threads. A non-finite
+			// prediction lies outside the uv-plane, and so does the sample.
+			std::complex<float> model;
+			_predictionGridder->SampleDataSample(model, sampleData.uInLambda, sampleData.vInLambda, sampleData.wInLambda);
+			if(std::isfinite(model.real()) && std::isfinite(model.imag()))
+				sampleData.sample -= model * sampleData.modelFactor;
+		}
 		_gridder->AddDataSample(sampleData.sample, sampleData.uInLambda, sampleData.vInLambda, sampleData.wInLambda);
+		++sampleCount;
 	}
+	timer.AddItems(sampleCount);
+}
+
+void WSMSGridder::jointWorkThreadPerSample(ao::lane<JointInversionWorkSample>* workLane, size_t pass)
+{
+	Instrumentation::ScopedTimer timer(Instrumentation::GriddingStage, pass);
+	size_t bufferSize = std::max<size_t>(8u, workLane->capacity()/8);
+	bufferSize = std::min<size_t>(128,std::min(bufferSize, workLane->capacity()));
+	lane_read_buffer<JointInversionWorkSample> buffer(workLane, bufferSize);
+	const size_t polarizationCount = _jointGridders.size() + 1;
+	WStackingGridder* gridders[4];
+	WStackingGridder* predictionGridders[4];
+	for(size_t p=0; p!=polarizationCount; ++p)
+	{
+		gridders[p] = &jointGridder(p);
+		if(_predictionGridder != nullptr)
+			predictionGridders[p] = (p == 0) ? _predictionGridder.get() : _jointPredictionGridders[p-1].get();
+	}
+	JointInversionWorkSample sampleData;
+	size_t sampleCount = 0;
+	while(buffer.read(sampleData))
+	{
+		for(size_t p=0; p!=polarizationCount; ++p)
+		{
+			if(sampleData.modelFactors[p] != 0.0)
+			{
+				std::complex<float> model;
+				predictionGridders[p]->SampleDataSample(model, sampleData.uInLambda, sampleData.vInLambda, sampleData.wInLambda);
+				if(std::isfinite(model.real()) && std::isfinite(model.imag()))
+					sampleData.samples[p] -= model * sampleData.modelFactors[p];
+			}
+		}
+		WStackingGridder::AddDataSamples(gridders, sampleData.samples, polarizationCount, sampleData.uInLambda, sampleData.vInLambda, sampleData.wInLambda);
+		++sampleCount;
+	}
+	timer.AddItems(sampleCount);
 }
 
 void WSMSGridder::predictMeasurementSet(MSData &msData)
@@ -258,6 +341,7 @@ void WSMSGridder::predictMeasurementSet(MSData &msData)
 	 * from this thread during further processing */
 	std::vector<double> us, vs, ws;
 	std::vector<size_t> rowIds, dataIds;
+	Instrumentation::ScopedTimer readTimer(Instrumentation::MSReadStage);
 	msData.msProvider->Reset();
 	while(msData.msProvider->CurrentRowAvailable())
 	{
@@ -280,6 +364,7 @@ void WSMSGridder::predictMeasurementSet(MSData &msData)
 		
 		msData.msProvider->NextRow();
 	}
+	readTimer.AddItems(rowsProcessed);
 	
 	for(size_t i=0; i!=us.size(); ++i)
 	{
@@ -305,12 +390,19 @@ void WSMSGridder::predictMeasurementSet(MSData &msData)
 
 void WSMSGridder::predictCalcThread(ao::lane<PredictionWorkItem>* inputLane, ao::lane<PredictionWorkItem>* outputLane)
 {
+	Instrumentation::ScopedTimer timer(Instrumentation::DegriddingStage);
 	lane_write_buffer<PredictionWorkItem> writeBuffer(outputLane, _laneBufferSize);
 	
 	PredictionWorkItem item;
-	while(inputLane->read(item))
+	while(true)
 	{
+		{
+			Instrumentation::Accumulator wait(Instrumentation::LaneWaitStage);
+			if(!inputLane->read(item))
+				break;
+		}
 		_gridder->SampleData(item.data, item.dataDescId, item.u, item.v, item.w);
+		timer.AddItems(1);
 		
 		writeBuffer.write(item);
 	}
@@ -322,23 +414,48 @@ void WSMSGridder::predictWriteThread(ao::lane<PredictionWorkItem>* predictionWor
 	PredictionWorkItem workItem;
 	while(buffer.read(workItem))
 	{
+		Instrumentation::Accumulator write(Instrumentation::PredictWriteStage);
 		msData->msProvider->WriteModel(workItem.rowId, workItem.data);
 		delete[] workItem.data;
 	}
 }
 
+void WSMSGridder::psfWorkThreadPerSample(ao::lane<PSFInversionWorkSample>* workLane, size_t pass)
+{
+	Instrumentation::ScopedTimer timer(Instrumentation::GriddingStage, pass);
+	size_t bufferSize = std::max<size_t>(8u, workLane->capacity()/8);
+	bufferSize = std::min<size_t>(128,std::min(bufferSize, workLane->capacity()));
+	lane_read_buffer<PSFInversionWorkSample> buffer(workLane, bufferSize);
+	WStackingGridder* gridders[2] = { _gridder.get(), _psfGridder.get() };
+	PSFInversionWorkSample sampleData;
+	size_t sampleCount = 0;
+	while(buffer.read(sampleData))
+	{
+		WStackingGridder::AddDataSamples(gridders, sampleData.samples, 2, sampleData.uInLambda, sampleData.vInLambda, sampleData.wInLambda);
+		++sampleCount;
+	}
+	timer.AddItems(sampleCount);
+}
+
+std::unique_ptr<WStackingGridder> WSMSGridder::createGridder(double maxMem) const
+{
+	std::unique_ptr<WStackingGridder> gridder(new WStackingGridder(_actualInversionWidth, _actualInversionHeight, _actualPixelSizeX, _actualPixelSizeY, _cpuCount, _imageBufferAllocator, AntialiasingKernelSize(), OverSamplingFactor()));
+	gridder->SetGridMode(GridMode());
+	if(HasDenormalPhaseCentre())
+		gridder->SetDenormalPhaseCentre(PhaseCentreDL(), PhaseCentreDM());
+	gridder->SetIsComplex(IsComplex());
+	//_imager->SetImageConjugatePart(Polarization() == Polarization::YX && IsComplex());
+	gridder->PrepareWLayers(WGridSize(), maxMem, _minW, _maxW);
+	return gridder;
+}
+
 void WSMSGridder::Invert()
 {
 	std::vector<MSData> msDataVector;
 	initializeMSDataVector(msDataVector, 1);
 	
-	_gridder = std::unique_ptr<WStackingGridder>(new WStackingGridder(_actualInversionWidth, _actualInversionHeight, _actualPixelSizeX, _actualPixelSizeY, _cpuCount, _imageBufferAllocator, AntialiasingKernelSize(), OverSamplingFactor()));
-	_gridder->SetGridMode(GridMode());
-	if(HasDenormalPhaseCentre())
-		_gridder->SetDenormalPhaseCentre(PhaseCentreDL(), PhaseCentreDM());
-	_gridder->SetIsComplex(IsComplex());
-	//_imager->SetImageConjugatePart(Polarization() == Polarization::YX && IsComplex());
-	_gridder->PrepareWLayers(WGridSize(), double(_memSize)*(7.0/10.0), _minW, _maxW);
+	_jointGridders.clear();
+	_gridder = createGridder(double(_memSize)*(7.0/10.0));
 	
 	if(Verbose() && Logger::IsVerbose())
 	{
@@ -366,7 +483,7 @@ void WSMSGridder::Invert()
 			
 			const MultiBandData selectedBand(msData.SelectedBand());
 			
-			startInversionWorkThreads(selectedBand.MaxChannels());
+			startInversionWorkThreads(selectedBand.MaxChannels(), pass);
 		
 			gridMeasurementSet(msData);
 			
@@ -379,6 +496,11 @@ void WSMSGridder::Invert()
 		_gridder->FinishInversionPass();
 	}
 	
+	finalizeImage(msDataVector);
+}
+
+void WSMSGridder::finalizeImage(const std::vector<MSData>& msDataVector)
+{
 	if(Verbose())
 	{
 		size_t totalRowsRead = 0, totalMatchingRows = 0;
@@ -394,16 +516,21 @@ void WSMSGridder::Invert()
 		Logger::Info << '\n';
 	}
 	
-	if(NormalizeForWeighting())
-		_gridder->FinalizeImage(1.0/totalWeight(), false);
-	else {
-		Logger::Info << "Not dividing by normalization factor of " << totalWeight()/2.0 << ".\n";
-		_gridder->FinalizeImage(2.0, true);
-	}
+	finalizeGridderImage(*_gridder, totalWeight());
 	Logger::Info << "Gridded visibility count: " << double(GriddedVisibilityCount());
 	if(Weighting().IsNatural())
 		Logger::Info << ", effective count after weighting: " << EffectiveGriddedVisibilityCount();
 	Logger::Info << '\n';
+}
+
+void WSMSGridder::finalizeGridderImage(WStackingGridder& gridder, double totalWeight)
+{
+	if(NormalizeForWeighting())
+		gridder.FinalizeImage(1.0/totalWeight, false);
+	else {
+		Logger::Info << "Not dividing by normalization factor of " << totalWeight/2.0 << ".\n";
+		gridder.FinalizeImage(2.0, true);
+	}
 	
 	if(ImageWidth()!=_actualInversionWidth || ImageHeight()!=_actualInversionHeight)
 	{
@@ -416,16 +543,16 @@ void WSMSGridder::Invert()
 			double *resizedReal = _imageBufferAllocator->Allocate(ImageWidth() * ImageHeight());
 			double *resizedImag = _imageBufferAllocator->Allocate(ImageWidth() * ImageHeight());
 			resampler.Start();
-			resampler.AddTask(_gridder->RealImage(), resizedReal);
-			resampler.AddTask(_gridder->ImaginaryImage(), resizedImag);
+			resampler.AddTask(gridder.RealImage(), resizedReal);
+			resampler.AddTask(gridder.ImaginaryImage(), resizedImag);
 			resampler.Finish();
-			_gridder->ReplaceRealImageBuffer(resizedReal);
-			_gridder->ReplaceImaginaryImageBuffer(resizedImag);
+			gridder.ReplaceRealImageBuffer(resizedReal);
+			gridder.ReplaceImaginaryImageBuffer(resizedImag);
 		}
 		else {
 			double *resized = _imageBufferAllocator->Allocate(ImageWidth() * ImageHeight());
-			resampler.RunSingle(_gridder->RealImage(), resized);
-			_gridder->ReplaceRealImageBuffer(resized);
+			resampler.RunSingle(gridder.RealImage(), resized);
+			gridder.ReplaceRealImageBuffer(resized);
 		}
 	}
 	
@@ -435,43 +562,20 @@ void WSMSGridder::Invert()
 		// Perform trimming
 		
 		double *trimmed = _imageBufferAllocator->Allocate(TrimWidth() * TrimHeight());
-		Image::Trim(trimmed, TrimWidth(), TrimHeight(), _gridder->RealImage(), ImageWidth(), ImageHeight());
-		_gridder->ReplaceRealImageBuffer(trimmed);
+		Image::Trim(trimmed, TrimWidth(), TrimHeight(), gridder.RealImage(), ImageWidth(), ImageHeight());
+		gridder.ReplaceRealImageBuffer(trimmed);
 		
 		if(IsComplex())
 		{
 			double *trimmedImag = _imageBufferAllocator->Allocate(TrimWidth() * TrimHeight());
-			Image::Trim(trimmedImag, TrimWidth(), TrimHeight(), _gridder->ImaginaryImage(), ImageWidth(), ImageHeight());
-			_gridder->ReplaceImaginaryImageBuffer(trimmedImag);
+			Image::Trim(trimmedImag, TrimWidth(), TrimHeight(), gridder.ImaginaryImage(), ImageWidth(), ImageHeight());
+			gridder.ReplaceImaginaryImageBuffer(trimmedImag);
 		}
 	}
 }
 
-void WSMSGridder::Predict(double* real, double* imaginary)
+void WSMSGridder::prepareModelImage(double*& real, double*& imaginary, ImageBufferAllocator::Ptr& untrimmedReal, ImageBufferAllocator::Ptr& untrimmedImag, ImageBufferAllocator::Ptr& resampledReal, ImageBufferAllocator::Ptr& resampledImag)
 {
-	if(imaginary==0 && IsComplex())
-		throw std::runtime_error("Missing imaginary in complex prediction");
-	if(imaginary!=0 && !IsComplex())
-		throw std::runtime_error("Imaginary specified in non-complex prediction");
-	
-	std::vector<MSData> msDataVector;
-	initializeMSDataVector(msDataVector, 1);
-	
-	_gridder = std::unique_ptr<WStackingGridder>(new WStackingGridder(_actualInversionWidth, _actualInversionHeight, _actualPixelSizeX, _actualPixelSizeY, _cpuCount, _imageBufferAllocator, AntialiasingKernelSize(), OverSamplingFactor()));
-	_gridder->SetGridMode(GridMode());
-	if(HasDenormalPhaseCentre())
-		_gridder->SetDenormalPhaseCentre(PhaseCentreDL(), PhaseCentreDM());
-	_gridder->SetIsComplex(IsComplex());
-	//_imager->SetImageConjugatePart(Polarization() == Polarization::YX && IsComplex());
-	_gridder->PrepareWLayers(WGridSize(), double(_memSize)*(7.0/10.0), _minW, _maxW);
-	
-	if(Verbose())
-	{
-		for(size_t i=0; i!=MeasurementSetCount(); ++i)
-			countSamplesPerLayer(msDataVector[i]);
-	}
-	
-	ImageBufferAllocator::Ptr untrimmedReal, untrimmedImag;
 	if(TrimWidth() != ImageWidth() || TrimHeight() != ImageHeight())
 	{
 		Logger::Info << "Untrimming " << TrimWidth() << " x " << TrimHeight() << " -> " << ImageWidth() << " x " << ImageHeight() << '\n';
@@ -490,7 +594,6 @@ void WSMSGridder::Predict(double* real, double* imaginary)
 		}
 	}
 	
-	ImageBufferAllocator::Ptr resampledReal, resampledImag;
 	if(ImageWidth()!=_actualInversionWidth || ImageHeight()!=_actualInversionHeight)
 	{
 		// Decimate the image
@@ -512,6 +615,29 @@ void WSMSGridder::Predict(double* real, double* imaginary)
 		}
 		real = resampledReal.data();
 	}
+}
+
+void WSMSGridder::Predict(double* real, double* imaginary)
+{
+	if(imaginary==0 && IsComplex())
+		throw std::runtime_error("Missing imaginary in complex prediction");
+	if(imaginary!=0 && !IsComplex())
+		throw std::runtime_error("Imaginary specified in non-complex prediction");
+	
+	std::vector<MSData> msDataVector;
+	initializeMSDataVector(msDataVector, 1);
+	
+	_jointGridders.clear();
+	_gridder = createGridder(double(_memSize)*(7.0/10.0));
+	
+	if(Verbose())
+	{
+		for(size_t i=0; i!=MeasurementSetCount(); ++i)
+			countSamplesPerLayer(msDataVector[i]);
+	}
+	
+	ImageBufferAllocator::Ptr untrimmedReal, untrimmedImag, resampledReal, resampledImag;
+	prepareModelImage(real, imaginary, untrimmedReal, untrimmedImag, resampledReal, resampledImag);
 	
 	for(size_t pass=0; pass!=_gridder->NPasses(); ++pass)
 	{
@@ -547,3 +673,628 @@ void WSMSGridder::Predict(double* real, double* imaginary)
 		Logger::Info << " (overhead: " << std::max(0.0, round(totalRowsWritten * 100.0 / totalMatchingRows - 100.0)) << "%)";
 	Logger::Info << '\n';
 }
+
+void WSMSGridder::PredictAndInvert(double* real, double* imaginary)
+{
+	if(imaginary==0 && IsComplex())
+		throw std::runtime_error("Missing imaginary in complex prediction");
+	if(imaginary!=0 && !IsComplex())
+		throw std::runtime_error("Imaginary specified in non-complex prediction");
+	if(DoImagePSF())
+		throw std::runtime_error("A model can not be subtracted when imaging the PSF");
+	
+	std::vector<MSData> msDataVector;
+	initializeMSDataVector(msDataVector, 1);
+	
+	FusedPredictionScope predictionScope(*this, true);
+	
+	// Both gridders get the same memory, so that they divide the w-layers over the
+	// passes in the same way, and each prediction pass matches an inversion pass.
+	_jointGridders.clear();
+	_gridder = createGridder(double(_memSize)*(7.0/20.0));
+	_predictionGridder = createGridder(double(_memSize)*(7.0/20.0));
+	
+	if(Verbose() && Logger::IsVerbose())
+	{
+		for(size_t i=0; i!=MeasurementSetCount(); ++i)
+			countSamplesPerLayer(msDataVector[i]);
+	}
+	
+	ImageBufferAllocator::Ptr untrimmedReal, untrimmedImag, resampledReal, resampledImag;
+	prepareModelImage(real, imaginary, untrimmedReal, untrimmedImag, resampledReal, resampledImag);
+	
+	resetVisibilityCounters();
+	for(size_t pass=0; pass!=_gridder->NPasses(); ++pass)
+	{
+		Logger::Info << "Fourier transforms for pass " << pass << "... ";
+		if(Verbose()) Logger::Info << '\n';
+		else Logger::Info.Flush();
+		if(imaginary == 0)
+			_predictionGridder->InitializePrediction(real);
+		else
+			_predictionGridder->InitializePrediction(real, imaginary);
+		_predictionGridder->StartPredictionPass(pass);
+		
+		Logger::Info << "Predicting and gridding...\n";
+		_gridder->StartInversionPass(pass);
+		for(size_t i=0; i!=MeasurementSetCount(); ++i)
+		{
+			MSData& msData = msDataVector[i];
+			startInversionWorkThreads(msData.SelectedBand().MaxChannels(), pass);
+			gridMeasurementSet(msData);
+			finishInversionWorkThreads();
+		}
+		
+		Logger::Info << "Fourier transforms...\n";
+		_gridder->FinishInversionPass();
+	}
+	
+	resampledReal.reset();
+	resampledImag.reset();
+	untrimmedReal.reset();
+	untrimmedImag.reset();
+	
+	finalizeImage(msDataVector);
+}
+
+WSMSGridder::PolarizationProduct WSMSGridder::GetPolarizationProduct(PolarizationEnum polarization, const std::vector<PolarizationEnum>& msPolarizations)
+{
+	// This follows the conversions of MSProvider::copyWeightedData()
+	PolarizationProduct product;
+	product.indexB = 0;
+	if(Polarization::TypeToIndex(polarization, msPolarizations, product.indexA))
+	{
+		product.operation = PolarizationProduct::Copy;
+		return product;
+	}
+	bool isLinear;
+	switch(polarization)
+	{
+		case Polarization::StokesI:
+			isLinear = Polarization::TypeToIndex(Polarization::XX, msPolarizations, product.indexA) &&
+				Polarization::TypeToIndex(Polarization::YY, msPolarizations, product.indexB);
+			if(isLinear || (Polarization::TypeToIndex(Polarization::RR, msPolarizations, product.indexA) &&
+				Polarization::TypeToIndex(Polarization::LL, msPolarizations, product.indexB)))
+			{
+				// I = XX + YY or RR + LL
+				product.operation = PolarizationProduct::Sum;
+				return product;
+			}
+			break;
+		case Polarization::StokesQ:
+			isLinear = Polarization::TypeToIndex(Polarization::XX, msPolarizations, product.indexA) &&
+				Polarization::TypeToIndex(Polarization::YY, msPolarizations, product.indexB);
+			if(isLinear)
+			{
+				// Q = XX - YY
+				product.operation = PolarizationProduct::Difference;
+				return product;
+			}
+			else if(Polarization::TypeToIndex(Polarization::RL, msPolarizations, product.indexA) &&
+				Polarization::TypeToIndex(Polarization::LR, msPolarizations, product.indexB))
+			{
+				// Q = RL + LR
+				product.operation = PolarizationProduct::Sum;
+				return product;
+			}
+			break;
+		case Polarization::StokesU:
+			isLinear = Polarization::TypeToIndex(Polarization::XY, msPolarizations, product.indexA) &&
+				Polarization::TypeToIndex(Polarization::YX, msPolarizations, product.indexB);
+			if(isLinear)
+			{
+				// U = XY + YX
+				product.operation = PolarizationProduct::Sum;
+				return product;
+			}
+			else if(Polarization::TypeToIndex(Polarization::RL, msPolarizations, product.indexA) &&
+				Polarization::TypeToIndex(Polarization::LR, msPolarizations, product.indexB))
+			{
+				// U = -i (RL - LR)
+				product.operation = PolarizationProduct::RotatedDifference;
+				return product;
+			}
+			break;
+		case Polarization::StokesV:
+			isLinear = Polarization::TypeToIndex(Polarization::XY, msPolarizations, product.indexA) &&
+				Polarization::TypeToIndex(Polarization::YX, msPolarizations, product.indexB);
+			if(isLinear)
+			{
+				// V = -i (XY - YX)
+				product.operation = PolarizationProduct::RotatedDifference;
+				return product;
+			}
+			else if(Polarization::TypeToIndex(Polarization::RR, msPolarizations, product.indexA) &&
+				Polarization::TypeToIndex(Polarization::LL, msPolarizations, product.indexB))
+			{
+				// V = RR - LL
+				product.operation = PolarizationProduct::Difference;
+				return product;
+			}
+			break;
+		default:
+			break;
+	}
+	throw std::runtime_error("Can not form requested polarization (" + Polarization::TypeToFullString(polarization) + ") from available polarizations");
+}
+
+void WSMSGridder::FormPolarization(const PolarizationProduct& product, size_t channelCount, const std::complex<float>* data, const float* weights, std::complex<float>* polarizationData, float* polarizationWeights)
+{
+	const size_t polCount = 4;
+	if(product.operation == PolarizationProduct::Copy)
+	{
+		for(size_t ch=0; ch!=channelCount; ++ch)
+		{
+			polarizationData[ch] = data[ch*polCount + product.indexA];
+			polarizationWeights[ch] = weights[ch*polCount + product.indexA];
+		}
+	}
+	else {
+		for(size_t ch=0; ch!=channelCount; ++ch)
+		{
+			const std::complex<float>
+				valA = data[ch*polCount + product.indexA],
+				valB = data[ch*polCount + product.indexB];
+			const float
+				weightA = weights[ch*polCount + product.indexA],
+				weightB = weights[ch*polCount + product.indexB];
+			if(weightA == 0.0 || weightB == 0.0)
+				polarizationData[ch] = 0.0;
+			else {
+				switch(product.operation)
+				{
+					case PolarizationProduct::Copy:
+					case PolarizationProduct::Sum:
+						polarizationData[ch] = valA + valB;
+						break;
+					case PolarizationProduct::Difference:
+						polarizationData[ch] = valA - valB;
+						break;
+					case PolarizationProduct::RotatedDifference: {
+						const std::complex<float> diff = valA - valB;
+						polarizationData[ch] = std::complex<float>(diff.imag(), -diff.real());
+					} break;
+				}
+			}
+			// Like MSProvider::copyWeights(), the weight is only zero when the second
+			// correlation is flagged.
+			polarizationWeights[ch] = (weightB == 0.0) ? 0.0 : weightA + weightB;
+		}
+	}
+}
+
+void WSMSGridder::gridMeasurementSetJointly(MSData& msData, const std::vector<PolarizationProduct>& products)
+{
+	const MultiBandData selectedBand(msData.SelectedBand());
+	const size_t
+		maxChannels = selectedBand.MaxChannels(),
+		polarizationCount = products.size();
+	ao::uvector<std::complex<float>>
+		correlationData(maxChannels * 4),
+		modelBuffer(maxChannels * 4),
+		polarizationData(maxChannels * polarizationCount);
+	ao::uvector<float>
+		weightBuffer(maxChannels * 4),
+		polarizationWeights(maxChannels * polarizationCount);
+	ao::uvector<bool> isSelected(maxChannels * 4);
+	ao::uvector<double> imagingWeights(maxChannels);
+	const bool subtractPrediction = (_predictionGridder != nullptr);
+	ao::uvector<float> modelFactors(subtractPrediction ? maxChannels * polarizationCount : 0);
+	
+	std::unique_ptr<lane_write_buffer<JointInversionWorkSample>[]>
+		bufferedLanes(new lane_write_buffer<JointInversionWorkSample>[_cpuCount]);
+	size_t bufferSize = std::max<size_t>(8u, _jointInversionCPULanes[0].capacity()/8);
+	bufferSize = std::min<size_t>(128, std::min(bufferSize, _jointInversionCPULanes[0].capacity()));
+	for(size_t i=0; i!=_cpuCount; ++i)
+	{
+		bufferedLanes[i].reset(&_jointInversionCPULanes[i], bufferSize);
+	}
+	
+	InversionRow row;
+	row.data = correlationData.data();
+	
+	size_t rowsRead = 0;
+	msData.msProvider->Reset();
+	while(msData.msProvider->CurrentRowAvailable())
+	{
+		size_t dataDescId;
+		double uInMeters, vInMeters, wInMeters;
+		msData.msProvider->ReadMeta(uInMeters, vInMeters, wInMeters, dataDescId);
+		const BandData& curBand(selectedBand[dataDescId]);
+		const double
+			w1 = wInMeters / curBand.LongestWavelength(),
+			w2 = wInMeters / curBand.SmallestWavelength();
+		if(_gridder->IsInLayerRange(w1, w2))
+		{
+			row.uvw[0] = uInMeters;
+			row.uvw[1] = vInMeters;
+			row.uvw[2] = wInMeters;
+			row.dataDescId = dataDescId;
+			
+			// Any visibilities that are not gridded in this pass
+			// should not contribute to the weight sum, so set these
+			// to have zero weight.
+			for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
+			{
+				double w = row.uvw[2] / curBand.ChannelWavelength(ch);
+				std::fill_n(&isSelected[ch*4], 4, _gridder->IsInLayerRange(w));
+			}
+			
+			{
+				Instrumentation::Accumulator read(Instrumentation::MSReadStage);
+				readVisibilities<4>(*msData.msProvider, row, curBand, weightBuffer.data(), modelBuffer.data(), isSelected.data());
+			}
+			
+			// The polarizations share the imaging weights, so these are looked up once
+			for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
+			{
+				const double wavelength = curBand.ChannelWavelength(ch);
+				imagingWeights[ch] = PrecalculatedWeightInfo()->GetWeight(row.uvw[0] / wavelength, row.uvw[1] / wavelength);
+			}
+			for(size_t p=0; p!=polarizationCount; ++p)
+			{
+				InversionRow polarizationRow = row;
+				polarizationRow.data = &polarizationData[p * maxChannels];
+				float* weights = &polarizationWeights[p * maxChannels];
+				FormPolarization(products[p], curBand.ChannelCount(), correlationData.data(), weightBuffer.data(), polarizationRow.data, weights);
+				VisibilityCounters& counters = (p == 0) ? visibilityCounters() : _jointVisibilityCounters[p-1];
+				weightVisibilities<1>(polarizationRow, curBand, weights, imagingWeights.data(), subtractPrediction ? &modelFactors[p * maxChannels] : nullptr, counters);
+			}
+			
+			JointInversionWorkSample sampleData;
+			for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
+			{
+				double wavelength = curBand.ChannelWavelength(ch);
+				for(size_t p=0; p!=polarizationCount; ++p)
+				{
+					sampleData.samples[p] = polarizationData[p * maxChannels + ch];
+					sampleData.modelFactors[p] = subtractPrediction ? modelFactors[p * maxChannels + ch] : 0.0;
+				}
+				sampleData.uInLambda = row.uvw[0] / wavelength;
+				sampleData.vInLambda = row.uvw[1] / wavelength;
+				sampleData.wInLambda = row.uvw[2] / wavelength;
+				size_t cpu = _gridder->WToLayer(sampleData.wInLambda) % _cpuCount;
+				bufferedLanes[cpu].write(sampleData);
+			}
+			
+			++rowsRead;
+		}
+		
+		msData.msProvider->NextRow();
+	}
+	
+	for(size_t i=0; i!=_cpuCount; ++i)
+		bufferedLanes[i].write_end();
+	
+	if(Verbose())
+		Logger::Info << "Rows that were required: " << rowsRead << '/' << msData.matchingRows << '\n';
+	msData.totalRowsProcessed += rowsRead;
+}
+
+void WSMSGridder::InvertPolarizations(const std::vector<PolarizationEnum>& polarizations, const std::vector<double*>& modelsReal, const std::vector<double*>& modelsImaginary)
+{
+	const size_t polarizationCount = polarizations.size();
+	if(polarizationCount == 0 || polarizationCount > 4)
+		throw std::runtime_error("One to four polarizations can be imaged jointly");
+	for(PolarizationEnum polarization : polarizations)
+	{
+		if(Polarization::IsComplex(polarization) != IsComplex())
+			throw std::runtime_error("Polarizations that are imaged jointly should either all be complex or all be non-complex");
+	}
+	if(DoImagePSF())
+		throw std::runtime_error("The PSF can not be imaged jointly for several polarizations");
+	const bool doPredict = !modelsReal.empty();
+	if(doPredict && modelsReal.size() != polarizationCount)
+		throw std::runtime_error("The number of model images does not match the number of polarizations");
+	if(doPredict && (modelsImaginary.size() == polarizationCount) != IsComplex())
+		throw std::runtime_error("Imaginary model images should be given for, and only for, complex polarizations");
+	
+	std::vector<MSData> msDataVector;
+	initializeMSDataVector(msDataVector, 4);
+	
+	std::vector<std::vector<PolarizationProduct>> products(MeasurementSetCount());
+	for(size_t i=0; i!=MeasurementSetCount(); ++i)
+	{
+		MSProvider& msProvider = *msDataVector[i].msProvider;
+		if(msProvider.Polarization() != Polarization::Instrumental)
+			throw std::runtime_error("Polarizations can only be imaged jointly from instrumental polarizations");
+		std::vector<PolarizationEnum> msPolarizations;
+		{
+			boost::mutex::scoped_lock lock(MetaDataMutex());
+			msPolarizations = MSProvider::GetMSPolarizations(msProvider.MS());
+		}
+		if(msPolarizations.size() != 4)
+			throw std::runtime_error("Polarizations can only be imaged jointly from measurement sets with four correlations");
+		for(PolarizationEnum polarization : polarizations)
+			products[i].push_back(GetPolarizationProduct(polarization, msPolarizations));
+	}
+	
+	// Each pass reads all visibilities. When splitting the memory over the gridders of all
+	// polarizations increases the number of passes so much that the polarizations together
+	// are read more often than when they are imaged one after the other, the polarizations
+	// are imaged one after the other.
+	const double memory = double(_memSize)*(7.0/10.0);
+	const size_t
+		griddersPerPolarization = doPredict ? 2 : 1,
+		singlePassCount = WStackingGridder::PassCount(_actualInversionWidth, _actualInversionHeight, _cpuCount, WGridSize(), memory/double(griddersPerPolarization)),
+		jointPassCount = WStackingGridder::PassCount(_actualInversionWidth, _actualInversionHeight, _cpuCount, WGridSize(), memory/double(griddersPerPolarization*polarizationCount));
+	if(polarizationCount > 1 && jointPassCount >= singlePassCount*polarizationCount)
+	{
+		Logger::Debug << "Imaging " << polarizationCount << " polarizations in one pass requires " << jointPassCount << " instead of " << singlePassCount << " passes: imaging them separately.\n";
+		// The polarizations are imaged in reverse order, so that the gridder and the
+		// counters of the first polarization are the last ones that are set.
+		std::vector<std::unique_ptr<WStackingGridder>> gridders(polarizationCount-1);
+		std::vector<VisibilityCounters> counters(polarizationCount-1);
+		for(size_t p=polarizationCount; p!=0; --p)
+		{
+			std::vector<std::vector<PolarizationProduct>> singleProducts(MeasurementSetCount());
+			for(size_t i=0; i!=MeasurementSetCount(); ++i)
+				singleProducts[i].push_back(products[i][p-1]);
+			std::vector<double*> real, imaginary;
+			if(doPredict)
+			{
+				real.push_back(modelsReal[p-1]);
+				imaginary.push_back(IsComplex() ? modelsImaginary[p-1] : nullptr);
+			}
+			gridPolarizationsJointly(msDataVector, singleProducts, 1, real, imaginary, memory/double(griddersPerPolarization));
+			if(p != 1)
+			{
+				finalizeGridderImage(*_gridder, totalWeight());
+				gridders[p-2] = std::move(_gridder);
+				counters[p-2] = visibilityCounters();
+			}
+		}
+		finalizeImage(msDataVector);
+		_jointGridders = std::move(gridders);
+		_jointVisibilityCounters = std::move(counters);
+		return;
+	}
+	
+	std::vector<double*> imaginary(modelsImaginary);
+	imaginary.resize(modelsReal.size(), nullptr);
+	gridPolarizationsJointly(msDataVector, products, polarizationCount, modelsReal, imaginary, memory/double(griddersPerPolarization*polarizationCount));
+	
+	finalizeImage(msDataVector);
+	for(size_t p=1; p!=polarizationCount; ++p)
+		finalizeGridderImage(*_jointGridders[p-1], _jointVisibilityCounters[p-1].totalWeight);
+}
+
+void WSMSGridder::gridPolarizationsJointly(std::vector<MSData>& msDataVector, const std::vector<std::vector<PolarizationProduct>>& products, size_t polarizationCount, const std::vector<double*>& modelsReal, const std::vector<double*>& modelsImaginary, double gridderMemory)
+{
+	const bool doPredict = !modelsReal.empty();
+	FusedPredictionScope predictionScope(*this, doPredict);
+	
+	// All gridders get the same memory, so that they divide the w-layers over the
+	// passes in the same way.
+	_gridder = createGridder(gridderMemory);
+	_jointGridders.clear();
+	_jointPredictionGridders.clear();
+	for(size_t p=1; p!=polarizationCount; ++p)
+		_jointGridders.emplace_back(createGridder(gridderMemory));
+	if(doPredict)
+	{
+		_predictionGridder = createGridder(gridderMemory);
+		for(size_t p=1; p!=polarizationCount; ++p)
+			_jointPredictionGridders.emplace_back(createGridder(gridderMemory));
+	}
+	
+	if(Verbose() && Logger::IsVerbose())
+	{
+		for(size_t i=0; i!=MeasurementSetCount(); ++i)
+			countSamplesPerLayer(msDataVector[i]);
+	}
+	
+	std::vector<double*> real(modelsReal), imaginary(modelsImaginary);
+	std::vector<ImageBufferAllocator::Ptr>
+		untrimmedReal(real.size()), untrimmedImag(real.size()),
+		resampledReal(real.size()), resampledImag(real.size());
+	for(size_t p=0; p!=real.size(); ++p)
+		prepareModelImage(real[p], imaginary[p], untrimmedReal[p], untrimmedImag[p], resampledReal[p], resampledImag[p]);
+	
+	resetVisibilityCounters();
+	_jointVisibilityCounters.assign(polarizationCount-1, VisibilityCounters());
+	for(size_t pass=0; pass!=_gridder->NPasses(); ++pass)
+	{
+		if(doPredict)
+		{
+			Logger::Info << "Fourier transforms for pass " << pass << "... ";
+			if(Verbose()) Logger::Info << '\n';
+			else Logger::Info.Flush();
+			for(size_t p=0; p!=polarizationCount; ++p)
+			{
+				WStackingGridder& predictionGridder = (p == 0) ? *_predictionGridder : *_jointPredictionGridders[p-1];
+				if(imaginary[p] == nullptr)
+					predictionGridder.InitializePrediction(real[p]);
+				else
+					predictionGridder.InitializePrediction(real[p], imaginary[p]);
+				predictionGridder.StartPredictionPass(pass);
+			}
+			Logger::Info << "Predicting and gridding " << polarizationCount << " polarizations...\n";
+		}
+		else {
+			Logger::Info << "Gridding pass " << pass << " of " << polarizationCount << " polarizations... ";
+			if(Verbose()) Logger::Info << '\n';
+			else Logger::Info.Flush();
+		}
+		
+		for(size_t p=0; p!=polarizationCount; ++p)
+			jointGridder(p).StartInversionPass(pass);
+		
+		for(size_t i=0; i!=MeasurementSetCount(); ++i)
+		{
+			MSData& msData = msDataVector[i];
+			startJointInversionWorkThreads(msData.SelectedBand().MaxChannels(), pass);
+			gridMeasurementSetJointly(msData, products[i]);
+			finishInversionWorkThreads();
+		}
+		
+		Logger::Info << "Fourier transforms...\n";
+		for(size_t p=0; p!=polarizationCount; ++p)
+			jointGridder(p).FinishInversionPass();
+	}
+}
+
+void WSMSGridder::gridMeasurementSetWithPSF(MSData& msData)
+{
+	const MultiBandData selectedBand(msData.SelectedBand());
+	const size_t maxChannels = selectedBand.MaxChannels();
+	ao::uvector<std::complex<float>>
+		data(maxChannels),
+		psfData(maxChannels),
+		modelBuffer(maxChannels);
+	ao::uvector<float> weightBuffer(maxChannels);
+	ao::uvector<bool> isSelected(maxChannels);
+	ao::uvector<double> imagingWeights(maxChannels);
+	// The PSF is weighted the same way as the data, so its counters would
+	// be equal to those of the data
+	VisibilityCounters psfCounters;
+	
+	std::unique_ptr<lane_write_buffer<PSFInversionWorkSample>[]>
+		bufferedLanes(new lane_write_buffer<PSFInversionWorkSample>[_cpuCount]);
+	size_t bufferSize = std::max<size_t>(8u, _psfInversionCPULanes[0].capacity()/8);
+	bufferSize = std::min<size_t>(128, std::min(bufferSize, _psfInversionCPULanes[0].capacity()));
+	for(size_t i=0; i!=_cpuCount; ++i)
+	{
+		bufferedLanes[i].reset(&_psfInversionCPULanes[i], bufferSize);
+	}
+	
+	InversionRow row, psfRow;
+	row.data = data.data();
+	
+	size_t rowsRead = 0;
+	msData.msProvider->Reset();
+	while(msData.msProvider->CurrentRowAvailable())
+	{
+		size_t dataDescId;
+		double uInMeters, vInMeters, wInMeters;
+		msData.msProvider->ReadMeta(uInMeters, vInMeters, wInMeters, dataDescId);
+		const BandData& curBand(selectedBand[dataDescId]);
+		const double
+			w1 = wInMeters / curBand.LongestWavelength(),
+			w2 = wInMeters / curBand.SmallestWavelength();
+		if(_gridder->IsInLayerRange(w1, w2))
+		{
+			row.uvw[0] = uInMeters;
+			row.uvw[1] = vInMeters;
+			row.uvw[2] = wInMeters;
+			row.dataDescId = dataDescId;
+			psfRow = row;
+			psfRow.data = psfData.data();
+			
+			// Any visibilities that are not gridded in this pass
+			// should not contribute to the weight sum, so set these
+			// to have zero weight.
+			for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
+			{
+				double w = row.uvw[2] / curBand.ChannelWavelength(ch);
+				isSelected[ch] = _gridder->IsInLayerRange(w);
+			}
+			
+			{
+				Instrumentation::Accumulator read(Instrumentation::MSReadStage);
+				// The PSF is made from the weights that are read for the data
+				readVisibilities<1>(*msData.msProvider, row, curBand, weightBuffer.data(), modelBuffer.data(), isSelected.data(), &psfRow);
+			}
+			
+			// The data and the PSF share the imaging weights, so these are looked up once
+			for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
+			{
+				const double wavelength = curBand.ChannelWavelength(ch);
+				imagingWeights[ch] = PrecalculatedWeightInfo()->GetWeight(row.uvw[0] / wavelength, row.uvw[1] / wavelength);
+			}
+			weightVisibilities<1>(row, curBand, weightBuffer.data(), imagingWeights.data(), nullptr, visibilityCounters());
+			weightVisibilities<1>(psfRow, curBand, weightBuffer.data(), imagingWeights.data(), nullptr, psfCounters);
+			
+			PSFInversionWorkSample sampleData;
+			for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
+			{
+				double wavelength = curBand.ChannelWavelength(ch);
+				sampleData.samples[0] = data[ch];
+				sampleData.samples[1] = psfData[ch];
+				sampleData.uInLambda = row.uvw[0] / wavelength;
+				sampleData.vInLambda = row.uvw[1] / wavelength;
+				sampleData.wInLambda = row.uvw[2] / wavelength;
+				size_t cpu = _gridder->WToLayer(sampleData.wInLambda) % _cpuCount;
+				bufferedLanes[cpu].write(sampleData);
+			}
+			
+			++rowsRead;
+		}
+		
+		msData.msProvider->NextRow();
+	}
+	
+	for(size_t i=0; i!=_cpuCount; ++i)
+		bufferedLanes[i].write_end();
+	
+	if(Verbose())
+		Logger::Info << "Rows that were required: " << rowsRead << '/' << msData.matchingRows << '\n';
+	msData.totalRowsProcessed += rowsRead;
+}
+
+void WSMSGridder::InvertWithPSF()
+{
+	const bool doImagePSF = DoImagePSF();
+	SetDoImagePSF(false);
+	
+	std::vector<MSData> msDataVector;
+	initializeMSDataVector(msDataVector, 1);
+	
+	const double memory = double(_memSize)*(7.0/10.0);
+	const size_t
+		singlePassCount = WStackingGridder::PassCount(_actualInversionWidth, _actualInversionHeight, _cpuCount, WGridSize(), memory),
+		dualPassCount = WStackingGridder::PassCount(_actualInversionWidth, _actualInversionHeight, _cpuCount, WGridSize(), memory/2.0);
+	if(dualPassCount >= singlePassCount*2)
+	{
+		Logger::Debug << "Imaging the PSF and the data in one pass requires " << dualPassCount << " instead of " << singlePassCount << " passes: imaging them separately.\n";
+		SetDoImagePSF(true);
+		const bool doSubtractModel = DoSubtractModel();
+		SetDoSubtractModel(false);
+		Invert();
+		_psfGridder = std::move(_gridder);
+		SetDoImagePSF(false);
+		SetDoSubtractModel(doSubtractModel);
+		Invert();
+		SetDoImagePSF(doImagePSF);
+		return;
+	}
+	
+	// Both gridders get the same memory, so that they divide the w-layers over the
+	// passes in the same way.
+	_jointGridders.clear();
+	_gridder = createGridder(memory/2.0);
+	_psfGridder = createGridder(memory/2.0);
+	
+	if(Verbose() && Logger::IsVerbose())
+	{
+		for(size_t i=0; i!=MeasurementSetCount(); ++i)
+			countSamplesPerLayer(msDataVector[i]);
+	}
+	
+	resetVisibilityCounters();
+	for(size_t pass=0; pass!=_gridder->NPasses(); ++pass)
+	{
+		Logger::Info << "Gridding pass " << pass << " of the data and the PSF... ";
+		if(Verbose()) Logger::Info << '\n';
+		else Logger::Info.Flush();
+		
+		_gridder->StartInversionPass(pass);
+		_psfGridder->StartInversionPass(pass);
+		
+		for(size_t i=0; i!=MeasurementSetCount(); ++i)
+		{
+			MSData& msData = msDataVector[i];
+			startPSFInversionWorkThreads(msData.SelectedBand().MaxChannels(), pass);
+			gridMeasurementSetWithPSF(msData);
+			finishInversionWorkThreads();
+		}
+		
+		Logger::Info << "Fourier transforms...\n";
+		_gridder->FinishInversionPass();
+		_psfGridder->FinishInversionPass();
+	}
+	
+	finalizeImage(msDataVector);
+	finalizeGridderImage(*_psfGridder, totalWeight());
+	SetDoImagePSF(doImagePSF);
+}
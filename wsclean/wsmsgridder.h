@@ -1,6 +1,7 @@
 #ifndef WS_MS_GRIDDER_H
 #define WS_MS_GRIDDER_H
 
+#include "imagebufferallocator.h"
 #include "msgridderbase.h"
 #include "wstackinggridder.h"
 
@@ -9,6 +10,7 @@
 
 #include <complex>
 #include <memory>
+#include <vector>
 
 #include <casacore/casa/Arrays/Array.h>
 #include <casacore/tables/Tables/ArrayColumn.h>
@@ -30,6 +32,50 @@ class WSMSGridder : public MSGridderBase
 		virtual void Predict(double* image) { Predict(image, 0); }
 		virtual void Predict(double* real, double* imaginary);
 		
+		/**
+		 * Predicts and inverts in a single pass over the visibilities: the model is
+		 * sampled from the uv-grid of a second w-stacking gridder in the gridding
+		 * threads, and subtracted from the visibilities just before they are gridded.
+		 * The model is not written to the MS providers. Both gridders share the memory
+		 * that a single gridder would use, which may increase the number of passes
+		 * for very large images.
+		 */
+		virtual void PredictAndInvert(double* real, double* imaginary) final override;
+		
+		virtual bool SupportsJointPolarizations() const final override { return true; }
+		
+		/**
+		 * Grids each polarization into its own w-stacking gridder. Each visibility is
+		 * read once, and its polarizations share the calculation of their position on
+		 * the grid and of the gridding kernel; see @ref WStackingGridder::AddDataSamples().
+		 * The gridders (including those for the prediction, if any) share the memory that a
+		 * single gridder would use, which may increase the number of passes for large images.
+		 * When this would read the visibilities more often than imaging the polarizations
+		 * one after the other, the polarizations are imaged one after the other.
+		 * The measurement sets should have four correlations.
+		 */
+		virtual void InvertPolarizations(const std::vector<PolarizationEnum>& polarizations, const std::vector<double*>& modelsReal, const std::vector<double*>& modelsImaginary) final override;
+		
+		virtual bool SupportsInvertWithPSF() const final override { return true; }
+		
+		/**
+		 * Grids the PSF and the data into two w-stacking gridders, which share the
+		 * calculation of the gridding position and kernel of each visibility. When
+		 * splitting the memory over the two gridders would need at least twice the number
+		 * of passes of a single gridder, reading the data once has no benefit, and the
+		 * PSF and the data are imaged one after the other.
+		 */
+		virtual void InvertWithPSF() final override;
+		
+		virtual double *PSFImageResult() final override { return _psfGridder->RealImage(); }
+		
+		virtual double *JointImageRealResult(size_t index) final override { return jointGridder(index).RealImage(); }
+		virtual double *JointImageImaginaryResult(size_t index) final override {
+			if(!IsComplex())
+				throw std::runtime_error("No imaginary result available for non-complex inversion");
+			return jointGridder(index).ImaginaryImage();
+		}
+		
 		virtual double *ImageRealResult() { return _gridder->RealImage(); }
 		virtual double *ImageImaginaryResult() {
 			if(!IsComplex())
@@ -45,13 +91,94 @@ class WSMSGridder : public MSGridderBase
 		virtual void FreeImagingData()
 		{
 			_gridder.reset();
+			_jointGridders.clear();
+			_psfGridder.reset();
 		}
 		
+		/**
+		 * Describes how a polarization is formed from the correlations of a row, the same
+		 * way as MSProvider::copyWeightedData() does it.
+		 */
+		struct PolarizationProduct
+		{
+			enum Operation {
+				/** The correlation at indexA */
+				Copy,
+				/** A + B */
+				Sum,
+				/** A - B */
+				Difference,
+				/** -i (A - B) */
+				RotatedDifference
+			} operation;
+			size_t indexA, indexB;
+		};
+		
+		/**
+		 * Determines how a polarization is formed from the correlations of a measurement set.
+		 * @throws std::runtime_error when the polarization can not be formed from the correlations.
+		 */
+		static PolarizationProduct GetPolarizationProduct(PolarizationEnum polarization, const std::vector<PolarizationEnum>& msPolarizations);
+		/**
+		 * Forms a polarization from the weighted correlations of a row as given by an
+		 * instrumental MS provider, and its weights from the weights of the correlations.
+		 * Like in the MS providers, the polarization is zero when one of its correlations
+		 * is flagged, which is recognized by a zero weight.
+		 */
+		static void FormPolarization(const PolarizationProduct& product, size_t channelCount, const std::complex<float>* data, const float* weights, std::complex<float>* polarizationData, float* polarizationWeights);
+		
 	private:
 		struct InversionWorkSample
 		{
 			double uInLambda, vInLambda, wInLambda;
 			std::complex<float> sample;
+			/** Factor for the predicted model that is subtracted from the sample, or zero when nothing is subtracted. */
+			float modelFactor;
+		};
+		/**
+		 * A visibility with all the polarizations that are gridded by @ref InvertPolarizations().
+		 */
+		struct JointInversionWorkSample
+		{
+			double uInLambda, vInLambda, wInLambda;
+			std::complex<float> samples[4];
+			float modelFactors[4];
+		};
+		/**
+		 * A visibility as gridded by @ref InvertWithPSF(): the data sample followed by the PSF sample.
+		 */
+		struct PSFInversionWorkSample
+		{
+			double uInLambda, vInLambda, wInLambda;
+			std::complex<float> samples[2];
+		};
+		/**
+		 * While a prediction is subtracted in the gridding threads, the model should not
+		 * also be read from the MS providers. This switches model subtraction off for its
+		 * lifetime, and afterwards restores it and releases the prediction gridders, also
+		 * when the inversion throws.
+		 */
+		class FusedPredictionScope
+		{
+		public:
+			FusedPredictionScope(WSMSGridder& gridder, bool isPredicting) :
+				_gridder(gridder),
+				_doSubtractModel(gridder.DoSubtractModel())
+			{
+				if(isPredicting)
+					_gridder.SetDoSubtractModel(false);
+			}
+			~FusedPredictionScope()
+			{
+				_gridder.SetDoSubtractModel(_doSubtractModel);
+				_gridder._predictionGridder.reset();
+				_gridder._jointPredictionGridders.clear();
+			}
+			FusedPredictionScope(const FusedPredictionScope&) = delete;
+			FusedPredictionScope& operator=(const FusedPredictionScope&) = delete;
+		private:
+			WSMSGridder& _gridder;
+			const bool _doSubtractModel;
 		};
 		struct PredictionWorkItem
 		{
@@ -60,8 +187,22 @@ class WSMSGridder : public MSGridderBase
 			size_t rowId, dataDescId;
 		};
 		
+		std::unique_ptr<WStackingGridder> createGridder(double maxMem) const;
+		void prepareModelImage(double*& real, double*& imaginary, ImageBufferAllocator::Ptr& untrimmedReal, ImageBufferAllocator::Ptr& untrimmedImag, ImageBufferAllocator::Ptr& resampledReal, ImageBufferAllocator::Ptr& resampledImag);
+		void finalizeImage(const std::vector<MSData>& msDataVector);
+		void finalizeGridderImage(WStackingGridder& gridder, double totalWeight);
+		WStackingGridder& jointGridder(size_t index) { return index == 0 ? *_gridder : *_jointGridders[index-1]; }
 		void gridMeasurementSet(MSData &msData);
 		void countSamplesPerLayer(MSData &msData);
+		
+		/**
+		 * Creates a gridder for each of the @p polarizationCount polarizations in @p products (and a prediction gridder
+		 * for each when models are given) and grids the measurement sets into them, without
+		 * finalizing the images.
+		 */
+		void gridPolarizationsJointly(std::vector<MSData>& msDataVector, const std::vector<std::vector<PolarizationProduct>>& products, size_t polarizationCount, const std::vector<double*>& modelsReal, const std::vector<double*>& modelsImaginary, double gridderMemory);
+		void gridMeasurementSetJointly(MSData& msData, const std::vector<PolarizationProduct>& products);
+		void gridMeasurementSetWithPSF(MSData& msData);
 		virtual size_t getSuggestedWGridSize() const  ;
 
 		void predictMeasurementSet(MSData &msData);
@@ -76,16 +217,33 @@ class WSMSGridder : public MSGridderBase
 			}
 		}
 		
-		void startInversionWorkThreads(size_t maxChannelCount);
+		void startInversionWorkThreads(size_t maxChannelCount, size_t pass);
 		void finishInversionWorkThreads();
-		void workThreadPerSample(ao::lane<InversionWorkSample>* workLane);
+		void workThreadPerSample(ao::lane<InversionWorkSample>* workLane, size_t pass);
+		void startJointInversionWorkThreads(size_t maxChannelCount, size_t pass);
+		void jointWorkThreadPerSample(ao::lane<JointInversionWorkSample>* workLane, size_t pass);
+		void startPSFInversionWorkThreads(size_t maxChannelCount, size_t pass);
+		void psfWorkThreadPerSample(ao::lane<PSFInversionWorkSample>* workLane, size_t pass);
 		
 		void predictCalcThread(ao::lane<PredictionWorkItem>* inputLane, ao::lane<PredictionWorkItem>* outputLane);
 		void predictWriteThread(ao::lane<PredictionWorkItem>* samplingWorkLane, const MSData* msData);
 
 		std::unique_ptr<WStackingGridder> _gridder;
+		/** Holds the model uv-grid during @ref PredictAndInvert(), otherwise empty. */
+		std::unique_ptr<WStackingGridder> _predictionGridder;
+		/**
+		 * During and after @ref InvertPolarizations(), the gridders of the polarizations
+		 * after the first, which uses _gridder. The prediction gridders are only
+		 * used during @ref InvertPolarizations(), similar to _predictionGridder.
+		 */
+		std::vector<std::unique_ptr<WStackingGridder>> _jointGridders, _jointPredictionGridders;
+		std::vector<VisibilityCounters> _jointVisibilityCounters;
+		/** Holds the PSF after @ref InvertWithPSF(), until @ref FreeImagingData() is called. */
+		std::unique_ptr<WStackingGridder> _psfGridder;
 		std::unique_ptr<ao::lane<InversionRow>> _inversionWorkLane;
 		std::unique_ptr<ao::lane<InversionWorkSample>[]> _inversionCPULanes;
+		std::unique_ptr<ao::lane<JointInversionWorkSample>[]> _jointInversionCPULanes;
+		std::unique_ptr<ao::lane<PSFInversionWorkSample>[]> _psfInversionCPULanes;
 		std::unique_ptr<boost::thread_group> _threadGroup;
 		size_t _cpuCount, _laneBufferSize;
 		int64_t _memSize;
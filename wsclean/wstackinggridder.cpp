@@ -1,11 +1,13 @@
 #include "wstackinggridder.h"
 #include "imagebufferallocator.h"
+#include "instrumentation.h"
 #include "logger.h"
 
 #include <fftw3.h>
 
 #include <iostream>
 #include <fstream>
+#include <stdexcept>
 
 #include <boost/thread/thread.hpp>
 #include <boost/thread/mutex.hpp>
@@ -62,17 +64,11 @@ void WStackingGridder::PrepareWLayers(size_t nWLayers, double maxMem, double min
 		_maxW += 1.0;
 	}
 	
-	size_t nrCopies = _nFFTThreads;
-	if(nrCopies > _nWLayers) nrCopies = _nWLayers;
-	double memPerImage = _width * _height * sizeof(double);
-	double memPerCore = memPerImage * 5.0; // two complex ones for FFT, one for projecting on
-	double remainingMem = maxMem - nrCopies * memPerCore;
-	if(remainingMem <= memPerImage * _nFFTThreads)
+	bool isMemoryLow;
+	_nPasses = calculatePassCount(_width, _height, nWLayers, maxMem, _nFFTThreads, isMemoryLow);
+	if(isMemoryLow)
 	{
-		_nFFTThreads = size_t(maxMem*3.0/(5.0*memPerCore)); // times 3/5 to use 3/5 of mem for FFTing at most
-		if(_nFFTThreads==0) _nFFTThreads = 1;
-		remainingMem = maxMem - _nFFTThreads * memPerCore;
-		
+		const double remainingMem = maxMem - _nFFTThreads * _width * _height * sizeof(double) * 5.0;
 		Logger::Warn <<
 			"WARNING: the amount of available memory is too low for the image size,\n"
 			"       : not all cores might be used.\n"
@@ -92,15 +88,39 @@ void WStackingGridder::PrepareWLayers(size_t nWLayers, double maxMem, double min
 		}
 	}
 	
+	Logger::Info << "Will process " << (_nWLayers / _nPasses) << "/" << _nWLayers << " w-layers per pass.\n";
+	
+	_curLayerRangeIndex = 0;
+}
+
+size_t WStackingGridder::PassCount(size_t width, size_t height, size_t fftThreadCount, size_t nWLayers, double maxMem)
+{
+	bool isMemoryLow;
+	return calculatePassCount(width, height, nWLayers, maxMem, fftThreadCount, isMemoryLow);
+}
+
+size_t WStackingGridder::calculatePassCount(size_t width, size_t height, size_t nWLayers, double maxMem, size_t& nFFTThreads, bool& isMemoryLow)
+{
+	size_t nrCopies = nFFTThreads;
+	if(nrCopies > nWLayers) nrCopies = nWLayers;
+	double memPerImage = width * height * sizeof(double);
+	double memPerCore = memPerImage * 5.0; // two complex ones for FFT, one for projecting on
+	double remainingMem = maxMem - nrCopies * memPerCore;
+	isMemoryLow = remainingMem <= memPerImage * nFFTThreads;
+	if(isMemoryLow)
+	{
+		nFFTThreads = size_t(maxMem*3.0/(5.0*memPerCore)); // times 3/5 to use 3/5 of mem for FFTing at most
+		if(nFFTThreads==0) nFFTThreads = 1;
+		remainingMem = maxMem - nFFTThreads * memPerCore;
+	}
+	
 	// Calculate nr wlayers per pass from remaining memory
 	int maxNWLayersPerPass = int((double) remainingMem / (2.0*memPerImage));
 	if(maxNWLayersPerPass < 1)
 		maxNWLayersPerPass=1;
-	_nPasses = (nWLayers+maxNWLayersPerPass-1)/maxNWLayersPerPass;
-	if(_nPasses == 0) _nPasses = 1;
-	Logger::Info << "Will process " << (_nWLayers / _nPasses) << "/" << _nWLayers << " w-layers per pass.\n";
-	
-	_curLayerRangeIndex = 0;
+	size_t nPasses = (nWLayers+maxNWLayersPerPass-1)/maxNWLayersPerPass;
+	if(nPasses == 0) nPasses = 1;
+	return nPasses;
 }
 
 void WStackingGridder::initializeLayeredUVData(size_t n)
@@ -170,7 +190,10 @@ void WStackingGridder::fftToImageThreadFunction(boost::mutex *mutex, std::stack<
 		// Fourier transform the layer
 		std::complex<double> *uvData = _layeredUVData[layer];
 		memcpy(fftwIn, uvData, imgSize * sizeof(double) * 2);
-		fftw_execute(plan);
+		{
+			Instrumentation::ScopedTimer timer(Instrumentation::FFTStage, layer + layerOffset);
+			fftw_execute(plan);
+		}
 		
 		// Add layer to full image
 		if(_isComplex)
@@ -217,7 +240,10 @@ void WStackingGridder::fftToUVThreadFunction(boost::mutex *mutex, std::stack<siz
 			copyImageToLayerAndInverseCorrect<false>(fftwIn, LayerToW(layer + layerOffset));
 		
 		// Fourier transform the layer
-		fftw_execute(plan);
+		{
+			Instrumentation::ScopedTimer timer(Instrumentation::FFTStage, layer + layerOffset);
+			fftw_execute(plan);
+		}
 		std::complex<double> *uvData = _layeredUVData[layer];
 		memcpy(uvData, fftwOut, imgSize * sizeof(double) * 2);
 		
@@ -348,86 +374,120 @@ double WStackingGridder::bessel0(double x, double precision)
 
 void WStackingGridder::AddDataSample(std::complex<float> sample, double uInLambda, double vInLambda, double wInLambda)
 {
- 	const size_t
-		layerOffset = layerRangeStart(_curLayerRangeIndex),
-		layerRangeEnd = layerRangeStart(_curLayerRangeIndex+1);
-	if(_imageConjugatePart)
+	WStackingGridder* gridder = this;
+	addDataSamples<1>(&gridder, &sample, uInLambda, vInLambda, wInLambda);
+}
+
+void WStackingGridder::AddDataSamples(WStackingGridder* const* gridders, const std::complex<float>* samples, size_t count, double uInLambda, double vInLambda, double wInLambda)
+{
+	switch(count)
+	{
+		case 1: addDataSamples<1>(gridders, samples, uInLambda, vInLambda, wInLambda); break;
+		case 2: addDataSamples<2>(gridders, samples, uInLambda, vInLambda, wInLambda); break;
+		case 3: addDataSamples<3>(gridders, samples, uInLambda, vInLambda, wInLambda); break;
+		case 4: addDataSamples<4>(gridders, samples, uInLambda, vInLambda, wInLambda); break;
+		default:
+			throw std::runtime_error("WStackingGridder::AddDataSamples() supports at most four gridders");
+	}
+}
+
+template<size_t Count>
+void WStackingGridder::addDataSamples(WStackingGridder* const* gridders, const std::complex<float>* samples, double uInLambda, double vInLambda, double wInLambda)
+{
+	// The layer, position and kernel are calculated from the first gridder, and
+	// are the same for the other gridders, since they have the same settings.
+	const WStackingGridder& first = *gridders[0];
+	const size_t
+		layerOffset = first.layerRangeStart(first._curLayerRangeIndex),
+		layerRangeEnd = first.layerRangeStart(first._curLayerRangeIndex+1);
+	bool isConjugated = false;
+	if(first._imageConjugatePart)
 	{
 		uInLambda = -uInLambda;
 		vInLambda = -vInLambda;
-		sample = std::conj(sample);
+		isConjugated = true;
 	}
-	if(wInLambda < 0.0 && !_isComplex)
+	if(wInLambda < 0.0 && !first._isComplex)
 	{
 		uInLambda = -uInLambda;
 		vInLambda = -vInLambda;
 		wInLambda = -wInLambda;
-		sample = std::conj(sample);
+		isConjugated = !isConjugated;
 	}
 	size_t
-		wLayer = WToLayer(wInLambda);
+		wLayer = first.WToLayer(wInLambda);
 	if(wLayer >= layerOffset && wLayer < layerRangeEnd)
 	{
-		size_t layerIndex = wLayer - layerOffset;
-		std::complex<double>* uvData = _layeredUVData[layerIndex];
-		if(_gridMode == NearestNeighbourGridding)
+		const size_t
+			layerIndex = wLayer - layerOffset,
+			width = first._width, height = first._height;
+		std::complex<double>* uvData[Count];
+		std::complex<double> sample[Count];
+		for(size_t g=0; g!=Count; ++g)
+		{
+			uvData[g] = gridders[g]->_layeredUVData[layerIndex];
+			sample[g] = isConjugated ? std::conj(samples[g]) : samples[g];
+		}
+		if(first._gridMode == NearestNeighbourGridding)
 		{
 			int
-				x = int(round(uInLambda * _pixelSizeX * _width)),
-				y = int(round(vInLambda * _pixelSizeY * _height));
-			if(x > -int(_width)/2 && y > -int(_height)/2 && x <= int(_width)/2 && y <= int(_height)/2)
+				x = int(round(uInLambda * first._pixelSizeX * width)),
+				y = int(round(vInLambda * first._pixelSizeY * height));
+			if(x > -int(width)/2 && y > -int(height)/2 && x <= int(width)/2 && y <= int(height)/2)
 			{
-				if(x < 0) x += _width;
-				if(y < 0) y += _height;
-				uvData[x + y*_width] += sample;
+				if(x < 0) x += width;
+				if(y < 0) y += height;
+				for(size_t g=0; g!=Count; ++g)
+					uvData[g][x + y*width] += sample[g];
 			}
 		}
 		else {
+			const size_t overSamplingFactor = first._overSamplingFactor, kernelSize = first._kernelSize;
 			double
-				xExact = uInLambda * _pixelSizeX * _width,
-				yExact = vInLambda * _pixelSizeY * _height;
+				xExact = uInLambda * first._pixelSizeX * width,
+				yExact = vInLambda * first._pixelSizeY * height;
 			int
 				x = round(xExact),
 				y = round(yExact),
-				xKernelIndex = round((xExact - double(x)) * _overSamplingFactor),
-				yKernelIndex = round((yExact - double(y)) * _overSamplingFactor);
-			xKernelIndex = (xKernelIndex + (_overSamplingFactor*3)/2) % _overSamplingFactor;
-			yKernelIndex = (yKernelIndex + (_overSamplingFactor*3)/2) % _overSamplingFactor;
-			const std::vector<double>& xKernel = _griddingKernels[xKernelIndex];
-			const std::vector<double>& yKernel = _griddingKernels[yKernelIndex];
-			int mid = _kernelSize / 2;
-			if(x > -int(_width)/2 && y > -int(_height)/2 && x <= int(_width)/2 && y <= int(_height)/2)
+				xKernelIndex = round((xExact - double(x)) * overSamplingFactor),
+				yKernelIndex = round((yExact - double(y)) * overSamplingFactor);
+			xKernelIndex = (xKernelIndex + (overSamplingFactor*3)/2) % overSamplingFactor;
+			yKernelIndex = (yKernelIndex + (overSamplingFactor*3)/2) % overSamplingFactor;
+			const std::vector<double>& xKernel = first._griddingKernels[xKernelIndex];
+			const std::vector<double>& yKernel = first._griddingKernels[yKernelIndex];
+			int mid = kernelSize / 2;
+			if(x > -int(width)/2 && y > -int(height)/2 && x <= int(width)/2 && y <= int(height)/2)
 			{
-				if(x < 0) x += _width;
-				if(y < 0) y += _height;
+				if(x < 0) x += width;
+				if(y < 0) y += height;
 				// Are we on the edge?
-				if(x < mid || x+mid+1 >= int(_width) || y < mid || y+mid+1 >= int(_height))
+				if(x < mid || x+mid+1 >= int(width) || y < mid || y+mid+1 >= int(height))
 				{
-					for(size_t j=0; j!=_kernelSize; ++j)
+					for(size_t j=0; j!=kernelSize; ++j)
 					{
 						const double yKernelValue = yKernel[j];
-						size_t cy = ((y+j+_height-mid) % _height) * _width;
-						for(size_t i=0; i!=_kernelSize; ++i)
+						size_t cy = ((y+j+height-mid) % height) * width;
+						for(size_t i=0; i!=kernelSize; ++i)
 						{
-							size_t cx = (x+i+_width-mid) % _width;
-							std::complex<double> *uvRowPtr = &uvData[cx + cy];
+							size_t cx = (x+i+width-mid) % width;
 							const double kernelValue = yKernelValue * xKernel[i];
-							*uvRowPtr += std::complex<double>(sample.real() * kernelValue, sample.imag() * kernelValue);
+							for(size_t g=0; g!=Count; ++g)
+								uvData[g][cx + cy] += std::complex<double>(sample[g].real() * kernelValue, sample[g].imag() * kernelValue);
 						}
 					}
 				}
 				else {
 					x -= mid;
 					y -= mid;
-					for(size_t j=0; j!=_kernelSize; ++j)
+					for(size_t j=0; j!=kernelSize; ++j)
 					{
 						const double yKernelValue = yKernel[j];
-						std::complex<double> *uvRowPtr = &uvData[x + y*_width];
-						for(size_t i=0; i!=_kernelSize; ++i)
+						const size_t rowOffset = x + y*width;
+						for(size_t i=0; i!=kernelSize; ++i)
 						{
 							const double kernelValue = yKernelValue * xKernel[i];
-							*uvRowPtr += std::complex<double>(sample.real() * kernelValue, sample.imag() * kernelValue);
-							++uvRowPtr;
+							for(size_t g=0; g!=Count; ++g)
+								uvData[g][rowOffset + i] += std::complex<double>(sample[g].real() * kernelValue, sample[g].imag() * kernelValue);
 						}
 						++y;
 					}
@@ -51,7 +51,8 @@ class ImageBufferAllocator;
  * - Call @ref PrepareWLayers();
  * - For each pass if multiple passes are necessary (or once otherwise) :
  *   - Call @ref StartInversionPass();
- *   - Add all samples with @ref AddDataSample();
+ *   - Add all samples with @ref AddDataSample() (or with @ref AddDataSamples() for
+ *     several gridders at once);
  *   - Call @ref FinishInversionPass();
  * - Finally, call @ref FinalizeImage();
  * - Now, @ref RealImage() and optionally @ref ImaginaryImage() will return the
@@ -145,6 +146,19 @@ class WStackingGridder
 		 */
 		void PrepareWLayers(size_t nWLayers, double maxMem, double minW, double maxW);
 		
+		/**
+		 * Calculates the number of passes that @ref PrepareWLayers() selects, without
+		 * allocating anything. This can be used to decide how to divide memory over
+		 * several gridders.
+		 * @param width Width of the image in pixels.
+		 * @param height Height of the image in pixels.
+		 * @param fftThreadCount The thread count given to the constructor.
+		 * @param nWLayers Number of uv grids at different w-values.
+		 * @param maxMem Allowed memory in bytes.
+		 * @returns The number of passes.
+		 */
+		static size_t PassCount(size_t width, size_t height, size_t fftThreadCount, size_t nWLayers, double maxMem);
+		
 #ifndef AVOID_CASACORE
 		/**
 		 * Initialize the inversion/prediction stage with a given band. This is
@@ -287,6 +301,23 @@ class WStackingGridder
 		 */
 		void AddDataSample(std::complex<float> sample, double uInLambda, double vInLambda, double wInLambda);
 		
+		/**
+		 * Grid visibilities with the same uvw-coordinate into several gridders, e.g. the
+		 * polarizations of a visibility, each into its own gridder. The w-layer, the position
+		 * on the uv-grid and the gridding kernel are calculated once for all gridders. Hence,
+		 * all gridders should have the same settings: they should have been constructed
+		 * with the same parameters, have the same grid mode and complexity, and have been prepared
+		 * with the same call to @ref PrepareWLayers(). They should also be in the same
+		 * inversion pass.
+		 * @param gridders Array of @p count gridders.
+		 * @param samples Array of @p count visibility values; sample i is gridded into gridder i.
+		 * @param count Number of gridders, at most 4.
+		 * @param uInLambda U value of UVW coordinate, in number of wavelengths.
+		 * @param vInLambda V value of UVW coordinate, in number of wavelengths.
+		 * @param wInLambda W value of UVW coordinate, in number of wavelengths.
+		 */
+		static void AddDataSamples(WStackingGridder* const* gridders, const std::complex<float>* samples, size_t count, double uInLambda, double vInLambda, double wInLambda);
+		
 		/**
 		 * Initialize a new inversion gridding pass. @ref PrepareWLayers() should have been called beforehand.
 		 * Each call to @ref StartInversionPass() should be followed by a call to
@@ -589,6 +620,9 @@ class WStackingGridder
 		{
 			return (_nWLayers * layerRangeIndex) / _nPasses;
 		}
+		static size_t calculatePassCount(size_t width, size_t height, size_t nWLayers, double maxMem, size_t& nFFTThreads, bool& isMemoryLow);
+		template<size_t Count>
+		static void addDataSamples(WStackingGridder* const* gridders, const std::complex<float>* samples, double uInLambda, double vInLambda, double wInLambda);
 		template<bool IsComplexImpl>
 		void projectOnImageAndCorrect(const std::complex<double> *source, double w, size_t threadIndex);
 		template<bool IsComplexImpl>